@@ -9,8 +9,11 @@ expr
         | (ADD | SUB) expr  # UnaryOp
         | expr (MUL | DIV) expr  # BinaryOp
         | expr (ADD | SUB) expr  # BinaryOp
+        | FUNCTION '(' (expr (',' expr)*)? ')'  # Function
         | CELL  # Cell
+        | RANGE  # Range
         | NUMBER  # Literal
+        | STRING  # Text
         ;
 
 // number literals cannot be signed, or else 1-2 would be lexed as [1] [-2]
@@ -26,5 +29,13 @@ ADD: '+' ;
 SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
-CELL: [A-Z]+[0-9]+ ;
+// a cell of another sheet is written as Sheet2!A1 or 'Sheet name'!A1
+fragment SHEET: [A-Za-z_][A-Za-z0-9_]* | '\'' ~['\r\n]+ '\'' ;
+CELL: (SHEET '!')? [A-Z]+[0-9]+ ;
+// a range is only valid as a function argument, which the AST checks
+RANGE: (SHEET '!')? [A-Z]+[0-9]+ ':' [A-Z]+[0-9]+ ;
+// a quote inside a string is doubled: "say ""hi"""
+STRING: '"' (~["\r\n] | '""')* '"' ;
+// function names have no digits, so a longer CELL match always wins
+FUNCTION: [A-Z]+ ;
 WS: [ \t\n\r]+ -> skip ;
@@ -3,15 +3,24 @@
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#include "aggregate.h"
+#include "lookup.h"
+#include "metrics.h"
 #include "sheet.h"
+#include "trace.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <memory>
 #include <optional>
 #include <sstream>
 #include <iostream>
 #include <set>
+#include <variant>
 
 using std::cout, std::endl;
 
@@ -72,12 +81,160 @@ constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
     /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
+// Compiled formulas are stored as a postfix sequence of nodes. Every node is
+// an opcode byte followed by its operands in host byte order; a consumer of
+// the code (see snapshot.h) is responsible for checking the byte order.
+enum CodeOp : char {
+    OP_NUMBER = 'n',       // double
+    OP_CELL = 'c',         // int32 row, int32 col
+    OP_SHEET_CELL = 's',   // uint32 name size, name, int32 row, int32 col
+    OP_UNARY = 'u',        // char operation, one operand on the stack
+    OP_BINARY = 'b',       // char operation, two operands on the stack
+    OP_RANGE = 'r',        // int32 first row, first col, last row, last col
+    OP_SHEET_RANGE = 'R',  // uint32 name size, name, then as OP_RANGE
+    OP_STRING = 't',       // uint32 size, characters
+    OP_FUNCTION = 'f',     // char function, uint8 argument count; the arguments on the stack
+    // char error category; only in the simplified tree (see Expr::Simplify),
+    // never in a stored formula
+    OP_ERROR = 'e',
+};
+
+namespace {
+template <typename T>
+void WriteCode(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+T ReadCode(std::string_view& code) {
+    if (code.size() < sizeof(T)) {
+        throw FormulaException("truncated formula code");
+    }
+    T value;
+    std::memcpy(&value, code.data(), sizeof(T));
+    code.remove_prefix(sizeof(T));
+    return value;
+}
+
+std::string ReadCodeString(std::string_view& code) {
+    auto size = ReadCode<uint32_t>(code);
+    if (code.size() < size) {
+        throw FormulaException("truncated formula code");
+    }
+    std::string text(code.substr(0, size));
+    code.remove_prefix(size);
+    return text;
+}
+
+// the whole text must be a number: "3D" is not 3
+double TextToNumber(const std::string& text) {
+    if (text.empty()) {
+        return 0;
+    }
+    size_t parsed = 0;
+    double value = 0;
+    try {
+        value = std::stod(text, &parsed);
+    }
+    catch (...) {
+        throw FormulaError(FormulaError::Category::Value);
+    }
+    if (parsed != text.size()) {
+        throw FormulaError(FormulaError::Category::Value);
+    }
+    return value;
+}
+
+// the value of a referenced cell as an operand
+double CellToNumber(const CellInterface* cell) {
+    if (!cell) {
+        return 0;
+    }
+    // numeric cells are read without parsing their text
+    if (auto number = cell->GetNumber()) {
+        return *number;
+    }
+
+    auto value = cell->GetValue();
+
+    if (std::holds_alternative<double>(value)) {
+        return std::get<double>(value);
+    }
+
+    if (std::holds_alternative<std::string>(value)) {
+        return TextToNumber(std::get<std::string>(value));
+    }
+
+    throw std::get<FormulaError> (value);
+}
+
+// a sheet of the workbook by the name used in a reference, or the own sheet
+const SheetInterface& ResolveSheet(const SheetInterface& sheet, const std::string& name) {
+    const SheetInterface* target = name.empty() ? &sheet : sheet.FindSheet(name);
+    if (!target) {
+        throw FormulaError(FormulaError::Category::Ref);
+    }
+    return *target;
+}
+}  // namespace
+
+// the value of a subtree that doesn't depend on the sheet
+using Constant = std::variant<double, FormulaError>;
+
 class Expr {
 public:
-    virtual ~Expr() = default;
+    Expr() = default;
+    Expr(const Expr&) = delete;
+    Expr& operator=(const Expr&) = delete;
+    virtual ~Expr() {
+        if (shared_) {
+            SubexpressionTable::Release(shared_);
+        }
+    }
+
     virtual void Print(std::ostream& out) const = 0;
     virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-    virtual double Evaluate(const SheetInterface& sheet) const = 0;
+    // a shared subtree takes its value from the table entry, the first
+    // formula to need it computes and stores it
+    double Evaluate(const SheetInterface& sheet) const {
+        return shared_ ? EvaluateShared(sheet) : DoEvaluate(sheet);
+    }
+    // the value a lookup function searches for: unlike Evaluate, text stays text
+    virtual LookupValue EvaluateKey(const SheetInterface& sheet) const {
+        return Evaluate(sheet);
+    }
+    // appends the compiled code of the subtree, operands first
+    virtual void Serialize(std::string& out) const = 0;
+    virtual std::unique_ptr<Expr> Clone() const = 0;
+
+    // A copy of the subtree for evaluation that computes the same value with
+    // less work, or nullptr if there's nothing to simplify: operations on
+    // constants are computed once, including the errors they produce, and
+    // operations that return their operand unchanged (+x, --x, and x*1,
+    // x/1, x-0 for an operation x, which is never infinite) are dropped.
+    // x+0 stays: it turns -0 into 0. In a key position (see EvaluateKey) a
+    // subtree isn't replaced with a cell reference, whose key is its text.
+    virtual std::unique_ptr<Expr> Simplify(bool /* key */) const {
+        return nullptr;
+    }
+    virtual std::optional<Constant> GetConstant() const {
+        return std::nullopt;
+    }
+
+    // the operands, for passes that rewrite the tree
+    virtual size_t GetOperandCount() const {
+        return 0;
+    }
+    virtual std::unique_ptr<Expr>& GetOperand(size_t /* index */) {
+        throw std::out_of_range("the expression has no operands");
+    }
+
+    // makes the subtree share its value through the entry and takes over
+    // the use acquired for it
+    void Share(SubexpressionTable::Entry* entry) {
+        assert(!shared_);
+        shared_ = entry;
+    }
 
     // higher is tighter
     virtual ExprPrecedence GetPrecedence() const = 0;
@@ -97,6 +254,31 @@ public:
             out << ')';
         }
     }
+
+protected:
+    virtual double DoEvaluate(const SheetInterface& sheet) const = 0;
+
+private:
+    SubexpressionTable::Entry* shared_ = nullptr;
+
+    double EvaluateShared(const SheetInterface& sheet) const {
+        if (const auto& value = shared_->GetValue()) {
+            SPREADSHEET_METRIC_ADD(SubexpressionHits, 1);
+            if (const double* number = std::get_if<double>(&*value)) {
+                return *number;
+            }
+            throw std::get<FormulaError>(*value);
+        }
+        SPREADSHEET_METRIC_ADD(SubexpressionMisses, 1);
+        try {
+            double result = DoEvaluate(sheet);
+            shared_->SetValue(result);
+            return result;
+        } catch (const FormulaError& error) {
+            shared_->SetValue(error);
+            throw;
+        }
+    }
 };
 
 namespace {
@@ -130,6 +312,21 @@ public:
         rhs_->PrintFormula(out, precedence, /* right_child = */ true);
     }
 
+    void Serialize(std::string& out) const override {
+        lhs_->Serialize(out);
+        rhs_->Serialize(out);
+        out += OP_BINARY;
+        out += static_cast<char>(type_);
+    }
+
+    size_t GetOperandCount() const override {
+        return 2;
+    }
+
+    std::unique_ptr<Expr>& GetOperand(size_t index) override {
+        return index == 0 ? lhs_ : rhs_;
+    }
+
     ExprPrecedence GetPrecedence() const override {
         switch (type_) {
             case Add:
@@ -147,11 +344,22 @@ public:
         }
     }
 
-    double Evaluate(const SheetInterface& sheet) const override {
+    std::unique_ptr<Expr> Clone() const override {
+        return std::make_unique<BinaryOpExpr>(type_, lhs_->Clone(), rhs_->Clone());
+    }
+
+    std::unique_ptr<Expr> Simplify(bool key) const override;
+
+    double DoEvaluate(const SheetInterface& sheet) const override {
         double left = lhs_->Evaluate(sheet);
         double right = rhs_->Evaluate(sheet);
+        return Apply(type_, left, right);
+    }
+
+    // throws #DIV/0! if the result is not finite
+    static double Apply(Type type, double left, double right) {
         double result;
-        switch (type_) {
+        switch (type) {
         case Add:
             result = left + right;
             break;
@@ -205,16 +413,40 @@ public:
         operand_->PrintFormula(out, precedence);
     }
 
+    void Serialize(std::string& out) const override {
+        operand_->Serialize(out);
+        out += OP_UNARY;
+        out += static_cast<char>(type_);
+    }
+
+    size_t GetOperandCount() const override {
+        return 1;
+    }
+
+    std::unique_ptr<Expr>& GetOperand(size_t /* index */) override {
+        return operand_;
+    }
+
     ExprPrecedence GetPrecedence() const override {
         return EP_UNARY;
     }
 
-    double Evaluate(const SheetInterface& sheet) const override {
-        switch (type_) {
+    std::unique_ptr<Expr> Clone() const override {
+        return std::make_unique<UnaryOpExpr>(type_, operand_->Clone());
+    }
+
+    std::unique_ptr<Expr> Simplify(bool key) const override;
+
+    double DoEvaluate(const SheetInterface& sheet) const override {
+        return Apply(type_, operand_->Evaluate(sheet));
+    }
+
+    static double Apply(Type type, double operand) {
+        switch (type) {
         case UnaryPlus:
-            return operand_->Evaluate(sheet);
+            return operand;
         case UnaryMinus:
-            return - operand_->Evaluate(sheet);
+            return - operand;
         default:
             throw std::runtime_error("no such operation");
         }
@@ -239,11 +471,24 @@ public:
         out << value_;
     }
 
+    void Serialize(std::string& out) const override {
+        out += OP_NUMBER;
+        WriteCode(out, value_);
+    }
+
     ExprPrecedence GetPrecedence() const override {
         return EP_ATOM;
     }
 
-    double Evaluate(const SheetInterface& sheet) const override {
+    std::unique_ptr<Expr> Clone() const override {
+        return std::make_unique<NumberExpr>(value_);
+    }
+
+    std::optional<Constant> GetConstant() const override {
+        return value_;
+    }
+
+    double DoEvaluate(const SheetInterface& sheet) const override {
         return value_;
     }
 
@@ -253,8 +498,8 @@ private:
 
 class CellExpr final : public Expr {
 public:
-    explicit CellExpr(Position pos) 
-        : pos_(pos)
+    explicit CellExpr(Position pos, std::string sheet = {})
+        : pos_(pos), sheet_(std::move(sheet))
     {
 
     }
@@ -263,6 +508,9 @@ public:
         if (!pos_.IsValid()) {
             out << FormulaError::Category::Ref;
         }
+        else if (!sheet_.empty()) {
+            out << SheetPosition{sheet_, pos_}.ToString();
+        }
         else {
             out << pos_.ToString();
         }
@@ -272,53 +520,618 @@ public:
         Print(out);
     }
 
+    void Serialize(std::string& out) const override {
+        if (sheet_.empty()) {
+            out += OP_CELL;
+        } else {
+            out += OP_SHEET_CELL;
+            WriteCode(out, static_cast<uint32_t>(sheet_.size()));
+            out += sheet_;
+        }
+        WriteCode(out, static_cast<int32_t>(pos_.row));
+        WriteCode(out, static_cast<int32_t>(pos_.col));
+    }
+
     ExprPrecedence GetPrecedence() const override {
         return EP_ATOM;
     } 
 
-    double Evaluate(const SheetInterface& sheet) const override {
+    std::unique_ptr<Expr> Clone() const override {
+        return std::make_unique<CellExpr>(pos_, sheet_);
+    }
+
+    double DoEvaluate(const SheetInterface& sheet) const override {
+        return CellToNumber(GetCell(sheet));
+    }
+
+    LookupValue EvaluateKey(const SheetInterface& sheet) const override {
+        const CellInterface* cell = GetCell(sheet);
+        if (cell) {
+            auto value = cell->GetValue();
+            if (const auto* error = std::get_if<FormulaError>(&value)) {
+                throw *error;
+            }
+        }
+        // an empty cell is not a value to search for
+        auto key = ReadLookupValue(cell);
+        if (!key) {
+            throw FormulaError(FormulaError::Category::NA);
+        }
+        return std::move(*key);
+    }
+
+private:
+    Position pos_;
+    std::string sheet_;
+
+    const CellInterface* GetCell(const SheetInterface& sheet) const {
         if (!pos_.IsValid()) {
             throw FormulaError(FormulaError::Category::Ref);
         }
-        if (!(sheet.GetCell(pos_))) {
-            return 0;
+        // a reference to another sheet is resolved through the workbook
+        return ResolveSheet(sheet, sheet_).GetCell(pos_);
+    }
+};
+
+// A range is not a value: it is accepted only as an argument of a function
+class RangeExpr final : public Expr {
+public:
+    explicit RangeExpr(Range range, std::string sheet = {})
+        : range_(range), sheet_(std::move(sheet)) {
+    }
+
+    void Print(std::ostream& out) const override {
+        if (!sheet_.empty()) {
+            out << SheetRange{sheet_, range_}.ToString();
+        } else {
+            out << range_.ToString();
         }
+    }
 
-        auto value = sheet.GetCell(pos_)->GetValue();
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        Print(out);
+    }
 
-        if (std::holds_alternative<double>(value)) {
-            return std::get<double>(value);
+    void Serialize(std::string& out) const override {
+        if (sheet_.empty()) {
+            out += OP_RANGE;
+        } else {
+            out += OP_SHEET_RANGE;
+            WriteCode(out, static_cast<uint32_t>(sheet_.size()));
+            out += sheet_;
         }
+        WriteCode(out, static_cast<int32_t>(range_.first.row));
+        WriteCode(out, static_cast<int32_t>(range_.first.col));
+        WriteCode(out, static_cast<int32_t>(range_.last.row));
+        WriteCode(out, static_cast<int32_t>(range_.last.col));
+    }
 
-        if (std::holds_alternative<std::string>(value)) {
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
 
-            std::string value_str = std::get<std::string>(value);
-            if (value_str.empty()) {
-                return 0;
-            } 
+    std::unique_ptr<Expr> Clone() const override {
+        return std::make_unique<RangeExpr>(range_, sheet_);
+    }
 
-            try {
-                double val = std::stod(value_str);
-                return val;
+    double DoEvaluate(const SheetInterface& /* sheet */) const override {
+        throw FormulaError(FormulaError::Category::Value);
+    }
+
+    Range GetRange() const {
+        return range_;
+    }
+
+    const SheetInterface& GetSheet(const SheetInterface& sheet) const {
+        return ResolveSheet(sheet, sheet_);
+    }
+
+private:
+    Range range_;
+    std::string sheet_;
+};
+
+class StringExpr final : public Expr {
+public:
+    explicit StringExpr(std::string text)
+        : text_(std::move(text)) {
+    }
+
+    void Print(std::ostream& out) const override {
+        // a quote inside the literal is doubled, as in the grammar
+        out << '"';
+        for (char c : text_) {
+            out << c;
+            if (c == '"') {
+                out << c;
+            }
+        }
+        out << '"';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        Print(out);
+    }
+
+    void Serialize(std::string& out) const override {
+        out += OP_STRING;
+        WriteCode(out, static_cast<uint32_t>(text_.size()));
+        out += text_;
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    std::unique_ptr<Expr> Clone() const override {
+        return std::make_unique<StringExpr>(text_);
+    }
+
+    std::optional<Constant> GetConstant() const override {
+        try {
+            return TextToNumber(text_);
+        } catch (const FormulaError& error) {
+            return error;
+        }
+    }
+
+    double DoEvaluate(const SheetInterface& /* sheet */) const override {
+        return TextToNumber(text_);
+    }
+
+    LookupValue EvaluateKey(const SheetInterface& /* sheet */) const override {
+        return text_;
+    }
+
+private:
+    std::string text_;
+};
+
+class FunctionExpr final : public Expr {
+public:
+    enum Function : char {
+        VLookup = 'v',
+        Match = 'm',
+        XLookup = 'x',
+        SumIf = 's',
+        CountIf = 'c',
+        AverageIf = 'a',
+    };
+
+    struct Signature {
+        Function function;
+        std::string_view name;
+        size_t min_args;
+        size_t max_args;
+        // a bit is set for every argument that must be a range
+        unsigned range_args;
+    };
+
+    // nullptr for an unknown function
+    static const Signature* FindSignature(std::string_view name);
+    static const Signature* FindSignature(Function function);
+
+    // throws ParsingError if the arguments don't match the signature
+    FunctionExpr(const Signature& signature, std::vector<std::unique_ptr<Expr>> args)
+        : signature_(signature)
+        , args_(std::move(args)) {
+        if (args_.size() < signature_.min_args || args_.size() > signature_.max_args) {
+            throw ParsingError("Wrong number of arguments of " + std::string(signature_.name));
+        }
+        for (size_t i = 0; i < args_.size(); ++i) {
+            bool is_range = dynamic_cast<const RangeExpr*>(args_[i].get()) != nullptr;
+            if (is_range != static_cast<bool>(signature_.range_args & (1u << i))) {
+                throw ParsingError("Argument " + std::to_string(i + 1) + " of " + std::string(signature_.name)
+                    + (is_range ? " can't be a range" : " must be a range"));
             }
-            catch (...) {
+        }
+    }
+
+    void Print(std::ostream& out) const override {
+        out << '(' << signature_.name;
+        for (const auto& arg : args_) {
+            out << ' ';
+            arg->Print(out);
+        }
+        out << ')';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        out << signature_.name << '(';
+        for (size_t i = 0; i < args_.size(); ++i) {
+            if (i > 0) {
+                out << ',';
+            }
+            args_[i]->PrintFormula(out, EP_ATOM);
+        }
+        out << ')';
+    }
+
+    void Serialize(std::string& out) const override {
+        for (const auto& arg : args_) {
+            arg->Serialize(out);
+        }
+        out += OP_FUNCTION;
+        out += static_cast<char>(signature_.function);
+        WriteCode(out, static_cast<uint8_t>(args_.size()));
+    }
+
+    size_t GetOperandCount() const override {
+        return args_.size();
+    }
+
+    std::unique_ptr<Expr>& GetOperand(size_t index) override {
+        return args_.at(index);
+    }
+
+    std::unique_ptr<Expr> Clone() const override {
+        std::vector<std::unique_ptr<Expr>> args;
+        args.reserve(args_.size());
+        for (const auto& arg : args_) {
+            args.push_back(arg->Clone());
+        }
+        return std::make_unique<FunctionExpr>(signature_, std::move(args));
+    }
+
+    std::unique_ptr<Expr> Simplify(bool key) const override;
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double DoEvaluate(const SheetInterface& sheet) const override {
+        switch (signature_.function) {
+        case VLookup:
+            return EvaluateVLookup(sheet);
+        case Match:
+            return EvaluateMatch(sheet);
+        case XLookup:
+            return EvaluateXLookup(sheet);
+        case SumIf:
+            return EvaluateAggregate(sheet).sum;
+        case CountIf:
+            return static_cast<double>(EvaluateAggregate(sheet).matches);
+        case AverageIf: {
+            auto aggregate = EvaluateAggregate(sheet);
+            if (aggregate.numbers == 0) {
+                throw FormulaError(FormulaError::Category::Div0);
+            }
+            return aggregate.sum / static_cast<double>(aggregate.numbers);
+        }
+        }
+        assert(false);
+        return 0;
+    }
+
+private:
+    static const Signature SIGNATURES[];
+
+    const Signature& signature_;
+    std::vector<std::unique_ptr<Expr>> args_;
+
+    const RangeExpr& GetRangeArg(size_t index) const {
+        return static_cast<const RangeExpr&>(*args_[index]);
+    }
+
+    // the number of cells of a single row or column range, 0 for a rectangle
+    static int GetLineSize(Range range) {
+        Size size = range.GetSize();
+        return size.rows == 1 ? size.cols : size.cols == 1 ? size.rows : 0;
+    }
+
+    // the cell at offset of a single row or column range
+    static Position GetLineCell(Range range, int offset) {
+        if (range.first.col == range.last.col) {
+            return {range.first.row + offset, range.first.col};
+        }
+        return {range.first.row, range.first.col + offset};
+    }
+
+    // VLOOKUP(key, table, column, [approximate = 1]): the value in the given
+    // column of the table row whose first cell matches the key
+    double EvaluateVLookup(const SheetInterface& sheet) const {
+        LookupValue key = args_[0]->EvaluateKey(sheet);
+        const SheetInterface& target = GetRangeArg(1).GetSheet(sheet);
+        Range table = GetRangeArg(1).GetRange();
+        double column = args_[2]->Evaluate(sheet);
+        if (column < 1) {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+        if (column >= table.GetSize().cols + 1) {
+            throw FormulaError(FormulaError::Category::Ref);
+        }
+        bool approximate = args_.size() < 4 || args_[3]->Evaluate(sheet) != 0;
+        auto row = target.Lookup(key, {table.first, {table.last.row, table.first.col}},
+            approximate ? LookupMode::LessOrEqual : LookupMode::Exact);
+        if (!row) {
+            throw FormulaError(FormulaError::Category::NA);
+        }
+        return CellToNumber(target.GetCell({table.first.row + *row, table.first.col + static_cast<int>(column) - 1}));
+    }
+
+    // MATCH(key, range, [type = 1]): the position of the matching cell in
+    // the range, counting from 1; type 1 takes the largest value not above
+    // the key, 0 -- an equal one, -1 -- the smallest value not below the key
+    double EvaluateMatch(const SheetInterface& sheet) const {
+        LookupValue key = args_[0]->EvaluateKey(sheet);
+        const SheetInterface& target = GetRangeArg(1).GetSheet(sheet);
+        Range range = GetRangeArg(1).GetRange();
+        double type = args_.size() < 3 ? 1 : args_[2]->Evaluate(sheet);
+        if (GetLineSize(range) == 0) {
+            throw FormulaError(FormulaError::Category::NA);
+        }
+        auto mode = type > 0 ? LookupMode::LessOrEqual : type < 0 ? LookupMode::GreaterOrEqual : LookupMode::Exact;
+        auto index = target.Lookup(key, range, mode);
+        if (!index) {
+            throw FormulaError(FormulaError::Category::NA);
+        }
+        return *index + 1;
+    }
+
+    // XLOOKUP(key, lookup_range, result_range, [if_not_found], [mode = 0]):
+    // the cell of result_range at the position of the match in lookup_range;
+    // mode 0 is an exact match, -1 also takes the next smaller value, 1 --
+    // the next larger one
+    double EvaluateXLookup(const SheetInterface& sheet) const {
+        LookupValue key = args_[0]->EvaluateKey(sheet);
+        const SheetInterface& lookup_sheet = GetRangeArg(1).GetSheet(sheet);
+        const SheetInterface& result_sheet = GetRangeArg(2).GetSheet(sheet);
+        Range lookup_range = GetRangeArg(1).GetRange();
+        Range result_range = GetRangeArg(2).GetRange();
+        int size = GetLineSize(lookup_range);
+        if (size == 0 || GetLineSize(result_range) != size) {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+        double mode = args_.size() < 5 ? 0 : args_[4]->Evaluate(sheet);
+        LookupMode lookup_mode;
+        if (mode == 0) {
+            lookup_mode = LookupMode::Exact;
+        } else if (mode == -1) {
+            lookup_mode = LookupMode::LessOrEqual;
+        } else if (mode == 1) {
+            lookup_mode = LookupMode::GreaterOrEqual;
+        } else {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+        auto index = lookup_sheet.Lookup(key, lookup_range, lookup_mode);
+        if (!index) {
+            if (args_.size() >= 4) {
+                return args_[3]->Evaluate(sheet);
+            }
+            throw FormulaError(FormulaError::Category::NA);
+        }
+        return CellToNumber(result_sheet.GetCell(GetLineCell(result_range, *index)));
+    }
+
+    // SUMIF(range, criterion, [sum_range]), COUNTIF(range, criterion),
+    // AVERAGEIF(range, criterion, [average_range]): the cells of the range
+    // that meet the criterion and the numbers at the same positions of the
+    // sum range (of the range itself if there is none). The sum range must
+    // be on the same sheet and have the same size.
+    ConditionalAggregate EvaluateAggregate(const SheetInterface& sheet) const {
+        const SheetInterface& target = GetRangeArg(0).GetSheet(sheet);
+        Range range = GetRangeArg(0).GetRange();
+        auto criterion = ParseCriterion(args_[1]->EvaluateKey(sheet));
+        std::optional<Range> sum_range;
+        if (args_.size() > 2) {
+            if (&GetRangeArg(2).GetSheet(sheet) != &target) {
                 throw FormulaError(FormulaError::Category::Value);
             }
+            sum_range = GetRangeArg(2).GetRange();
         }
+        const int size = GetLineSize(range);
+        if (size == 0 || (sum_range && GetLineSize(*sum_range) != size)) {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+        if (!criterion) {
+            return {};
+        }
+        return target.Aggregate(range, *criterion, sum_range);
+    }
+};
+
+const FunctionExpr::Signature FunctionExpr::SIGNATURES[] = {
+    {VLookup, "VLOOKUP", 3, 4, 0b0010},
+    {Match, "MATCH", 2, 3, 0b0010},
+    {XLookup, "XLOOKUP", 3, 5, 0b0110},
+    {SumIf, "SUMIF", 2, 3, 0b0101},
+    {CountIf, "COUNTIF", 2, 2, 0b0001},
+    {AverageIf, "AVERAGEIF", 2, 3, 0b0101},
+};
+
+const FunctionExpr::Signature* FunctionExpr::FindSignature(std::string_view name) {
+    auto it = std::find_if(std::begin(SIGNATURES), std::end(SIGNATURES), [name](const Signature& signature) {
+        return signature.name == name;
+    });
+    return it == std::end(SIGNATURES) ? nullptr : it;
+}
+
+const FunctionExpr::Signature* FunctionExpr::FindSignature(Function function) {
+    auto it = std::find_if(std::begin(SIGNATURES), std::end(SIGNATURES), [function](const Signature& signature) {
+        return signature.function == function;
+    });
+    return it == std::end(SIGNATURES) ? nullptr : it;
+}
+
+// The error of a constant subtree, e.g. 1/0; only in the simplified tree
+class ErrorExpr final : public Expr {
+public:
+    explicit ErrorExpr(FormulaError error)
+        : error_(error) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << error_;
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        Print(out);
+    }
+
+    void Serialize(std::string& out) const override {
+        out += OP_ERROR;
+        out += static_cast<char>(error_.GetCategory());
+    }
+
+    std::unique_ptr<Expr> Clone() const override {
+        return std::make_unique<ErrorExpr>(error_);
+    }
+
+    std::optional<Constant> GetConstant() const override {
+        return error_;
+    }
 
-        throw std::get<FormulaError> (value);
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double DoEvaluate(const SheetInterface& /* sheet */) const override {
+        throw error_;
     }
 
 private:
-    Position pos_;
+    FormulaError error_;
 };
 
+std::unique_ptr<Expr> MakeConstant(const Constant& value) {
+    if (const double* number = std::get_if<double>(&value)) {
+        return std::make_unique<NumberExpr>(*number);
+    }
+    return std::make_unique<ErrorExpr>(std::get<FormulaError>(value));
+}
+
+// the simplified operand if there is one, otherwise a copy of the original
+std::unique_ptr<Expr> TakeOrClone(std::unique_ptr<Expr>& simplified, const Expr& original) {
+    return simplified ? std::move(simplified) : original.Clone();
+}
+
+bool IsNumber(const std::optional<Constant>& value, double number) {
+    const double* actual = value ? std::get_if<double>(&*value) : nullptr;
+    return actual && *actual == number && !std::signbit(*actual);
+}
+
+std::unique_ptr<Expr> BinaryOpExpr::Simplify(bool /* key */) const {
+    auto lhs = lhs_->Simplify(false);
+    auto rhs = rhs_->Simplify(false);
+    const Expr& left = lhs ? *lhs : *lhs_;
+    const Expr& right = rhs ? *rhs : *rhs_;
+    auto left_value = left.GetConstant();
+    auto right_value = right.GetConstant();
+    if (left_value && right_value) {
+        // the left operand is evaluated first, so its error wins
+        if (std::holds_alternative<FormulaError>(*left_value)) {
+            return MakeConstant(*left_value);
+        }
+        if (std::holds_alternative<FormulaError>(*right_value)) {
+            return MakeConstant(*right_value);
+        }
+        try {
+            return MakeConstant(Apply(type_, std::get<double>(*left_value), std::get<double>(*right_value)));
+        } catch (const FormulaError& error) {
+            return MakeConstant(error);
+        }
+    }
+    // an operation never returns an infinity, so the identity has nothing
+    // to check; a cell may hold "inf"
+    if (dynamic_cast<const BinaryOpExpr*>(&left)
+        && (((type_ == Multiply || type_ == Divide) && IsNumber(right_value, 1))
+            || (type_ == Subtract && IsNumber(right_value, 0)))) {
+        return TakeOrClone(lhs, *lhs_);
+    }
+    if (dynamic_cast<const BinaryOpExpr*>(&right) && type_ == Multiply && IsNumber(left_value, 1)) {
+        return TakeOrClone(rhs, *rhs_);
+    }
+    if (!lhs && !rhs) {
+        return nullptr;
+    }
+    return std::make_unique<BinaryOpExpr>(type_, TakeOrClone(lhs, *lhs_), TakeOrClone(rhs, *rhs_));
+}
+
+std::unique_ptr<Expr> UnaryOpExpr::Simplify(bool key) const {
+    auto operand = operand_->Simplify(false);
+    const Expr& current = operand ? *operand : *operand_;
+    if (auto value = current.GetConstant()) {
+        if (const double* number = std::get_if<double>(&*value)) {
+            return MakeConstant(Apply(type_, *number));
+        }
+        return MakeConstant(*value);
+    }
+    // a cell reference as a key is its text, not its number
+    auto replaceable = [key](const Expr& expr) {
+        return !key || !dynamic_cast<const CellExpr*>(&expr);
+    };
+    if (type_ == UnaryPlus && replaceable(current)) {
+        return TakeOrClone(operand, *operand_);
+    }
+    const auto* inner = dynamic_cast<const UnaryOpExpr*>(&current);
+    if (type_ == UnaryMinus && inner && inner->type_ == UnaryMinus && replaceable(*inner->operand_)) {
+        if (operand) {
+            return std::move(static_cast<UnaryOpExpr&>(*operand).operand_);
+        }
+        return inner->operand_->Clone();
+    }
+    if (!operand) {
+        return nullptr;
+    }
+    return std::make_unique<UnaryOpExpr>(type_, std::move(operand));
+}
+
+std::unique_ptr<Expr> FunctionExpr::Simplify(bool /* key */) const {
+    // allocated only when an argument changes
+    std::vector<std::unique_ptr<Expr>> args;
+    for (size_t i = 0; i < args_.size(); ++i) {
+        if (auto arg = args_[i]->Simplify(true)) {
+            args.resize(args_.size());
+            args[i] = std::move(arg);
+        }
+    }
+    if (args.empty()) {
+        return nullptr;
+    }
+    for (size_t i = 0; i < args_.size(); ++i) {
+        args[i] = TakeOrClone(args[i], *args_[i]);
+    }
+    return std::make_unique<FunctionExpr>(signature_, std::move(args));
+}
+
+// Shares every subtree with operands that references a cell or a range
+// through the table, innermost first, and collects the acquired entries.
+// Returns whether the subtree references anything; code is a scratch buffer.
+bool ShareSubtrees(std::unique_ptr<Expr>& expr, SubexpressionTable& table,
+                   std::vector<SubexpressionTable::Entry*>& entries, std::string& code) {
+    if (dynamic_cast<const CellExpr*>(expr.get()) || dynamic_cast<const RangeExpr*>(expr.get())) {
+        return true;
+    }
+    bool references = false;
+    for (size_t i = 0; i < expr->GetOperandCount(); ++i) {
+        references |= ShareSubtrees(expr->GetOperand(i), table, entries, code);
+    }
+    if (!references) {
+        return false;
+    }
+    code.clear();
+    expr->Serialize(code);
+    entries.reserve(entries.size() + 1);
+    SubexpressionTable::Entry* entry = table.Acquire(code);
+    expr->Share(entry);
+    entries.push_back(entry);
+    return true;
+}
+
+// ranges are accepted only as function arguments
+void CheckNotRange(const Expr& expr) {
+    if (dynamic_cast<const RangeExpr*>(&expr)) {
+        throw ParsingError("A range can only be an argument of a function");
+    }
+}
+
 class ParseASTListener final : public FormulaBaseListener {
 public:
     std::unique_ptr<Expr> MoveRoot() {
         assert(args_.size() == 1);
         auto root = std::move(args_.front());
         args_.clear();
+        CheckNotRange(*root);
 
         return root;
     }
@@ -327,12 +1140,25 @@ public:
         return cells_;
     }
 
+    std::set<SheetPosition> GetExternalCells() const {
+        return external_cells_;
+    }
+
+    std::set<Range> GetRanges() const {
+        return ranges_;
+    }
+
+    std::set<SheetRange> GetExternalRanges() const {
+        return external_ranges_;
+    }
+
 public:
 
     void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
         assert(args_.size() >= 1);
 
         auto operand = std::move(args_.back());
+        CheckNotRange(*operand);
 
         UnaryOpExpr::Type type;
         if (ctx->SUB()) {
@@ -360,12 +1186,28 @@ public:
     }
 
     void exitCell(FormulaParser::CellContext* ctx) override {
-        Position pos = Position::FromString(ctx->getText());
+        std::string text = ctx->getText();
+        auto separator = text.rfind(SHEET_SEPARATOR);
+        std::string_view cell = text;
+        if (separator != std::string::npos) {
+            cell.remove_prefix(separator + 1);
+        }
+        Position pos = Position::FromString(cell);
         if (!pos.IsValid()) {
             throw InvalidPositionException("Invalid position" + pos.ToString());
         } 
-        args_.push_back(std::make_unique<CellExpr> (pos));
-        cells_.insert(pos);
+        if (separator == std::string::npos) {
+            args_.push_back(std::make_unique<CellExpr> (pos));
+            cells_.insert(pos);
+            return;
+        }
+
+        std::string sheet = text.substr(0, separator);
+        if (sheet.front() == ESCAPE_SIGN) {
+            sheet = sheet.substr(1, sheet.size() - 2);
+        }
+        args_.push_back(std::make_unique<CellExpr> (pos, sheet));
+        external_cells_.insert({std::move(sheet), pos});
     }
 
     void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
@@ -375,6 +1217,8 @@ public:
         args_.pop_back();
 
         auto lhs = std::move(args_.back());
+        CheckNotRange(*lhs);
+        CheckNotRange(*rhs);
 
         BinaryOpExpr::Type type;
         if (ctx->ADD()) {
@@ -392,6 +1236,63 @@ public:
         args_.back() = std::move(node);
     }
 
+    void exitRange(FormulaParser::RangeContext* ctx) override {
+        std::string text = ctx->getText();
+        auto separator = text.rfind(SHEET_SEPARATOR);
+        std::string_view corners = text;
+        if (separator != std::string::npos) {
+            corners.remove_prefix(separator + 1);
+        }
+        auto colon = corners.find(':');
+        Position first = Position::FromString(corners.substr(0, colon));
+        Position last = Position::FromString(corners.substr(colon + 1));
+        if (!first.IsValid() || !last.IsValid()) {
+            throw InvalidPositionException("Invalid range " + std::string(corners));
+        }
+        // B3:A1 is the same range as A1:B3
+        Range range{{std::min(first.row, last.row), std::min(first.col, last.col)},
+                    {std::max(first.row, last.row), std::max(first.col, last.col)}};
+        if (separator == std::string::npos) {
+            args_.push_back(std::make_unique<RangeExpr>(range));
+            ranges_.insert(range);
+            return;
+        }
+
+        std::string sheet = text.substr(0, separator);
+        if (sheet.front() == ESCAPE_SIGN) {
+            sheet = sheet.substr(1, sheet.size() - 2);
+        }
+        args_.push_back(std::make_unique<RangeExpr>(range, sheet));
+        external_ranges_.insert({std::move(sheet), range});
+    }
+
+    void exitText(FormulaParser::TextContext* ctx) override {
+        std::string literal = ctx->STRING()->getSymbol()->getText();
+        // without the outer quotes, a doubled quote stands for one
+        std::string text;
+        for (size_t i = 1; i + 1 < literal.size(); ++i) {
+            text += literal[i];
+            if (literal[i] == '"') {
+                ++i;
+            }
+        }
+        args_.push_back(std::make_unique<StringExpr>(std::move(text)));
+    }
+
+    void exitFunction(FormulaParser::FunctionContext* ctx) override {
+        std::string name = ctx->FUNCTION()->getSymbol()->getText();
+        const auto* signature = FunctionExpr::FindSignature(name);
+        if (!signature) {
+            throw ParsingError("Unknown function " + name);
+        }
+        size_t count = ctx->expr().size();
+        assert(args_.size() >= count);
+        std::vector<std::unique_ptr<Expr>> args(std::make_move_iterator(args_.end() - count),
+                                                std::make_move_iterator(args_.end()));
+        args_.resize(args_.size() - count);
+        args_.push_back(std::make_unique<FunctionExpr>(*signature, std::move(args)));
+    }
+
     void visitErrorNode(antlr4::tree::ErrorNode* node) override {
         throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
     }
@@ -399,6 +1300,9 @@ public:
 private:
     std::vector<std::unique_ptr<Expr>> args_;
     std::set<Position> cells_;
+    std::set<SheetPosition> external_cells_;
+    std::set<Range> ranges_;
+    std::set<SheetRange> external_ranges_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -416,6 +1320,8 @@ public:
 
 FormulaAST ParseFormulaAST(std::istream& in) {
     using namespace antlr4;
+    SPREADSHEET_METRIC_TIMER(ParseNanoseconds);
+    SPREADSHEET_TRACE_SPAN("parse");
 
     ANTLRInputStream input(in);
 
@@ -435,7 +1341,290 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     ASTImpl::ParseASTListener listener;
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.GetCells());
+    auto root = listener.MoveRoot();
+    return FormulaAST(std::move(root), listener.GetCells(), listener.GetExternalCells(), listener.GetRanges(),
+        listener.GetExternalRanges());
+}
+
+FormulaAST LoadFormulaAST(std::string_view code) {
+    using namespace ASTImpl;
+
+    std::vector<std::unique_ptr<Expr>> args;
+    std::set<Position> cells;
+    std::set<SheetPosition> external_cells;
+    std::set<Range> ranges;
+    std::set<SheetRange> external_ranges;
+    auto pop_arg = [&args] {
+        if (args.empty()) {
+            throw FormulaException("malformed formula code");
+        }
+        auto arg = std::move(args.back());
+        args.pop_back();
+        return arg;
+    };
+
+    while (!code.empty()) {
+        char op = ReadCode<char>(code);
+        switch (op) {
+        case OP_NUMBER:
+            args.push_back(std::make_unique<NumberExpr>(ReadCode<double>(code)));
+            break;
+        case OP_CELL:
+        case OP_SHEET_CELL: {
+            std::string sheet;
+            if (op == OP_SHEET_CELL) {
+                sheet = ReadCodeString(code);
+            }
+            Position pos;
+            pos.row = ReadCode<int32_t>(code);
+            pos.col = ReadCode<int32_t>(code);
+            if (!pos.IsValid()) {
+                throw FormulaException("malformed formula code");
+            }
+            if (sheet.empty()) {
+                cells.insert(pos);
+            } else {
+                external_cells.insert({sheet, pos});
+            }
+            args.push_back(std::make_unique<CellExpr>(pos, std::move(sheet)));
+            break;
+        }
+        case OP_UNARY: {
+            auto type = static_cast<UnaryOpExpr::Type>(ReadCode<char>(code));
+            if (type != UnaryOpExpr::UnaryPlus && type != UnaryOpExpr::UnaryMinus) {
+                throw FormulaException("malformed formula code");
+            }
+            auto operand = pop_arg();
+            if (dynamic_cast<const RangeExpr*>(operand.get())) {
+                throw FormulaException("malformed formula code");
+            }
+            args.push_back(std::make_unique<UnaryOpExpr>(type, std::move(operand)));
+            break;
+        }
+        case OP_BINARY: {
+            auto type = static_cast<BinaryOpExpr::Type>(ReadCode<char>(code));
+            if (type != BinaryOpExpr::Add && type != BinaryOpExpr::Subtract
+                && type != BinaryOpExpr::Multiply && type != BinaryOpExpr::Divide) {
+                throw FormulaException("malformed formula code");
+            }
+            auto rhs = pop_arg();
+            auto lhs = pop_arg();
+            if (dynamic_cast<const RangeExpr*>(lhs.get()) || dynamic_cast<const RangeExpr*>(rhs.get())) {
+                throw FormulaException("malformed formula code");
+            }
+            args.push_back(std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs)));
+            break;
+        }
+        case OP_RANGE:
+        case OP_SHEET_RANGE: {
+            std::string sheet;
+            if (op == OP_SHEET_RANGE) {
+                sheet = ReadCodeString(code);
+            }
+            Range range;
+            range.first.row = ReadCode<int32_t>(code);
+            range.first.col = ReadCode<int32_t>(code);
+            range.last.row = ReadCode<int32_t>(code);
+            range.last.col = ReadCode<int32_t>(code);
+            if (!range.IsValid()) {
+                throw FormulaException("malformed formula code");
+            }
+            if (sheet.empty()) {
+                ranges.insert(range);
+            } else {
+                external_ranges.insert({sheet, range});
+            }
+            args.push_back(std::make_unique<RangeExpr>(range, std::move(sheet)));
+            break;
+        }
+        case OP_STRING:
+            args.push_back(std::make_unique<StringExpr>(ReadCodeString(code)));
+            break;
+        case OP_FUNCTION: {
+            const auto* signature = FunctionExpr::FindSignature(static_cast<FunctionExpr::Function>(ReadCode<char>(code)));
+            auto count = ReadCode<uint8_t>(code);
+            if (!signature || count > args.size()) {
+                throw FormulaException("malformed formula code");
+            }
+            std::vector<std::unique_ptr<Expr>> function_args(std::make_move_iterator(args.end() - count),
+                                                             std::make_move_iterator(args.end()));
+            args.resize(args.size() - count);
+            try {
+                args.push_back(std::make_unique<FunctionExpr>(*signature, std::move(function_args)));
+            } catch (const ParsingError&) {
+                throw FormulaException("malformed formula code");
+            }
+            break;
+        }
+        default:
+            throw FormulaException("malformed formula code");
+        }
+    }
+    if (args.size() != 1 || dynamic_cast<const RangeExpr*>(args.front().get())) {
+        throw FormulaException("malformed formula code");
+    }
+    return FormulaAST(std::move(args.front()), cells, external_cells, ranges, external_ranges);
+}
+
+std::optional<FormulaReferences> ScanFormulaReferences(std::string_view expression) {
+    auto is_digit = [](char c) {
+        return c >= '0' && c <= '9';
+    };
+    auto is_upper = [](char c) {
+        return c >= 'A' && c <= 'Z';
+    };
+    auto is_ident = [&](char c) {
+        return is_digit(c) || is_upper(c) || (c >= 'a' && c <= 'z') || c == '_';
+    };
+
+    FormulaReferences result;
+    const size_t n = expression.size();
+    size_t i = 0;
+    // the grammar subset is checked as well: an operand or a unary sign is
+    // expected after an operator or '(', an operator or ')' after an operand
+    bool operand_expected = true;
+    int depth = 0;
+    // CELL without the sheet part: [A-Z]+[0-9]+ and nothing identifier-like after it
+    auto scan_cell = [&]() -> std::optional<Position> {
+        size_t begin = i;
+        while (i < n && is_upper(expression[i])) {
+            ++i;
+        }
+        size_t letters_end = i;
+        while (i < n && is_digit(expression[i])) {
+            ++i;
+        }
+        if (letters_end == begin || letters_end == i || (i < n && is_ident(expression[i]))) {
+            return std::nullopt;
+        }
+        Position pos = Position::FromString(expression.substr(begin, i - begin));
+        if (!pos.IsValid()) {
+            return std::nullopt;
+        }
+        return pos;
+    };
+
+    while (i < n) {
+        char c = expression[i];
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            ++i;
+            continue;
+        }
+        if (c == '+' || c == '-' || c == '*' || c == '/' || c == '(' || c == ')') {
+            if (c == '(') {
+                if (!operand_expected) {
+                    return std::nullopt;
+                }
+                ++depth;
+            } else if (c == ')') {
+                if (operand_expected || depth == 0) {
+                    return std::nullopt;
+                }
+                --depth;
+            } else if (operand_expected && (c == '*' || c == '/')) {
+                return std::nullopt;
+            } else {
+                // a binary operator or a unary sign
+                operand_expected = true;
+            }
+            ++i;
+            continue;
+        }
+        // everything else is an operand
+        if (!operand_expected) {
+            return std::nullopt;
+        }
+        operand_expected = false;
+        if (is_digit(c) || c == '.') {
+            // NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+            size_t begin = i;
+            while (i < n && is_digit(expression[i])) {
+                ++i;
+            }
+            if (i < n && expression[i] == '.') {
+                if (++i == n || !is_digit(expression[i])) {
+                    return std::nullopt;
+                }
+                while (i < n && is_digit(expression[i])) {
+                    ++i;
+                }
+            }
+            if (i < n && (expression[i] == 'e' || expression[i] == 'E')) {
+                size_t exponent = i + 1;
+                if (exponent < n && (expression[exponent] == '+' || expression[exponent] == '-')) {
+                    ++exponent;
+                }
+                if (exponent == n || !is_digit(expression[exponent])) {
+                    return std::nullopt;
+                }
+                for (i = exponent; i < n && is_digit(expression[i]);) {
+                    ++i;
+                }
+            }
+            // the parser rejects a literal out of the double range
+            char buffer[64];
+            if (i - begin >= sizeof(buffer)) {
+                return std::nullopt;
+            }
+            expression.copy(buffer, i - begin, begin);
+            buffer[i - begin] = '\0';
+            errno = 0;
+            std::strtod(buffer, nullptr);
+            if (errno == ERANGE) {
+                return std::nullopt;
+            }
+        } else if (c == ESCAPE_SIGN) {
+            // 'Sheet name'!A1
+            size_t close = expression.find(ESCAPE_SIGN, i + 1);
+            if (close == std::string_view::npos || close == i + 1 || close + 1 >= n
+                || expression[close + 1] != SHEET_SEPARATOR) {
+                return std::nullopt;
+            }
+            std::string sheet(expression.substr(i + 1, close - i - 1));
+            if (sheet.find_first_of("\r\n") != std::string::npos) {
+                return std::nullopt;
+            }
+            i = close + 2;
+            auto pos = scan_cell();
+            if (!pos) {
+                return std::nullopt;
+            }
+            result.external_cells.push_back({std::move(sheet), *pos});
+        } else if (is_ident(c)) {
+            size_t begin = i;
+            while (i < n && is_ident(expression[i])) {
+                ++i;
+            }
+            if (i < n && expression[i] == SHEET_SEPARATOR) {
+                std::string sheet(expression.substr(begin, i - begin));
+                ++i;
+                auto pos = scan_cell();
+                if (!pos) {
+                    return std::nullopt;
+                }
+                result.external_cells.push_back({std::move(sheet), *pos});
+            } else {
+                i = begin;
+                auto pos = scan_cell();
+                if (!pos) {
+                    return std::nullopt;
+                }
+                result.cells.push_back(*pos);
+            }
+        } else {
+            return std::nullopt;
+        }
+    }
+    if (operand_expected || depth != 0) {
+        return std::nullopt;
+    }
+    auto sort_unique = [](auto& items) {
+        std::sort(items.begin(), items.end());
+        items.erase(std::unique(items.begin(), items.end()), items.end());
+    };
+    sort_unique(result.cells);
+    sort_unique(result.external_cells);
+    return result;
 }
 
 FormulaAST ParseFormulaAST(const std::string& in_str) {
@@ -455,18 +1644,57 @@ void FormulaAST::PrintFormula(std::ostream& out) const {
     root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
 }
 
+void FormulaAST::Serialize(std::string& out) const {
+    root_expr_->Serialize(out);
+}
+
 double FormulaAST::Execute(const SheetInterface& sheet) const {
-    return root_expr_->Evaluate(sheet);
+    return (eval_expr_ ? eval_expr_ : root_expr_)->Evaluate(sheet);
+}
+
+void FormulaAST::ShareSubexpressions(SubexpressionTable& table) {
+    assert(shared_.empty());
+    std::string code;
+    ASTImpl::ShareSubtrees(eval_expr_ ? eval_expr_ : root_expr_, table, shared_, code);
+}
+
+void FormulaAST::ResetSubexpressions() const {
+    for (auto* entry : shared_) {
+        entry->ResetValue();
+    }
 }
 
 std::vector<Position> FormulaAST::GetReferencedCells() const {
     return cells_;
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, const std::set<Position>& cells)
-    : root_expr_(std::move(root_expr)), cells_({ cells.begin(), cells.end() })
+Span<const Position> FormulaAST::GetReferencedCellsRef() const {
+    return cells_;
+}
+
+std::vector<SheetPosition> FormulaAST::GetExternalReferencedCells() const {
+    return external_cells_;
+}
+
+std::vector<Range> FormulaAST::GetReferencedRanges() const {
+    return ranges_;
+}
+
+std::vector<SheetRange> FormulaAST::GetExternalReferencedRanges() const {
+    return external_ranges_;
+}
+
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, const std::set<Position>& cells,
+    const std::set<SheetPosition>& external_cells, const std::set<Range>& ranges,
+    const std::set<SheetRange>& external_ranges)
+    : root_expr_(std::move(root_expr)), cells_({ cells.begin(), cells.end() }),
+      external_cells_({ external_cells.begin(), external_cells.end() }),
+      ranges_({ ranges.begin(), ranges.end() }),
+      external_ranges_({ external_ranges.begin(), external_ranges.end() })
 {
-    
+    eval_expr_ = root_expr_->Simplify(false);
 }
 
+FormulaAST::FormulaAST(FormulaAST&&) = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) = default;
 FormulaAST::~FormulaAST() = default;
@@ -2,11 +2,14 @@
 
 #include "FormulaLexer.h"
 #include "common.h"
+#include "subexpressions.h"
 
 #include <forward_list>
 #include <functional>
+#include <optional>
 #include <stdexcept>
 #include <set>
+#include <string_view>
 
 namespace ASTImpl {
 class Expr;
@@ -20,22 +23,62 @@ class ParsingError : public std::runtime_error {
 class FormulaAST {
 public:
   
-    FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, const std::set<Position>& cells = {});
+    FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, const std::set<Position>& cells = {},
+        const std::set<SheetPosition>& external_cells = {}, const std::set<Range>& ranges = {},
+        const std::set<SheetRange>& external_ranges = {});
 
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+    FormulaAST(FormulaAST&&);
+    FormulaAST& operator=(FormulaAST&&);
     ~FormulaAST();
 
+    // evaluates the simplified copy of the tree if there is one (see
+    // Expr::Simplify); printing and serialization use the tree as written
     double Execute(const SheetInterface& sheet) const;
+    // Makes the evaluated subtrees that reference cells or ranges share
+    // their values through the table, see SubexpressionTable. Called once,
+    // when the formula is placed on a sheet.
+    void ShareSubexpressions(SubexpressionTable& table);
+    // forgets the shared values of the subtrees of this formula
+    void ResetSubexpressions() const;
     void Print(std::ostream& out) const;
     void PrintFormula(std::ostream& out) const;
+    // appends the compiled code of the formula, see LoadFormulaAST
+    void Serialize(std::string& out) const;
 
     std::vector<Position> GetReferencedCells() const;
+    Span<const Position> GetReferencedCellsRef() const;
+    std::vector<SheetPosition> GetExternalReferencedCells() const;
+    // ranges passed to functions, e.g. VLOOKUP(A1,B1:C10,2); sorted, no duplicates
+    std::vector<Range> GetReferencedRanges() const;
+    std::vector<SheetRange> GetExternalReferencedRanges() const;
 
 private:
     std::unique_ptr<ASTImpl::Expr> root_expr_;
+    // the tree that is evaluated, if simplification changed anything
+    std::unique_ptr<ASTImpl::Expr> eval_expr_;
     std::vector<Position> cells_;
+    std::vector<SheetPosition> external_cells_;
+    std::vector<Range> ranges_;
+    std::vector<SheetRange> external_ranges_;
+    // entries of the shared subtrees; the subtree nodes hold their uses
+    std::vector<SubexpressionTable::Entry*> shared_;
 };
 
 FormulaAST ParseFormulaAST(std::istream& in);
 FormulaAST ParseFormulaAST(const std::string& in_str);
+// Rebuilds the AST from the code written by FormulaAST::Serialize without
+// running the parser. Throws FormulaException if the code is malformed.
+FormulaAST LoadFormulaAST(std::string_view code);
+
+struct FormulaReferences {
+    std::vector<Position> cells;                  // sorted, no duplicates
+    std::vector<SheetPosition> external_cells;    // sorted, no duplicates
+};
+
+// Extracts the cell references of an expression with a single lexer-like pass
+// that mirrors the tokens of Formula.g4, without building a parse tree.
+// Returns nullopt if the text contains anything the scan can't classify with
+// certainty (the caller should run the real parser then). The scan also checks
+// the grammar of the subset it accepts (operators, parentheses, numbers and
+// cells), so a text accepted here always parses: "A1 A2" and "1+" are rejected.
+std::optional<FormulaReferences> ScanFormulaReferences(std::string_view expression);
@@ -0,0 +1,306 @@
+#include "aggregate.h"
+#include "lookup.h"
+
+#include <algorithm>
+#include <cassert>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+
+namespace {
+
+// число ячеек диапазона из одной строки или одного столбца; 0 -- диапазон
+// недопустим или это прямоугольник
+int GetLineSize(Range range) {
+    if (!range.IsValid()) {
+        return 0;
+    }
+    Size size = range.GetSize();
+    return size.rows == 1 ? size.cols : size.cols == 1 ? size.rows : 0;
+}
+
+Position GetLineCell(Range range, int offset) {
+    if (range.first.col == range.last.col) {
+        return {range.first.row + offset, range.first.col};
+    }
+    return {range.first.row, range.first.col + offset};
+}
+
+std::optional<double> ParseNumber(std::string_view text) {
+    if (text.empty() || std::string_view("0123456789.+-").find(text.front()) == std::string_view::npos) {
+        return std::nullopt;
+    }
+    size_t parsed = 0;
+    double value = 0;
+    try {
+        value = std::stod(std::string(text), &parsed);
+    } catch (...) {
+        return std::nullopt;
+    }
+    if (parsed != text.size()) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+}  // namespace
+
+AggregateValue ReadAggregateValue(const CellInterface* cell) {
+    if (!cell) {
+        return std::monostate();
+    }
+    if (auto number = cell->GetNumber()) {
+        return *number;
+    }
+    auto value = cell->GetValue();
+    if (const double* number = std::get_if<double>(&value)) {
+        return *number;
+    }
+    if (const FormulaError* error = std::get_if<FormulaError>(&value)) {
+        return *error;
+    }
+    return std::monostate();
+}
+
+std::optional<Criterion> ParseCriterion(LookupValue argument) {
+    Criterion criterion;
+    if (const std::string* text = std::get_if<std::string>(&argument)) {
+        // двухсимвольные операторы проверяются раньше своих префиксов
+        static const std::pair<std::string_view, CriterionOp> OPERATORS[] = {
+            {"<>", CriterionOp::NotEqual},
+            {"<=", CriterionOp::LessOrEqual},
+            {">=", CriterionOp::GreaterOrEqual},
+            {"<", CriterionOp::Less},
+            {">", CriterionOp::Greater},
+            {"=", CriterionOp::Equal},
+        };
+        std::string_view rest = *text;
+        for (const auto& [prefix, op] : OPERATORS) {
+            if (rest.substr(0, prefix.size()) == prefix) {
+                criterion.op = op;
+                rest.remove_prefix(prefix.size());
+                break;
+            }
+        }
+        if (auto number = ParseNumber(rest)) {
+            argument = *number;
+        } else {
+            argument = std::string(rest);
+        }
+    }
+    auto value = NormalizeLookupValue(std::move(argument));
+    if (!value) {
+        return std::nullopt;
+    }
+    criterion.value = std::move(*value);
+    return criterion;
+}
+
+bool MatchesCriterion(const Criterion& criterion, const std::optional<LookupValue>& value) {
+    if (!value) {
+        return false;
+    }
+    if (value->index() != criterion.value.index()) {
+        return criterion.op == CriterionOp::NotEqual;
+    }
+    switch (criterion.op) {
+    case CriterionOp::Equal:
+        return *value == criterion.value;
+    case CriterionOp::NotEqual:
+        return *value != criterion.value;
+    case CriterionOp::Less:
+        return *value < criterion.value;
+    case CriterionOp::LessOrEqual:
+        return *value <= criterion.value;
+    case CriterionOp::Greater:
+        return *value > criterion.value;
+    case CriterionOp::GreaterOrEqual:
+        return *value >= criterion.value;
+    }
+    return false;
+}
+
+ConditionalAggregate SheetInterface::Aggregate(Range criteria_range, const Criterion& criterion,
+                                               std::optional<Range> sum_range) const {
+    const int size = GetLineSize(criteria_range);
+    if (size == 0) {
+        throw std::invalid_argument("criteria range must be a single row or column");
+    }
+    if (sum_range && GetLineSize(*sum_range) != size) {
+        throw std::invalid_argument("sum range must be a single row or column of the criteria range size");
+    }
+    ConditionalAggregate result;
+    auto normalized = NormalizeLookupValue(criterion.value);
+    if (!normalized) {
+        return result;
+    }
+    const Criterion normalized_criterion{criterion.op, std::move(*normalized)};
+    for (int i = 0; i < size; ++i) {
+        const CellInterface* cell = GetCell(GetLineCell(criteria_range, i));
+        if (!MatchesCriterion(normalized_criterion, ReadLookupValue(cell))) {
+            continue;
+        }
+        ++result.matches;
+        auto value = ReadAggregateValue(sum_range ? GetCell(GetLineCell(*sum_range, i)) : cell);
+        if (const double* number = std::get_if<double>(&value)) {
+            result.sum += *number;
+            ++result.numbers;
+        } else if (const FormulaError* error = std::get_if<FormulaError>(&value)) {
+            throw *error;
+        }
+    }
+    return result;
+}
+
+AggregateIndex::AggregateIndex(int size)
+    : rows_(size)
+{
+    assert(size > 0);
+}
+
+bool AggregateIndex::IsComplete() const {
+    return complete_;
+}
+
+void AggregateIndex::Reset() {
+    std::fill(rows_.begin(), rows_.end(), Row{});
+    dirty_rows_.clear();
+    groups_.clear();
+    error_rows_.clear();
+    complete_ = false;
+}
+
+void AggregateIndex::SetComplete() {
+    complete_ = true;
+}
+
+void AggregateIndex::Set(int row, std::optional<LookupValue> key, AggregateValue value) {
+    Row updated{std::move(key), std::move(value)};
+    Row& current = rows_.at(row);
+    if (current == updated) {
+        return;
+    }
+    RemoveFromGroup(row);
+    if (std::holds_alternative<FormulaError>(current.value)) {
+        error_rows_.erase(row);
+    }
+    current = std::move(updated);
+    if (std::holds_alternative<FormulaError>(current.value)) {
+        error_rows_.insert(row);
+    }
+    AddToGroup(row);
+}
+
+void AggregateIndex::MarkDirty(int row) {
+    if (!complete_) {
+        return;
+    }
+    if (dirty_rows_.size() >= rows_.size()) {
+        Reset();
+        return;
+    }
+    dirty_rows_.push_back(row);
+}
+
+std::vector<int> AggregateIndex::TakeDirtyRows() {
+    return std::exchange(dirty_rows_, {});
+}
+
+ConditionalAggregate AggregateIndex::Aggregate(const Criterion& criterion) {
+    for (int row : error_rows_) {
+        if (MatchesCriterion(criterion, rows_[row].key)) {
+            throw std::get<FormulaError>(rows_[row].value);
+        }
+    }
+    ConditionalAggregate result;
+    auto add = [this, &result](Group& group) {
+        Refresh(group);
+        result.matches += group.rows.size();
+        result.sum += group.sum;
+        result.numbers += group.numbers;
+    };
+    const LookupValue& value = criterion.value;
+    if (criterion.op == CriterionOp::Equal) {
+        if (auto it = groups_.find(value); it != groups_.end()) {
+            add(it->second);
+        }
+        return result;
+    }
+    if (criterion.op == CriterionOp::NotEqual) {
+        for (auto& [key, group] : groups_) {
+            if (key != value) {
+                add(group);
+            }
+        }
+        return result;
+    }
+    // сравнение идёт только среди значений того же типа; числа в словаре
+    // стоят раньше текста
+    const auto text_begin = groups_.lower_bound(LookupValue(std::string()));
+    auto first = value.index() == 0 ? groups_.begin() : text_begin;
+    auto last = value.index() == 0 ? text_begin : groups_.end();
+    switch (criterion.op) {
+    case CriterionOp::Less:
+        last = groups_.lower_bound(value);
+        break;
+    case CriterionOp::LessOrEqual:
+        last = groups_.upper_bound(value);
+        break;
+    case CriterionOp::Greater:
+        first = groups_.upper_bound(value);
+        break;
+    case CriterionOp::GreaterOrEqual:
+        first = groups_.lower_bound(value);
+        break;
+    default:
+        assert(false);
+    }
+    for (; first != last; ++first) {
+        add(first->second);
+    }
+    return result;
+}
+
+void AggregateIndex::AddToGroup(int row) {
+    const Row& current = rows_[row];
+    if (!current.key) {
+        return;
+    }
+    Group& group = groups_[*current.key];
+    group.rows.insert(std::lower_bound(group.rows.begin(), group.rows.end(), row), row);
+    if (const double* number = std::get_if<double>(&current.value); number && !group.stale) {
+        group.sum += *number;
+        ++group.numbers;
+    }
+}
+
+void AggregateIndex::RemoveFromGroup(int row) {
+    const Row& current = rows_[row];
+    if (!current.key) {
+        return;
+    }
+    auto it = groups_.find(*current.key);
+    assert(it != groups_.end());
+    Group& group = it->second;
+    group.rows.erase(std::lower_bound(group.rows.begin(), group.rows.end(), row));
+    if (group.rows.empty()) {
+        groups_.erase(it);
+    } else if (std::holds_alternative<double>(current.value)) {
+        group.stale = true;
+    }
+}
+
+void AggregateIndex::Refresh(Group& group) {
+    if (!group.stale) {
+        return;
+    }
+    group.sum = 0;
+    group.numbers = 0;
+    for (int row : group.rows) {
+        if (const double* number = std::get_if<double>(&rows_[row].value)) {
+            group.sum += *number;
+            ++group.numbers;
+        }
+    }
+    group.stale = false;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "common.h"
+
+#include <map>
+#include <optional>
+#include <set>
+#include <variant>
+#include <vector>
+
+// Значение ячейки суммирования: число, ошибка либо ничего (пусто, текст)
+using AggregateValue = std::variant<std::monostate, double, FormulaError>;
+
+AggregateValue ReadAggregateValue(const CellInterface* cell);
+
+// Условие из аргумента функции: число -- равенство ему, текст может
+// начинаться с оператора (=, <>, <, <=, >, >=), остаток -- число, если
+// разбирается как число, иначе текст. Значение приводится к виду
+// ReadLookupValue; условие без значения (NaN) возвращает std::nullopt.
+std::optional<Criterion> ParseCriterion(LookupValue argument);
+// подходит ли значение ячейки (вида ReadLookupValue) под условие
+bool MatchesCriterion(const Criterion& criterion, const std::optional<LookupValue>& value);
+
+// Индекс условной агрегации по отрезку из size строк: ключ строки -- её
+// значение в диапазоне условий, значение -- в диапазоне суммирования.
+// Строки сгруппированы по ключу в упорядоченном словаре; у группы хранятся
+// её строки, сумма и количество чисел. Равенство отвечает одной группой,
+// сравнения -- отрезком словаря, так что формулы с разными условиями над
+// одним диапазоном делят один проход по нему. Добавление строки в группу
+// прибавляет её число к сумме, а удаление помечает сумму группы
+// устаревшей: она пересчитывается по строкам группы при следующем запросе,
+// чтобы вычитание не копило погрешность. Отметки строк (MarkDirty,
+// TakeDirtyRows) работают, как в LookupIndex.
+class AggregateIndex {
+public:
+    explicit AggregateIndex(int size);
+
+    bool IsComplete() const;
+    void Reset();
+    void SetComplete();
+
+    void Set(int row, std::optional<LookupValue> key, AggregateValue value);
+    void MarkDirty(int row);
+    std::vector<int> TakeDirtyRows();
+
+    // criterion -- результат ParseCriterion; бросает FormulaError по
+    // правилам SheetInterface::Aggregate
+    ConditionalAggregate Aggregate(const Criterion& criterion);
+
+private:
+    struct Row {
+        std::optional<LookupValue> key;
+        AggregateValue value;
+
+        bool operator==(const Row& rhs) const {
+            return key == rhs.key && value == rhs.value;
+        }
+    };
+    struct Group {
+        std::vector<int> rows;  // по возрастанию
+        double sum = 0;
+        size_t numbers = 0;
+        bool stale = false;
+    };
+
+    bool complete_ = false;
+    std::vector<Row> rows_;
+    std::vector<int> dirty_rows_;
+    std::map<LookupValue, Group> groups_;
+    // строки, в ячейках суммирования которых ошибка
+    std::set<int> error_rows_;
+
+    void AddToGroup(int row);
+    void RemoveFromGroup(int row);
+    // пересчитывает устаревшую сумму группы
+    void Refresh(Group& group);
+};
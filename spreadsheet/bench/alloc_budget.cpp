@@ -0,0 +1,268 @@
+// Бюджеты выделений памяти на горячих путях листа. Глобальный operator new
+// заменён счётчиком; каждая операция выполняется на подготовленном листе, и
+// число выделений сравнивается с бюджетом. Программа запускается после
+// сборки (см. CMakeLists.txt), поэтому правка, незаметно добавившая
+// выделения, ломает сборку. Бюджеты сняты на libstdc++; если выделений
+// стало меньше, бюджет стоит понизить -- программа об этом напоминает.
+// Использование: alloc_budget [--verbose]
+
+#include "formula.h"
+#include "sheet.h"
+
+#include <array>
+#include <atomic>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace {
+
+std::atomic<size_t> allocations{0};
+
+// Поток, отбрасывающий вывод: печать меряется без роста буфера
+class NullBuffer : public std::streambuf {
+protected:
+    int overflow(int c) override {
+        return c;
+    }
+};
+
+template <typename Func>
+size_t CountAllocations(Func func) {
+    size_t before = allocations.load(std::memory_order_relaxed);
+    func();
+    return allocations.load(std::memory_order_relaxed) - before;
+}
+
+struct Budget {
+    std::string name;
+    // разрешённое число выделений; measure возвращает фактическое и может
+    // добавить к бюджету выделения, которые от движка не зависят
+    size_t limit;
+    std::function<size_t(size_t& limit)> measure;
+};
+
+constexpr const char* FORMULA = "A1+B1*2";
+constexpr int ROW_CELLS = 100;
+
+std::vector<Budget> MakeBudgets() {
+    std::vector<Budget> budgets;
+
+    // разбор формулы (ANTLR) в бюджет не входит: он меряется отдельно;
+    // записи общих подвыражений формулы в таблице листа (ключ, узел
+    // словаря, список записей формулы) входят
+    budgets.push_back({"set_formula", 33, [](size_t& limit) {
+        Sheet sheet;
+        sheet.SetCell({0, 0}, "1");
+        sheet.SetCell({0, 1}, "2");
+        limit += CountAllocations([] { ParseFormula(FORMULA); });
+        return CountAllocations([&] { sheet.SetCell({1, 0}, std::string("=") + FORMULA); });
+    }});
+
+    budgets.push_back({"replace_formula", 30, [](size_t& limit) {
+        Sheet sheet;
+        sheet.SetCell({0, 0}, "1");
+        sheet.SetCell({1, 0}, "=A1*3");
+        limit += CountAllocations([] { ParseFormula(FORMULA); });
+        return CountAllocations([&] { sheet.SetCell({1, 0}, std::string("=") + FORMULA); });
+    }});
+
+    budgets.push_back({"set_number", 4, [](size_t&) {
+        Sheet sheet;
+        return CountAllocations([&] { sheet.SetCell({2, 0}, "42"); });
+    }});
+
+    // повтор длинного текста, уже лежащего в пуле строк листа: новая
+    // ячейка не копирует текст, а тот же текст в той же ячейке -- не правка
+    budgets.push_back({"set_pooled_text", 3, [](size_t& limit) {
+        Sheet sheet;
+        std::string text(50, 'x');
+        sheet.SetCell({0, 0}, text);
+        // копия аргумента SetCell
+        limit += CountAllocations([&] { std::string copy = text; });
+        return CountAllocations([&] { sheet.SetCell({1, 0}, text); });
+    }});
+
+    budgets.push_back({"set_same_text", 0, [](size_t& limit) {
+        Sheet sheet;
+        std::string text(50, 'x');
+        sheet.SetCell({0, 0}, text);
+        limit += CountAllocations([&] { std::string copy = text; });
+        return CountAllocations([&] { sheet.SetCell({0, 0}, text); });
+    }});
+
+    budgets.push_back({"read_cached_value", 0, [](size_t&) {
+        Sheet sheet;
+        sheet.SetCell({0, 0}, "1");
+        sheet.SetCell({1, 0}, "=A1+1");
+        const CellInterface* cell = sheet.GetCell({1, 0});
+        cell->GetValue();
+        return CountAllocations([&] { cell->GetValue(); });
+    }});
+
+    budgets.push_back({"read_text_value", 0, [](size_t&) {
+        Sheet sheet;
+        sheet.SetCell({0, 0}, "short");
+        const CellInterface* cell = sheet.GetCell({0, 0});
+        return CountAllocations([&] { cell->GetValue(); });
+    }});
+
+    budgets.push_back({"read_long_text_value", 1, [](size_t&) {
+        Sheet sheet;
+        sheet.SetCell({0, 0}, std::string(100, 'x'));
+        const CellInterface* cell = sheet.GetCell({0, 0});
+        return CountAllocations([&] { cell->GetValue(); });
+    }});
+
+    // чтение без копирования не выделяет память ни для текста, ни для формулы
+    budgets.push_back({"read_refs", 0, [](size_t&) {
+        Sheet sheet;
+        sheet.SetCell({0, 0}, std::string(100, 'x'));
+        sheet.SetCell({2, 0}, "=A2+B2");
+        sheet.GetTextRef({2, 0});
+        return CountAllocations([&] {
+            sheet.GetValueRef({0, 0});
+            sheet.GetTextRef({0, 0});
+            sheet.GetValueRef({2, 0});
+            sheet.GetTextRef({2, 0});
+            sheet.GetReferencedCellsRef({2, 0});
+        });
+    }});
+
+    // перезапись числового столбца: числа меняются на месте, выделяется
+    // только пачка изменений и старые ссылки в графе
+    budgets.push_back({"set_numbers_column", 2, [](size_t&) {
+        Sheet sheet;
+        std::array<double, ROW_CELLS> numbers{};
+        sheet.SetNumbers(0, 0, numbers);
+        numbers.fill(1);
+        return CountAllocations([&] { sheet.SetNumbers(0, 0, numbers); });
+    }});
+
+    // GetValues с теми же буферами выделяет только стек обхода для формул,
+    // потерявших кеш
+    budgets.push_back({"get_values_range", 1, [](size_t&) {
+        Sheet sheet;
+        for (int col = 0; col < ROW_CELLS; ++col) {
+            sheet.SetCell({0, col}, col % 2 ? "=A1+1" : std::string(50, 'x'));
+        }
+        std::array<double, ROW_CELLS> numbers;
+        std::array<ValueTag, ROW_CELLS> tags;
+        std::vector<uint32_t> offsets;
+        std::string bytes;
+        ValueBuffers buffers{numbers, tags, &offsets, &bytes};
+        Range range{{0, 0}, {0, ROW_CELLS - 1}};
+        sheet.GetValues(range, buffers);
+        sheet.SetCell({0, 0}, "1");
+        return CountAllocations([&] { sheet.GetValues(range, buffers); });
+    }});
+
+    // строка из чисел и формул через одну
+    auto print_row = [](bool values) {
+        return [values](size_t&) {
+            Sheet sheet;
+            for (int col = 0; col < ROW_CELLS; ++col) {
+                sheet.SetCell({0, col}, col % 2 ? "=A1+1" : std::to_string(col));
+            }
+            sheet.Recalculate();
+            NullBuffer buffer;
+            std::ostream out(&buffer);
+            return CountAllocations([&] { values ? sheet.PrintValues(out) : sheet.PrintTexts(out); });
+        };
+    };
+    budgets.push_back({"print_values_row", 0, print_row(true)});
+    budgets.push_back({"print_texts_row", ROW_CELLS / 2, print_row(false)});
+
+    budgets.push_back({"clear_formula", 2, [](size_t&) {
+        Sheet sheet;
+        sheet.SetCell({0, 0}, "1");
+        sheet.SetCell({1, 0}, "=A1+1");
+        return CountAllocations([&] { sheet.ClearCell({1, 0}); });
+    }});
+
+    budgets.push_back({"clear_number", 2, [](size_t&) {
+        Sheet sheet;
+        sheet.SetCell({0, 0}, "1");
+        return CountAllocations([&] { sheet.ClearCell({0, 0}); });
+    }});
+
+    // доставка пачки подписчику: отметки и буферы подписки заводятся при
+    // подписке, поэтому к той же правке с чтением формул без подписки
+    // ничего не добавляется
+    budgets.push_back({"notify_subscribers", 0, [](size_t& limit) {
+        auto make_sheet = [] {
+            auto sheet = std::make_unique<Sheet>();
+            sheet->SetCell({0, 0}, "1");
+            for (int row = 0; row < ROW_CELLS; ++row) {
+                sheet->SetCell({row, 1}, "=A1+" + std::to_string(row));
+            }
+            return sheet;
+        };
+        auto edit = [](Sheet& sheet, int value) {
+            sheet.SetCell({0, 0}, std::to_string(value));
+            for (int row = 0; row < ROW_CELLS; ++row) {
+                sheet.GetCell({row, 1})->GetValue();
+            }
+        };
+        auto plain = make_sheet();
+        edit(*plain, 2);
+        limit += CountAllocations([&] { edit(*plain, 3); });
+
+        auto subscribed = make_sheet();
+        size_t delivered = 0;
+        subscribed->Subscribe({{0, 1}, {ROW_CELLS - 1, 1}}, [&delivered](Span<const ValueChange> changes) {
+            delivered += changes.size();
+        });
+        edit(*subscribed, 2);
+        return CountAllocations([&] { edit(*subscribed, 3); });
+    }});
+
+    return budgets;
+}
+
+}  // namespace
+
+void* operator new(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+int main(int argc, char** argv) {
+    const bool verbose = argc > 1 && std::string(argv[1]) == "--verbose";
+    int failed = 0;
+    for (auto& budget : MakeBudgets()) {
+        // первый прогон прогревает статические и thread_local данные
+        // (реестры метрик и т. п.), считается второй
+        size_t limit = budget.limit;
+        budget.measure(limit);
+        limit = budget.limit;
+        size_t count = budget.measure(limit);
+        if (count > limit) {
+            std::cerr << budget.name << ": " << count << " allocations, budget " << limit << std::endl;
+            ++failed;
+        } else if (count < limit) {
+            std::cerr << budget.name << ": " << count << " allocations, budget " << limit
+                      << " can be lowered" << std::endl;
+        } else if (verbose) {
+            std::cerr << budget.name << ": " << count << " allocations" << std::endl;
+        }
+    }
+    if (failed) {
+        std::cerr << failed << " allocation budgets exceeded" << std::endl;
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,652 @@
+// Набор замеров горячих путей листа. Результаты печатаются в JSON, чтобы
+// их можно было сравнивать между версиями.
+// Использование: spreadsheet_bench [--filter подстрока] [--repetitions N] [--out файл]
+
+#include "formula.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Сценарий готовит данные в setup и замеряет только run. run возвращает
+// число обработанных элементов для подсчёта скорости.
+struct Scenario {
+    std::string name;
+    std::vector<int> sizes;
+    std::function<std::function<size_t()>(int size)> setup;
+};
+
+struct Result {
+    std::string name;
+    int size = 0;
+    std::vector<double> seconds;
+    size_t items = 0;
+};
+
+std::string Cell(int row, int col = 0) {
+    return Position{row, col}.ToString();
+}
+
+void Consume(const CellInterface::Value& value) {
+    static volatile size_t sink = 0;
+    sink = sink + value.index();
+}
+
+std::vector<Scenario> MakeScenarios() {
+    std::vector<Scenario> scenarios;
+
+    // ввод чисел в квадрат size x 16
+    scenarios.push_back({"set_cell_text", {1000, 10000, 100000}, [](int size) {
+        return [size]() -> size_t {
+            Sheet sheet;
+            for (int i = 0; i < size; ++i) {
+                sheet.SetCell({i / 16, i % 16}, std::to_string(i));
+            }
+            return size;
+        };
+    }});
+
+    // ввод формул, ссылающихся на две ячейки первой строки (цепочки
+    // зависимостей меряет chain_build)
+    scenarios.push_back({"set_cell_formula", {1000, 10000, 100000}, [](int size) {
+        return [size]() -> size_t {
+            Sheet sheet;
+            for (int i = 0; i < size; ++i) {
+                int row = i / 16 + 1;
+                int col = i % 16;
+                sheet.SetCell({row, col}, "=" + Cell(0, col) + "+" + Cell(0, (col + 1) % 16) + "*2");
+            }
+            return size;
+        };
+    }});
+
+    // построение цепочки A2=A1+1, A3=A2+1, ... по одной ячейке
+    scenarios.push_back({"chain_build", {500, 1000, 2000}, [](int size) {
+        return [size]() -> size_t {
+            Sheet sheet;
+            sheet.SetCell({0, 0}, "1");
+            for (int i = 1; i < size; ++i) {
+                sheet.SetCell({i, 0}, "=" + Cell(i - 1) + "+1");
+            }
+            return size;
+        };
+    }});
+
+    // смена начала цепочки и пересчёт её конца
+    scenarios.push_back({"chain_recalc", {1000, 4000}, [](int size) {
+        auto sheet = std::make_shared<Sheet>();
+        std::vector<PreparedCell> cells;
+        cells.push_back({{0, 0}, "1"});
+        for (int i = 1; i < size; ++i) {
+            cells.push_back({{i, 0}, "=" + Cell(i - 1) + "+1"});
+        }
+        sheet->SetCells(std::move(cells));
+        return [sheet, size, value = 0]() mutable -> size_t {
+            sheet->SetCell({0, 0}, std::to_string(++value));
+            Consume(sheet->GetCell({size - 1, 0})->GetValue());
+            return size;
+        };
+    }});
+
+    // лента котировок: каждый такт заново пишутся 16 столбцов чисел, от
+    // каждой строки зависит формула. Текстом через SetCell и числами через
+    // SetNumbers; скорость -- обновлений в секунду
+    auto make_feed = [](bool numbers) {
+        return [numbers](int size) {
+            const int rows = size / 16;
+            auto sheet = std::make_shared<Sheet>();
+            std::vector<PreparedCell> cells;
+            for (int row = 0; row < rows; ++row) {
+                cells.push_back({{row, 16}, "=" + Cell(row, 0) + "+" + Cell(row, 15)});
+            }
+            sheet->SetCells(std::move(cells));
+            auto column = std::make_shared<std::vector<double>>(rows);
+            return [sheet, rows, numbers, column, tick = 0]() mutable -> size_t {
+                ++tick;
+                for (int col = 0; col < 16; ++col) {
+                    for (int row = 0; row < rows; ++row) {
+                        (*column)[row] = tick + row * 0.25 + col;
+                    }
+                    if (numbers) {
+                        sheet->SetNumbers(col, 0, *column);
+                        continue;
+                    }
+                    for (int row = 0; row < rows; ++row) {
+                        sheet->SetCell({row, col}, std::to_string((*column)[row]));
+                    }
+                }
+                Consume(sheet->GetCell({rows - 1, 16})->GetValue());
+                return rows * 16;
+            };
+        };
+    };
+    scenarios.push_back({"feed_set_cell", {1000, 10000, 100000}, make_feed(false)});
+    scenarios.push_back({"feed_set_numbers", {1000, 10000, 100000}, make_feed(true)});
+
+    // одна ячейка, от которой зависят size формул: инвалидация кеша
+    scenarios.push_back({"fan_out_invalidation", {1000, 10000, 100000}, [](int size) {
+        auto sheet = std::make_shared<Sheet>();
+        std::vector<PreparedCell> cells;
+        for (int i = 0; i < size; ++i) {
+            cells.push_back({{i / 16 + 1, i % 16}, "=A1*" + std::to_string(i % 7 + 1)});
+        }
+        sheet->SetCells(std::move(cells));
+        sheet->Recalculate();
+        return [sheet, size, value = 0]() mutable -> size_t {
+            sheet->SetCell({0, 0}, std::to_string(++value));
+            return size;
+        };
+    }});
+
+    // попытка замкнуть цепочку: поиск цикла проходит весь граф. Обходы
+    // графа рекурсивны, поэтому цепочка длиннее 10000 переполняет стек
+    scenarios.push_back({"cycle_detection", {1000, 10000}, [](int size) {
+        auto sheet = std::make_shared<Sheet>();
+        std::vector<PreparedCell> cells;
+        for (int i = 1; i < size; ++i) {
+            cells.push_back({{i % Position::MAX_ROWS, i / Position::MAX_ROWS},
+                "=" + Cell((i - 1) % Position::MAX_ROWS, (i - 1) / Position::MAX_ROWS) + "+1"});
+        }
+        sheet->SetCells(std::move(cells));
+        std::string closing = "=" + Cell((size - 1) % Position::MAX_ROWS, (size - 1) / Position::MAX_ROWS);
+        return [sheet, closing, size]() -> size_t {
+            try {
+                sheet->SetCell({0, 0}, closing);
+            }
+            catch (const CircularDependencyException&) {
+                return size;
+            }
+            throw std::logic_error("cycle was not detected");
+        };
+    }});
+
+    // размер печатной области листа с size ячейками
+    scenarios.push_back({"get_printable_size", {1000, 10000, 100000}, [](int size) {
+        auto sheet = std::make_shared<Sheet>();
+        for (int i = 0; i < size; ++i) {
+            sheet->SetCell({i / 64, i % 64}, "x");
+        }
+        return [sheet, size]() -> size_t {
+            Size printable = sheet->GetPrintableSize();
+            Consume(CellInterface::Value(static_cast<double>(printable.rows)));
+            return size;
+        };
+    }});
+
+    // размер печатной области листа из формул над разреженными входами:
+    // каждая ссылается на две пустые ячейки
+    scenarios.push_back({"sparse_references_size", {1000, 10000, 100000}, [](int size) {
+        auto sheet = std::make_shared<Sheet>();
+        std::vector<PreparedCell> cells;
+        for (int i = 0; i < size; ++i) {
+            int row = i / 16;
+            int col = i % 16;
+            cells.push_back({{row, col}, "=" + Cell(row, col + 100) + "+" + Cell(row, col + 200)});
+        }
+        sheet->SetCells(std::move(cells));
+        return [sheet, size]() -> size_t {
+            Size printable = sheet->GetPrintableSize();
+            Consume(CellInterface::Value(static_cast<double>(printable.rows)));
+            return size;
+        };
+    }});
+
+    // вывод значений листа из чисел и формул
+    scenarios.push_back({"print_values", {1000, 10000, 100000}, [](int size) {
+        auto sheet = std::make_shared<Sheet>();
+        std::vector<PreparedCell> cells;
+        for (int i = 0; i < size; ++i) {
+            int row = i / 16;
+            int col = i % 16;
+            cells.push_back({{row, col}, col == 0 ? std::to_string(row) : "=" + Cell(row, col - 1) + "/3"});
+        }
+        sheet->SetCells(std::move(cells));
+        return [sheet, size]() -> size_t {
+            std::ostringstream out;
+            sheet->PrintValues(out);
+            return size;
+        };
+    }});
+
+    // опрос значений листа из длинных текстов и формул, как в интерфейсе:
+    // копиями (GetCell()->GetValue()), без копирования (GetValueRef) и всем
+    // диапазоном в буферы (GetValues)
+    enum class Poll { Values, ValueRefs, Range };
+    auto make_poll = [](Poll poll) {
+        return [poll](int size) {
+            auto sheet = std::make_shared<Sheet>();
+            std::vector<PreparedCell> cells;
+            for (int i = 0; i < size; ++i) {
+                int row = i / 16;
+                int col = i % 16;
+                cells.push_back({{row, col}, col % 2 ? "=" + std::to_string(i) + "*2" : "label " + std::to_string(i)
+                    + " with a text longer than the small string buffer"});
+            }
+            sheet->SetCells(std::move(cells));
+            sheet->Recalculate();
+            auto numbers = std::make_shared<std::vector<double>>(size);
+            auto tags = std::make_shared<std::vector<ValueTag>>(size);
+            auto offsets = std::make_shared<std::vector<uint32_t>>();
+            auto bytes = std::make_shared<std::string>();
+            return [sheet, size, poll, numbers, tags, offsets, bytes]() -> size_t {
+                size_t length = 0;
+                if (poll == Poll::Range) {
+                    sheet->GetValues({{0, 0}, {size / 16 - 1, 15}}, {*numbers, *tags, offsets.get(), bytes.get()});
+                    length = bytes->size();
+                }
+                for (int i = 0; poll != Poll::Range && i < size; ++i) {
+                    Position pos{i / 16, i % 16};
+                    if (poll == Poll::ValueRefs) {
+                        length += sheet->GetValueRef(pos).index();
+                    } else {
+                        length += sheet->GetCell(pos)->GetValue().index();
+                    }
+                }
+                Consume(CellInterface::Value(static_cast<double>(length)));
+                return size;
+            };
+        };
+    };
+    scenarios.push_back({"poll_values", {10000, 100000}, make_poll(Poll::Values)});
+    scenarios.push_back({"poll_value_refs", {10000, 100000}, make_poll(Poll::ValueRefs)});
+    scenarios.push_back({"get_values_range", {10000, 100000}, make_poll(Poll::Range)});
+
+    // справочник из size строк и LOOKUP_FORMULAS формул VLOOKUP над ним:
+    // правка ключа сбрасывает кеш всех формул, затем они читаются заново.
+    // Без индекса (lookup_linear) те же ключи ищутся полным просмотром
+    // столбца (SheetInterface::Lookup).
+    constexpr int LOOKUP_FORMULAS = 100;
+    auto make_lookup = [](bool indexed) {
+        return [indexed](int size) {
+            auto sheet = std::make_shared<Sheet>();
+            std::vector<PreparedCell> cells;
+            for (int i = 0; i < size; ++i) {
+                cells.push_back({{i, 0}, "key " + std::to_string(i)});
+                cells.push_back({{i, 1}, std::to_string(i)});
+            }
+            const std::string table = "A1:B" + std::to_string(size);
+            for (int i = 0; i < LOOKUP_FORMULAS; ++i) {
+                std::string key = "\"key " + std::to_string(i * (size / LOOKUP_FORMULAS)) + "\"";
+                cells.push_back({{i, 3}, "=VLOOKUP(" + key + "," + table + ",2,0)"});
+            }
+            sheet->SetCells(std::move(cells));
+            auto step = std::make_shared<int>(0);
+            return [sheet, size, indexed, step]() -> size_t {
+                // ключ строки между искомыми то пропадает, то возвращается
+                int index = (*step)++;
+                Position edited{index / 2 % LOOKUP_FORMULAS * (size / LOOKUP_FORMULAS) + 1, 0};
+                sheet->SetCell(edited, (index % 2 ? "key " : "moved ") + std::to_string(edited.row));
+                double sum = 0;
+                for (int i = 0; i < LOOKUP_FORMULAS; ++i) {
+                    if (indexed) {
+                        sum += std::get<double>(sheet->GetCell({i, 3})->GetValue());
+                    } else {
+                        LookupValue key = "key " + std::to_string(i * (size / LOOKUP_FORMULAS));
+                        sum += *sheet->SheetInterface::Lookup(key, {{0, 0}, {size - 1, 0}}, LookupMode::Exact);
+                    }
+                }
+                Consume(CellInterface::Value(sum));
+                return LOOKUP_FORMULAS;
+            };
+        };
+    };
+    scenarios.push_back({"lookup_indexed", {1000, 10000}, make_lookup(true)});
+    scenarios.push_back({"lookup_linear", {1000, 10000}, make_lookup(false)});
+
+    // панель из AGGREGATE_FORMULAS формул SUMIF с разными условиями над
+    // одними столбцами регионов и сумм в size строк: правка суммы сбрасывает
+    // кеш всех формул, затем они читаются заново. Без индекса
+    // (sumif_linear) каждое условие считается полным просмотром
+    // (SheetInterface::Aggregate).
+    constexpr int AGGREGATE_FORMULAS = 100;
+    auto make_sumif = [](bool indexed) {
+        return [indexed](int size) {
+            auto sheet = std::make_shared<Sheet>();
+            std::vector<PreparedCell> cells;
+            for (int i = 0; i < size; ++i) {
+                cells.push_back({{i, 0}, "region " + std::to_string(i % AGGREGATE_FORMULAS)});
+                cells.push_back({{i, 1}, std::to_string(i % 7)});
+            }
+            const std::string ranges = "A1:A" + std::to_string(size) + ",\"region ";
+            const std::string sum_range = "\",B1:B" + std::to_string(size);
+            for (int i = 0; i < AGGREGATE_FORMULAS; ++i) {
+                cells.push_back({{i, 3}, "=SUMIF(" + ranges + std::to_string(i) + sum_range + ")"});
+            }
+            sheet->SetCells(std::move(cells));
+            auto step = std::make_shared<int>(0);
+            return [sheet, size, indexed, step]() -> size_t {
+                int index = (*step)++;
+                sheet->SetCell({index % size, 1}, std::to_string(index % 11));
+                double sum = 0;
+                for (int i = 0; i < AGGREGATE_FORMULAS; ++i) {
+                    if (indexed) {
+                        sum += std::get<double>(sheet->GetCell({i, 3})->GetValue());
+                    } else {
+                        Criterion criterion{CriterionOp::Equal, "region " + std::to_string(i)};
+                        sum += sheet->SheetInterface::Aggregate({{0, 0}, {size - 1, 0}}, criterion,
+                            Range{{0, 1}, {size - 1, 1}}).sum;
+                    }
+                }
+                Consume(CellInterface::Value(sum));
+                return AGGREGATE_FORMULAS;
+            };
+        };
+    };
+    scenarios.push_back({"sumif_indexed", {1000, 10000}, make_sumif(true)});
+    scenarios.push_back({"sumif_linear", {1000, 10000}, make_sumif(false)});
+
+    // size формул с одним и тем же подвыражением A1*A2+A3*A4+...+A19*A20:
+    // правка A1 сбрасывает кеш всех формул, затем они читаются заново.
+    // Подвыражение считается один раз за шаг, остальные формулы берут его
+    // из таблицы общих подвыражений листа.
+    scenarios.push_back({"shared_subexpressions", {1000, 10000}, [](int size) {
+        auto sheet = std::make_shared<Sheet>();
+        std::vector<PreparedCell> cells;
+        std::string common;
+        for (int i = 0; i < 20; ++i) {
+            cells.push_back({{i, 0}, std::to_string(i)});
+            common += (i == 0 ? "" : i % 2 ? "*" : "+") + Cell(i, 0);
+        }
+        for (int i = 0; i < size; ++i) {
+            cells.push_back({{i, 1}, std::to_string(i + 1)});
+            cells.push_back({{i, 2}, "=(" + common + ")*" + Cell(i, 1) + "/(" + common + "+1)"});
+        }
+        sheet->SetCells(std::move(cells));
+        auto step = std::make_shared<int>(0);
+        return [sheet, size, step]() -> size_t {
+            sheet->SetCell({0, 0}, std::to_string((*step)++ % 7));
+            double sum = 0;
+            for (int i = 0; i < size; ++i) {
+                sum += std::get<double>(sheet->GetCell({i, 2})->GetValue());
+            }
+            Consume(CellInterface::Value(sum));
+            return static_cast<size_t>(size);
+        };
+    }});
+
+    // size формул с константными частями и тождествами, как в моделях с
+    // коэффициентами: правка A1 сбрасывает кеш всех формул, затем они
+    // читаются заново. Константы и тождества убраны из вычисляемого дерева
+    // при разборе.
+    scenarios.push_back({"folded_formulas", {1000, 10000}, [](int size) {
+        auto sheet = std::make_shared<Sheet>();
+        std::vector<PreparedCell> cells;
+        cells.push_back({{0, 0}, "1"});
+        for (int i = 0; i < size; ++i) {
+            const std::string b = Cell(i, 1);
+            cells.push_back({{i, 1}, std::to_string(i + 1)});
+            cells.push_back({{i, 2}, "=(2*3.14159/360)*" + b + "*A1+(" + b + "*A1)*1-(--" + b
+                + ")*(10/4)+(" + b + "-A1)/(3-2)-(1+1)*(4-1)"});
+        }
+        sheet->SetCells(std::move(cells));
+        auto step = std::make_shared<int>(0);
+        return [sheet, size, step]() -> size_t {
+            sheet->SetCell({0, 0}, std::to_string((*step)++ % 7 + 1));
+            double sum = 0;
+            for (int i = 0; i < size; ++i) {
+                sum += std::get<double>(sheet->GetCell({i, 2})->GetValue());
+            }
+            Consume(CellInterface::Value(sum));
+            return static_cast<size_t>(size);
+        };
+    }});
+
+    // пакет правок: каждый такт заново пишутся 16 входов, от которых
+    // зависят все size формул, затем формулы читаются. В автоматическом
+    // режиме каждая правка обходит всех зависимых, в ручном правки только
+    // помечаются, а Recalculate обходит граф один раз
+    auto make_editing = [](CalculationMode mode) {
+        return [mode](int size) {
+            auto sheet = std::make_shared<Sheet>();
+            std::vector<PreparedCell> cells;
+            std::string inputs;
+            for (int i = 0; i < 16; ++i) {
+                cells.push_back({{i, 0}, std::to_string(i)});
+                inputs += (i == 0 ? "" : "+") + Cell(i, 0);
+            }
+            for (int i = 0; i < size; ++i) {
+                cells.push_back({{i, 1}, std::to_string(i + 1)});
+                cells.push_back({{i, 2}, "=(" + inputs + ")*" + Cell(i, 1)});
+            }
+            sheet->SetCells(std::move(cells));
+            sheet->SetCalculationMode(mode);
+            auto step = std::make_shared<int>(0);
+            return [sheet, size, mode, step]() -> size_t {
+                int tick = (*step)++;
+                for (int i = 0; i < 16; ++i) {
+                    sheet->SetCell({i, 0}, std::to_string((tick + i) % 7));
+                }
+                if (mode == CalculationMode::Manual) {
+                    sheet->Recalculate();
+                }
+                double sum = 0;
+                for (int i = 0; i < size; ++i) {
+                    sum += std::get<double>(sheet->GetCell({i, 2})->GetValue());
+                }
+                Consume(CellInterface::Value(sum));
+                return static_cast<size_t>(size);
+            };
+        };
+    };
+    scenarios.push_back({"editing_automatic", {1000, 10000}, make_editing(CalculationMode::Automatic)});
+    scenarios.push_back({"editing_manual", {1000, 10000}, make_editing(CalculationMode::Manual)});
+
+    // ручной режим: правка входа, пересчёт и чтение видимой области из 50
+    // строк. Recalculate держит вызывающего до конца пересчёта всех size
+    // формул; RecalculateAsync считает область первой и отдаёт остальное
+    // потоку, которого следующая правка останавливает
+    auto make_recalculate = [](bool async) {
+        return [async](int size) {
+            auto sheet = std::make_shared<Sheet>();
+            std::vector<PreparedCell> cells;
+            cells.push_back({{0, 0}, "1"});
+            for (int i = 0; i < size; ++i) {
+                cells.push_back({{i, 1}, "=A1*" + std::to_string(i + 1) + "+" + std::to_string(i)});
+                cells.push_back({{i, 2}, "=" + Cell(i, 1) + "/2"});
+            }
+            sheet->SetCells(std::move(cells));
+            sheet->SetCalculationMode(CalculationMode::Manual);
+            const Range viewport{{0, 1}, {49, 2}};
+            auto step = std::make_shared<int>(0);
+            return [sheet, async, viewport, step]() -> size_t {
+                sheet->SetCell({0, 0}, std::to_string((*step)++ % 7 + 1));
+                if (async) {
+                    sheet->RecalculateAsync({viewport});
+                } else {
+                    sheet->Recalculate();
+                }
+                double sum = 0;
+                for (int row = viewport.first.row; row <= viewport.last.row; ++row) {
+                    sum += std::get<double>(sheet->GetCell({row, 2})->GetValue());
+                }
+                Consume(CellInterface::Value(sum));
+                return 1;
+            };
+        };
+    };
+    scenarios.push_back({"recalculate_blocking", {1000, 10000}, make_recalculate(false)});
+    scenarios.push_back({"recalculate_async", {1000, 10000}, make_recalculate(true)});
+
+    // время от правки до значений видимой области из 50 строк, когда от
+    // входа зависят все 2 * size формул. В автоматическом режиме правка
+    // сбрасывает кеши всех зависимых; в режиме видимых областей -- только
+    // в конусе области, остальное откладывается
+    auto make_first_visible = [](CalculationMode mode) {
+        return [mode](int size) {
+            auto sheet = std::make_shared<Sheet>();
+            std::vector<PreparedCell> cells;
+            cells.push_back({{0, 0}, "1"});
+            for (int i = 0; i < size; ++i) {
+                cells.push_back({{i, 1}, "=A1*" + std::to_string(i + 1)});
+                cells.push_back({{i, 2}, "=" + Cell(i, 1) + "+" + std::to_string(i)});
+            }
+            sheet->SetCells(std::move(cells));
+            const Range viewport{{size / 2, 1}, {size / 2 + 49, 2}};
+            sheet->SetVisibleRanges({viewport});
+            sheet->SetCalculationMode(mode);
+            auto step = std::make_shared<int>(0);
+            return [sheet, viewport, step]() -> size_t {
+                sheet->SetCell({0, 0}, std::to_string((*step)++ % 7 + 1));
+                double sum = 0;
+                for (int row = viewport.first.row; row <= viewport.last.row; ++row) {
+                    sum += std::get<double>(sheet->GetCell({row, 2})->GetValue());
+                }
+                Consume(CellInterface::Value(sum));
+                return 1;
+            };
+        };
+    };
+    scenarios.push_back({"first_visible_automatic", {1000, 10000}, make_first_visible(CalculationMode::Automatic)});
+    scenarios.push_back({"first_visible_viewport", {1000, 10000}, make_first_visible(CalculationMode::Viewport)});
+
+    // потребитель изменений: каждый такт правятся 16 входов из size, и
+    // нужно узнать, какие из size формул изменились. Опрос читает столбец
+    // формул целиком через GetValues и сравнивает с прошлым тактом;
+    // подписка получает только изменившиеся ячейки
+    auto make_changes = [](bool subscribe) {
+        return [subscribe](int size) {
+            auto sheet = std::make_shared<Sheet>();
+            std::vector<PreparedCell> cells;
+            for (int i = 0; i < size; ++i) {
+                cells.push_back({{i, 0}, std::to_string(i)});
+                cells.push_back({{i, 1}, "=" + Cell(i, 0) + "*2"});
+            }
+            sheet->SetCells(std::move(cells));
+            const Range column{{0, 1}, {size - 1, 1}};
+            auto changed = std::make_shared<double>(0);
+            if (subscribe) {
+                sheet->Subscribe(column, [changed](Span<const ValueChange> changes) {
+                    for (const auto& change : changes) {
+                        *changed += std::get<double>(change.new_value);
+                    }
+                });
+            }
+            auto numbers = std::make_shared<std::vector<double>>(size);
+            auto previous = std::make_shared<std::vector<double>>(size);
+            auto tags = std::make_shared<std::vector<ValueTag>>(size);
+            auto step = std::make_shared<int>(0);
+            return [sheet, size, subscribe, column, changed, numbers, previous, tags, step]() -> size_t {
+                int tick = (*step)++;
+                for (int i = 0; i < 16; ++i) {
+                    sheet->SetCell({(tick * 16 + i) * 7919 % size, 0}, std::to_string(tick + i));
+                }
+                if (!subscribe) {
+                    sheet->GetValues(column, {*numbers, *tags});
+                    for (int i = 0; i < size; ++i) {
+                        if ((*numbers)[i] != (*previous)[i]) {
+                            *changed += (*numbers)[i];
+                        }
+                    }
+                    numbers->swap(*previous);
+                }
+                Consume(CellInterface::Value(*changed));
+                return 1;
+            };
+        };
+    };
+    scenarios.push_back({"changes_polling", {1000, 10000}, make_changes(false)});
+    scenarios.push_back({"changes_subscription", {1000, 10000}, make_changes(true)});
+
+    // разбор формул разной длины
+    scenarios.push_back({"parse_formula", {1000, 10000, 100000}, [](int size) {
+        auto expressions = std::make_shared<std::vector<std::string>>();
+        for (int i = 0; i < size; ++i) {
+            std::string expression = Cell(i % 1000, i % 26);
+            for (int k = 0; k < i % 8; ++k) {
+                expression += (k % 2 ? "*(" : "+(") + Cell(k, i % 26) + "-" + std::to_string(k) + ".5)";
+            }
+            expressions->push_back(std::move(expression));
+        }
+        return [expressions]() -> size_t {
+            for (const auto& expression : *expressions) {
+                ParseFormula(expression);
+            }
+            return expressions->size();
+        };
+    }});
+
+    return scenarios;
+}
+
+std::string JsonEscape(const std::string& text) {
+    std::string result;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            result += '\\';
+        }
+        result += c;
+    }
+    return result;
+}
+
+void PrintJson(std::ostream& out, const std::vector<Result>& results) {
+    out << std::setprecision(9) << "{\n  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        auto seconds = results[i].seconds;
+        std::sort(seconds.begin(), seconds.end());
+        double median = seconds[seconds.size() / 2];
+        out << (i ? "," : "") << "\n    {\"name\": \"" << JsonEscape(results[i].name) << "\", \"size\": "
+            << results[i].size << ", \"repetitions\": " << seconds.size() << ", \"min_seconds\": " << seconds.front()
+            << ", \"median_seconds\": " << median << ", \"max_seconds\": " << seconds.back()
+            << ", \"items_per_second\": " << (median > 0 ? results[i].items / median : 0) << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    std::string filter;
+    std::string out_path;
+    int repetitions = 5;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string arg = argv[i];
+        if (arg == "--filter") {
+            filter = argv[i + 1];
+        } else if (arg == "--repetitions") {
+            repetitions = std::max(1, std::stoi(argv[i + 1]));
+        } else if (arg == "--out") {
+            out_path = argv[i + 1];
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--filter substring] [--repetitions N] [--out file]" << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<Result> results;
+    for (const auto& scenario : MakeScenarios()) {
+        for (int size : scenario.sizes) {
+            Result result{scenario.name, size, {}, 0};
+            if (!filter.empty() && (scenario.name + "/" + std::to_string(size)).find(filter) == std::string::npos) {
+                continue;
+            }
+            auto run = scenario.setup(size);
+            for (int i = 0; i < repetitions; ++i) {
+                auto start = Clock::now();
+                result.items = run();
+                result.seconds.push_back(std::chrono::duration<double>(Clock::now() - start).count());
+            }
+            std::cerr << scenario.name << "/" << size << " done" << std::endl;
+            results.push_back(std::move(result));
+        }
+    }
+
+    if (out_path.empty()) {
+        PrintJson(std::cout, results);
+    } else {
+        std::ofstream out(out_path);
+        PrintJson(out, results);
+    }
+    return 0;
+}
@@ -0,0 +1,85 @@
+// Замер скорости правок с журналом для каждой политики надёжности.
+// Каждый поток правит свой лист, все листы пишут в один журнал, поэтому
+// при JournalSync::Full правки разных потоков делят один fsync.
+// Использование: journal_bench [edits per thread] [threads] [journal path]
+
+#include "journal.h"
+#include "sheet.h"
+
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+void Edit(Sheet& sheet, int edits) {
+    for (int i = 0; i < edits; ++i) {
+        int row = i % 1000;
+        if (i % 4 == 3) {
+            sheet.SetCell({row, 1}, "=A" + std::to_string(row + 1) + "*2");
+        } else {
+            sheet.SetCell({row, 0}, std::to_string(i));
+        }
+    }
+}
+
+void Run(const char* name, int edits, int threads, const std::string& path, const JournalOptions* options) {
+    std::filesystem::remove(path);
+    std::unique_ptr<Journal> journal;
+    if (options) {
+        journal = std::make_unique<Journal>(path, *options);
+    }
+    std::vector<std::unique_ptr<Sheet>> sheets;
+    for (int i = 0; i < threads; ++i) {
+        sheets.push_back(std::make_unique<Sheet>(nullptr, "t" + std::to_string(i),
+            std::make_shared<DependencyGraph>()));
+        sheets.back()->SetJournal(journal.get());
+    }
+
+    auto start = Clock::now();
+    std::vector<std::thread> workers;
+    for (auto& sheet : sheets) {
+        workers.emplace_back(Edit, std::ref(*sheet), edits);
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    if (journal) {
+        journal->Flush();
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::cout << name << static_cast<long long>(edits * threads / seconds) << " edits/s";
+    if (journal) {
+        auto stats = journal->GetStats();
+        std::cout << ", " << stats.groups << " groups, " << stats.syncs << " fsyncs, "
+                  << stats.bytes / 1024 << " KB";
+    }
+    std::cout << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    int edits = argc > 1 ? std::stoi(argv[1]) : 20000;
+    int threads = argc > 2 ? std::stoi(argv[2]) : 4;
+    std::string path = argc > 3 ? argv[3]
+        : (std::filesystem::temp_directory_path() / "journal_bench.journal").string();
+
+    JournalOptions none{JournalSync::None};
+    JournalOptions group{JournalSync::Group};
+    JournalOptions full{JournalSync::Full};
+
+    Run("no journal:         ", edits, threads, path, nullptr);
+    Run("JournalSync::None:  ", edits, threads, path, &none);
+    Run("JournalSync::Group: ", edits, threads, path, &group);
+    Run("JournalSync::Full:  ", edits, threads, path, &full);
+    std::filesystem::remove(path);
+    return 0;
+}
@@ -0,0 +1,104 @@
+// Замер загрузки модели из формул в обычном и ленивом режимах: время
+// ImportCsv, занятая память и время первого значения.
+// Использование: lazy_bench [formulas] [eager|lazy]
+// Без режима запускает себя по разу для каждого режима, чтобы память
+// мерилась в чистом процессе.
+
+#include "csv_import.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double SecondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// резидентная память процесса в мегабайтах; 0, если узнать нельзя
+double ResidentMegabytes() {
+#ifdef __linux__
+    std::ifstream statm("/proc/self/statm");
+    long pages = 0;
+    long resident = 0;
+    if (statm >> pages >> resident) {
+        return resident * static_cast<double>(sysconf(_SC_PAGESIZE)) / (1 << 20);
+    }
+#endif
+    return 0;
+}
+
+std::string ColumnName(int col) {
+    std::string name;
+    for (++col; col > 0; col = (col - 1) / 26) {
+        name.insert(name.begin(), static_cast<char>('A' + (col - 1) % 26));
+    }
+    return name;
+}
+
+// в строке число и цепочка формул, каждая ссылается на соседа слева и на
+// первый столбец
+std::string MakeModel(long formulas, int& rows, int& cols) {
+    cols = std::min<long>(Position::MAX_COLS - 1, std::max<long>(1, formulas / Position::MAX_ROWS + 1)) + 1;
+    rows = static_cast<int>((formulas + cols - 2) / (cols - 1));
+    std::ostringstream out;
+    for (int row = 0; row < rows; ++row) {
+        std::string r = std::to_string(row + 1);
+        out << row % 97;
+        for (int col = 1; col < cols; ++col) {
+            out << ",=" << ColumnName(col - 1) << r << "*1.01+A" << r;
+        }
+        out << '\n';
+    }
+    return out.str();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    long formulas = argc > 1 ? std::stol(argv[1]) : 2000000;
+    if (argc < 3) {
+        for (const char* mode : {"eager", "lazy"}) {
+            std::string command = std::string(argv[0]) + " " + std::to_string(formulas) + " " + mode;
+            if (std::system(command.c_str()) != 0) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    const std::string mode = argv[2];
+
+    int rows = 0;
+    int cols = 0;
+    CsvImportOptions options;
+    options.lazy_formulas = mode == "lazy";
+    Sheet sheet;
+    double base_memory = ResidentMegabytes();
+    double load = 0;
+    {
+        std::istringstream input(MakeModel(formulas, rows, cols));
+        auto start = Clock::now();
+        ImportCsv(sheet, input, options);
+        load = SecondsSince(start);
+    }
+    double memory = ResidentMegabytes() - base_memory;
+
+    auto start = Clock::now();
+    auto value = sheet.GetCell({rows / 2, cols - 1})->GetValue();
+    double first = SecondsSince(start);
+
+    std::cout << mode << ": " << static_cast<long long>(rows) * (cols - 1) << " formulas, load " << load
+              << " s, memory " << memory << " MB, first value " << first << " s (" << value << ")" << std::endl;
+    return 0;
+}
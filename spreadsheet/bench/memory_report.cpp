@@ -0,0 +1,180 @@
+// Память, которую лист тратит на ячейку, для моделей с разным содержимым.
+// Глобальный operator new считает живые байты в куче; после построения
+// модели печатается прирост на ячейку (без накладных расходов malloc) и
+// sizeof(Cell). Результаты печатаются в JSON.
+// Использование: memory_report [--filter подстрока] [--cells N]
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace {
+
+std::atomic<size_t> live_bytes{0};
+
+// перед каждым блоком хранится его размер, чтобы operator delete без
+// размера знал, сколько вычесть
+constexpr size_t HEADER_SIZE = alignof(std::max_align_t);
+
+constexpr int COLUMNS = 1024;
+
+struct Model {
+    std::string name;
+    std::function<void(Sheet& sheet, int cells)> build;
+};
+
+Position CellPosition(int i) {
+    return {i / COLUMNS, i % COLUMNS};
+}
+
+std::vector<Model> MakeModels() {
+    std::vector<Model> models;
+
+    // целые числа, введённые текстом
+    models.push_back({"typed_integers", [](Sheet& sheet, int cells) {
+        for (int i = 0; i < cells; ++i) {
+            sheet.SetCell(CellPosition(i), std::to_string(i % 100000));
+        }
+    }});
+
+    // цены с двумя знаками после точки
+    models.push_back({"typed_prices", [](Sheet& sheet, int cells) {
+        for (int i = 0; i < cells; ++i) {
+            sheet.SetCell(CellPosition(i), std::to_string(i % 100000) + "." + std::to_string(10 + i % 90));
+        }
+    }});
+
+    // те же цены столбцами через SetNumbers
+    models.push_back({"set_numbers", [](Sheet& sheet, int cells) {
+        const int rows = (cells + COLUMNS - 1) / COLUMNS;
+        std::vector<double> column(rows);
+        for (int col = 0; col < COLUMNS; ++col) {
+            int count = std::min(rows, std::max(0, cells - col * rows));
+            for (int row = 0; row < count; ++row) {
+                int i = col * rows + row;
+                column[row] = i % 100000 + (10 + i % 90) / 100.0;
+            }
+            sheet.SetNumbers(col, 0, Span<const double>(column.data(), count));
+        }
+    }});
+
+    // короткие категории вроде статуса или валюты
+    models.push_back({"short_text", [](Sheet& sheet, int cells) {
+        static const char* categories[] = {"open", "closed", "pending", "USD", "EUR"};
+        for (int i = 0; i < cells; ++i) {
+            sheet.SetCell(CellPosition(i), categories[i % 5]);
+        }
+    }});
+
+    // категории длиннее текста, помещающегося в ячейку: названия товаров,
+    // регионов, статусов
+    models.push_back({"categorical", [](Sheet& sheet, int cells) {
+        static const char* categories[] = {
+            "Awaiting payment confirmation", "Shipped to the customer", "Returned by the customer",
+            "Cancelled before shipping", "Eastern Europe and Central Asia", "Latin America and Caribbean",
+            "Middle East and North Africa", "Stainless steel water bottle", "Wireless noise cancelling headphones",
+            "Ergonomic office chair (black)",
+        };
+        for (int i = 0; i < cells; ++i) {
+            sheet.SetCell(CellPosition(i), categories[i % 10]);
+        }
+    }});
+
+    // текст длиннее встроенного буфера std::string
+    models.push_back({"long_text", [](Sheet& sheet, int cells) {
+        for (int i = 0; i < cells; ++i) {
+            sheet.SetCell(CellPosition(i), "description of row " + std::to_string(i) + " in the ledger");
+        }
+    }});
+
+    // формулы, ссылающиеся на ячейку первой строки
+    models.push_back({"formulas", [](Sheet& sheet, int cells) {
+        sheet.SetCell({0, 0}, "1");
+        for (int i = COLUMNS; i < cells + COLUMNS; ++i) {
+            Position pos = CellPosition(i);
+            sheet.SetCell(pos, "=" + Position{0, pos.col}.ToString() + "*2");
+        }
+    }});
+
+    // формулы над разреженными входами: каждая ссылается на две ещё не
+    // заданные ячейки далеко справа
+    models.push_back({"sparse_references", [](Sheet& sheet, int cells) {
+        for (int i = 0; i < cells; ++i) {
+            Position pos = CellPosition(i);
+            sheet.SetCell(pos, "=" + Position{pos.row, pos.col + 2 * COLUMNS}.ToString() + "+"
+                + Position{pos.row, pos.col + 4 * COLUMNS}.ToString());
+        }
+    }});
+
+    return models;
+}
+
+}  // namespace
+
+void* operator new(std::size_t size) {
+    if (auto* block = static_cast<char*>(std::malloc(size + HEADER_SIZE))) {
+        *reinterpret_cast<std::size_t*>(block) = size;
+        live_bytes.fetch_add(size, std::memory_order_relaxed);
+        return block + HEADER_SIZE;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+    if (!ptr) {
+        return;
+    }
+    // через целое, чтобы компилятор не принимал заголовок за выход за
+    // границы объекта
+    auto* block = reinterpret_cast<char*>(reinterpret_cast<std::uintptr_t>(ptr) - HEADER_SIZE);
+    live_bytes.fetch_sub(*reinterpret_cast<std::size_t*>(block), std::memory_order_relaxed);
+    std::free(block);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    operator delete(ptr);
+}
+
+int main(int argc, char** argv) {
+    std::string filter;
+    int cells = 200000;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string arg = argv[i];
+        if (arg == "--filter") {
+            filter = argv[i + 1];
+        } else if (arg == "--cells") {
+            cells = std::clamp(std::stoi(argv[i + 1]), 1, Position::MAX_ROWS * COLUMNS - COLUMNS);
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--filter substring] [--cells N]" << std::endl;
+            return 1;
+        }
+    }
+
+    std::cout << "{\n  \"cells\": " << cells << ",\n  \"sizeof_cell\": " << sizeof(Cell) << ",\n  \"models\": [";
+    bool first = true;
+    for (const auto& model : MakeModels()) {
+        if (!filter.empty() && model.name.find(filter) == std::string::npos) {
+            continue;
+        }
+        size_t before = live_bytes.load(std::memory_order_relaxed);
+        {
+            Sheet sheet;
+            model.build(sheet, cells);
+            size_t bytes = live_bytes.load(std::memory_order_relaxed) - before;
+            std::cout << (first ? "" : ",") << "\n    {\"name\": \"" << model.name << "\", \"bytes\": " << bytes
+                      << ", \"bytes_per_cell\": " << static_cast<double>(bytes) / cells << "}";
+            first = false;
+        }
+    }
+    std::cout << "\n  ]\n}" << std::endl;
+    return 0;
+}
@@ -0,0 +1,90 @@
+// Замер холодного старта: загрузка снимка против повторного ввода текстов
+// ячеек через SetCell.
+// Использование: snapshot_bench [rows] [snapshot path]
+
+#include "snapshot.h"
+
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double SecondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// по строке: 4 числа, текст, 3 формулы, одна из которых ссылается на
+// предыдущую строку (длинная цепочка зависимостей)
+std::vector<std::pair<Position, std::string>> MakeCells(int rows) {
+    std::vector<std::pair<Position, std::string>> cells;
+    cells.reserve(rows * 8);
+    for (int row = 0; row < rows; ++row) {
+        std::string r = std::to_string(row + 1);
+        for (int col = 0; col < 4; ++col) {
+            cells.push_back({{row, col}, std::to_string((row * 31 + col * 7) % 1000)});
+        }
+        cells.push_back({{row, 4}, "item #" + r});
+        cells.push_back({{row, 5}, "=A" + r + "*B" + r + "+C" + r});
+        cells.push_back({{row, 6}, "=(D" + r + "-F" + r + ")/2"});
+        cells.push_back({{row, 7}, row == 0 ? "=G1" : "=H" + std::to_string(row) + "+G" + r});
+    }
+    return cells;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    // ввод цепочки через SetCell квадратичен (поиск цикла идёт по всей
+    // цепочке), поэтому по умолчанию строк меньше, чем в import_bench
+    int rows = argc > 1 ? std::stoi(argv[1]) : 4096;
+    std::string path = argc > 2 ? argv[2]
+        : (std::filesystem::temp_directory_path() / "snapshot_bench.snapshot").string();
+
+    const auto cells = MakeCells(rows);
+    const Position last{rows - 1, 7};
+
+    Sheet source;
+    {
+        auto start = Clock::now();
+        for (const auto& [pos, text] : cells) {
+            source.SetCell(pos, text);
+        }
+        double build = SecondsSince(start);
+        start = Clock::now();
+        auto value = source.GetCell(last)->GetValue();
+        double first = SecondsSince(start);
+        std::cout << "SetCell replay:  " << cells.size() << " cells, " << build << " s, first value "
+                  << first << " s (" << std::get<double>(value) << ")" << std::endl;
+    }
+
+    for (bool with_values : {false, true}) {
+        auto start = Clock::now();
+        SaveSnapshot(source, path, SnapshotOptions{with_values});
+        double save = SecondsSince(start);
+
+        start = Clock::now();
+        Sheet sheet;
+        LoadSnapshot(sheet, path);
+        double load = SecondsSince(start);
+
+        start = Clock::now();
+        auto value = sheet.GetCell(last)->GetValue();
+        double first = SecondsSince(start);
+
+        start = Clock::now();
+        sheet.Recalculate();
+        double all = SecondsSince(start);
+
+        std::cout << (with_values ? "snapshot+values: " : "snapshot:        ")
+                  << std::filesystem::file_size(path) / 1024 << " KB, save " << save << " s, load " << load
+                  << " s, first value " << first << " s (" << std::get<double>(value) << "), materialize all "
+                  << all << " s" << std::endl;
+    }
+    std::filesystem::remove(path);
+    return 0;
+}
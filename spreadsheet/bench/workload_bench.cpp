@@ -0,0 +1,107 @@
+// Прогон сгенерированной нагрузки (см. workload.h) через лист.
+// Режим perf печатает в JSON время фаз: построение модели, первый полный
+// пересчёт, правки вперемешку с чтениями, повторная печать значений.
+// Режим diff сравнивает лист с эталонным движком для нескольких зёрен.
+// Использование: workload_bench [perf|diff] [--seed N] [--seeds N] [--scale K]
+
+#include "sheet.h"
+#include "workload.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double SecondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+WorkloadOptions MakeOptions(uint64_t seed, int scale) {
+    WorkloadOptions options;
+    options.seed = seed;
+    options.filled_rows *= scale;
+    options.aggregations *= scale;
+    options.dag_cells *= scale;
+    options.edits *= scale;
+    return options;
+}
+
+int RunPerf(const WorkloadOptions& options) {
+    Workload workload = GenerateWorkload(options);
+    auto sheet = CreateSheet();
+    std::ostringstream sink;
+
+    auto start = Clock::now();
+    RunWorkload(*sheet, workload.build);
+    double build = SecondsSince(start);
+
+    start = Clock::now();
+    sheet->PrintValues(sink);
+    double recalc = SecondsSince(start);
+
+    start = Clock::now();
+    RunWorkload(*sheet, workload.edits);
+    double edits = SecondsSince(start);
+
+    sink.str({});
+    start = Clock::now();
+    sheet->PrintValues(sink);
+    double print = SecondsSince(start);
+
+    std::cout << "{\"seed\": " << options.seed << ", \"phases\": ["
+              << "\n  {\"name\": \"build\", \"operations\": " << workload.build.size() << ", \"seconds\": " << build << "},"
+              << "\n  {\"name\": \"recalc\", \"seconds\": " << recalc << "},"
+              << "\n  {\"name\": \"edits\", \"operations\": " << workload.edits.size() << ", \"seconds\": " << edits << "},"
+              << "\n  {\"name\": \"print\", \"seconds\": " << print << "}\n]}" << std::endl;
+    return 0;
+}
+
+int RunDiff(uint64_t first_seed, int seeds, int scale) {
+    int failed = 0;
+    for (uint64_t seed = first_seed; seed < first_seed + seeds; ++seed) {
+        auto sheet = CreateSheet();
+        std::string mismatch = CompareWithReference(GenerateWorkload(MakeOptions(seed, scale)), *sheet);
+        if (!mismatch.empty()) {
+            std::cerr << "seed " << seed << ": " << mismatch << std::endl;
+            ++failed;
+        }
+    }
+    std::cerr << seeds - failed << " of " << seeds << " seeds match the reference engine" << std::endl;
+    return failed ? 1 : 0;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    std::string mode = "perf";
+    uint64_t seed = 1;
+    int seeds = 10;
+    int scale = 1;
+    int i = 1;
+    if (argc > 1 && argv[1][0] != '-') {
+        mode = argv[1];
+        ++i;
+    }
+    for (; i + 1 < argc; i += 2) {
+        std::string arg = argv[i];
+        if (arg == "--seed") {
+            seed = std::stoull(argv[i + 1]);
+        } else if (arg == "--seeds") {
+            seeds = std::stoi(argv[i + 1]);
+        } else if (arg == "--scale") {
+            scale = std::max(1, std::stoi(argv[i + 1]));
+        } else {
+            break;
+        }
+    }
+    if (i != argc || (mode != "perf" && mode != "diff")) {
+        std::cerr << "usage: " << argv[0] << " [perf|diff] [--seed N] [--seeds N] [--scale K]" << std::endl;
+        return 1;
+    }
+    return mode == "perf" ? RunPerf(MakeOptions(seed, scale)) : RunDiff(seed, seeds, scale);
+}
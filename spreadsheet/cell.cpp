@@ -1,150 +1,633 @@
 #include "cell.h"
+#include "metrics.h"
+#include "profile.h"
+#include "sheet.h"
+#include "trace.h"
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
 #include <iostream>
 #include <string>
 #include <optional>
 
 using std::make_unique;
 
-DependencyGraph::DependencyGraph(SheetInterface& sheet) 
-    : sheet_(sheet)
-{
+bool DependencyGraph::TryChangeCell(CellNode node, const std::vector<CellNode>& new_referenced_cells) {
+    return TryChangeCells({{node, new_referenced_cells, {}}});
+}
+
+bool DependencyGraph::TryChangeCells(const std::vector<Change>& changes) {
+
+    // у ячеек без ссылок (текст, числа) записи в графе нет вовсе
+    std::vector<NodeSet> old_referenced_cells(changes.size());
+    // диапазоны редки: старые заводятся, только если они у кого-то были
+    std::vector<std::vector<RangeNode>> old_referenced_ranges;
+    for (size_t i = 0; i < changes.size(); ++i) {
+        const auto& change = changes[i];
+        if (auto it = cell_to_referenced_cells_.find(change.node); it != cell_to_referenced_cells_.end()) {
+            old_referenced_cells[i] = std::move(it->second);
+            cell_to_referenced_cells_.erase(it);
+        }
+        if (!change.referenced_cells.empty()) {
+            cell_to_referenced_cells_[change.node] = { change.referenced_cells.begin(), change.referenced_cells.end() };
+        }
+        if (auto it = cell_to_referenced_ranges_.find(change.node); it != cell_to_referenced_ranges_.end()) {
+            old_referenced_ranges.resize(changes.size());
+            old_referenced_ranges[i] = std::move(it->second);
+            cell_to_referenced_ranges_.erase(it);
+        }
+        if (!change.referenced_ranges.empty()) {
+            cell_to_referenced_ranges_[change.node] = change.referenced_ranges;
+        }
+    }
+
+    if (IsCycle(changes)) {
+        for (size_t i = 0; i < changes.size(); ++i) {
+            if (old_referenced_cells[i].empty()) {
+                cell_to_referenced_cells_.erase(changes[i].node);
+            } else {
+                cell_to_referenced_cells_[changes[i].node] = std::move(old_referenced_cells[i]);
+            }
+            if (old_referenced_ranges.empty() || old_referenced_ranges[i].empty()) {
+                cell_to_referenced_ranges_.erase(changes[i].node);
+            } else {
+                cell_to_referenced_ranges_[changes[i].node] = std::move(old_referenced_ranges[i]);
+            }
+        }
+        return false;
+    }
+
+    for (size_t i = 0; i < changes.size(); ++i) {
+        if (visible_cone_valid_ && IsInVisibleCone(changes[i].node) && (!old_referenced_cells[i].empty()
+                || !changes[i].referenced_cells.empty() || !changes[i].referenced_ranges.empty()
+                || (!old_referenced_ranges.empty() && !old_referenced_ranges[i].empty()))) {
+            visible_cone_valid_ = false;
+        }
+        RecalculateDepentEdges(changes[i].node, old_referenced_cells[i], changes[i].referenced_cells);
+        if (!old_referenced_ranges.empty() || !changes[i].referenced_ranges.empty()) {
+            RecalculateRangeEdges(changes[i].node, old_referenced_ranges.empty() ? std::vector<RangeNode>{}
+                : old_referenced_ranges[i], changes[i].referenced_ranges);
+        }
+        // значение самой ячейки меняется: индексы поиска по ней устарели
+        static_cast<Sheet*> (changes[i].node.sheet)->InvalidateLookups(changes[i].node.pos);
+        subscriptions_.MarkChanged(changes[i].node.sheet, changes[i].node.pos);
+    }
+    InvalidateCash(changes);
+    return true;
+}
 
+void DependencyGraph::RestoreCells(const std::vector<Change>& changes) {
+    for (const auto& [node, referenced_cells, referenced_ranges] : changes) {
+        if (!referenced_cells.empty()) {
+            cell_to_referenced_cells_[node] = { referenced_cells.begin(), referenced_cells.end() };
+            RecalculateDepentEdges(node, {}, referenced_cells);
+        }
+        if (!referenced_ranges.empty()) {
+            cell_to_referenced_ranges_[node] = referenced_ranges;
+            RecalculateRangeEdges(node, {}, referenced_ranges);
+        }
+    }
+    visible_cone_valid_ = false;
+    if (mode_ == CalculationMode::Viewport) {
+        RefreshVisible(nullptr);
+    }
 }
 
-bool DependencyGraph::TryChangeCell(Position pos, const std::vector<Position>& new_referenced_cells) {
+std::vector<std::pair<SheetInterface*, SheetInterface*>> DependencyGraph::GetSheetEdges() const {
+    std::vector<std::pair<SheetInterface*, SheetInterface*>> result;
+    result.reserve(sheet_edges_.size());
+    for (const auto& [sheets, _] : sheet_edges_) {
+        result.push_back(sheets);
+    }
+    return result;
+}
 
-    std::unordered_set<Position, Position::Hasher> old_referenced_cells = cell_to_referenced_cells_[pos];
-    cell_to_referenced_cells_[pos] = { new_referenced_cells.begin(), new_referenced_cells.end() };
+bool DependencyGraph::HasDependents(CellNode node) const {
+    bool found = false;
+    ForEachDependent(node, [&found](CellNode) {
+        found = true;
+    });
+    return found;
+}
 
-    if (!IsCycle(pos)) {
-        RecalculateDepentEdges(pos, old_referenced_cells, new_referenced_cells);
-        InvalidateCash(pos);
-        return true;
+size_t DependencyGraph::GetReferenceCount(const SheetInterface* sheet) const {
+    size_t count = 0;
+    for (const auto& [node, referenced_cells] : cell_to_referenced_cells_) {
+        if (node.sheet == sheet) {
+            count += referenced_cells.size();
+        }
+    }
+    for (const auto& [node, referenced_ranges] : cell_to_referenced_ranges_) {
+        if (node.sheet == sheet) {
+            count += referenced_ranges.size();
+        }
     }
+    return count;
+}
 
-    cell_to_referenced_cells_[pos] = old_referenced_cells;
-    return false;
+size_t DependencyGraph::GetDependentCount(CellNode node) const {
+    NodeSet visited = {node};
+    std::vector<CellNode> stack = {node};
+    while (!stack.empty()) {
+        CellNode current = stack.back();
+        stack.pop_back();
+        ForEachDependent(current, [&](CellNode cell) {
+            if (visited.insert(cell).second) {
+                stack.push_back(cell);
+            }
+        });
+    }
+    return visited.size() - 1;
 }
 
-bool DependencyGraph::IsCycle(Position pos) const {
+bool DependencyGraph::IsCycle(const std::vector<Change>& changes) const {
+    SPREADSHEET_TRACE_SPAN("cycle_check", changes.size() == 1 ? changes[0].node.pos : Position::NONE);
     bool is_cycle = false;
-    std::unordered_map<Position, int, Position::Hasher> colors;
-    DfsForCycle(pos, colors, is_cycle);
+    std::unordered_map<CellNode, int, CellNode::Hasher> colors;
+    for (size_t i = 0; i < changes.size() && !is_cycle; ++i) {
+        // ячейка без ссылок не может лежать на цикле
+        bool has_references = !changes[i].referenced_cells.empty() || !changes[i].referenced_ranges.empty();
+        if (has_references && !colors.count(changes[i].node)) {
+            DfsForCycle(changes[i].node, colors, is_cycle);
+        }
+    }
+    SPREADSHEET_METRIC_RECORD(CycleCheckNodes, colors.size());
     return is_cycle;
 }
 
-void DependencyGraph::DfsForCycle(Position pos, std::unordered_map<Position, int, Position::Hasher>& colors, bool& is_cycle) const {
-    if (cell_to_referenced_cells_.count(pos) == 0) {
-        colors[pos] = 2;
+void DependencyGraph::DfsForCycle(CellNode node, std::unordered_map<CellNode, int, CellNode::Hasher>& colors, bool& is_cycle) const {
+    auto cells = cell_to_referenced_cells_.find(node);
+    auto ranges = cell_to_referenced_ranges_.find(node);
+    if (cells == cell_to_referenced_cells_.end() && ranges == cell_to_referenced_ranges_.end()) {
+        colors[node] = 2;
         return;
     }
-    colors[pos] = 1;
-    for (const auto& cell : cell_to_referenced_cells_.at(pos)) {
-        if (!colors.count(cell)) {
+    colors[node] = 1;
+    // true -- цикл найден, обход прекращается
+    auto visit = [&](CellNode cell) {
+        if (auto color = colors.find(cell); color == colors.end()) {
             DfsForCycle(cell, colors, is_cycle);
         }
-        else if (colors.at(cell) == 1) {
+        else if (color->second == 1) {
             is_cycle = true;
-            return;
         }
-        if (is_cycle) {
-            return;
+        return is_cycle;
+    };
+    if (cells != cell_to_referenced_cells_.end()) {
+        for (const auto& cell : cells->second) {
+            if (visit(cell)) {
+                return;
+            }
         }
     }
-    colors[pos] = 2;
+    if (ranges != cell_to_referenced_ranges_.end()) {
+        for (const auto& range : ranges->second) {
+            if (ForEachReferencingNode(range, visit)) {
+                return;
+            }
+        }
+    }
+    colors[node] = 2;
+}
+
+bool DependencyGraph::HasReferences(CellNode node) const {
+    return cell_to_referenced_cells_.count(node) || cell_to_referenced_ranges_.count(node);
 }
 
-void DependencyGraph::RecalculateDepentEdges(Position pos, const std::unordered_set<Position, Position::Hasher>& old_referenced_cells,
-    const std::vector<Position>& new_referenced_cells) {
+template <typename Func>
+bool DependencyGraph::ForEachReferencingNode(const RangeNode& range, Func func) const {
+    const auto [first, last] = range.range;
+    const Size size = range.range.GetSize();
+    if (static_cast<size_t>(size.rows) * size.cols <= cell_to_referenced_cells_.size() + cell_to_referenced_ranges_.size()) {
+        for (int row = first.row; row <= last.row; ++row) {
+            for (int col = first.col; col <= last.col; ++col) {
+                CellNode cell{range.sheet, {row, col}};
+                if (HasReferences(cell) && func(cell)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+    auto inside = [&](const CellNode& cell) {
+        return cell.sheet == range.sheet && cell.pos.row >= first.row && cell.pos.row <= last.row
+            && cell.pos.col >= first.col && cell.pos.col <= last.col;
+    };
+    // ячейка с обоими видами рёбер может попасть в func дважды: повтор
+    // отсекают цвета обхода
+    for (const auto& [cell, _] : cell_to_referenced_cells_) {
+        if (inside(cell) && func(cell)) {
+            return true;
+        }
+    }
+    for (const auto& [cell, _] : cell_to_referenced_ranges_) {
+        if (inside(cell) && func(cell)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+template <typename Func>
+void DependencyGraph::ForEachDependent(CellNode node, Func func) const {
+    if (auto it = cell_to_depent_cells_.find(node); it != cell_to_depent_cells_.end()) {
+        for (const auto& cell : it->second) {
+            func(cell);
+        }
+    }
+    if (column_to_range_dependents_.empty()) {
+        return;
+    }
+    auto it = column_to_range_dependents_.find({node.sheet, node.pos.col});
+    if (it == column_to_range_dependents_.end()) {
+        return;
+    }
+    for (const auto& dependent : it->second) {
+        if (node.pos.row >= dependent.first_row && node.pos.row <= dependent.last_row) {
+            func(dependent.node);
+        }
+    }
+}
+
+void DependencyGraph::RecalculateDepentEdges(CellNode node, const NodeSet& old_referenced_cells,
+    const std::vector<CellNode>& new_referenced_cells) {
 
     for (const auto& cell : old_referenced_cells) {
-        cell_to_depent_cells_[cell].erase(pos);
+        auto& depent_cells = cell_to_depent_cells_[cell];
+        depent_cells.erase(node);
+        if (depent_cells.empty()) {
+            cell_to_depent_cells_.erase(cell);
+        }
+        if (cell.sheet != node.sheet && --sheet_edges_[{node.sheet, cell.sheet}] == 0) {
+            sheet_edges_.erase({node.sheet, cell.sheet});
+        }
     }
     for (const auto& cell : new_referenced_cells) {
-        cell_to_depent_cells_[cell].insert(pos);
+        cell_to_depent_cells_[cell].insert(node);
+        if (cell.sheet != node.sheet) {
+            ++sheet_edges_[{node.sheet, cell.sheet}];
+        }
     }
 }
 
-void DependencyGraph::InvalidateCash(Position pos) {
-    std::unordered_set<Position, Position::Hasher> visited;
-    DfsForCashInvalidation(pos, visited);
+void DependencyGraph::RecalculateRangeEdges(CellNode node, const std::vector<RangeNode>& old_referenced_ranges,
+    const std::vector<RangeNode>& new_referenced_ranges) {
+
+    for (const auto& [sheet, range] : old_referenced_ranges) {
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+            auto it = column_to_range_dependents_.find({sheet, col});
+            assert(it != column_to_range_dependents_.end());
+            auto& dependents = it->second;
+            dependents.erase(std::find_if(dependents.begin(), dependents.end(), [&](const RangeDependent& dependent) {
+                return dependent.node == node && dependent.first_row == range.first.row
+                    && dependent.last_row == range.last.row;
+            }));
+            if (dependents.empty()) {
+                column_to_range_dependents_.erase(it);
+            }
+        }
+        if (sheet != node.sheet && --sheet_edges_[{node.sheet, sheet}] == 0) {
+            sheet_edges_.erase({node.sheet, sheet});
+        }
+    }
+    for (const auto& [sheet, range] : new_referenced_ranges) {
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+            column_to_range_dependents_[{sheet, col}].push_back({range.first.row, range.last.row, node});
+        }
+        if (sheet != node.sheet) {
+            ++sheet_edges_[{node.sheet, sheet}];
+        }
+    }
+}
+
+void DependencyGraph::SetCalculationMode(CalculationMode mode) {
+    mode_ = mode;
+    if (mode == CalculationMode::Automatic) {
+        ApplyPendingChanges();
+    } else if (mode == CalculationMode::Viewport) {
+        RefreshVisible(nullptr);
+    }
 }
 
-void DependencyGraph::DfsForCashInvalidation(Position pos, std::unordered_set<Position, Position::Hasher>& visited) {
-    visited.insert(pos);
-    if (cell_to_depent_cells_.count(pos) == 0) {
+CalculationMode DependencyGraph::GetCalculationMode() const {
+    return mode_;
+}
+
+void DependencyGraph::ApplyPendingChanges() {
+    if (pending_.empty()) {
         return;
     }
-    for (const auto& cell : cell_to_depent_cells_.at(pos)) {
-        if (!visited.count(cell)) {
-            dynamic_cast<Cell*> (sheet_.GetCell(cell))->ResetCashedValue();
-            DfsForCashInvalidation(cell, visited);
-        }
+    std::vector<Change> changes;
+    for (const auto& [sheet, positions] : pending_) {
+        positions.ForEach([this, &changes, sheet = sheet](Position pos) {
+            // формула, заданная в ручном режиме, могла посчитаться из
+            // устаревших значений, а обход ниже начальные вершины не сбрасывает
+            ResetCache({sheet, pos});
+            changes.push_back({{sheet, pos}, {}, {}});
+        });
     }
+    pending_.clear();
+    ResetDependents(changes);
 }
 
+bool DependencyGraph::HasPendingChanges() const {
+    return !pending_.empty();
+}
 
-Impl::Value EmptyImpl::GetValue() const {
-    return "";
+bool DependencyGraph::IsPendingDependent(CellNode node) const {
+    if (pending_.empty()) {
+        return false;
+    }
+    // конус видимых областей обновляется при каждой правке
+    if (mode_ == CalculationMode::Viewport && visible_cone_valid_ && visible_cone_.count(node)) {
+        return false;
+    }
+    auto is_pending = [this](CellNode cell) {
+        auto it = pending_.find(cell.sheet);
+        return it != pending_.end() && it->second.Contains(cell.pos);
+    };
+    NodeSet visited = {node};
+    std::vector<CellNode> stack = {node};
+    // true -- отмеченная правка найдена, обход прекращается
+    auto visit = [&](CellNode cell) {
+        if (!visited.insert(cell).second) {
+            return false;
+        }
+        stack.push_back(cell);
+        return is_pending(cell);
+    };
+    while (!stack.empty()) {
+        CellNode current = stack.back();
+        stack.pop_back();
+        if (auto it = cell_to_referenced_cells_.find(current); it != cell_to_referenced_cells_.end()) {
+            for (const auto& cell : it->second) {
+                if (visit(cell)) {
+                    return true;
+                }
+            }
+        }
+        auto ranges = cell_to_referenced_ranges_.find(current);
+        if (ranges == cell_to_referenced_ranges_.end()) {
+            continue;
+        }
+        for (const auto& range : ranges->second) {
+            // отмеченной может быть и ячейка диапазона без рёбер
+            if (auto it = pending_.find(range.sheet); it != pending_.end() && it->second.Intersects(range.range)) {
+                return true;
+            }
+            if (ForEachReferencingNode(range, visit)) {
+                return true;
+            }
+        }
+    }
+    return false;
 }
 
-std::string EmptyImpl::GetText() const {
-    return "";    
+void DependencyGraph::SetVisibleRanges(SheetInterface* sheet, std::vector<Range> ranges) {
+    if (ranges.empty()) {
+        visible_.erase(sheet);
+    } else {
+        visible_[sheet] = std::move(ranges);
+    }
+    visible_cone_valid_ = false;
+    if (mode_ == CalculationMode::Viewport) {
+        RefreshVisible(nullptr);
+    }
 }
 
-std::vector<Position> EmptyImpl::GetReferencedCells() const {
-    return {};
+const std::vector<Range>& DependencyGraph::GetVisibleRanges(SheetInterface* sheet) const {
+    static const std::vector<Range> none;
+    auto it = visible_.find(sheet);
+    return it == visible_.end() ? none : it->second;
 }
 
-void EmptyImpl::ResetCashedValue() {
+bool DependencyGraph::IsInVisibleCone(CellNode node) const {
+    if (visible_cone_.count(node)) {
+        return true;
+    }
+    auto inside = [&node](SheetInterface* sheet, const Range& range) {
+        return sheet == node.sheet && range.first.row <= node.pos.row && node.pos.row <= range.last.row
+            && range.first.col <= node.pos.col && node.pos.col <= range.last.col;
+    };
+    // ячейка без рёбер в конус не входит, но может войти, став формулой
+    if (auto it = visible_.find(node.sheet); it != visible_.end()) {
+        for (const auto& range : it->second) {
+            if (inside(node.sheet, range)) {
+                return true;
+            }
+        }
+    }
+    return std::any_of(visible_cone_ranges_.begin(), visible_cone_ranges_.end(), [&inside](const RangeNode& range) {
+        return inside(range.sheet, range.range);
+    });
+}
 
+void DependencyGraph::BuildVisibleCone() {
+    visible_cone_.clear();
+    visible_cone_ranges_.clear();
+    std::vector<CellNode> stack;
+    // в конус попадают только ячейки с исходящими рёбрами: остальные не
+    // бывают зависимыми и при обходе от правки не встречаются
+    auto visit = [&](CellNode cell) {
+        if (HasReferences(cell) && visible_cone_.insert(cell).second) {
+            stack.push_back(cell);
+        }
+        return false;
+    };
+    for (const auto& [sheet, ranges] : visible_) {
+        for (const auto& range : ranges) {
+            ForEachReferencingNode({sheet, range}, visit);
+        }
+    }
+    while (!stack.empty()) {
+        CellNode current = stack.back();
+        stack.pop_back();
+        if (auto it = cell_to_referenced_cells_.find(current); it != cell_to_referenced_cells_.end()) {
+            for (const auto& cell : it->second) {
+                visit(cell);
+            }
+        }
+        if (auto it = cell_to_referenced_ranges_.find(current); it != cell_to_referenced_ranges_.end()) {
+            for (const auto& range : it->second) {
+                visible_cone_ranges_.push_back(range);
+                ForEachReferencingNode(range, visit);
+            }
+        }
+    }
+    visible_cone_valid_ = true;
 }
 
-bool EmptyImpl::IsCashedValue() const {
-    return true;
+void DependencyGraph::RefreshVisible(const std::vector<Change>* changes) {
+    if (!visible_cone_valid_) {
+        BuildVisibleCone();
+        // новые ячейки конуса могли устареть от прежних правок
+        changes = nullptr;
+    }
+    if (visible_cone_.empty()) {
+        return;
+    }
+    SPREADSHEET_TRACE_SPAN("visible_invalidation");
+    NodeSet visited;
+    std::vector<CellNode> stack;
+    auto reset_from = [&](CellNode start) {
+        stack.push_back(start);
+        while (!stack.empty()) {
+            CellNode current = stack.back();
+            stack.pop_back();
+            ForEachDependent(current, [&](CellNode cell) {
+                if (visible_cone_.count(cell) && visited.insert(cell).second) {
+                    ResetCache(cell);
+                    stack.push_back(cell);
+                }
+            });
+        }
+    };
+    if (changes) {
+        for (const auto& change : *changes) {
+            reset_from(change.node);
+        }
+        return;
+    }
+    for (const auto& [sheet, positions] : pending_) {
+        positions.ForEach([&reset_from, sheet = sheet](Position pos) {
+            reset_from({sheet, pos});
+        });
+    }
 }
 
-TextImpl::TextImpl(std::string text) 
-    : text_(text)
-{
-    
+DependencyGraph::~DependencyGraph() {
+    CancelRecalculation();
 }
 
-Impl::Value TextImpl::GetValue() const {
-    if (!text_.empty() && text_[0] == '\'') {
-        return text_.substr(1);
+void DependencyGraph::StartRecalculation(std::shared_ptr<RecalculationState> state, std::function<void()> run) {
+    CancelRecalculation();
+    recalculation_ = std::move(state);
+    // счётчик растёт до запуска потока: чтения после возврата уже идут под замком
+    ++running_recalculations_;
+    recalculation_thread_ = std::thread([this, state = recalculation_, run = std::move(run)] {
+        run();
+        state->Finish(!state->cancelled);
+        --running_recalculations_;
+    });
+}
+
+void DependencyGraph::CancelRecalculation() {
+    if (!recalculation_thread_.joinable()) {
+        return;
     }
-    return text_;
+    recalculation_->cancelled = true;
+    recalculation_thread_.join();
+    recalculation_.reset();
 }
 
-std::string TextImpl::GetText() const {
-    return text_;    
+std::unique_lock<std::recursive_mutex> DependencyGraph::LockEvaluation() {
+    return std::unique_lock(evaluation_mutex_);
 }
 
-std::vector<Position> TextImpl::GetReferencedCells() const {
-    return {};
+bool DependencyGraph::IsRecalculationRunning() {
+    return running_recalculations_ != 0;
 }
 
-void TextImpl::ResetCashedValue() {
+void DependencyGraph::InvalidateCash(const std::vector<Change>& changes) {
+    if (mode_ != CalculationMode::Automatic) {
+        for (const auto& change : changes) {
+            pending_[change.node.sheet].Insert(change.node.pos);
+        }
+        if (mode_ == CalculationMode::Viewport) {
+            RefreshVisible(&changes);
+        }
+        return;
+    }
+    ResetDependents(changes);
+}
 
+void DependencyGraph::ResetDependents(const std::vector<Change>& changes) {
+    SPREADSHEET_TRACE_SPAN("invalidation", changes.size() == 1 ? changes[0].node.pos : Position::NONE);
+    NodeSet visited;
+    // каждая пройденная вершина, кроме начальных, сбросила кеш
+    [[maybe_unused]] size_t roots = 0;
+    for (const auto& change : changes) {
+        if (HasDependents(change.node) && !visited.count(change.node)) {
+            ++roots;
+            [[maybe_unused]] size_t before = visited.size();
+            DfsForCashInvalidation(change.node, visited);
+            SPREADSHEET_PROFILE_INVALIDATION(change.node.sheet, change.node.pos, visited.size() - before - 1);
+        }
+    }
+    SPREADSHEET_METRIC_RECORD(InvalidationFanOut, visited.size() - roots);
 }
 
-bool TextImpl::IsCashedValue() const {
-    return true;
+void DependencyGraph::ResetCache(CellNode node) {
+    // через лист: ячейка может быть ещё не загружена из снимка
+    static_cast<Sheet*> (node.sheet)->ResetCashedValue(node.pos);
+    subscriptions_.MarkChanged(node.sheet, node.pos);
 }
 
+SubscriptionRegistry& DependencyGraph::GetSubscriptions() {
+    return subscriptions_;
+}
+
+void DependencyGraph::DfsForCashInvalidation(CellNode node, NodeSet& visited) {
+    visited.insert(node);
+    ForEachDependent(node, [&](CellNode cell) {
+        if (!visited.count(cell)) {
+            ResetCache(cell);
+            DfsForCashInvalidation(cell, visited);
+        }
+    });
+}
+
+
 FormulaImpl::FormulaImpl(std::string text, Position pos, SheetInterface* sheet)
     : pos_(pos), formula_(ParseFormula(std::move(text))), sheet_(sheet)
 {
     assert(sheet);
+    formula_->ShareSubexpressions(static_cast<Sheet*>(sheet_)->GetSubexpressions());
 }
 
-Impl::Value FormulaImpl::GetValue() const {
+FormulaImpl::FormulaImpl(std::unique_ptr<FormulaInterface> formula, Position pos, SheetInterface* sheet)
+    : pos_(pos), formula_(std::move(formula)), sheet_(sheet)
+{
+    assert(formula_ && sheet);
+    formula_->ShareSubexpressions(static_cast<Sheet*>(sheet_)->GetSubexpressions());
+}
+
+namespace {
+
+// замок вычислений графа листа, если идёт фоновый пересчёт
+std::unique_lock<std::recursive_mutex> LockEvaluation(SheetInterface* sheet) {
+    if (!DependencyGraph::IsRecalculationRunning()) {
+        return {};
+    }
+    return static_cast<Sheet*>(sheet)->GetGraph().LockEvaluation();
+}
+
+}  // namespace
+
+FormulaImpl::Value FormulaImpl::GetValue() const {
+    auto lock = LockEvaluation(sheet_);
     if (value_) {
+        SPREADSHEET_METRIC_ADD(CacheHits, 1);
         return *value_;
     }
+    SPREADSHEET_METRIC_ADD(CacheMisses, 1);
+    SPREADSHEET_TRACE_SPAN("evaluate", pos_);
+    SPREADSHEET_PROFILE_EVALUATION(sheet_, pos_);
+    if (!evaluated_) {
+        // Общие подвыражения новой формулы могла посчитать другая формула
+        // до отложенных правок (ручной режим, режим видимых областей): та
+        // хранит устаревшее значение до пересчёта, а новая считается из
+        // текущих значений ячеек
+        evaluated_ = true;
+        if (static_cast<Sheet*>(sheet_)->GetGraph().HasPendingChanges()) {
+            formula_->ResetSubexpressions();
+        }
+    }
     auto value = formula_->Evaluate(*sheet_);
     if (std::holds_alternative<double>(value)) {
         value_ = std::optional(Value(std::get<double>(value))); 
@@ -155,24 +638,347 @@ Impl::Value FormulaImpl::GetValue() const {
     return *value_;
 }
 
+FormulaImpl::ValueRef FormulaImpl::GetValueRef() const {
+    auto lock = LockEvaluation(sheet_);
+    GetValue();
+    if (std::holds_alternative<double>(*value_)) {
+        return std::get<double>(*value_);
+    }
+    return std::get<FormulaError>(*value_);
+}
+
 std::string FormulaImpl::GetText() const {
+    // текст ленивой формулы собирается после разбора, который мог начать поток пересчёта
+    auto lock = LockEvaluation(sheet_);
     return "=" + formula_->GetExpression();
 }
 
-std::vector<Position> FormulaImpl::GetReferencedCells() const {
-    return formula_->GetReferencedCells();
+std::string_view FormulaImpl::GetTextRef() const {
+    auto lock = LockEvaluation(sheet_);
+    if (!text_) {
+        text_ = GetText();
+    }
+    return *text_;
 }
 
 void FormulaImpl::ResetCashedValue() {
     value_.reset();
+    formula_->ResetSubexpressions();
 }
 
 bool FormulaImpl::IsCashedValue() const {
+    auto lock = LockEvaluation(sheet_);
     return value_.has_value();
 }
 
+const FormulaInterface* FormulaImpl::GetFormula() const {
+    return formula_.get();
+}
+
+void FormulaImpl::SetCashedValue(Value value) {
+    value_ = std::move(value);
+}
+
+namespace {
+
+// Кратчайшая запись числа, из которой std::stod вернёт то же число
+std::string_view FormatNumber(double number, char (&buffer)[32]) {
+    auto [end, ec] = std::to_chars(buffer, buffer + sizeof(buffer), number);
+    assert(ec == std::errc());
+    return {buffer, static_cast<size_t>(end - buffer)};
+}
+
+// Число, если text -- его кратчайшая запись
+std::optional<double> ParseCanonicalNumber(std::string_view text) {
+    double number = 0;
+    auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), number);
+    if (ec != std::errc() || end != text.data() + text.size()) {
+        return std::nullopt;
+    }
+    char buffer[32];
+    if (FormatNumber(number, buffer) != text) {
+        return std::nullopt;
+    }
+    return number;
+}
+
+}  // namespace
+
+// Разметка data_ по видам:
+// * Text -- символы с нулевого байта, длина в теге;
+// * LongText -- указатель на символы в куче и длина (uint32_t с 8-го байта);
+// * Number -- double и с 8-го байта его запись, если она собрана и не
+//   длиннее NUMBER_TEXT_SIZE (длина в теге, 0 -- ещё не собрана);
+// * LongNumber и Formula -- указатель на объект в куче;
+// * PooledText -- указатель на запись пула строк.
+struct CellContent::LongNumber {
+    double number = 0;
+    std::string text;   // пусто -- запись ещё не собрана
+};
+
+CellContent::~CellContent() {
+    Destroy();
+}
+
+CellContent::CellContent(CellContent&& other) noexcept {
+    std::copy(std::begin(other.data_), std::end(other.data_), data_);
+    tag_ = other.tag_;
+    other.tag_ = 0;
+}
+
+CellContent& CellContent::operator=(CellContent&& other) noexcept {
+    if (this != &other) {
+        Destroy();
+        std::copy(std::begin(other.data_), std::end(other.data_), data_);
+        tag_ = other.tag_;
+        other.tag_ = 0;
+    }
+    return *this;
+}
+
+CellContent CellContent::FromText(std::string_view text, StringPool* pool) {
+    CellContent content;
+    if (auto number = ParseCanonicalNumber(text)) {
+        // длинная запись не хранится: её можно собрать из числа
+        content.Store(*number);
+        if (text.size() <= NUMBER_TEXT_SIZE) {
+            std::copy(text.begin(), text.end(), content.data_ + NUMBER_TEXT_OFFSET);
+            content.SetTag(Kind::Number, true, text.size());
+        } else {
+            content.SetTag(Kind::Number, true, 0);
+        }
+        return content;
+    }
+    if (text.size() <= INLINE_TEXT_SIZE) {
+        std::copy(text.begin(), text.end(), content.data_);
+        content.SetTag(Kind::Text, false, text.size());
+        return content;
+    }
+    if (text.size() > std::numeric_limits<uint32_t>::max()) {
+        throw std::length_error("cell text is too long");
+    }
+    if (pool) {
+        content.Store(pool->Acquire(text));
+        content.SetTag(Kind::PooledText, false, 0);
+        return content;
+    }
+    auto chars = std::make_unique<char[]>(text.size());
+    std::copy(text.begin(), text.end(), chars.get());
+    content.Store(chars.release());
+    content.Store(static_cast<uint32_t>(text.size()), NUMBER_TEXT_OFFSET);
+    content.SetTag(Kind::LongText, false, 0);
+    return content;
+}
+
+CellContent CellContent::FromNumber(double number) {
+    CellContent content;
+    content.Store(number);
+    content.SetTag(Kind::Number, false, 0);
+    return content;
+}
+
+CellContent CellContent::FromFormula(std::unique_ptr<FormulaImpl> formula) {
+    CellContent content;
+    content.Store(formula.release());
+    content.SetTag(Kind::Formula, false, 0);
+    return content;
+}
+
+bool CellContent::IsEmpty() const {
+    return GetKind() == Kind::Empty;
+}
+
+bool CellContent::TrySetNumber(double number) {
+    if (IsTyped()) {
+        return false;
+    }
+    if (GetKind() == Kind::Number) {
+        Store(number);
+        SetTag(Kind::Number, false, 0);
+        return true;
+    }
+    if (GetKind() == Kind::LongNumber) {
+        auto* long_number = Load<LongNumber*>();
+        long_number->number = number;
+        long_number->text.clear();
+        return true;
+    }
+    return false;
+}
+
+std::optional<double> CellContent::GetNumber() const {
+    switch (GetKind()) {
+    case Kind::Number:
+        return Load<double>();
+    case Kind::LongNumber:
+        return Load<LongNumber*>()->number;
+    default:
+        return std::nullopt;
+    }
+}
+
+FormulaImpl* CellContent::GetFormula() const {
+    return GetKind() == Kind::Formula ? Load<FormulaImpl*>() : nullptr;
+}
+
+bool CellContent::IsSame(const CellContent& other) const {
+    if (GetFormula() || other.GetFormula() || IsTyped() != other.IsTyped()) {
+        return false;
+    }
+    if (GetKind() == Kind::PooledText && other.GetKind() == Kind::PooledText) {
+        return Load<StringPool::Entry*>() == other.Load<StringPool::Entry*>();
+    }
+    auto number = GetNumber();
+    auto other_number = other.GetNumber();
+    if (number || other_number) {
+        // побитово: 0 и -0 записываются по-разному
+        return number && other_number && std::memcmp(&*number, &*other_number, sizeof(double)) == 0;
+    }
+    return GetTextRef() == other.GetTextRef();
+}
+
+CellContent::Value CellContent::GetValue() const {
+    if (GetKind() == Kind::Number && IsTyped()) {
+        return GetText();
+    }
+    auto value = GetValueRef();
+    if (const auto* text = std::get_if<std::string_view>(&value)) {
+        return std::string(*text);
+    }
+    if (const auto* number = std::get_if<double>(&value)) {
+        return *number;
+    }
+    return std::get<FormulaError>(value);
+}
+
+CellContent::ValueRef CellContent::GetValueRef() const {
+    switch (GetKind()) {
+    case Kind::Empty:
+        return std::string_view();
+    case Kind::Text:
+    case Kind::LongText:
+    case Kind::PooledText: {
+        std::string_view text = GetTextRef();
+        if (!text.empty() && text[0] == ESCAPE_SIGN) {
+            text.remove_prefix(1);
+        }
+        return text;
+    }
+    case Kind::Number:
+    case Kind::LongNumber:
+        if (IsTyped()) {
+            return GetTextRef();
+        }
+        return *GetNumber();
+    case Kind::Formula:
+        return GetFormula()->GetValueRef();
+    }
+    return std::string_view();
+}
+
+std::string CellContent::GetText() const {
+    if (auto* formula = GetFormula()) {
+        return formula->GetText();
+    }
+    if (GetKind() == Kind::Number && GetInlineSize() == 0) {
+        // запись собирается без переноса числа в кучу
+        char buffer[32];
+        return std::string(FormatNumber(Load<double>(), buffer));
+    }
+    return std::string(GetTextRef());
+}
+
+std::string_view CellContent::GetTextRef() const {
+    switch (GetKind()) {
+    case Kind::Empty:
+        return {};
+    case Kind::Text:
+        return {data_, GetInlineSize()};
+    case Kind::LongText:
+        return {Load<char*>(), Load<uint32_t>(NUMBER_TEXT_OFFSET)};
+    case Kind::Number: {
+        if (GetInlineSize() == 0) {
+            char buffer[32];
+            std::string_view text = FormatNumber(Load<double>(), buffer);
+            if (text.size() > NUMBER_TEXT_SIZE) {
+                // запись не помещается рядом с числом: число уходит в кучу
+                Store(new LongNumber{Load<double>(), std::string(text)});
+                SetTag(Kind::LongNumber, IsTyped(), 0);
+                return Load<LongNumber*>()->text;
+            }
+            std::copy(text.begin(), text.end(), data_ + NUMBER_TEXT_OFFSET);
+            SetTag(Kind::Number, IsTyped(), text.size());
+        }
+        return {data_ + NUMBER_TEXT_OFFSET, GetInlineSize()};
+    }
+    case Kind::LongNumber: {
+        auto* long_number = Load<LongNumber*>();
+        if (long_number->text.empty()) {
+            char buffer[32];
+            long_number->text = FormatNumber(long_number->number, buffer);
+        }
+        return long_number->text;
+    }
+    case Kind::Formula:
+        return GetFormula()->GetTextRef();
+    case Kind::PooledText:
+        return Load<StringPool::Entry*>()->GetText();
+    }
+    return {};
+}
+
+CellContent::Kind CellContent::GetKind() const {
+    return static_cast<Kind>(tag_ & 0x7);
+}
+
+bool CellContent::IsTyped() const {
+    return tag_ & 0x8;
+}
+
+size_t CellContent::GetInlineSize() const {
+    return tag_ >> 4;
+}
+
+void CellContent::SetTag(Kind kind, bool typed, size_t inline_size) const {
+    assert(inline_size <= INLINE_TEXT_SIZE);
+    tag_ = static_cast<uint8_t>(static_cast<uint8_t>(kind) | (typed ? 0x8 : 0) | (inline_size << 4));
+}
+
+template <typename T>
+T CellContent::Load(size_t offset) const {
+    T value;
+    std::memcpy(&value, data_ + offset, sizeof(T));
+    return value;
+}
+
+template <typename T>
+void CellContent::Store(T value, size_t offset) const {
+    static_assert(sizeof(T) <= NUMBER_TEXT_OFFSET);
+    std::memcpy(data_ + offset, &value, sizeof(T));
+}
+
+void CellContent::Destroy() {
+    switch (GetKind()) {
+    case Kind::LongText:
+        delete[] Load<char*>();
+        break;
+    case Kind::LongNumber:
+        delete Load<LongNumber*>();
+        break;
+    case Kind::Formula:
+        delete Load<FormulaImpl*>();
+        break;
+    case Kind::PooledText:
+        StringPool::Release(Load<StringPool::Entry*>());
+        break;
+    default:
+        break;
+    }
+    tag_ = 0;
+}
+
 Cell::Cell(SheetInterface* sheet)
-    : impl_(make_unique<EmptyImpl> ()), sheet_(sheet)
+    : sheet_(sheet)
 {
     
 }
@@ -180,48 +986,159 @@ Cell::Cell(SheetInterface* sheet)
 Cell::~Cell() = default;
 
 void Cell::Set(std::string text) {
+    Set(Prepare(std::move(text)));
+}
 
+void Cell::Set(CellContent content) {
+    // текстовая ячейка тоже проходит через граф: у неё пропадают старые
+    // ссылки, а зависящие от неё формулы должны сбросить кеш
+    DependencyGraph::Change change{{sheet_, pos_}, GetReferencedNodes(content), GetReferencedRangeNodes(content)};
+    if ( ! GetGraph().TryChangeCells({std::move(change)})) {
+        throw CircularDependencyException("circular dependency");
+    }
+    content_ = std::move(content);
+}
+
+CellContent Cell::Prepare(std::string text, std::unique_ptr<FormulaInterface> formula) const {
     if (text.empty()) {
-        impl_ = make_unique<EmptyImpl> ();
-    }  else if (text[0] != FORMULA_SIGN || text.size() == 1) {
-        impl_ = make_unique<TextImpl> (std::move(text));
-    } else {
-        auto tmp = make_unique<FormulaImpl> (text.substr(1), pos_, sheet_); 
-        if ( ! graph_->TryChangeCell(pos_, tmp->GetReferencedCells())) {
-            throw CircularDependencyException("circular dependency");
-        }
-        impl_ = std::move(tmp);
+        return {};
+    }
+    if (text[0] != FORMULA_SIGN || text.size() == 1) {
+        return CellContent::FromText(text, sheet_ ? &static_cast<Sheet*>(sheet_)->GetStringPool() : nullptr);
+    }
+    if (formula) {
+        return CellContent::FromFormula(make_unique<FormulaImpl> (std::move(formula), pos_, sheet_));
+    }
+    return CellContent::FromFormula(make_unique<FormulaImpl> (text.substr(1), pos_, sheet_));
+}
+
+void Cell::SetPrepared(CellContent content) {
+    content_ = std::move(content);
+}
+
+void Cell::SetNumber(double number) {
+    if (!content_.TrySetNumber(number)) {
+        content_ = CellContent::FromNumber(number);
     }
 }
 
-void Cell::SetItems(Position pos, SheetInterface* sheet, DependencyGraph* graph) {
+void Cell::SetItems(Position pos, SheetInterface* sheet) {
     pos_ = pos;
     sheet_ = sheet;
-    graph_ = graph;
 }
 
 void Cell::ResetCashedValue() {
-    impl_->ResetCashedValue();
+    if (auto* formula = content_.GetFormula()) {
+        formula->ResetCashedValue();
+    }
 }
 
 bool Cell::IsCashedValue() const {
-    return impl_->IsCashedValue();
+    auto* formula = content_.GetFormula();
+    return !formula || formula->IsCashedValue();
 }
 
 void Cell::Clear() {
-    graph_->TryChangeCell(pos_, {});
-    impl_ = make_unique<EmptyImpl> ();
+    GetGraph().TryChangeCell({sheet_, pos_}, {});
+    content_ = {};
 }
 
 Cell::Value Cell::GetValue() const {
-    return impl_->GetValue();  
+    auto lock = LockContent();
+    return content_.GetValue();
 }
 std::string Cell::GetText() const {
-    return impl_->GetText();
+    auto lock = LockContent();
+    return content_.GetText();
 }  
 
 std::vector<Position> Cell::GetReferencedCells() const {
-    return impl_->GetReferencedCells();
+    auto* formula = GetFormula();
+    return formula ? formula->GetReferencedCells() : std::vector<Position>();
+}
+
+std::vector<SheetPosition> Cell::GetExternalReferencedCells() const {
+    auto* formula = GetFormula();
+    return formula ? formula->GetExternalReferencedCells() : std::vector<SheetPosition>();
+}
+
+std::optional<double> Cell::GetNumber() const {
+    return content_.GetNumber();
+}
+
+Cell::ValueRef Cell::GetValueRef() const {
+    auto lock = LockContent();
+    return content_.GetValueRef();
 }
 
-  
+std::string_view Cell::GetTextRef() const {
+    auto lock = LockContent();
+    return content_.GetTextRef();
+}
+
+Span<const Position> Cell::GetReferencedCellsRef() const {
+    auto* formula = GetFormula();
+    return formula ? formula->GetReferencedCellsRef() : Span<const Position>();
+}
+
+const FormulaInterface* Cell::GetFormula() const {
+    auto* formula = content_.GetFormula();
+    return formula ? formula->GetFormula() : nullptr;
+}
+
+const CellContent& Cell::GetContent() const {
+    return content_;
+}
+
+std::unique_lock<std::recursive_mutex> Cell::LockContent() const {
+    if (!sheet_ || content_.GetFormula()) {
+        return {};
+    }
+    return LockEvaluation(sheet_);
+}
+
+DependencyGraph& Cell::GetGraph() const {
+    return static_cast<Sheet*>(sheet_)->GetGraph();
+}
+
+std::vector<CellNode> Cell::GetReferencedNodes() const {
+    return GetReferencedNodes(content_);
+}
+
+std::vector<CellNode> Cell::GetReferencedNodes(const CellContent& content) const {
+    std::vector<CellNode> nodes;
+    const FormulaImpl* formula = content.GetFormula();
+    if (!formula) {
+        return nodes;
+    }
+    for (const auto& pos : formula->GetFormula()->GetReferencedCells()) {
+        nodes.push_back({sheet_, pos});
+    }
+    for (const auto& [sheet_name, pos] : formula->GetFormula()->GetExternalReferencedCells()) {
+        SheetInterface* sheet = sheet_->FindSheet(sheet_name);
+        if (!sheet) {
+            throw FormulaException("unknown sheet " + sheet_name);
+        }
+        nodes.push_back({sheet, pos});
+    }
+    return nodes;
+}
+
+std::vector<RangeNode> Cell::GetReferencedRangeNodes(const CellContent& content) const {
+    std::vector<RangeNode> nodes;
+    const FormulaImpl* formula = content.GetFormula();
+    if (!formula) {
+        return nodes;
+    }
+    for (const auto& range : formula->GetFormula()->GetReferencedRanges()) {
+        nodes.push_back({sheet_, range});
+    }
+    for (const auto& [sheet_name, range] : formula->GetFormula()->GetExternalReferencedRanges()) {
+        SheetInterface* sheet = sheet_->FindSheet(sheet_name);
+        if (!sheet) {
+            throw FormulaException("unknown sheet " + sheet_name);
+        }
+        nodes.push_back({sheet, range});
+    }
+    return nodes;
+}
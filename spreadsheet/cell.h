@@ -2,74 +2,307 @@
 
 #include "common.h"
 #include "formula.h"
+#include "position_bitset.h"
+#include "recalculation.h"
+#include "string_pool.h"
+#include "subscriptions.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 
-class DependencyGraph {
-public:
-    explicit DependencyGraph(SheetInterface& sheet);
-    bool TryChangeCell(Position pos, const std::vector<Position>& new_referenced_cells);
-private:
-    std::unordered_map<Position, std::unordered_set<Position, Position::Hasher>, Position::Hasher> cell_to_referenced_cells_;
-    std::unordered_map<Position, std::unordered_set<Position, Position::Hasher>, Position::Hasher> cell_to_depent_cells_;
-    SheetInterface& sheet_;
+// Вершина графа зависимостей -- позиция на конкретном листе. Листы одной книги
+// используют общий граф, поэтому рёбра могут связывать ячейки разных листов.
+struct CellNode {
+    SheetInterface* sheet = nullptr;
+    Position pos;
 
-    bool IsCycle(Position pos) const;
-    void DfsForCycle(Position pos, std::unordered_map<Position, int, Position::Hasher>& colors, bool& is_cycle) const;
-    
-    void RecalculateDepentEdges(Position pos, const std::unordered_set<Position, Position::Hasher>& old_referenced_cells,
-        const std::vector<Position>& new_referenced_cells);
+    bool operator==(const CellNode& rhs) const {
+        return sheet == rhs.sheet && pos == rhs.pos;
+    }
 
-    void InvalidateCash(Position pos);
-    void DfsForCashInvalidation(Position pos, std::unordered_set<Position, Position::Hasher>& visited);
+    struct Hasher {
+        size_t operator() (const CellNode& node) const {
+            static const size_t p = 37;
+            return Position::Hasher() (node.pos) + p * std::hash<const void*>() (node.sheet);
+        }
+    };
 };
 
+// Диапазон конкретного листа, на который ссылается формула (аргумент
+// функции поиска). Формула зависит от каждой ячейки диапазона, в том числе
+// от ещё пустых.
+struct RangeNode {
+    SheetInterface* sheet = nullptr;
+    Range range;
 
-class Impl {
-public:
-    using Value = std::variant<std::string, double, FormulaError>;
-    virtual Value GetValue() const = 0;
-    virtual std::string GetText() const = 0;
-    virtual std::vector<Position> GetReferencedCells() const = 0;
-    virtual void ResetCashedValue() = 0;
-    virtual bool IsCashedValue() const = 0;
+    bool operator==(const RangeNode& rhs) const {
+        return sheet == rhs.sheet && range == rhs.range;
+    }
 };
 
-class EmptyImpl : public Impl {
-public:
-    Value GetValue() const override;
-    std::string GetText() const override;
-    std::vector<Position> GetReferencedCells() const override;
-    void ResetCashedValue() override;
-    bool IsCashedValue() const override;
-};  
+// Режим пересчёта: в автоматическом правка сразу сбрасывает кеши зависимых
+// формул, и они пересчитываются при чтении; в ручном правки копятся до
+// явного пересчёта (Sheet::Recalculate, Workbook::Recalculate). В режиме
+// видимых областей правки копятся так же, но ячейки видимых областей
+// (Sheet::SetVisibleRanges) и все влияющие на них остаются актуальными.
+enum class CalculationMode {
+    Automatic,
+    Manual,
+    Viewport,
+};
 
-class TextImpl : public Impl {
+class DependencyGraph {
 public:
-    explicit TextImpl(std::string text);
-    Value GetValue() const override;
-    std::string GetText() const override;
-    std::vector<Position> GetReferencedCells() const override;
-    void ResetCashedValue() override;
-    bool IsCashedValue() const override;
+    using NodeSet = std::unordered_set<CellNode, CellNode::Hasher>;
+
+    struct Change {
+        CellNode node;
+        std::vector<CellNode> referenced_cells;
+        std::vector<RangeNode> referenced_ranges;
+    };
+
+    DependencyGraph() = default;
+    // останавливает фоновый пересчёт
+    ~DependencyGraph();
+
+    bool TryChangeCell(CellNode node, const std::vector<CellNode>& new_referenced_cells);
+    // Меняет ссылки сразу у пачки ячеек: один поиск цикла и одна инвалидация
+    // кеша на всю пачку. При цикле граф остаётся прежним и возвращается false.
+    bool TryChangeCells(const std::vector<Change>& changes);
+    // Добавляет рёбра ячеек, про которые заранее известно, что они не образуют
+    // цикл (например, загруженных из снимка), без поиска цикла и инвалидации
+    void RestoreCells(const std::vector<Change>& changes);
+
+    // Пары листов (зависимый, влияющий), между которыми есть хотя бы одна ссылка
+    std::vector<std::pair<SheetInterface*, SheetInterface*>> GetSheetEdges() const;
+
+    // есть ли формулы, ссылающиеся на node (в том числе через диапазон)
+    bool HasDependents(CellNode node) const;
+
+    // Число ссылок из формул листа (рёбер, исходящих из его ячеек); диапазон
+    // -- одна ссылка
+    size_t GetReferenceCount(const SheetInterface* sheet) const;
+    // Число ячеек, транзитивно зависящих от node: столько кешей сбрасывает
+    // правка node
+    size_t GetDependentCount(CellNode node) const;
+
+    // В ручном режиме правка не обходит зависимых: изменённая ячейка только
+    // отмечается в битовой карте своего листа, а зависимые формулы хранят
+    // последние посчитанные значения. Переход в автоматический режим
+    // применяет накопленные правки.
+    void SetCalculationMode(CalculationMode mode);
+    CalculationMode GetCalculationMode() const;
+    // Сбрасывает кеши ячеек, зависящих от правок, отмеченных в ручном режиме
+    void ApplyPendingChanges();
+    bool HasPendingChanges() const;
+    // Зависит ли node (транзитивно) от отмеченной правки: её значение могло
+    // устареть. Обходит влияющие ячейки node по прямым рёбрам.
+    bool IsPendingDependent(CellNode node) const;
+
+    // Видимые области листа. В режиме Viewport правка сбрасывает кеши
+    // только в конусе видимых областей -- среди ячеек, от которых видимые
+    // зависят; остальные зависимые ждут пересчёта, как в ручном режиме.
+    // Новые области сразу получают актуальные значения.
+    void SetVisibleRanges(SheetInterface* sheet, std::vector<Range> ranges);
+    const std::vector<Range>& GetVisibleRanges(SheetInterface* sheet) const;
+
+    // Фоновый пересчёт (Sheet::RecalculateAsync): run выполняется в
+    // отдельном потоке. Граф общий для книги, и пересчёт в нём идёт не
+    // больше одного: новый останавливает прежний.
+    void StartRecalculation(std::shared_ptr<RecalculationState> state, std::function<void()> run);
+    // Останавливает фоновый пересчёт и дожидается потока. Листы вызывают
+    // его перед каждой правкой, поэтому правка не пересекается с
+    // вычислениями потока, а сброс кешей после неё видит согласованные
+    // значения.
+    void CancelRecalculation();
+    // Пока идёт фоновый пересчёт, формулы читаются и вычисляются только под
+    // этим замком: поток пересчёта берёт его на каждую формулу, а чтение из
+    // другого потока ждёт её окончания и вычисляет свою ячейку вне очереди.
+    std::unique_lock<std::recursive_mutex> LockEvaluation();
+    // идёт ли фоновый пересчёт хоть в одном графе; пока нет, чтение формул
+    // обходится без замка
+    static bool IsRecalculationRunning();
+
+    // Подписки на значения (Sheet::Subscribe). Граф отмечает в них каждую
+    // изменённую ячейку и каждую ячейку со сброшенным кешем, а лист
+    // доставляет пачки в конце своей операции.
+    SubscriptionRegistry& GetSubscriptions();
+
 private:
-    std::string text_;
+    std::unordered_map<CellNode, NodeSet, CellNode::Hasher> cell_to_referenced_cells_;
+    std::unordered_map<CellNode, NodeSet, CellNode::Hasher> cell_to_depent_cells_;
+    std::unordered_map<CellNode, std::vector<RangeNode>, CellNode::Hasher> cell_to_referenced_ranges_;
+    // Обратные рёбра диапазонов по столбцам (лист, столбец): ребро
+    // записано в каждом столбце диапазона, и зависимые от ячейки находятся
+    // просмотром рёбер одного столбца
+    struct RangeDependent {
+        int first_row;
+        int last_row;
+        CellNode node;
+    };
+    std::map<std::pair<SheetInterface*, int>, std::vector<RangeDependent>> column_to_range_dependents_;
+    // число межлистовых рёбер для каждой пары листов
+    std::map<std::pair<SheetInterface*, SheetInterface*>, int> sheet_edges_;
+    CalculationMode mode_ = CalculationMode::Automatic;
+    // правки ручного режима, ещё не дошедшие до зависимых
+    std::unordered_map<SheetInterface*, PositionBitset> pending_;
+    std::thread recalculation_thread_;
+    std::shared_ptr<RecalculationState> recalculation_;
+    std::recursive_mutex evaluation_mutex_;
+    static inline std::atomic<int> running_recalculations_{0};
+    std::unordered_map<SheetInterface*, std::vector<Range>> visible_;
+    // Конус видимых областей: формулы видимых областей и все формулы, от
+    // которых они зависят (по прямым рёбрам), и диапазоны, через которые он
+    // прошёл. Строится при первой правке после изменения рёбер ячейки
+    // конуса или самих областей.
+    NodeSet visible_cone_;
+    std::vector<RangeNode> visible_cone_ranges_;
+    bool visible_cone_valid_ = false;
+    SubscriptionRegistry subscriptions_;
+
+    bool IsCycle(const std::vector<Change>& changes) const;
+    void DfsForCycle(CellNode node, std::unordered_map<CellNode, int, CellNode::Hasher>& colors, bool& is_cycle) const;
+    // есть ли у node исходящие рёбра (только такие ячейки лежат на циклах)
+    bool HasReferences(CellNode node) const;
+    // Вызывает func для ячеек диапазона с исходящими рёбрами, пока func не
+    // вернёт true. Перебирает либо диапазон, либо ячейки с рёбрами -- что
+    // короче.
+    template <typename Func>
+    bool ForEachReferencingNode(const RangeNode& range, Func func) const;
+    // вызывает func для формул, ссылающихся на node напрямую или через диапазон
+    template <typename Func>
+    void ForEachDependent(CellNode node, Func func) const;
+    
+    void RecalculateDepentEdges(CellNode node, const NodeSet& old_referenced_cells,
+        const std::vector<CellNode>& new_referenced_cells);
+    void RecalculateRangeEdges(CellNode node, const std::vector<RangeNode>& old_referenced_ranges,
+        const std::vector<RangeNode>& new_referenced_ranges);
+
+    // сбрасывает кеши зависимых от changes либо, в ручном режиме, отмечает changes
+    void InvalidateCash(const std::vector<Change>& changes);
+    void ResetDependents(const std::vector<Change>& changes);
+    void DfsForCashInvalidation(CellNode node, NodeSet& visited);
+    // сбрасывает кеш ячейки и отмечает её для подписок
+    void ResetCache(CellNode node);
+
+    // меняет ли новое содержимое node состав конуса видимых областей
+    bool IsInVisibleCone(CellNode node) const;
+    void BuildVisibleCone();
+    // Сбрасывает кеши ячеек конуса, зависящих от changes; nullptr -- от
+    // всех отмеченных правок. Обход зависимых идёт только по конусу: путь
+    // от правки к видимой ячейке целиком лежит в нём.
+    void RefreshVisible(const std::vector<Change>* changes);
 };
 
-class FormulaImpl : public Impl {
+
+class FormulaImpl {
 public:
+    using Value = CellInterface::Value;
+    using ValueRef = CellInterface::ValueRef;
+
     FormulaImpl(std::string text, Position pos, SheetInterface* sheet);
-    Value GetValue() const override;
-    std::string GetText() const override;
-    std::vector<Position> GetReferencedCells() const override;
-    void ResetCashedValue() override;
-    bool IsCashedValue() const override;
+    FormulaImpl(std::unique_ptr<FormulaInterface> formula, Position pos, SheetInterface* sheet);
+    Value GetValue() const;
+    ValueRef GetValueRef() const;
+    std::string GetText() const;
+    // текст формулы собирается из AST при первом вызове и хранится в ячейке
+    std::string_view GetTextRef() const;
+    void ResetCashedValue();
+    bool IsCashedValue() const;
+    const FormulaInterface* GetFormula() const;
+    // значение, посчитанное заранее (например, сохранённое в снимке)
+    void SetCashedValue(Value value);
 private:
     Position pos_ = Position::NONE;
     std::unique_ptr<FormulaInterface> formula_ = nullptr;
     SheetInterface* sheet_ = nullptr;
     mutable std::optional<Value> value_; // храним кешированное значение
+    mutable std::optional<std::string> text_;
+    // формула уже вычислялась (см. GetValue)
+    mutable bool evaluated_ = false;
+};
+
+// Содержимое ячейки в 16 байтах: пусто, текст, число или формула. Текст до
+// 15 байт и число (вместе с записью до 7 знаков) лежат прямо в ячейке; в
+// куче -- только длинный текст, формула и длинная запись числа, если её
+// попросили через GetTextRef или GetValueRef. Длинный текст ячеек листа
+// хранится в пуле строк (см. string_pool.h), по одному разу на лист.
+class CellContent {
+public:
+    using Value = CellInterface::Value;
+    using ValueRef = CellInterface::ValueRef;
+
+    CellContent() = default;
+    ~CellContent();
+    CellContent(CellContent&& other) noexcept;
+    CellContent& operator=(CellContent&& other) noexcept;
+
+    // Текст, введённый в ячейку (не формула). Число в кратчайшей записи,
+    // например "42" или "0.25", хранится как число: формулы читают его без
+    // разбора, а GetValue и GetText возвращают текст, как раньше. Длинный
+    // текст попадает в pool, если он задан.
+    static CellContent FromText(std::string_view text, StringPool* pool = nullptr);
+    // число без текста (Sheet::SetNumbers): GetValue возвращает число
+    static CellContent FromNumber(double number);
+    static CellContent FromFormula(std::unique_ptr<FormulaImpl> formula);
+
+    bool IsEmpty() const;
+    // меняет число на месте, если содержимое создано FromNumber
+    bool TrySetNumber(double number);
+    std::optional<double> GetNumber() const;
+    // nullptr, если содержимое -- не формула
+    FormulaImpl* GetFormula() const;
+    // То же содержимое, что у other; формулы всегда различны. Тексты из
+    // одного пула сравниваются по записи пула, без сравнения символов.
+    bool IsSame(const CellContent& other) const;
+
+    Value GetValue() const;
+    ValueRef GetValueRef() const;
+    std::string GetText() const;
+    std::string_view GetTextRef() const;
+
+private:
+    enum class Kind : uint8_t {
+        Empty,
+        Text,           // текст в data_
+        LongText,       // указатель на текст в куче и длина
+        Number,         // число и его запись (если уже собрана)
+        LongNumber,     // указатель на число с длинной записью
+        Formula,        // указатель на FormulaImpl
+        PooledText,     // указатель на запись пула строк
+    };
+    struct LongNumber;
+
+    static constexpr size_t INLINE_TEXT_SIZE = 15;
+    static constexpr size_t NUMBER_TEXT_OFFSET = 8;
+    static constexpr size_t NUMBER_TEXT_SIZE = INLINE_TEXT_SIZE - NUMBER_TEXT_OFFSET;
+
+    // запись числа собирается лениво, поэтому данные изменяемы
+    alignas(8) mutable char data_[INLINE_TEXT_SIZE] = {};
+    // вид (3 бита), признак числа, введённого текстом (1 бит), и длина
+    // текста в data_ (4 бита)
+    mutable uint8_t tag_ = 0;
+
+    Kind GetKind() const;
+    bool IsTyped() const;
+    size_t GetInlineSize() const;
+    void SetTag(Kind kind, bool typed, size_t inline_size) const;
+    template <typename T>
+    T Load(size_t offset = 0) const;
+    template <typename T>
+    void Store(T value, size_t offset = 0) const;
+    void Destroy();
 };
 
+static_assert(sizeof(CellContent) == 16);
 
 class Cell : public CellInterface {
 public:
@@ -78,7 +311,24 @@ public:
 
     void Set(std::string text); // в этом методе в случае формулы ищем циклическую зависимость с помощью графа зависимостей 
     // и если нашли, бросаем CircularDependencyException
-    void SetItems(Position pos, SheetInterface* sheet, DependencyGraph* graph);
+    void Set(CellContent content);
+    void SetItems(Position pos, SheetInterface* sheet);
+
+    // Пакетная вставка: содержимое готовится заранее (формула может быть уже
+    // разобрана), рёбра графа добавляет вызывающий через TryChangeCells,
+    // после чего содержимое устанавливается через SetPrepared
+    CellContent Prepare(std::string text, std::unique_ptr<FormulaInterface> formula = nullptr) const;
+    void SetPrepared(CellContent content);
+    // Делает ячейку числовой без разбора текста; число меняется на месте,
+    // без выделения памяти. Рёбра графа и сброс кешей
+    // зависимых -- забота вызывающего (Sheet::SetNumbers).
+    void SetNumber(double number);
+    // переводит ссылки формулы в вершины графа; бросает FormulaException,
+    // если формула ссылается на лист, которого нет в книге
+    std::vector<CellNode> GetReferencedNodes(const CellContent& content) const;
+    std::vector<CellNode> GetReferencedNodes() const;
+    // то же для диапазонов, переданных функциям
+    std::vector<RangeNode> GetReferencedRangeNodes(const CellContent& content) const;
 
     void ResetCashedValue();
     bool IsCashedValue() const;
@@ -87,13 +337,33 @@ public:
     Value GetValue() const override;
     std::string GetText() const override;
     std::vector<Position> GetReferencedCells() const override;
+    std::vector<SheetPosition> GetExternalReferencedCells() const;
+    std::optional<double> GetNumber() const override;
+
+    // Чтение без копирования. Строки и диапазоны указывают внутрь ячейки и
+    // действительны до следующего изменения листа (SetCell, SetCells,
+    // ClearCell и т. п.); сброс кеша при правке других ячеек их не портит.
+    ValueRef GetValueRef() const;
+    std::string_view GetTextRef() const;
+    Span<const Position> GetReferencedCellsRef() const;
+
+    // формула ячейки либо nullptr, если ячейка не формульная
+    const FormulaInterface* GetFormula() const;
+    const CellContent& GetContent() const;
     Position GetPosition() const;
 
 private:
     Position pos_ = Position::NONE;
-    std::unique_ptr<Impl> impl_ = nullptr;
+    CellContent content_;
     SheetInterface* sheet_ = nullptr;
-    DependencyGraph* graph_ = nullptr;
+
+    // граф листа (общий для книги); ячейка его не хранит ради размера
+    DependencyGraph& GetGraph() const;
+    // Замок вычислений на чтение ячейки без формулы, пока идёт фоновый
+    // пересчёт: запись числа собирается при чтении и меняет содержимое,
+    // которое поток пересчёта может в это время читать. Формула берёт
+    // замок сама.
+    std::unique_lock<std::recursive_mutex> LockContent() const;
 };
     
 
@@ -2,6 +2,7 @@
 
 #include <iosfwd>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -25,15 +26,67 @@ static const int MAX_ROWS = 16384;
 static const int MAX_COLS = 16384;
 static const Position NONE;
 
+// row * MAX_COLS + col различен для всех допустимых позиций, поэтому
+// коллизий нет (раньше row + 37 * col давал длинные цепочки в бакетах)
 struct Hasher {
     size_t operator() (const Position& pos) const {
-        static const size_t p = 37;
-        return std::hash<int>() (pos.row) + p * std::hash<int>() (pos.col);
+        return static_cast<size_t>(pos.row) * MAX_COLS + static_cast<size_t>(pos.col);
     }
 };
 
 };
 
+// Ссылка на ячейку другого листа книги, например Sheet2!A1
+struct SheetPosition {
+std::string sheet;
+Position pos;
+
+bool operator==(const SheetPosition& rhs) const;
+bool operator<(const SheetPosition& rhs) const;
+
+std::string ToString() const;
+};
+
+// Непрерывный диапазон чужих элементов без владения ими (как std::span
+// из C++20)
+template <typename T>
+class Span {
+public:
+    Span() = default;
+    Span(T* data, size_t size)
+        : data_(data), size_(size)
+    {
+    }
+    template <typename Container>
+    Span(Container& container)
+        : data_(container.data()), size_(container.size())
+    {
+    }
+
+    T* begin() const {
+        return data_;
+    }
+    T* end() const {
+        return data_ + size_;
+    }
+    T* data() const {
+        return data_;
+    }
+    size_t size() const {
+        return size_;
+    }
+    bool empty() const {
+        return size_ == 0;
+    }
+    T& operator[](size_t index) const {
+        return data_[index];
+    }
+
+private:
+    T* data_ = nullptr;
+    size_t size_ = 0;
+};
+
 struct Size {
 int rows = 0;
 int cols = 0;
@@ -45,6 +98,33 @@ Size& operator=(Size rhs);
 Size(const Size& other);
 };
 
+// Прямоугольный диапазон ячеек от first до last включительно, например A1:C3
+struct Range {
+Position first;
+Position last;
+
+// обе позиции допустимы и first не ниже и не правее last
+bool IsValid() const;
+Size GetSize() const;
+
+bool operator==(const Range& rhs) const;
+bool operator<(const Range& rhs) const;
+
+// запись вида A1:C3
+std::string ToString() const;
+};
+
+// Ссылка на диапазон другого листа книги, например Sheet2!A1:B10
+struct SheetRange {
+std::string sheet;
+Range range;
+
+bool operator==(const SheetRange& rhs) const;
+bool operator<(const SheetRange& rhs) const;
+
+std::string ToString() const;
+};
+
 // Описывает ошибки, которые могут возникнуть при вычислении формулы.
 class FormulaError {
 public:
@@ -52,6 +132,7 @@ public:
         Ref,    // ссылка на ячейку с некорректной позицией
         Value,  // ячейка не может быть трактована как число
         Div0,  // в результате вычисления возникло деление на ноль
+        NA,    // функция поиска (VLOOKUP, MATCH, XLOOKUP) не нашла значение
     };
 
    // explicit FormulaError(std::string text);
@@ -100,12 +181,15 @@ using std::runtime_error::runtime_error;
 
 inline constexpr char FORMULA_SIGN = '=';
 inline constexpr char ESCAPE_SIGN = '\'';
+inline constexpr char SHEET_SEPARATOR = '!';
 
 class CellInterface {
 public:
 // Либо текст ячейки, либо значение формулы, либо сообщение об ошибке из
 // формулы
 using Value = std::variant<std::string, double, FormulaError>;
+// То же значение без копирования текста: string_view указывает внутрь ячейки
+using ValueRef = std::variant<std::string_view, double, FormulaError>;
 
 virtual ~CellInterface() = default;
 
@@ -131,8 +215,50 @@ virtual std::string GetText() const = 0;
 // формуле. Список отсортирован по возрастанию и не содержит повторяющихся
 // ячеек. В случае текстовой ячейки список пуст.
 virtual std::vector<Position> GetReferencedCells() const = 0;
+
+// Число в ячейке, если оно известно без разбора текста (числовые ячейки);
+// формулы читают его вместо GetValue. По умолчанию std::nullopt.
+virtual std::optional<double> GetNumber() const {
+    return std::nullopt;
+}
 };
   
+// Искомое значение функций поиска (VLOOKUP, MATCH, XLOOKUP): число или текст
+using LookupValue = std::variant<double, std::string>;
+
+// Как функции поиска сравнивают ячейки диапазона с искомым значением
+enum class LookupMode {
+    Exact,           // равное значение
+    LessOrEqual,     // равное либо наибольшее из меньших
+    GreaterOrEqual,  // равное либо наименьшее из больших
+};
+
+// Условие функций SUMIF, COUNTIF, AVERAGEIF: значение ячейки сравнивается
+// с value по правилам функций поиска (число -- с числом, текст -- с текстом
+// без учёта регистра). Текстовый аргумент вида ">5" или "<>north"
+// разбирается в оператор и значение, см. ParseCriterion.
+enum class CriterionOp {
+    Equal,
+    NotEqual,        // непустое значение, не равное value
+    Less,
+    LessOrEqual,
+    Greater,
+    GreaterOrEqual,
+};
+
+struct Criterion {
+    CriterionOp op = CriterionOp::Equal;
+    LookupValue value;
+};
+
+// Итог условной агрегации: число ячеек, подошедших под условие, а также
+// сумма и количество чисел среди соответствующих им ячеек суммирования
+struct ConditionalAggregate {
+    size_t matches = 0;
+    double sum = 0;
+    size_t numbers = 0;
+};
+
 // Интерфейс таблицы
 class SheetInterface {
 public:
@@ -165,6 +291,37 @@ virtual Size GetPrintableSize() const = 0;
 // соответственно. Пустая ячейка представляется пустой строкой в любом случае.
 virtual void PrintValues(std::ostream& output) const = 0;
 virtual void PrintTexts(std::ostream& output) const = 0;
+
+// Возвращает лист той же книги с заданным именем (для ссылок вида
+// Sheet2!A1) либо nullptr, если такого листа нет. Отдельный лист, созданный
+// через CreateSheet(), не видит других листов.
+virtual const SheetInterface* FindSheet(std::string_view name) const {
+    return nullptr;
+}
+virtual SheetInterface* FindSheet(std::string_view name) {
+    return nullptr;
+}
+
+// Ищет key в диапазоне range из одного столбца или одной строки и
+// возвращает номер найденной ячейки внутри диапазона (с нуля) либо
+// std::nullopt. Число совпадает только с числом, текст -- только с текстом
+// (без учёта регистра латинских букв); пустые ячейки и ошибки не совпадают
+// ни с чем. Из нескольких подходящих ячеек выбирается верхняя (левая).
+// Реализация по умолчанию просматривает диапазон целиком; Sheet отвечает
+// по индексам столбцов. Бросает std::invalid_argument, если диапазон
+// недопустим или не одномерен.
+virtual std::optional<int> Lookup(const LookupValue& key, Range range, LookupMode mode) const;
+
+// Проверяет ячейки диапазона criteria_range (одна строка или один столбец)
+// на условие и складывает числа в ячейках sum_range того же размера на тех
+// же местах (без sum_range -- в самих подошедших ячейках). Пустые ячейки и
+// ошибки под условие не подходят; ошибка в ячейке суммирования подошедшей
+// ячейки бросается как FormulaError (первая по порядку). Реализация по
+// умолчанию просматривает диапазон целиком; Sheet отвечает по индексам,
+// сгруппированным по значению условия. Бросает std::invalid_argument, если
+// диапазоны недопустимы, не одномерны или разного размера.
+virtual ConditionalAggregate Aggregate(Range criteria_range, const Criterion& criterion,
+    std::optional<Range> sum_range) const;
 };
 
 // Создаёт готовую к работе пустую таблицу.
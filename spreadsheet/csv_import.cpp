@@ -0,0 +1,185 @@
+#include "csv_import.h"
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+
+constexpr char QUOTE = '"';
+
+struct ParsedChunk {
+    std::vector<PreparedCell> cells;
+    size_t rows = 0;
+};
+
+// Ищет конец последней полной строки блока (с учётом кавычек) и считает строки
+// до него. Возвращает позицию сразу за последним "\n" либо 0, если его нет.
+size_t FindRowsEnd(const std::string& block, size_t& rows) {
+    size_t end = 0;
+    bool quoted = false;
+    rows = 0;
+    for (size_t i = 0; i < block.size(); ++i) {
+        if (block[i] == QUOTE) {
+            quoted = !quoted;
+        } else if (block[i] == '\n' && !quoted) {
+            ++rows;
+            end = i + 1;
+        }
+    }
+    return end;
+}
+
+ParsedChunk ParseChunk(const std::string& data, Position origin, char delimiter, bool lazy_formulas) {
+    ParsedChunk result;
+    std::string field;
+    int row = origin.row;
+    int col = origin.col;
+    bool row_started = false;
+
+    auto finish_field = [&] {
+        if (!field.empty()) {
+            result.cells.push_back({{row, col}, std::move(field)});
+            field.clear();
+        }
+        ++col;
+    };
+
+    const size_t n = data.size();
+    size_t i = 0;
+    while (i < n) {
+        char c = data[i];
+        row_started = true;
+        if (c == QUOTE) {
+            for (++i; i < n; ++i) {
+                if (data[i] != QUOTE) {
+                    field += data[i];
+                } else if (i + 1 < n && data[i + 1] == QUOTE) {
+                    field += QUOTE;
+                    ++i;
+                } else {
+                    ++i;
+                    break;
+                }
+            }
+        } else if (c == delimiter) {
+            finish_field();
+            ++i;
+        } else if (c == '\n') {
+            if (!field.empty() && field.back() == '\r') {
+                field.pop_back();
+            }
+            finish_field();
+            ++row;
+            col = origin.col;
+            row_started = false;
+            ++i;
+        } else {
+            // обычное поле копируется целиком, а не по символу
+            size_t j = i;
+            while (j < n && data[j] != delimiter && data[j] != '\n' && data[j] != QUOTE) {
+                ++j;
+            }
+            field.append(data, i, j - i);
+            i = j;
+        }
+    }
+    if (row_started) {
+        finish_field();
+        ++row;
+    }
+    result.rows = row - origin.row;
+
+    for (auto& cell : result.cells) {
+        if (cell.text.size() > 1 && cell.text[0] == FORMULA_SIGN) {
+            try {
+                cell.formula = lazy_formulas ? ParseFormulaLazy(cell.text.substr(1)) : ParseFormula(cell.text.substr(1));
+            } catch (const FormulaException& exc) {
+                throw FormulaException(cell.pos.ToString() + ": " + exc.what());
+            }
+        }
+    }
+    return result;
+}
+
+}  // namespace
+
+double CsvImportStats::RowsPerSecond() const {
+    return seconds > 0 ? rows / seconds : 0;
+}
+
+CsvImportStats ImportCsv(Sheet& sheet, std::istream& input, const CsvImportOptions& options) {
+    auto start = std::chrono::steady_clock::now();
+    size_t max_in_flight = options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<ParsedChunk> parsed;
+    std::deque<std::future<ParsedChunk>> in_flight;
+    auto wait_oldest = [&] {
+        parsed.push_back(in_flight.front().get());
+        in_flight.pop_front();
+    };
+
+    std::string carry;
+    Position chunk_origin = options.origin;
+    while (input) {
+        std::string block = std::move(carry);
+        size_t old_size = block.size();
+        block.resize(old_size + options.chunk_size);
+        input.read(&block[old_size], options.chunk_size);
+        block.resize(old_size + input.gcount());
+
+        size_t rows = 0;
+        size_t end = input ? FindRowsEnd(block, rows) : block.size();
+        if (end == 0 && input) {
+            // строка длиннее блока -- дочитываем
+            carry = std::move(block);
+            continue;
+        }
+        carry = block.substr(end);
+        block.resize(end);
+        if (block.empty()) {
+            continue;
+        }
+
+        if (in_flight.size() == max_in_flight) {
+            wait_oldest();
+        }
+        in_flight.push_back(std::async(std::launch::async, ParseChunk, std::move(block), chunk_origin,
+            options.delimiter, options.lazy_formulas));
+        chunk_origin.row += static_cast<int>(rows);
+    }
+    while (!in_flight.empty()) {
+        wait_oldest();
+    }
+
+    CsvImportStats stats;
+    size_t total_cells = 0;
+    for (const auto& chunk : parsed) {
+        total_cells += chunk.cells.size();
+        stats.rows += chunk.rows;
+    }
+    std::vector<PreparedCell> cells;
+    cells.reserve(total_cells);
+    for (auto& chunk : parsed) {
+        std::move(chunk.cells.begin(), chunk.cells.end(), std::back_inserter(cells));
+    }
+    parsed.clear();
+
+    stats.cells = cells.size();
+    sheet.SetCells(std::move(cells));
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return stats;
+}
+
+CsvImportStats ImportCsv(Sheet& sheet, const std::string& path, const CsvImportOptions& options) {
+    std::ifstream input(path, std::ios::binary);
+    if (!input) {
+        throw std::runtime_error("cannot open " + path);
+    }
+    return ImportCsv(sheet, input, options);
+}
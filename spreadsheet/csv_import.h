@@ -0,0 +1,38 @@
+#pragma once
+
+#include "sheet.h"
+
+#include <iosfwd>
+#include <string>
+
+// Параметры загрузки CSV/TSV
+struct CsvImportOptions {
+    char delimiter = ',';             // '\t' для TSV
+    Position origin = {0, 0};         // куда на листе попадёт первое поле файла
+    size_t threads = 0;               // 0 -- по числу ядер
+    size_t chunk_size = 4 << 20;      // размер блока чтения в байтах
+    // формулы разбираются при первом обращении (см. ParseFormulaLazy), при
+    // загрузке из них только извлекаются ссылки
+    bool lazy_formulas = false;
+};
+
+struct CsvImportStats {
+    size_t rows = 0;
+    size_t cells = 0;
+    double seconds = 0;
+
+    double RowsPerSecond() const;
+};
+
+// Загружает CSV/TSV в лист. Файл читается большими блоками, блоки из целых
+// строк раздаются потокам, которые делят строки на поля и разбирают формулы.
+// Все ячейки вставляются одной пачкой через Sheet::SetCells, поэтому поиск
+// циклов и инвалидация кеша выполняются один раз на весь файл.
+// Строки разделяются "\n" или "\r\n", пустые поля пропускаются. Поле в
+// кавычках может содержать разделитель и перевод строки, "" внутри кавычек
+// означает одну кавычку.
+// При синтаксической ошибке в формуле бросает FormulaException с адресом
+// ячейки; в этом случае лист не меняется, в том числе в ленивом режиме:
+// сканер пропускает только формулы, которые разбираются без ошибок.
+CsvImportStats ImportCsv(Sheet& sheet, std::istream& input, const CsvImportOptions& options = {});
+CsvImportStats ImportCsv(Sheet& sheet, const std::string& path, const CsvImportOptions& options = {});
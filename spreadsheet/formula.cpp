@@ -1,6 +1,7 @@
 #include "formula.h"
 
 #include "FormulaAST.h"
+#include "metrics.h"
 
 #include <algorithm>
 #include <cassert>
@@ -21,9 +22,17 @@ namespace {
 class Formula : public FormulaInterface {
 public:
     explicit Formula(std::string expression);
+    explicit Formula(FormulaAST ast);
     Value Evaluate(const SheetInterface& sheet) const override;
     std::string GetExpression() const override; 
     std::vector<Position> GetReferencedCells() const override;
+    Span<const Position> GetReferencedCellsRef() const override;
+    std::vector<SheetPosition> GetExternalReferencedCells() const override;
+    std::vector<Range> GetReferencedRanges() const override;
+    std::vector<SheetRange> GetExternalReferencedRanges() const override;
+    void Serialize(std::string& out) const override;
+    void ShareSubexpressions(SubexpressionTable& table) override;
+    void ResetSubexpressions() const override;
 
 private:
     FormulaAST ast_;
@@ -35,7 +44,14 @@ Formula::Formula(std::string expression)
     
 }
 
+Formula::Formula(FormulaAST ast)
+    : ast_(std::move(ast))
+{
+
+}
+
 FormulaInterface::Value Formula::Evaluate(const SheetInterface& sheet) const {
+    SPREADSHEET_METRIC_ADD(Evaluations, 1);
     try {
         return ast_.Execute(sheet);
     }
@@ -57,9 +73,151 @@ std::string Formula::GetExpression() const {
 std::vector<Position> Formula::GetReferencedCells() const {
     return ast_.GetReferencedCells();
 }
+
+Span<const Position> Formula::GetReferencedCellsRef() const {
+    return ast_.GetReferencedCellsRef();
+}
+
+std::vector<SheetPosition> Formula::GetExternalReferencedCells() const {
+    return ast_.GetExternalReferencedCells();
+}
+
+std::vector<Range> Formula::GetReferencedRanges() const {
+    return ast_.GetReferencedRanges();
+}
+
+std::vector<SheetRange> Formula::GetExternalReferencedRanges() const {
+    return ast_.GetExternalReferencedRanges();
+}
+
+void Formula::Serialize(std::string& out) const {
+    ast_.Serialize(out);
+}
+
+void Formula::ShareSubexpressions(SubexpressionTable& table) {
+    ast_.ShareSubexpressions(table);
+}
+
+void Formula::ResetSubexpressions() const {
+    ast_.ResetSubexpressions();
+}
     
 }  // namespace
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
     return std::make_unique<Formula>(std::move(expression));
 }
+
+namespace {
+class LazyFormula : public FormulaInterface {
+public:
+    LazyFormula(std::string expression, FormulaReferences references);
+    Value Evaluate(const SheetInterface& sheet) const override;
+    std::string GetExpression() const override;
+    std::vector<Position> GetReferencedCells() const override;
+    Span<const Position> GetReferencedCellsRef() const override;
+    std::vector<SheetPosition> GetExternalReferencedCells() const override;
+    std::vector<Range> GetReferencedRanges() const override;
+    std::vector<SheetRange> GetExternalReferencedRanges() const override;
+    void Serialize(std::string& out) const override;
+    void ShareSubexpressions(SubexpressionTable& table) override;
+    void ResetSubexpressions() const override;
+
+private:
+    // после разбора текст освобождается; ссылки остаются, чтобы диапазон из
+    // GetReferencedCellsRef не терял силу при первом вычислении
+    mutable std::string expression_;
+    FormulaReferences references_;
+    mutable std::unique_ptr<Formula> formula_;
+    // таблица общих подвыражений; формула делится ими при разборе
+    SubexpressionTable* subexpressions_ = nullptr;
+    // сброс до разбора: значения подвыражений сбрасываются после него
+    mutable bool reset_subexpressions_ = false;
+
+    const Formula& Materialize() const;
+};
+
+LazyFormula::LazyFormula(std::string expression, FormulaReferences references)
+    : expression_(std::move(expression)), references_(std::move(references))
+{
+
+}
+
+const Formula& LazyFormula::Materialize() const {
+    if (!formula_) {
+        formula_ = std::make_unique<Formula>(expression_);
+        if (subexpressions_) {
+            formula_->ShareSubexpressions(*subexpressions_);
+            if (reset_subexpressions_) {
+                formula_->ResetSubexpressions();
+            }
+        }
+        expression_ = {};
+    }
+    return *formula_;
+}
+
+FormulaInterface::Value LazyFormula::Evaluate(const SheetInterface& sheet) const {
+    return Materialize().Evaluate(sheet);
+}
+
+std::string LazyFormula::GetExpression() const {
+    // запись формулы (например, в журнал) не заставляет её разбирать
+    return formula_ ? formula_->GetExpression() : expression_;
+}
+
+std::vector<Position> LazyFormula::GetReferencedCells() const {
+    return references_.cells;
+}
+
+Span<const Position> LazyFormula::GetReferencedCellsRef() const {
+    return references_.cells;
+}
+
+std::vector<SheetPosition> LazyFormula::GetExternalReferencedCells() const {
+    return references_.external_cells;
+}
+
+// сканер не принимает ':', поэтому формула с диапазонами сразу разбирается
+// полностью и ленивой не бывает
+std::vector<Range> LazyFormula::GetReferencedRanges() const {
+    return {};
+}
+
+std::vector<SheetRange> LazyFormula::GetExternalReferencedRanges() const {
+    return {};
+}
+
+void LazyFormula::Serialize(std::string& out) const {
+    Materialize().Serialize(out);
+}
+
+void LazyFormula::ShareSubexpressions(SubexpressionTable& table) {
+    assert(!subexpressions_);
+    if (formula_) {
+        formula_->ShareSubexpressions(table);
+    } else {
+        subexpressions_ = &table;
+    }
+}
+
+void LazyFormula::ResetSubexpressions() const {
+    if (formula_) {
+        formula_->ResetSubexpressions();
+    } else {
+        reset_subexpressions_ = true;
+    }
+}
+}  // namespace
+
+std::unique_ptr<FormulaInterface> ParseFormulaLazy(std::string expression) {
+    auto references = ScanFormulaReferences(expression);
+    if (!references) {
+        return ParseFormula(std::move(expression));
+    }
+    return std::make_unique<LazyFormula>(std::move(expression), std::move(*references));
+}
+
+std::unique_ptr<FormulaInterface> LoadFormula(std::string_view code) {
+    return std::make_unique<Formula>(LoadFormulaAST(code));
+}
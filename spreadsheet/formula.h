@@ -10,6 +10,10 @@
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
+// * Ссылки на ячейки текущего и других листов книги: A1+Sheet2!B3
+// * Функции поиска VLOOKUP, MATCH и XLOOKUP, которым передаются диапазоны
+//   и строки: VLOOKUP("north",Data!A1:C100,3,0)
+// * Условные агрегаты SUMIF, COUNTIF и AVERAGEIF: SUMIF(A1:A100,">=10",B1:B100)
 class FormulaInterface {
 public:
     using Value = std::variant<double, FormulaError>;
@@ -25,8 +29,45 @@ public:
     virtual std::string GetExpression() const = 0;
 
     virtual std::vector<Position> GetReferencedCells() const = 0;
+    // То же без копирования: диапазон живёт, пока жива формула
+    virtual Span<const Position> GetReferencedCellsRef() const = 0;
+
+    // Возвращает ссылки на ячейки других листов книги (Sheet2!A1).
+    // Список отсортирован и не содержит повторов.
+    virtual std::vector<SheetPosition> GetExternalReferencedCells() const = 0;
+
+    // Диапазоны, переданные функциям (A1:B10), и диапазоны других листов
+    // книги (Sheet2!A1:B10). Списки отсортированы и не содержат повторов.
+    virtual std::vector<Range> GetReferencedRanges() const = 0;
+    virtual std::vector<SheetRange> GetExternalReferencedRanges() const = 0;
+
+    // Дописывает в out скомпилированное представление формулы, из которого
+    // LoadFormula восстанавливает её без разбора текста.
+    virtual void Serialize(std::string& out) const = 0;
+
+    // Делит подвыражения со ссылками с одинаковыми подвыражениями других
+    // формул листа через его таблицу (см. subexpressions.h): общее
+    // подвыражение вычисляется один раз до сброса. Вызывается один раз,
+    // когда формула попадает в ячейку листа.
+    virtual void ShareSubexpressions(SubexpressionTable& table) = 0;
+    // Сбрасывает значения общих подвыражений формулы; вызывается вместе со
+    // сбросом кеша её ячейки
+    virtual void ResetSubexpressions() const = 0;
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Ленивый вариант ParseFormula для массовой загрузки. Сначала ссылки
+// извлекаются быстрым сканером (ScanFormulaReferences), а AST строится при
+// первом вызове Evaluate или Serialize. Если сканер не уверен в тексте,
+// формула разбирается сразу, и ошибка бросается, как в ParseFormula; текст,
+// принятый сканером, разбирается всегда. До разбора GetExpression
+// возвращает выражение как оно записано (например, для журнала), после --
+// собранное из AST.
+std::unique_ptr<FormulaInterface> ParseFormulaLazy(std::string expression);
+
+// Восстанавливает формулу из представления, записанного Serialize.
+// Бросает FormulaException, если представление повреждено.
+std::unique_ptr<FormulaInterface> LoadFormula(std::string_view code);
@@ -0,0 +1,433 @@
+#include "journal.h"
+
+#include "sheet.h"
+#include "snapshot.h"
+
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <optional>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+constexpr char JOURNAL_MAGIC[8] = "SPJRNL";
+// версия 2 добавила записи чисел; журналы версии 1 читаются как есть
+constexpr uint32_t JOURNAL_VERSION = 2;
+constexpr uint32_t JOURNAL_BYTE_ORDER = 0x01020304;
+constexpr size_t JOURNAL_HEADER_SIZE = 16;   // magic, версия, порядок байт
+
+constexpr char OP_SET = 'S';
+constexpr char OP_CLEAR = 'C';
+constexpr char OP_NUMBER = 'N';     // текст записи -- double в порядке байт хоста
+
+// тело записи: op, row, col, размер имени листа, имя листа, текст
+constexpr size_t RECORD_HEADER_SIZE = 2 * sizeof(uint32_t);
+constexpr size_t PAYLOAD_FIXED_SIZE = 1 + 3 * sizeof(int32_t);
+
+// FNV-1a: ловит оборванные и недописанные записи, от порчи не защищает
+uint32_t Checksum(std::string_view data) {
+    uint32_t hash = 2166136261u;
+    for (char c : data) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+    }
+    return hash;
+}
+
+template <typename T>
+void Put(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+T Get(const char* data) {
+    T value;
+    std::memcpy(&value, data, sizeof(T));
+    return value;
+}
+
+std::string MakeHeader(uint32_t version = JOURNAL_VERSION) {
+    std::string header(JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+    Put(header, version);
+    Put(header, JOURNAL_BYTE_ORDER);
+    return header;
+}
+
+bool IsSupportedHeader(std::string_view header) {
+    return header == MakeHeader() || header == MakeHeader(1);
+}
+
+std::string ErrorText(const std::string& what, const std::string& path) {
+    return what + " " + path + ": " + std::strerror(errno);
+}
+
+#ifdef _WIN32
+int OpenFile(const std::string& path) {
+    return ::_open(path.c_str(), _O_WRONLY | _O_APPEND | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE);
+}
+bool WriteAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        int written = ::_write(fd, data, static_cast<unsigned>(std::min<size_t>(size, 1 << 30)));
+        if (written < 0) {
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+bool SyncFile(int fd) {
+    return ::_commit(fd) == 0;
+}
+bool TruncateFile(int fd, size_t size) {
+    return ::_chsize_s(fd, size) == 0;
+}
+void CloseFile(int fd) {
+    ::_close(fd);
+}
+// каталог в Windows не открыть; запись о новом файле сохраняет журнал NTFS
+bool SyncDirectory(const std::string&) {
+    return true;
+}
+#else
+int OpenFile(const std::string& path) {
+    return ::open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+}
+bool WriteAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t written = ::write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+bool SyncFile(int fd) {
+    return ::fsync(fd) == 0;
+}
+bool TruncateFile(int fd, size_t size) {
+    return ::ftruncate(fd, size) == 0;
+}
+void CloseFile(int fd) {
+    ::close(fd);
+}
+bool SyncDirectory(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = ::fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+}
+#endif
+
+// Сбрасывает каталог файла: без этого только что созданный файл может
+// пропасть после отключения питания вместе со всеми записями в нём.
+bool SyncParentDirectory(const std::string& path) {
+    auto directory = std::filesystem::path(path).parent_path();
+    return SyncDirectory(directory.empty() ? "." : directory.string());
+}
+
+struct JournalRecord {
+    char op;
+    std::string_view sheet;
+    Position pos;
+    std::string_view text;
+};
+
+// Разбирает записи журнала по порядку. Возвращает смещение конца последней
+// целой записи: дальше лежит оборванный хвост.
+template <typename Callback>
+size_t ReadRecords(const std::string& data, const std::string& path, Callback callback) {
+    if (data.size() < JOURNAL_HEADER_SIZE || !IsSupportedHeader(std::string_view(data).substr(0, JOURNAL_HEADER_SIZE))) {
+        throw JournalException("not a journal or unsupported version: " + path);
+    }
+    size_t offset = JOURNAL_HEADER_SIZE;
+    while (data.size() - offset >= RECORD_HEADER_SIZE) {
+        auto size = Get<uint32_t>(data.data() + offset);
+        auto checksum = Get<uint32_t>(data.data() + offset + sizeof(uint32_t));
+        if (size < PAYLOAD_FIXED_SIZE || data.size() - offset - RECORD_HEADER_SIZE < size) {
+            break;
+        }
+        std::string_view payload(data.data() + offset + RECORD_HEADER_SIZE, size);
+        if (Checksum(payload) != checksum) {
+            break;
+        }
+        JournalRecord record;
+        record.op = payload[0];
+        record.pos.row = Get<int32_t>(payload.data() + 1);
+        record.pos.col = Get<int32_t>(payload.data() + 1 + sizeof(int32_t));
+        auto sheet_size = Get<uint32_t>(payload.data() + 1 + 2 * sizeof(int32_t));
+        if (sheet_size > size - PAYLOAD_FIXED_SIZE || (record.op != OP_SET && record.op != OP_CLEAR
+            && record.op != OP_NUMBER) || !record.pos.IsValid()) {
+            break;
+        }
+        record.sheet = payload.substr(PAYLOAD_FIXED_SIZE, sheet_size);
+        record.text = payload.substr(PAYLOAD_FIXED_SIZE + sheet_size);
+        if (record.op == OP_NUMBER && record.text.size() != sizeof(double)) {
+            break;
+        }
+        callback(record);
+        offset += RECORD_HEADER_SIZE + size;
+    }
+    return offset;
+}
+
+}  // namespace
+
+Journal::Journal(std::string path, JournalOptions options)
+    : path_(std::move(path)), options_(options)
+{
+    std::error_code error;
+    bool is_new = !std::filesystem::exists(path_, error) || std::filesystem::file_size(path_, error) == 0;
+    if (!is_new) {
+        std::ifstream input(path_, std::ios::binary);
+        std::string header(JOURNAL_HEADER_SIZE, '\0');
+        input.read(header.data(), header.size());
+        if (!input || !IsSupportedHeader(header)) {
+            throw JournalException("not a journal or unsupported version: " + path_);
+        }
+    }
+    fd_ = OpenFile(path_);
+    if (fd_ < 0) {
+        throw JournalException(ErrorText("cannot open", path_));
+    }
+    if (is_new) {
+        std::string header = MakeHeader();
+        if (!WriteAll(fd_, header.data(), header.size()) || !SyncFile(fd_)) {
+            CloseFile(fd_);
+            throw JournalException(ErrorText("cannot write", path_));
+        }
+        if (!SyncParentDirectory(path_)) {
+            CloseFile(fd_);
+            throw JournalException(ErrorText("cannot sync the directory of", path_));
+        }
+    }
+    writer_ = std::thread(&Journal::WriterLoop, this);
+}
+
+Journal::~Journal() {
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    writer_wakeup_.notify_one();
+    writer_.join();
+    CloseFile(fd_);
+}
+
+void Journal::LogSet(std::string_view sheet, Position pos, std::string_view text) {
+    Append(sheet, OP_SET, pos, text);
+}
+
+void Journal::LogNumber(std::string_view sheet, Position pos, double number) {
+    char text[sizeof(double)];
+    std::memcpy(text, &number, sizeof(number));
+    Append(sheet, OP_NUMBER, pos, std::string_view(text, sizeof(text)));
+}
+
+void Journal::LogClear(std::string_view sheet, Position pos) {
+    Append(sheet, OP_CLEAR, pos, {});
+}
+
+void Journal::Append(std::string_view sheet, char op, Position pos, std::string_view text) {
+    const auto size = static_cast<uint32_t>(PAYLOAD_FIXED_SIZE + sheet.size() + text.size());
+
+    std::unique_lock lock(mutex_);
+    ThrowIfFailed();
+    // запись собирается прямо в буфере группы, контрольная сумма -- по месту
+    size_t begin = pending_.size();
+    Put(pending_, size);
+    Put(pending_, uint32_t(0));
+    pending_ += op;
+    Put(pending_, static_cast<int32_t>(pos.row));
+    Put(pending_, static_cast<int32_t>(pos.col));
+    Put(pending_, static_cast<uint32_t>(sheet.size()));
+    pending_ += sheet;
+    pending_ += text;
+    uint32_t checksum = Checksum(std::string_view(pending_).substr(begin + RECORD_HEADER_SIZE));
+    std::memcpy(&pending_[begin + sizeof(uint32_t)], &checksum, sizeof(checksum));
+    uint64_t lsn = ++appended_;
+
+    if (options_.sync == JournalSync::Full || pending_.size() >= options_.group_bytes) {
+        writer_wakeup_.notify_one();
+    }
+    if (options_.sync == JournalSync::Full) {
+        committed_cv_.wait(lock, [&] { return committed_ >= lsn || error_; });
+        ThrowIfFailed();
+    }
+}
+
+void Journal::Flush() {
+    std::unique_lock lock(mutex_);
+    ThrowIfFailed();
+    uint64_t target = appended_;
+    if (committed_ >= target) {
+        return;
+    }
+    flush_requested_ = std::max(flush_requested_, target);
+    writer_wakeup_.notify_one();
+    committed_cv_.wait(lock, [&] { return committed_ >= target || error_; });
+    ThrowIfFailed();
+}
+
+void Journal::Compact(const Sheet& sheet, const std::string& snapshot_path) {
+    Flush();
+    // Снимок заменяется атомарно, и SaveSnapshot возвращается, только когда
+    // его данные и переименование сброшены на диск (fsync файла и каталога).
+    // Поэтому очищать журнал после него безопасно: правки уже не потерять.
+    // Если упасть до очистки, журнал повторно применится к новому снимку
+    // без вреда.
+    SaveSnapshot(sheet, snapshot_path);
+
+    std::lock_guard io_lock(io_mutex_);
+    if (!TruncateFile(fd_, JOURNAL_HEADER_SIZE) || !SyncFile(fd_)) {
+        throw JournalException(ErrorText("cannot truncate", path_));
+    }
+}
+
+JournalStats Journal::GetStats() const {
+    std::lock_guard lock(mutex_);
+    return stats_;
+}
+
+void Journal::ThrowIfFailed() const {
+    if (error_) {
+        std::rethrow_exception(error_);
+    }
+}
+
+void Journal::WriterLoop() {
+    std::unique_lock lock(mutex_);
+    while (true) {
+        writer_wakeup_.wait_for(lock, options_.commit_interval, [this] {
+            return stop_ || pending_.size() >= options_.group_bytes || flush_requested_ > committed_
+                || (options_.sync == JournalSync::Full && !pending_.empty());
+        });
+        if (pending_.empty()) {
+            if (stop_) {
+                return;
+            }
+            continue;
+        }
+
+        std::string group;
+        group.swap(pending_);
+        uint64_t lsn = appended_;
+        lock.unlock();
+
+        // пока группа пишется, новые записи копятся в pending_ и уйдут
+        // следующей группой
+        bool ok;
+        bool synced = false;
+        {
+            std::lock_guard io_lock(io_mutex_);
+            ok = WriteAll(fd_, group.data(), group.size());
+            if (ok && options_.sync != JournalSync::None) {
+                ok = SyncFile(fd_);
+                synced = true;
+            }
+        }
+        std::exception_ptr error;
+        if (!ok) {
+            error = std::make_exception_ptr(JournalException(ErrorText("cannot write", path_)));
+        }
+
+        lock.lock();
+        if (error) {
+            error_ = error;
+        } else {
+            committed_ = lsn;
+            stats_.records = lsn;
+            ++stats_.groups;
+            stats_.syncs += synced;
+            stats_.bytes += group.size();
+        }
+        committed_cv_.notify_all();
+        if (error_) {
+            return;
+        }
+    }
+}
+
+size_t RecoverSheet(Sheet& sheet, const std::string& snapshot_path, const std::string& journal_path) {
+    if (std::filesystem::exists(snapshot_path)) {
+        LoadSnapshot(sheet, snapshot_path);
+    }
+    if (!std::filesystem::exists(journal_path)) {
+        return 0;
+    }
+
+    std::string data;
+    {
+        std::ifstream input(journal_path, std::ios::binary);
+        data.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+        if (input.bad()) {
+            throw JournalException("cannot read " + journal_path);
+        }
+    }
+
+    // последняя правка каждой ячейки
+    std::map<Position, JournalRecord> last;
+    size_t applied = 0;
+    size_t end = ReadRecords(data, journal_path, [&](const JournalRecord& record) {
+        if (record.sheet != sheet.GetName()) {
+            return;
+        }
+        ++applied;
+        last[record.pos] = record;
+    });
+
+    if (end < data.size()) {
+        std::filesystem::resize_file(journal_path, end);
+    }
+
+    // итог журнала ацикличен, поэтому хватает одной пачки с одним поиском
+    // цикла, даже если промежуточные состояния с этим снимком несовместимы.
+    // Числа сначала входят в пачку пустыми (это убирает рёбра
+    // прежних формул), а затем ставятся через SetNumbers отрезками столбцов.
+    std::vector<PreparedCell> cells;
+    std::vector<Position> cleared;
+    std::map<std::pair<int, int>, double> numbers;  // (столбец, строка) -> число
+    cells.reserve(last.size());
+    for (const auto& [pos, record] : last) {
+        cells.push_back({pos, record.op == OP_SET ? std::string(record.text) : std::string()});
+        if (record.op == OP_CLEAR) {
+            cleared.push_back(pos);
+        } else if (record.op == OP_NUMBER) {
+            numbers[{pos.col, pos.row}] = Get<double>(record.text.data());
+        }
+    }
+    sheet.SetCells(std::move(cells));
+    for (Position pos : cleared) {
+        sheet.ClearCell(pos);
+    }
+    std::vector<double> run;
+    for (auto it = numbers.begin(); it != numbers.end();) {
+        const auto [col, start_row] = it->first;
+        run.clear();
+        for (; it != numbers.end() && it->first == std::pair(col, start_row + static_cast<int>(run.size())); ++it) {
+            run.push_back(it->second);
+        }
+        sheet.SetNumbers(col, start_row, run);
+    }
+    return applied;
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+
+class Sheet;
+
+// Исключение, выбрасываемое при ошибке записи или чтения журнала
+class JournalException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Насколько надёжно правка сохранена к моменту возврата из SetCell/ClearCell
+enum class JournalSync {
+    None,    // группы записей пишутся в файл без fsync: переживают падение
+             // процесса, но не отключение питания
+    Group,   // каждая группа завершается fsync, но правка его не ждёт:
+             // при отключении питания теряется не больше commit_interval
+    Full,    // правка возвращается только после fsync группы, в которую
+             // попала; правки, пришедшие во время fsync, ждут следующего
+};
+
+struct JournalOptions {
+    JournalSync sync = JournalSync::Group;
+    // группа записывается не реже, чем раз в этот интервал
+    std::chrono::microseconds commit_interval{2000};
+    // и досрочно, если набрала столько байт
+    size_t group_bytes = 1 << 20;
+};
+
+struct JournalStats {
+    uint64_t records = 0;
+    uint64_t groups = 0;    // записей в файл
+    uint64_t syncs = 0;     // вызовов fsync
+    uint64_t bytes = 0;
+};
+
+// Журнал упреждающей записи правок листов. Правки добавляются в буфер под
+// мьютексом, а фоновый поток записывает накопленное одной группой, поэтому
+// пишущие потоки не выстраиваются в очередь за диском. Один журнал может
+// обслуживать несколько листов: в записи хранится имя листа.
+// Формат: заголовок, затем записи [размер][контрольная сумма][тело];
+// оборванная при сбое последняя запись отбрасывается при восстановлении.
+class Journal {
+public:
+    // Открывает журнал для дозаписи, создавая файл при необходимости.
+    // Восстановление (RecoverSheet) нужно выполнить до открытия.
+    explicit Journal(std::string path, JournalOptions options = {});
+    // записывает оставшиеся правки
+    ~Journal();
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    void LogSet(std::string_view sheet, Position pos, std::string_view text);
+    // число без текста (Sheet::SetNumbers): восстанавливается числом, а не
+    // текстом его записи
+    void LogNumber(std::string_view sheet, Position pos, double number);
+    void LogClear(std::string_view sheet, Position pos);
+
+    // Дожидается записи всех добавленных правок (и fsync, если политика
+    // не None)
+    void Flush();
+
+    // Складывает журнал в снимок: лист сохраняется в snapshot_path (см.
+    // snapshot.h), и только когда снимок и его каталог сброшены на диск,
+    // журнал очищается и тоже сбрасывается. Правки листа во время
+    // сжатия недопустимы. Журнал, обслуживающий несколько листов, очищается
+    // целиком, поэтому сжимать его нужно через снимки всех листов.
+    void Compact(const Sheet& sheet, const std::string& snapshot_path);
+
+    JournalStats GetStats() const;
+
+private:
+    std::string path_;
+    JournalOptions options_;
+    int fd_ = -1;
+
+    mutable std::mutex mutex_;
+    std::condition_variable writer_wakeup_;
+    std::condition_variable committed_cv_;
+    std::string pending_;           // записи ещё не отданные на диск
+    uint64_t appended_ = 0;         // номер последней добавленной записи
+    uint64_t committed_ = 0;        // номер последней записанной
+    uint64_t flush_requested_ = 0;
+    bool stop_ = false;
+    std::exception_ptr error_;      // ошибка фонового потока
+    JournalStats stats_;
+
+    std::mutex io_mutex_;           // файл пишет либо фоновый поток, либо Compact
+    std::thread writer_;
+
+    void Append(std::string_view sheet, char op, Position pos, std::string_view text);
+    void WriterLoop();
+    void ThrowIfFailed() const;
+};
+
+// Восстанавливает лист после сбоя: загружает снимок (если файл есть) и
+// применяет правки этого листа из журнала (если он есть) одной пачкой.
+// Оборванный хвост журнала отрезается. Повторное применение журнала к
+// снимку, уже содержащему его правки, ничего не меняет, поэтому сбой
+// посреди Compact не портит состояние. Возвращает число применённых записей.
+size_t RecoverSheet(Sheet& sheet, const std::string& snapshot_path, const std::string& journal_path);
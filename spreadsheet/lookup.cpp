@@ -0,0 +1,195 @@
+#include "lookup.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <iterator>
+#include <stdexcept>
+#include <utility>
+
+std::optional<LookupValue> ReadLookupValue(const CellInterface* cell) {
+    if (!cell) {
+        return std::nullopt;
+    }
+    if (auto number = cell->GetNumber()) {
+        return NormalizeLookupValue(*number);
+    }
+    auto value = cell->GetValue();
+    if (const double* number = std::get_if<double>(&value)) {
+        return NormalizeLookupValue(*number);
+    }
+    if (auto* text = std::get_if<std::string>(&value); text && !text->empty()) {
+        return NormalizeLookupValue(std::move(*text));
+    }
+    return std::nullopt;
+}
+
+std::optional<LookupValue> NormalizeLookupValue(LookupValue value) {
+    if (double* number = std::get_if<double>(&value)) {
+        if (std::isnan(*number)) {
+            return std::nullopt;
+        }
+        // -0 и 0 -- одно значение и для хеша
+        *number += 0.0;
+        return value;
+    }
+    for (char& c : std::get<std::string>(value)) {
+        if (c >= 'A' && c <= 'Z') {
+            c = static_cast<char>(c - 'A' + 'a');
+        }
+    }
+    return value;
+}
+
+std::optional<int> SheetInterface::Lookup(const LookupValue& key, Range range, LookupMode mode) const {
+    if (!range.IsValid() || (range.first.row != range.last.row && range.first.col != range.last.col)) {
+        throw std::invalid_argument("lookup range must be a single row or column");
+    }
+    auto normalized = NormalizeLookupValue(key);
+    if (!normalized) {
+        return std::nullopt;
+    }
+    const bool by_rows = range.first.col == range.last.col;
+    const int count = by_rows ? range.GetSize().rows : range.GetSize().cols;
+    std::optional<int> found;
+    std::optional<LookupValue> best;
+    for (int i = 0; i < count; ++i) {
+        Position pos = by_rows ? Position{range.first.row + i, range.first.col}
+                               : Position{range.first.row, range.first.col + i};
+        auto value = ReadLookupValue(GetCell(pos));
+        if (!value || value->index() != normalized->index()) {
+            continue;
+        }
+        bool better = false;
+        switch (mode) {
+        case LookupMode::Exact:
+            if (*value == *normalized) {
+                return i;
+            }
+            break;
+        case LookupMode::LessOrEqual:
+            better = *value <= *normalized && (!best || *best < *value);
+            break;
+        case LookupMode::GreaterOrEqual:
+            better = *normalized <= *value && (!best || *value < *best);
+            break;
+        }
+        if (better) {
+            best = std::move(value);
+            found = i;
+        }
+    }
+    return found;
+}
+
+LookupIndex::LookupIndex(int first_row, int last_row)
+    : first_row_(first_row), values_(last_row - first_row + 1)
+{
+    assert(first_row <= last_row);
+}
+
+bool LookupIndex::IsComplete() const {
+    return complete_;
+}
+
+void LookupIndex::Reset() {
+    std::fill(values_.begin(), values_.end(), std::nullopt);
+    dirty_rows_.clear();
+    exact_.reset();
+    sorted_.reset();
+    complete_ = false;
+}
+
+void LookupIndex::SetComplete() {
+    complete_ = true;
+}
+
+void LookupIndex::Set(int row, std::optional<LookupValue> value) {
+    auto& current = values_.at(row - first_row_);
+    if (current == value) {
+        return;
+    }
+    if (current) {
+        if (exact_) {
+            Erase(*exact_, *current, row);
+        }
+        if (sorted_) {
+            Erase(*sorted_, *current, row);
+        }
+    }
+    current = std::move(value);
+    if (current) {
+        if (exact_) {
+            Insert(*exact_, *current, row);
+        }
+        if (sorted_) {
+            Insert(*sorted_, *current, row);
+        }
+    }
+}
+
+void LookupIndex::MarkDirty(int row) {
+    if (!complete_) {
+        return;
+    }
+    if (dirty_rows_.size() >= values_.size()) {
+        Reset();
+        return;
+    }
+    dirty_rows_.push_back(row);
+}
+
+std::vector<int> LookupIndex::TakeDirtyRows() {
+    return std::exchange(dirty_rows_, {});
+}
+
+std::optional<int> LookupIndex::Find(const LookupValue& key, LookupMode mode) {
+    auto build = [this](auto& index) {
+        index.emplace();
+        for (size_t i = 0; i < values_.size(); ++i) {
+            if (values_[i]) {
+                (*index)[*values_[i]].push_back(first_row_ + static_cast<int>(i));
+            }
+        }
+    };
+    if (mode == LookupMode::Exact) {
+        if (!exact_) {
+            build(exact_);
+        }
+        auto it = exact_->find(key);
+        return it == exact_->end() ? std::nullopt : std::optional(it->second.front());
+    }
+    if (!sorted_) {
+        build(sorted_);
+    }
+    // число не сравнивается с текстом: граница ищется среди значений того же типа
+    if (mode == LookupMode::LessOrEqual) {
+        auto it = sorted_->upper_bound(key);
+        if (it == sorted_->begin() || std::prev(it)->first.index() != key.index()) {
+            return std::nullopt;
+        }
+        return std::prev(it)->second.front();
+    }
+    auto it = sorted_->lower_bound(key);
+    if (it == sorted_->end() || it->first.index() != key.index()) {
+        return std::nullopt;
+    }
+    return it->second.front();
+}
+
+template <typename Index>
+void LookupIndex::Insert(Index& index, const LookupValue& value, int row) {
+    auto& rows = index[value];
+    rows.insert(std::lower_bound(rows.begin(), rows.end(), row), row);
+}
+
+template <typename Index>
+void LookupIndex::Erase(Index& index, const LookupValue& value, int row) {
+    auto it = index.find(value);
+    assert(it != index.end());
+    auto& rows = it->second;
+    rows.erase(std::lower_bound(rows.begin(), rows.end(), row));
+    if (rows.empty()) {
+        index.erase(it);
+    }
+}
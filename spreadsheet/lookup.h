@@ -0,0 +1,57 @@
+#pragma once
+
+#include "common.h"
+
+#include <map>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+// Значение ячейки, с которым сравнивают функции поиска: число либо текст в
+// нижнем регистре (латинские буквы). Пустая ячейка, пустой текст и ошибка
+// значения не дают. Текст, который ячейка хранит как число ("42"), -- число.
+std::optional<LookupValue> ReadLookupValue(const CellInterface* cell);
+// Приводит искомое значение к виду ReadLookupValue; NaN не совпадает ни с чем
+std::optional<LookupValue> NormalizeLookupValue(LookupValue value);
+
+// Индекс поиска по отрезку строк [first_row, last_row] одного столбца.
+// Значения строк хранит сам индекс, а хеш-таблица (для точного поиска) и
+// упорядоченный словарь (для приближённого) строятся по ним при первом
+// поиске нужного вида и дальше поддерживаются при каждом Set. Лист
+// отмечает строки, значения которых могли измениться (MarkDirty), а перед
+// поиском перечитывает их (TakeDirtyRows), так что правка стоит O(1), а
+// поиск -- O(1) или O(log n) плюс число правок с прошлого поиска.
+class LookupIndex {
+public:
+    LookupIndex(int first_row, int last_row);
+
+    // false -- значения строк ещё не прочитаны или отметок набралось больше,
+    // чем строк в отрезке: тогда дешевле прочитать весь отрезок заново
+    bool IsComplete() const;
+    // забывает все значения; после чтения всех строк вызывающий ставит
+    // признак полноты через SetComplete
+    void Reset();
+    void SetComplete();
+
+    // значение строки row (nullopt -- в ячейке нет значения для поиска)
+    void Set(int row, std::optional<LookupValue> value);
+    void MarkDirty(int row);
+    std::vector<int> TakeDirtyRows();
+
+    // строка ячейки, выбранной по правилам SheetInterface::Lookup
+    std::optional<int> Find(const LookupValue& key, LookupMode mode);
+
+private:
+    int first_row_;
+    bool complete_ = false;
+    std::vector<std::optional<LookupValue>> values_;   // по строкам отрезка
+    std::vector<int> dirty_rows_;
+    // строки каждого значения по возрастанию; индексы пусты, пока не построены
+    std::optional<std::unordered_map<LookupValue, std::vector<int>>> exact_;
+    std::optional<std::map<LookupValue, std::vector<int>>> sorted_;
+
+    template <typename Index>
+    void Insert(Index& index, const LookupValue& value, int row);
+    template <typename Index>
+    void Erase(Index& index, const LookupValue& value, int row);
+};
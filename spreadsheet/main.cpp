@@ -1,6 +1,20 @@
 #include "common.h"
+#include "csv_import.h"
 #include "formula.h"
+#include "journal.h"
+#include "metrics.h"
+#include "profile.h"
+#include "sheet.h"
+#include "snapshot.h"
 #include "test_runner_p.h"
+#include "trace.h"
+#include "workbook.h"
+#include "workload.h"
+
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <random>
 using namespace std;
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
@@ -244,7 +258,7 @@ namespace {
     void TestEmptyCellTreatedAsZero() {
         auto sheet = CreateSheet();
         sheet->SetCell("A1"_pos, "=B2");
-        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0));
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
     }
 
     void TestFormulaInvalidPosition() {
@@ -344,6 +358,1812 @@ namespace {
         ASSERT(caught);
         ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
     }
+
+    void TestTextChangeInvalidatesDependents() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("B1"_pos, "=A1+1");
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+        sheet->SetCell("A1"_pos, "5");
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(6.0));
+
+        // формула, заменённая текстом, больше ни на что не ссылается
+        sheet->SetCell("C1"_pos, "=D1");
+        sheet->SetCell("C1"_pos, "text");
+        sheet->SetCell("D1"_pos, "=C1");
+        ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(),
+            CellInterface::Value(FormulaError::Category::Value));
+    }
+
+    void TestWorkbookCrossSheetReferences() {
+        Workbook book;
+        SheetInterface& main_sheet = book.AddSheet("Main");
+        SheetInterface& data = book.AddSheet("Data");
+        SheetInterface& spaced = book.AddSheet("My data");
+
+        data.SetCell("A1"_pos, "2");
+        main_sheet.SetCell("A1"_pos, "=Data!A1*3");
+        ASSERT_EQUAL(main_sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(6.0));
+        ASSERT_EQUAL(main_sheet.GetCell("A1"_pos)->GetText(), "=Data!A1*3");
+        ASSERT(main_sheet.GetCell("A1"_pos)->GetReferencedCells().empty());
+
+        data.SetCell("A1"_pos, "5");
+        ASSERT_EQUAL(main_sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(15.0));
+
+        spaced.SetCell("B2"_pos, "=Main!A1+ 'My data'!C3");
+        ASSERT_EQUAL(spaced.GetCell("B2"_pos)->GetText(), "=Main!A1+'My data'!C3");
+        ASSERT_EQUAL(spaced.GetCell("B2"_pos)->GetValue(), CellInterface::Value(15.0));
+        ASSERT(spaced.GetCell("C3"_pos) != nullptr);
+
+        data.SetCell("A1"_pos, "=1/0");
+        std::ostringstream values;
+        spaced.PrintValues(values);
+        ASSERT_EQUAL(values.str(), "\t\n\t" + ToString(FormulaError::Category::Div0) + "\n");
+
+        bool caught = false;
+        try {
+            main_sheet.SetCell("B1"_pos, "=Missing!A1");
+        }
+        catch (const FormulaException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        caught = false;
+        try {
+            book.AddSheet("Data");
+        }
+        catch (const std::invalid_argument&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT_EQUAL(book.GetSheetNames(), (std::vector<std::string>{ "Main", "Data", "My data" }));
+    }
+
+    void TestWorkbookCrossSheetCycle() {
+        Workbook book;
+        SheetInterface& first = book.AddSheet("First");
+        SheetInterface& second = book.AddSheet("Second");
+
+        first.SetCell("A1"_pos, "=Second!A1");
+        second.SetCell("A1"_pos, "=B1");
+
+        bool caught = false;
+        try {
+            second.SetCell("B1"_pos, "=First!A1");
+        }
+        catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT_EQUAL(second.GetCell("B1"_pos)->GetText(), "");
+    }
+
+    void TestWorkbookRecalculate() {
+        Workbook book;
+        Sheet& inputs = book.AddSheet("Inputs");
+        Sheet& left = book.AddSheet("Left");
+        Sheet& right = book.AddSheet("Right");
+        Sheet& total = book.AddSheet("Total");
+        Sheet& ping = book.AddSheet("Ping");
+        Sheet& pong = book.AddSheet("Pong");
+
+        for (int i = 0; i < 100; ++i) {
+            inputs.SetCell({ i, 0 }, std::to_string(i));
+            left.SetCell({ i, 0 }, "=Inputs!A" + std::to_string(i + 1) + "*2");
+            right.SetCell({ i, 0 }, "=Inputs!A" + std::to_string(i + 1) + "+1");
+            total.SetCell({ i, 0 }, "=Left!A" + std::to_string(i + 1) + "+Right!A" + std::to_string(i + 1));
+        }
+        // листы ссылаются друг на друга, но не образуют цикла из ячеек
+        ping.SetCell("A1"_pos, "=Pong!B1");
+        pong.SetCell("A1"_pos, "=Ping!B1");
+        ping.SetCell("B1"_pos, "1");
+        pong.SetCell("B1"_pos, "=Ping!B1+1");
+
+        book.Recalculate();
+        for (int i = 0; i < 100; ++i) {
+            ASSERT_EQUAL(total.GetCell({ i, 0 })->GetValue(), CellInterface::Value(3.0 * i + 1));
+        }
+        ASSERT_EQUAL(ping.GetCell("A1"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT_EQUAL(pong.GetCell("A1"_pos)->GetValue(), CellInterface::Value(1.0));
+
+        inputs.SetCell("A1"_pos, "10");
+        book.Recalculate();
+        ASSERT_EQUAL(total.GetCell("A1"_pos)->GetValue(), CellInterface::Value(31.0));
+    }
+
+    void TestCsvImport() {
+        const std::string csv =
+            "id,name,price,total\r\n"
+            "1,\"Widget, small\",2.5,=C2*A2\n"
+            "2,\"Say \"\"hi\"\"\",4,=C3*A3+D2\n"
+            "\n"
+            "3,\"multi\nline\",,=D3\n"
+            "'=not formula";
+        for (size_t chunk_size : { size_t(7), size_t(1 << 20) }) {
+            Sheet sheet;
+            std::istringstream input(csv);
+            CsvImportOptions options;
+            options.chunk_size = chunk_size;
+            options.threads = 3;
+            auto stats = ImportCsv(sheet, input, options);
+
+            ASSERT_EQUAL(stats.rows, 6u);
+            ASSERT_EQUAL(stats.cells, 16u);
+            ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 6, 4 }));
+            ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "Widget, small");
+            ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), "Say \"hi\"");
+            ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetText(), "multi\nline");
+            ASSERT_EQUAL(sheet.GetCell("D3"_pos)->GetValue(), CellInterface::Value(10.5));
+            ASSERT_EQUAL(sheet.GetCell("D5"_pos)->GetValue(), CellInterface::Value(10.5));
+            ASSERT(sheet.GetCell("C5"_pos) == nullptr);
+            ASSERT_EQUAL(sheet.GetCell("A6"_pos)->GetValue(), CellInterface::Value("=not formula"));
+
+            sheet.SetCell("C2"_pos, "0.5");
+            ASSERT_EQUAL(sheet.GetCell("D5"_pos)->GetValue(), CellInterface::Value(8.5));
+        }
+    }
+
+    void TestCsvImportTsvAndErrors() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "keep");
+
+        std::istringstream tsv("1\t=A2+1\n");
+        CsvImportOptions options;
+        options.delimiter = '\t';
+        options.origin = "A2"_pos;
+        ImportCsv(sheet, tsv, options);
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(2.0));
+
+        bool caught = false;
+        try {
+            std::istringstream bad("=A1+\n2");
+            ImportCsv(sheet, bad, options);
+        }
+        catch (const FormulaException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        caught = false;
+        try {
+            std::istringstream cycle("=B5\t=A5\n");
+            options.origin = "A5"_pos;
+            ImportCsv(sheet, cycle, options);
+        }
+        catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT(sheet.GetCell("A5"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 2, 2 }));
+    }
+
+    void TestScanFormulaReferences() {
+        // принятый сканером текст всегда разбирается
+        for (const std::string expression : { "1E5+E5", "(A1+.5)*-B12/3e-2", "Data!A1+'My data'!B2*C3+A1",
+                "_x1!ZZ10-1.5", "-(+A1)--((2))" }) {
+            auto references = ScanFormulaReferences(expression);
+            ASSERT(references.has_value());
+            auto formula = ParseFormula(expression);
+            ASSERT_EQUAL(references->cells, formula->GetReferencedCells());
+            ASSERT(references->external_cells == formula->GetExternalReferencedCells());
+        }
+        ASSERT_EQUAL(ScanFormulaReferences("1E5+E5")->cells, std::vector{ "E5"_pos });
+        for (const std::string expression : { "a1", "A1B", "ZZZZZ1+1", "1E", "1.", "'x'A1", "A1%",
+                "A1 A2", "1+", "(A1", "A1)", "()", "*A1", "A1(2)", "", "1e999" }) {
+            ASSERT(!ScanFormulaReferences(expression).has_value());
+        }
+    }
+
+    void TestLazyFormulaImport() {
+        Sheet sheet;
+        std::istringstream input("2,=A1*3,=B1+A1\n=C1/0,=A1 * 2,=C1\n");
+        CsvImportOptions options;
+        options.lazy_formulas = true;
+        ImportCsv(sheet, input, options);
+
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetReferencedCells(), (std::vector{ "A1"_pos, "B1"_pos }));
+        // до разбора текст формулы -- как в файле, после -- собранный из AST
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "=A1 * 2");
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(8.0));
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(4.0));
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "=A1*2");
+        sheet.SetCell("A1"_pos, "1");
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(4.0));
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A1*3");
+
+        // ошибка, которую сканер пропустил бы раньше, бросается при
+        // загрузке, как без ленивого разбора, и лист не меняется
+        bool caught = false;
+        try {
+            std::istringstream broken("1,=A5+1\n2,=1+\n3,=A7*2\n");
+            options.origin = "A5"_pos;
+            ImportCsv(sheet, broken, options);
+        }
+        catch (const FormulaException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT(sheet.GetCell("A5"_pos) == nullptr);
+
+        // журнал пишет текст ленивой формулы, не разбирая её
+        const auto dir = std::filesystem::temp_directory_path();
+        const std::string journal_path = (dir / "spreadsheet_lazy.journal").string();
+        const std::string snapshot_path = (dir / "spreadsheet_lazy.snapshot").string();
+        std::filesystem::remove(journal_path);
+        std::filesystem::remove(snapshot_path);
+        {
+            Sheet journaled;
+            Journal journal(journal_path, JournalOptions{ JournalSync::Full });
+            journaled.SetJournal(&journal);
+            std::istringstream rows("1,=A1 + 1\n2,=A2*2\n");
+            ImportCsv(journaled, rows, CsvImportOptions{ ',', {0, 0}, 0, 4 << 20, true });
+            ASSERT_EQUAL(journal.GetStats().records, 4u);
+            ASSERT_EQUAL(journaled.GetCell("B1"_pos)->GetText(), "=A1 + 1");
+            journaled.SetJournal(nullptr);
+        }
+        Sheet recovered;
+        ASSERT_EQUAL(RecoverSheet(recovered, snapshot_path, journal_path), 4u);
+        ASSERT_EQUAL(recovered.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT_EQUAL(recovered.GetCell("B2"_pos)->GetValue(), CellInterface::Value(4.0));
+        std::filesystem::remove(journal_path);
+
+        caught = false;
+        try {
+            std::istringstream cycle("=B3,=A3\n");
+            options.origin = "A3"_pos;
+            ImportCsv(sheet, cycle, options);
+        }
+        catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+    }
+
+    std::string PrintedTexts(const Sheet& sheet) {
+        std::ostringstream out;
+        sheet.PrintTexts(out);
+        return out.str();
+    }
+
+    std::string PrintedValues(const Sheet& sheet) {
+        std::ostringstream out;
+        sheet.PrintValues(out);
+        return out.str();
+    }
+
+    void TestSnapshotRoundTrip() {
+        const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_test.snapshot").string();
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "2");
+        sheet.SetCell("A2"_pos, "=A1*3");
+        sheet.SetCell("A3"_pos, "=A2/(B1-B1)");
+        sheet.SetCell("B2"_pos, "'=text");
+        sheet.SetCell("C1"_pos, "=-(A1+A2)/4");
+        sheet.SetCell("C3"_pos, "=B5+1");
+
+        for (bool with_values : { false, true }) {
+            SaveSnapshot(sheet, path, SnapshotOptions{ with_values });
+
+            Sheet loaded;
+            LoadSnapshot(loaded, path);
+            ASSERT_EQUAL(loaded.GetPrintableSize(), sheet.GetPrintableSize());
+            ASSERT(loaded.GetCell("B5"_pos) != nullptr);
+            ASSERT_EQUAL(loaded.GetCell("C1"_pos)->GetValue(), CellInterface::Value(-2.0));
+            ASSERT_EQUAL(PrintedTexts(loaded), PrintedTexts(sheet));
+            ASSERT_EQUAL(PrintedValues(loaded), PrintedValues(sheet));
+
+            // зависимые ячейки ещё не загружены, но их сохранённые значения
+            // должны устареть
+            Sheet edited;
+            LoadSnapshot(edited, path);
+            edited.SetCell("A1"_pos, "10");
+            ASSERT_EQUAL(edited.GetCell("A2"_pos)->GetValue(), CellInterface::Value(30.0));
+            ASSERT_EQUAL(edited.GetCell("C1"_pos)->GetValue(), CellInterface::Value(-10.0));
+            ASSERT_EQUAL(edited.GetCell("A2"_pos)->GetReferencedCells(), std::vector{ "A1"_pos });
+
+            bool caught = false;
+            try {
+                edited.SetCell("A1"_pos, "=C1");
+            }
+            catch (const CircularDependencyException&) {
+                caught = true;
+            }
+            ASSERT(caught);
+            ASSERT_EQUAL(edited.GetCell("A1"_pos)->GetText(), "10");
+
+            edited.ClearCell("C3"_pos);
+            ASSERT_EQUAL(edited.GetPrintableSize(), (Size{ 3, 3 }));
+            std::vector<PreparedCell> cells;
+            cells.push_back({ "A2"_pos, "=A1+1" });
+            edited.SetCells(std::move(cells));
+            ASSERT_EQUAL(edited.GetCell("C1"_pos)->GetValue(), CellInterface::Value(-5.25));
+        }
+        std::filesystem::remove(path);
+    }
+
+    void TestSnapshotWorkbookAndErrors() {
+        const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_test.snapshot").string();
+        {
+            Workbook book;
+            Sheet& data = book.AddSheet("Data");
+            Sheet& report = book.AddSheet("Report");
+            data.SetCell("A1"_pos, "5");
+            report.SetCell("A1"_pos, "=Data!A1*2");
+            SaveSnapshot(report, path);
+        }
+
+        Workbook book;
+        Sheet& data = book.AddSheet("Data");
+        Sheet& report = book.AddSheet("Report");
+        data.SetCell("A1"_pos, "7");
+        LoadSnapshot(report, path);
+        ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(14.0));
+        data.SetCell("A1"_pos, "1");
+        ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+        auto expect_error = [](auto action) {
+            bool caught = false;
+            try {
+                action();
+            }
+            catch (const SnapshotException&) {
+                caught = true;
+            }
+            ASSERT(caught);
+        };
+        // лист, на который ссылается снимок, отсутствует
+        expect_error([&] {
+            Sheet sheet;
+            LoadSnapshot(sheet, path);
+        });
+        // лист не пуст
+        expect_error([&] {
+            LoadSnapshot(data, path);
+        });
+        // другая версия формата
+        {
+            std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+            file.seekp(offsetof(SnapshotHeader, version));
+            file.put(char(SNAPSHOT_VERSION + 1));
+        }
+        expect_error([&] {
+            Workbook other;
+            other.AddSheet("Data");
+            LoadSnapshot(other.AddSheet("Report"), path);
+        });
+        // не снимок вовсе
+        {
+            std::ofstream file(path, std::ios::binary | std::ios::trunc);
+            file << "id,name\n";
+        }
+        expect_error([&] {
+            Sheet sheet;
+            LoadSnapshot(sheet, path);
+        });
+        std::filesystem::remove(path);
+    }
+
+    void TestJournalRecovery() {
+        const auto dir = std::filesystem::temp_directory_path();
+        const std::string journal_path = (dir / "spreadsheet_test.journal").string();
+        const std::string snapshot_path = (dir / "spreadsheet_test.snapshot").string();
+        std::filesystem::remove(journal_path);
+        std::filesystem::remove(snapshot_path);
+
+        {
+            Sheet sheet;
+            Journal journal(journal_path, JournalOptions{ JournalSync::Full });
+            sheet.SetJournal(&journal);
+            sheet.SetCell("A1"_pos, "1");
+            sheet.SetCell("A2"_pos, "=A1+1");
+            journal.Compact(sheet, snapshot_path);
+
+            sheet.SetCell("A1"_pos, "5");
+            std::vector<PreparedCell> cells;
+            cells.push_back({ "B1"_pos, "=A2*2" });
+            cells.push_back({ "B2"_pos, "x" });
+            sheet.SetCells(std::move(cells));
+            sheet.ClearCell("B2"_pos);
+            ASSERT_EQUAL(journal.GetStats().records, 6u);
+        }
+        // запись, оборванная при сбое
+        {
+            std::ofstream file(journal_path, std::ios::binary | std::ios::app);
+            const char torn[] = "\x20\0\0\0torn";
+            file.write(torn, 8);
+        }
+        const auto intact_size = std::filesystem::file_size(journal_path) - 8;
+
+        Sheet sheet;
+        ASSERT_EQUAL(RecoverSheet(sheet, snapshot_path, journal_path), 4u);
+        ASSERT_EQUAL(std::filesystem::file_size(journal_path), intact_size);
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(6.0));
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(12.0));
+        ASSERT(sheet.GetCell("B2"_pos) == nullptr);
+
+        // после восстановления журнал продолжается
+        {
+            Journal journal(journal_path, JournalOptions{ JournalSync::None });
+            sheet.SetJournal(&journal);
+            sheet.SetCell("A1"_pos, "0");
+            journal.LogSet("Other", "A1"_pos, "=1/0");
+            sheet.SetJournal(nullptr);
+        }
+        Sheet again;
+        ASSERT_EQUAL(RecoverSheet(again, snapshot_path, journal_path), 5u);
+        ASSERT_EQUAL(again.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+        // числа SetNumbers восстанавливаются числами, а не текстом, в том
+        // числе поверх формул из снимка
+        std::filesystem::remove(journal_path);
+        std::filesystem::remove(snapshot_path);
+        const std::vector<double> numbers = {42, 0.1 + 0.2, 1.0 / 3};
+        {
+            Sheet sheet;
+            Journal journal(journal_path, JournalOptions{ JournalSync::Full });
+            sheet.SetJournal(&journal);
+            sheet.SetCell("A2"_pos, "=B1");
+            sheet.SetCell("B1"_pos, "1");
+            journal.Compact(sheet, snapshot_path);
+            sheet.SetNumbers(0, 0, numbers);
+            sheet.SetCell("B1"_pos, "=A2*2");
+            const double single = -7.5;
+            sheet.SetNumbers(2, 5, Span<const double>(&single, 1));
+            sheet.SetJournal(nullptr);
+        }
+        Sheet numbered;
+        ASSERT_EQUAL(RecoverSheet(numbered, snapshot_path, journal_path), 5u);
+        for (int row = 0; row < 3; ++row) {
+            ASSERT(numbered.GetCell({row, 0})->GetValue() == CellInterface::Value(numbers[row]));
+        }
+        ASSERT(numbered.GetCell("A2"_pos)->GetReferencedCells().empty());
+        ASSERT_EQUAL(numbered.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2 * (0.1 + 0.2)));
+        ASSERT(numbered.GetCell("C6"_pos)->GetValue() == CellInterface::Value(-7.5));
+
+        std::filesystem::remove(journal_path);
+        std::filesystem::remove(snapshot_path);
+    }
+
+    void TestJournalReplayAfterInterruptedCompaction() {
+        const auto dir = std::filesystem::temp_directory_path();
+        const std::string journal_path = (dir / "spreadsheet_test.journal").string();
+        const std::string snapshot_path = (dir / "spreadsheet_test.snapshot").string();
+        std::filesystem::remove(journal_path);
+
+        {
+            Sheet sheet;
+            Journal journal(journal_path, JournalOptions{ JournalSync::Group });
+            sheet.SetJournal(&journal);
+            sheet.SetCell("A1"_pos, "=B1");
+            sheet.SetCell("A1"_pos, "1");
+            sheet.SetCell("B1"_pos, "=A1");
+            journal.Flush();
+            // снимок записан, а журнал очистить не успели
+            SaveSnapshot(sheet, snapshot_path);
+        }
+
+        // по одной правке журнал дал бы цикл A1 -> B1 -> A1
+        Sheet sheet;
+        ASSERT_EQUAL(RecoverSheet(sheet, snapshot_path, journal_path), 3u);
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(1.0));
+
+        std::filesystem::remove(journal_path);
+        std::filesystem::remove(snapshot_path);
+    }
+
+    void TestEngineStats() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1+1");
+        sheet.SetCell("A3"_pos, "=A2+1");
+        ResetEngineStats();
+
+        sheet.GetCell("A3"_pos)->GetValue();
+        sheet.GetCell("A3"_pos)->GetValue();
+        sheet.SetCell("A1"_pos, "2");
+        sheet.SetCell("B1"_pos, "=A3");
+
+        auto stats = sheet.GetStats();
+        ASSERT_EQUAL(stats.live_cells, 4u);
+        ASSERT_EQUAL(stats.live_edges, 3u);
+        std::ostringstream json;
+        stats.PrintJson(json);
+        ASSERT(json.str().find("\"live_edges\": 3") != std::string::npos);
+
+        const auto& engine = stats.engine;
+        if (!engine.enabled) {
+            ASSERT_EQUAL(engine.Get(MetricCounter::Evaluations), 0u);
+            return;
+        }
+        ASSERT_EQUAL(engine.Get(MetricCounter::CacheMisses), 2u);
+        ASSERT_EQUAL(engine.Get(MetricCounter::CacheHits), 1u);
+        ASSERT_EQUAL(engine.Get(MetricCounter::Evaluations), 2u);
+        ASSERT_EQUAL(engine.CacheHitRate(), 1.0 / 3);
+        // A1 сбросил кеш A2 и A3, у B1 зависимых нет
+        const auto& fan_out = engine.Get(MetricHistogram::InvalidationFanOut);
+        ASSERT_EQUAL(fan_out.count, 2u);
+        ASSERT_EQUAL(fan_out.sum, 2u);
+        ASSERT_EQUAL(fan_out.max, 2u);
+        // проверка B1 прошла B1, A3, A2, A1
+        ASSERT_EQUAL(engine.Get(MetricHistogram::CycleCheckNodes).max, 4u);
+        ASSERT_EQUAL(engine.Get(MetricHistogram::ParseNanoseconds).count, 1u);
+
+        ResetEngineStats();
+        ASSERT_EQUAL(GetEngineStats().Get(MetricCounter::CacheHits), 0u);
+    }
+
+    void TestTracing() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        StartTracing();
+        sheet.SetCell("A2"_pos, "=A1+1");
+        sheet.SetCell("A3"_pos, "=A2+1");
+        sheet.GetCell("A3"_pos)->GetValue();
+        StopTracing();
+        // после остановки события не пишутся
+        sheet.SetCell("A4"_pos, "=A3");
+
+        std::ostringstream out;
+        WriteTrace(out);
+        const std::string trace = out.str();
+        ASSERT(trace.find("\"traceEvents\"") != std::string::npos);
+        ASSERT(trace.find("A4") == std::string::npos);
+#ifdef SPREADSHEET_TRACING
+        for (const char* name : {"set_cell", "parse", "cycle_check", "invalidation"}) {
+            ASSERT(trace.find("\"name\": \""s + name + "\"") != std::string::npos);
+        }
+        // A3 вычисляется на глубине 0, вложенное вычисление A2 -- на глубине 1
+        ASSERT(trace.find("\"depth\": 0, \"cell\": \"A3\"") != std::string::npos);
+        ASSERT(trace.find("\"depth\": 1, \"cell\": \"A2\"") != std::string::npos);
+#else
+        ASSERT(trace.find("\"ph\"") == std::string::npos);
+#endif
+    }
+
+    void TestCellProfile() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        for (int row = 0; row < 50; ++row) {
+            sheet.SetCell({row, 1}, "=A1*2");
+        }
+        sheet.SetCell("C1"_pos, "=B1+B2+B3");
+
+        StartProfiling();
+        sheet.GetCell("C1"_pos)->GetValue();
+        sheet.SetCell("A1"_pos, "2");
+        StopProfiling();
+        sheet.GetCell("C1"_pos)->GetValue();
+
+        auto profile = sheet.GetProfile(ProfileOrder::Evaluations, 10);
+#ifdef SPREADSHEET_PROFILING
+        // C1, B1..B3 и правка A1
+        ASSERT_EQUAL(profile.size(), 5u);
+        ASSERT_EQUAL(profile.front().evaluations, 1u);
+
+        auto by_time = sheet.GetProfile(ProfileOrder::InclusiveTime, 1);
+        ASSERT_EQUAL(by_time.at(0).pos, "C1"_pos);
+        ASSERT(by_time[0].exclusive_ns <= by_time[0].inclusive_ns);
+        ASSERT_EQUAL(by_time[0].cone_size, 0u);
+
+        // правка A1 сбросила кеш всего столбца B и C1
+        auto by_invalidation = sheet.GetProfile(ProfileOrder::Invalidated, 1);
+        ASSERT_EQUAL(by_invalidation.at(0).pos, "A1"_pos);
+        ASSERT_EQUAL(by_invalidation[0].edits, 1u);
+        ASSERT_EQUAL(by_invalidation[0].invalidated, 51u);
+        ASSERT_EQUAL(by_invalidation[0].cone_size, 51u);
+
+        std::ostringstream out;
+        PrintProfile(out, by_invalidation);
+        ASSERT(out.str().find("A1") != std::string::npos);
+#else
+        ASSERT(profile.empty());
+#endif
+    }
+
+    void TestReadRefs() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "'=not a formula, long enough to skip small string optimization");
+        sheet.SetCell("B1"_pos, "2");
+        sheet.SetCell("C1"_pos, "=(B1+D1)*2");
+        std::vector<PreparedCell> cells;
+        cells.push_back({"C2"_pos, "=B1/0", ParseFormulaLazy("B1/0")});
+        sheet.SetCells(std::move(cells));
+
+        using ValueRef = CellInterface::ValueRef;
+        ASSERT(sheet.GetValueRef("A1"_pos) == ValueRef("=not a formula, long enough to skip small string optimization"));
+        ASSERT_EQUAL(sheet.GetTextRef("A1"_pos)[0], '\'');
+        ASSERT(sheet.GetValueRef("C1"_pos) == ValueRef(4.0));
+        ASSERT_EQUAL(sheet.GetTextRef("C1"_pos), "=(B1+D1)*2");
+        // пустая ячейка, на которую ссылается формула, и ячейка, которой нет
+        ASSERT(sheet.GetValueRef("D1"_pos) == ValueRef(std::string_view()));
+        ASSERT(sheet.GetTextRef("Z9"_pos).empty());
+
+        auto references = sheet.GetReferencedCellsRef("C1"_pos);
+        ASSERT_EQUAL(std::vector<Position>(references.begin(), references.end()),
+            (std::vector<Position>{"B1"_pos, "D1"_pos}));
+
+        // ссылки ленивой формулы переживают её разбор при вычислении
+        auto lazy_references = sheet.GetReferencedCellsRef("C2"_pos);
+        ASSERT(sheet.GetValueRef("C2"_pos) == ValueRef(FormulaError(FormulaError::Category::Div0)));
+        ASSERT_EQUAL(lazy_references.size(), 1u);
+        ASSERT_EQUAL(lazy_references[0], "B1"_pos);
+
+        // правка другой ячейки сбрасывает кеш, но не портит строку
+        auto text = sheet.GetTextRef("C1"_pos);
+        sheet.SetCell("B1"_pos, "3");
+        ASSERT_EQUAL(text, "=(B1+D1)*2");
+        ASSERT(sheet.GetValueRef("C1"_pos) == ValueRef(6.0));
+    }
+
+    void TestGetValues() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1*2");
+        sheet.SetCell("B1"_pos, "'text");
+        sheet.SetCell("B2"_pos, "=1/0");
+        sheet.SetCell("C1"_pos, "=B1*2");
+
+        // диапазон A1:C3 по строкам: A1 B1 C1 A2 B2 C2 A3 B3 C3
+        std::vector<double> numbers(9, -1);
+        std::vector<ValueTag> tags(9);
+        std::vector<uint32_t> offsets;
+        std::string bytes;
+        ValueBuffers buffers{numbers, tags, &offsets, &bytes};
+        sheet.GetValues({"A1"_pos, "C3"_pos}, buffers);
+        ASSERT_EQUAL(numbers, (std::vector<double>{0, 0, 0, 2, 0, 0, 0, 0, 0}));
+        // числа, введённые текстом, остаются текстом, как в GetValue
+        ASSERT(tags == (std::vector<ValueTag>{ValueTag::Text, ValueTag::Text, ValueTag::ValueError,
+            ValueTag::Number, ValueTag::Div0Error, ValueTag::Empty, ValueTag::Empty, ValueTag::Empty,
+            ValueTag::Empty}));
+        ASSERT_EQUAL(bytes, "1text");
+        ASSERT_EQUAL(offsets, (std::vector<uint32_t>{0, 1, 5, 5, 5, 5, 5, 5, 5, 5}));
+
+        // только числа; текст в буфер не попадает
+        std::vector<double> column(2);
+        std::vector<ValueTag> column_tags(2);
+        sheet.SetCell("A1"_pos, "5");
+        sheet.GetValues({"A2"_pos, "A3"_pos}, {column, column_tags});
+        ASSERT_EQUAL(column, (std::vector<double>{10, 0}));
+
+        try {
+            sheet.GetValues({"B1"_pos, "A1"_pos}, {column, column_tags});
+            ASSERT(false);
+        } catch (const InvalidPositionException&) {
+        }
+        try {
+            sheet.GetValues({"A1"_pos, "A3"_pos}, {column, column_tags});
+            ASSERT(false);
+        } catch (const std::invalid_argument&) {
+        }
+
+        // длинная цепочка без кеша вычисляется в порядке зависимостей
+        const int chain = 1000;
+        sheet.SetCell({0, 4}, "=0");
+        for (int row = 1; row < chain; ++row) {
+            sheet.SetCell({row, 4}, "=" + Position{row - 1, 4}.ToString() + "+1");
+        }
+        sheet.SetCell({0, 4}, "=1");
+        std::vector<double> chain_numbers(chain);
+        std::vector<ValueTag> chain_tags(chain);
+        sheet.GetValues({{chain - 1, 4}, {chain - 1, 4}}, {chain_numbers, chain_tags});
+        ASSERT_EQUAL(chain_numbers[0], chain);
+        sheet.GetValues({{0, 4}, {chain - 1, 4}}, {chain_numbers, chain_tags});
+        for (int row = 0; row < chain; ++row) {
+            ASSERT_EQUAL(chain_numbers[row], row + 1);
+        }
+    }
+
+    void TestSetNumbers() {
+        Sheet sheet;
+        sheet.SetCell("A2"_pos, "=B1");
+        sheet.SetCell("C1"_pos, "=A1+A2+A3");
+        sheet.SetCell("A4"_pos, "=A1*10");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 0.0);
+        ASSERT_EQUAL(sheet.GetStats().live_edges, 5u);
+
+        // формула A2 заменяется числом: её ссылка пропадает, C1 и A4 пересчитываются
+        std::vector<double> numbers = {1.5, 2, 0.1};
+        sheet.SetNumbers(0, 0, numbers);
+        ASSERT(sheet.GetCell("A1"_pos)->GetValue() == CellInterface::Value(1.5));
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "0.1");
+        ASSERT(sheet.GetCell("A2"_pos)->GetReferencedCells().empty());
+        ASSERT_EQUAL(sheet.GetStats().live_edges, 4u);
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 1.5 + 2 + 0.1);
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A4"_pos)->GetValue()), 15.0);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{4, 3}));
+
+        // повтор тех же чисел кеши не сбрасывает
+        sheet.SetNumbers(0, 0, numbers);
+        ASSERT(static_cast<const Cell*>(sheet.GetCell("C1"_pos))->IsCashedValue());
+        numbers[1] = -4;
+        sheet.SetNumbers(0, 0, numbers);
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 1.5 - 4 + 0.1);
+
+        // текст числовой ячейки читается обратно в то же число
+        sheet.SetCell("B2"_pos, "=A1");
+        sheet.SetCell("A1"_pos, sheet.GetCell("A1"_pos)->GetText());
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("B2"_pos)->GetValue()), 1.5);
+
+        const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_numbers.snapshot").string();
+        SaveSnapshot(sheet, path);
+        Sheet loaded;
+        LoadSnapshot(loaded, path);
+        ASSERT(loaded.GetCell("A3"_pos)->GetValue() == CellInterface::Value(0.1));
+        ASSERT_EQUAL(loaded.GetCell("A3"_pos)->GetText(), "0.1");
+        std::filesystem::remove(path);
+
+        try {
+            sheet.SetNumbers(0, Position::MAX_ROWS - 2, numbers);
+            ASSERT(false);
+        } catch (const InvalidPositionException&) {
+        }
+        ASSERT(sheet.GetCell({Position::MAX_ROWS - 2, 0}) == nullptr);
+    }
+
+    void TestCompactCellContent() {
+        Sheet sheet;
+        // числа в кратчайшей записи хранятся числом, остальное -- текстом;
+        // текст и значение ячейки при этом прежние
+        const std::vector<std::pair<std::string, std::optional<double>>> cases = {
+            {"42", 42.0},
+            {"-0.25", -0.25},
+            {"123456.75", 123456.75},
+            {"1e+300", 1e300},
+            {"1.50", std::nullopt},
+            {"+5", std::nullopt},
+            {" 7", std::nullopt},
+            {"0x10", std::nullopt},
+            {"exactly 15 char", std::nullopt},
+            {"sixteen chars ok", std::nullopt},
+            {"'12", std::nullopt},
+        };
+        for (const auto& [text, number] : cases) {
+            sheet.SetCell("A1"_pos, text);
+            const CellInterface* cell = sheet.GetCell("A1"_pos);
+            ASSERT_EQUAL(cell->GetText(), text);
+            ASSERT_EQUAL(sheet.GetTextRef("A1"_pos), text);
+            ASSERT_EQUAL(std::get<std::string>(cell->GetValue()), text[0] == '\'' ? text.substr(1) : text);
+            ASSERT(cell->GetNumber() == number);
+        }
+
+        // формула читает число из ячейки так же, как из текста
+        sheet.SetCell("B1"_pos, "=A2*2");
+        sheet.SetCell("A2"_pos, "21");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(42.0));
+        sheet.SetCell("A2"_pos, "2.50");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(5.0));
+
+        // число из SetNumbers с длинной записью и его замена на месте
+        std::vector<double> numbers = {0.1 + 0.2};
+        sheet.SetNumbers(2, 0, numbers);
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "0.30000000000000004");
+        numbers[0] = 0.5;
+        sheet.SetNumbers(2, 0, numbers);
+        ASSERT_EQUAL(sheet.GetTextRef("C1"_pos), "0.5");
+        ASSERT(sheet.GetCell("C1"_pos)->GetValue() == CellInterface::Value(0.5));
+
+        // введённое текстом число SetNumbers превращает в число
+        sheet.SetCell("C2"_pos, "7");
+        numbers[0] = 7;
+        sheet.SetNumbers(2, 1, numbers);
+        ASSERT(sheet.GetCell("C2"_pos)->GetValue() == CellInterface::Value(7.0));
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetText(), "7");
+    }
+
+    void TestStringPool() {
+        Sheet sheet;
+        const std::string pending = "pending approval by manager";
+        const std::string shipped = "shipped to the customer";
+        for (int row = 0; row < 100; ++row) {
+            sheet.SetCell({row, 0}, row % 3 ? pending : shipped);
+        }
+        // короткий текст лежит в ячейке и в пул не попадает
+        sheet.SetCell("B1"_pos, "open");
+        ASSERT_EQUAL(sheet.GetStats().pooled_strings, 2u);
+        ASSERT_EQUAL(sheet.GetStats().pooled_bytes, pending.size() + shipped.size());
+        ASSERT_EQUAL(sheet.GetTextRef("A2"_pos), pending);
+        ASSERT_EQUAL(std::get<std::string>(sheet.GetCell("A1"_pos)->GetValue()), shipped);
+
+        // ячейки с одинаковым текстом указывают на одну запись пула
+        ASSERT_EQUAL(sheet.GetTextRef("A2"_pos).data(), sheet.GetTextRef("A3"_pos).data());
+        auto content = [&sheet](Position pos) -> const CellContent& {
+            return static_cast<const Cell*>(sheet.GetCell(pos))->GetContent();
+        };
+        ASSERT(content("A2"_pos).IsSame(content("A3"_pos)));
+        ASSERT(!content("A1"_pos).IsSame(content("A2"_pos)));
+
+        // тот же текст не меняет ячейку: кеш зависимой формулы цел
+        sheet.SetCell("C1"_pos, "=A1");
+        ASSERT(std::holds_alternative<FormulaError>(sheet.GetCell("C1"_pos)->GetValue()));
+        sheet.SetCell("A1"_pos, shipped);
+        ASSERT(static_cast<const Cell*>(sheet.GetCell("C1"_pos))->IsCashedValue());
+        sheet.SetCell("A1"_pos, "'" + shipped);
+        ASSERT(!static_cast<const Cell*>(sheet.GetCell("C1"_pos))->IsCashedValue());
+        ASSERT_EQUAL(sheet.GetStats().pooled_strings, 3u);
+
+        // текст, на который больше никто не ссылается, уходит из пула
+        sheet.ClearCell("A1"_pos);
+        for (int row = 3; row < 100; row += 3) {
+            sheet.SetCell({row, 0}, "done");
+        }
+        ASSERT_EQUAL(sheet.GetStats().pooled_strings, 1u);
+        ASSERT_EQUAL(sheet.GetStats().pooled_bytes, pending.size());
+
+        // число из SetNumbers и то же число, введённое текстом, -- разное
+        // содержимое: у второго значение -- текст
+        std::vector<double> numbers = {7};
+        sheet.SetNumbers(3, 0, numbers);
+        sheet.SetCell("D1"_pos, "7");
+        ASSERT(sheet.GetCell("D1"_pos)->GetValue() == CellInterface::Value("7"s));
+    }
+
+    void TestReferencedEmptyCells() {
+        Sheet sheet;
+        const Sheet& const_sheet = sheet;
+        sheet.SetCell("A1"_pos, "=X100+Y200*2");
+        // пустые ячейки под ссылками хранятся только в графе зависимостей;
+        // GetCell отдаёт для них общий пустой объект
+        ASSERT_EQUAL(sheet.GetStats().live_cells, 1u);
+        ASSERT_EQUAL(const_sheet.GetCell("X100"_pos), const_sheet.GetCell("Y200"_pos));
+        ASSERT_EQUAL(const_sheet.GetCell("X100"_pos)->GetText(), "");
+        ASSERT(const_sheet.GetCell("X101"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 1}));
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+        // правка такой ячейки сбрасывает кеш зависимых
+        sheet.SetCell("Y200"_pos, "4");
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(8.0));
+        sheet.ClearCell("Y200"_pos);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+        ASSERT_EQUAL(sheet.GetStats().live_cells, 1u);
+
+        // цикл через неё находится, а неудачная правка не оставляет ячейки
+        bool caught = false;
+        try {
+            sheet.SetCell("X100"_pos, "=A1");
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT_EQUAL(sheet.GetStats().live_cells, 1u);
+
+        // изменяемый указатель ведёт на настоящую ячейку листа
+        sheet.GetCell("X100"_pos)->Set("5");
+        ASSERT_EQUAL(sheet.GetCell("X100"_pos)->GetText(), "5");
+        ASSERT_EQUAL(sheet.GetStats().live_cells, 2u);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(5.0));
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{100, 24}));
+    }
+
+    void TestLookupFunctions() {
+        Sheet sheet;
+        // A -- названия, B -- цены, C:D -- пороги по возрастанию и скидки
+        sheet.SetCell("A1"_pos, "apple");
+        sheet.SetCell("B1"_pos, "3");
+        sheet.SetCell("A2"_pos, "Banana");
+        sheet.SetCell("B2"_pos, "=B1*2");
+        sheet.SetCell("A3"_pos, "cherry");
+        sheet.SetCell("B3"_pos, "9");
+        sheet.SetCell("A4"_pos, "42");
+        sheet.SetCell("B4"_pos, "1");
+        sheet.SetCell("C1"_pos, "0");
+        sheet.SetCell("D1"_pos, "5");
+        sheet.SetCell("C2"_pos, "10");
+        sheet.SetCell("D2"_pos, "15");
+        sheet.SetCell("C3"_pos, "100");
+        sheet.SetCell("D3"_pos, "25");
+        auto evaluate = [&sheet](std::string formula) {
+            sheet.SetCell("F1"_pos, std::move(formula));
+            return sheet.GetCell("F1"_pos)->GetValue();
+        };
+        auto error = [](FormulaError::Category category) {
+            return CellInterface::Value(FormulaError(category));
+        };
+
+        // текст сравнивается без учёта регистра, "42" в ячейке -- число
+        ASSERT_EQUAL(evaluate("=VLOOKUP(\"banana\",A1:B4,2,0)"), CellInterface::Value(6.0));
+        ASSERT_EQUAL(evaluate("=VLOOKUP(42,A1:B4,2,0)"), CellInterface::Value(1.0));
+        ASSERT_EQUAL(evaluate("=VLOOKUP(\"kiwi\",A1:B4,2,0)"), error(FormulaError::Category::NA));
+        ASSERT_EQUAL(evaluate("=VLOOKUP(\"apple\",A1:B4,3,0)"), error(FormulaError::Category::Ref));
+        ASSERT_EQUAL(evaluate("=VLOOKUP(\"apple\",A1:B4,0,0)"), error(FormulaError::Category::Value));
+        // результат -- число: текст в столбце результата даёт #VALUE!
+        ASSERT_EQUAL(evaluate("=VLOOKUP(3,B1:B4,1,0)-VLOOKUP(\"cherry\",A1:B4,2,0)"), CellInterface::Value(-6.0));
+        ASSERT_EQUAL(evaluate("=XLOOKUP(3,B1:B4,A1:A4)"), error(FormulaError::Category::Value));
+
+        // приближённый поиск: наибольший порог, не превышающий ключ
+        ASSERT_EQUAL(evaluate("=VLOOKUP(50,C1:D3,2)"), CellInterface::Value(15.0));
+        ASSERT_EQUAL(evaluate("=VLOOKUP(100,C1:D3,2,1)"), CellInterface::Value(25.0));
+        ASSERT_EQUAL(evaluate("=VLOOKUP(-1,C1:D3,2)"), error(FormulaError::Category::NA));
+        ASSERT_EQUAL(evaluate("=MATCH(100,C1:C3,0)"), CellInterface::Value(3.0));
+        ASSERT_EQUAL(evaluate("=MATCH(11,C1:C3)"), CellInterface::Value(2.0));
+        ASSERT_EQUAL(evaluate("=MATCH(11,C1:C3,-1)"), CellInterface::Value(3.0));
+        ASSERT_EQUAL(evaluate("=MATCH(15,C2:D2,0)"), CellInterface::Value(2.0));
+        ASSERT_EQUAL(evaluate("=MATCH(1,A1:B2,0)"), error(FormulaError::Category::NA));
+        ASSERT_EQUAL(evaluate("=XLOOKUP(\"CHERRY\",A1:A4,B1:B4)"), CellInterface::Value(9.0));
+        ASSERT_EQUAL(evaluate("=XLOOKUP(\"kiwi\",A1:A4,B1:B4,-1)"), CellInterface::Value(-1.0));
+        ASSERT_EQUAL(evaluate("=XLOOKUP(50,C1:C3,D1:D3,0,1)"), CellInterface::Value(25.0));
+        ASSERT_EQUAL(evaluate("=XLOOKUP(50,C1:C3,D1:D3,0,-1)"), CellInterface::Value(15.0));
+        ASSERT_EQUAL(evaluate("=XLOOKUP(50,C1:C3,D1:D2)"), error(FormulaError::Category::Value));
+        // ключ из ячейки; пустая ячейка не ищется
+        ASSERT_EQUAL(evaluate("=XLOOKUP(A3,A1:A4,B1:B4)"), CellInterface::Value(9.0));
+        ASSERT_EQUAL(evaluate("=XLOOKUP(E9,A1:A4,B1:B4)"), error(FormulaError::Category::NA));
+
+        // запись формулы без пробелов; углы диапазона упорядочиваются
+        sheet.SetCell("F2"_pos, "=XLOOKUP( \"say \"\"hi\"\"\" , A1:A4 , B4:B1 , -1 )");
+        ASSERT_EQUAL(sheet.GetCell("F2"_pos)->GetText(), "=XLOOKUP(\"say \"\"hi\"\"\",A1:A4,B1:B4,-1)");
+        ASSERT_EQUAL(sheet.GetCell("F2"_pos)->GetValue(), CellInterface::Value(-1.0));
+        ASSERT_EQUAL(ParseFormula("-MATCH(1,A1:A3)*2")->GetExpression(), "-MATCH(1,A1:A3)*2");
+        for (const char* incorrect : {"A1:B2", "A1:B2+1", "FOO(1)", "MATCH(1)", "VLOOKUP(1,2,3)",
+                                      "MATCH(A1:A2,A1:A2)", "vlookup(1,A1:B2,2)"}) {
+            bool caught = false;
+            try {
+                ParseFormula(incorrect);
+            } catch (const FormulaException&) {
+                caught = true;
+            }
+            ASSERT(caught);
+        }
+
+        // правки диапазона меняют результат, в том числе правки влияющих
+        // ячеек формул внутри диапазона
+        sheet.SetCell("F3"_pos, "=VLOOKUP(\"banana\",A1:B4,2,0)");
+        ASSERT_EQUAL(sheet.GetCell("F3"_pos)->GetValue(), CellInterface::Value(6.0));
+        sheet.SetCell("B1"_pos, "5");
+        ASSERT_EQUAL(sheet.GetCell("F3"_pos)->GetValue(), CellInterface::Value(10.0));
+        sheet.SetCell("A2"_pos, "kiwi");
+        ASSERT_EQUAL(sheet.GetCell("F3"_pos)->GetValue(), error(FormulaError::Category::NA));
+        sheet.SetCell("A4"_pos, "BANANA");
+        ASSERT_EQUAL(sheet.GetCell("F3"_pos)->GetValue(), CellInterface::Value(1.0));
+        sheet.SetCell("A3"_pos, "banana");
+        ASSERT_EQUAL(sheet.GetCell("F3"_pos)->GetValue(), CellInterface::Value(9.0));
+        sheet.ClearCell("A3"_pos);
+        ASSERT_EQUAL(sheet.GetCell("F3"_pos)->GetValue(), CellInterface::Value(1.0));
+        sheet.SetCell("A3"_pos, "=B3*100");
+        sheet.SetCell("F4"_pos, "=MATCH(900,A1:A4,0)");
+        ASSERT_EQUAL(sheet.GetCell("F4"_pos)->GetValue(), CellInterface::Value(3.0));
+        sheet.SetCell("B3"_pos, "8");
+        ASSERT_EQUAL(sheet.GetCell("F4"_pos)->GetValue(), error(FormulaError::Category::NA));
+        std::vector<double> thresholds = {0, 20, 30};
+        sheet.SetNumbers(2, 0, thresholds);
+        sheet.SetCell("F5"_pos, "=VLOOKUP(25,C1:D3,2)");
+        ASSERT_EQUAL(sheet.GetCell("F5"_pos)->GetValue(), CellInterface::Value(15.0));
+        thresholds = {0, 26, 30};
+        sheet.SetNumbers(2, 0, thresholds);
+        ASSERT_EQUAL(sheet.GetCell("F5"_pos)->GetValue(), CellInterface::Value(5.0));
+
+        // формула зависит от всего диапазона, поэтому ссылка на себя -- цикл
+        bool caught = false;
+        try {
+            sheet.SetCell("B2"_pos, "=VLOOKUP(1,A1:B4,2,0)");
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "=B1*2");
+        ASSERT(sheet.GetCell("B100"_pos) == nullptr);
+        ASSERT(sheet.GetCell("A100"_pos) == nullptr);
+        sheet.SetCell("F6"_pos, "=MATCH(1,A1:A100,0)");
+        ASSERT(sheet.GetCell("A100"_pos) != nullptr);
+
+        // рёбра диапазонов переживают снимок
+        const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_test.snapshot").string();
+        SaveSnapshot(sheet, path);
+        Sheet loaded;
+        LoadSnapshot(loaded, path);
+        std::filesystem::remove(path);
+        ASSERT_EQUAL(PrintedValues(loaded), PrintedValues(sheet));
+        loaded.SetCell("A1"_pos, "banana");
+        ASSERT_EQUAL(loaded.GetCell("F3"_pos)->GetValue(), CellInterface::Value(5.0));
+
+        // поиск на другом листе книги
+        Workbook book;
+        Sheet& data = book.AddSheet("Data");
+        Sheet& report = book.AddSheet("Report");
+        data.SetCell("A1"_pos, "north");
+        data.SetCell("B1"_pos, "7");
+        report.SetCell("A1"_pos, "=VLOOKUP(\"north\",Data!A1:B10,2,0)");
+        book.Recalculate();
+        ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(7.0));
+        data.SetCell("A1"_pos, "south");
+        ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), error(FormulaError::Category::NA));
+        data.SetCell("A5"_pos, "North");
+        data.SetCell("B5"_pos, "8");
+        ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(8.0));
+
+        // индекс после случайных правок отвечает так же, как полный просмотр
+        std::mt19937 random(1);
+        Sheet column;
+        auto random_value = [&random]() -> std::string {
+            switch (random() % 4) {
+            case 0:
+                return "";
+            case 1:
+                return std::to_string(random() % 10);
+            case 2:
+                return std::string(1, "aBc"[random() % 3]);
+            default:
+                return "=B1+" + std::to_string(random() % 3);
+            }
+        };
+        const Range range{{0, 0}, {29, 0}};
+        for (int step = 0; step < 300; ++step) {
+            Position pos{static_cast<int>(random() % 32), 0};
+            if (random() % 8 == 0) {
+                column.SetCell("B1"_pos, std::to_string(random() % 10));
+            } else if (auto text = random_value(); text.empty()) {
+                column.ClearCell(pos);
+            } else {
+                column.SetCell(pos, text);
+            }
+            for (auto mode : {LookupMode::Exact, LookupMode::LessOrEqual, LookupMode::GreaterOrEqual}) {
+                LookupValue key = random() % 2 ? LookupValue(double(random() % 12)) : LookupValue("abc"s.substr(random() % 3, 1));
+                ASSERT(column.Lookup(key, range, mode) == column.SheetInterface::Lookup(key, range, mode));
+            }
+        }
+    }
+
+    void TestConditionalAggregates() {
+        Sheet sheet;
+        // A -- регионы, B -- продажи
+        const std::vector<std::pair<std::string, std::string>> rows = {
+            {"north", "10"}, {"South", "20"}, {"north", "=B1*3"}, {"east", "40"}, {"", "50"}, {"north", "n/a"},
+        };
+        for (int row = 0; row < static_cast<int>(rows.size()); ++row) {
+            if (!rows[row].first.empty()) {
+                sheet.SetCell({row, 0}, rows[row].first);
+            }
+            sheet.SetCell({row, 1}, rows[row].second);
+        }
+        auto evaluate = [&sheet](std::string formula) {
+            sheet.SetCell("F1"_pos, std::move(formula));
+            return sheet.GetCell("F1"_pos)->GetValue();
+        };
+        auto error = [](FormulaError::Category category) {
+            return CellInterface::Value(FormulaError(category));
+        };
+
+        ASSERT_EQUAL(evaluate("=SUMIF(A1:A6,\"NORTH\",B1:B6)"), CellInterface::Value(40.0));
+        ASSERT_EQUAL(evaluate("=COUNTIF(A1:A6,\"north\")"), CellInterface::Value(3.0));
+        ASSERT_EQUAL(evaluate("=AVERAGEIF(A1:A6,\"north\",B1:B6)"), CellInterface::Value(20.0));
+        ASSERT_EQUAL(evaluate("=AVERAGEIF(A1:A6,\"west\",B1:B6)"), error(FormulaError::Category::Div0));
+        // пустая ячейка не подходит ни под какое условие
+        ASSERT_EQUAL(evaluate("=COUNTIF(A1:A6,\"<>north\")"), CellInterface::Value(2.0));
+        ASSERT_EQUAL(evaluate("=COUNTIF(A1:A6,\">m\")"), CellInterface::Value(4.0));
+        ASSERT_EQUAL(evaluate("=SUMIF(B1:B6,\">=20\")"), CellInterface::Value(140.0));
+        ASSERT_EQUAL(evaluate("=COUNTIF(B1:B6,\"<25\")"), CellInterface::Value(2.0));
+        ASSERT_EQUAL(evaluate("=SUMIF(B1:B6,30)+SUMIF(B1:B6,\"=40\")"), CellInterface::Value(70.0));
+        sheet.SetCell("D1"_pos, "north");
+        ASSERT_EQUAL(evaluate("=SUMIF(A1:A6,D1,B1:B6)"), CellInterface::Value(40.0));
+        // диапазон в строке считается просмотром
+        ASSERT_EQUAL(evaluate("=COUNTIF(A1:D1,\"north\")"), CellInterface::Value(2.0));
+        ASSERT_EQUAL(evaluate("=SUMIF(A1:A6,\"north\",B1:B5)"), error(FormulaError::Category::Value));
+        ASSERT_EQUAL(evaluate("=SUMIF(A1:B6,\"north\")"), error(FormulaError::Category::Value));
+
+        sheet.SetCell("F2"_pos, "=SUMIF( A1:A6 , \">=10\" , B6:B1 )");
+        ASSERT_EQUAL(sheet.GetCell("F2"_pos)->GetText(), "=SUMIF(A1:A6,\">=10\",B1:B6)");
+        for (const char* incorrect : {"SUMIF(1,2)", "COUNTIF(A1:A6)", "COUNTIF(A1:A6,A1:A6)", "SUMIF(A1:A6,1,2)"}) {
+            bool caught = false;
+            try {
+                ParseFormula(incorrect);
+            } catch (const FormulaException&) {
+                caught = true;
+            }
+            ASSERT(caught);
+        }
+
+        // правки условий и сумм, в том числе через формулы
+        sheet.SetCell("F3"_pos, "=SUMIF(A1:A6,\"north\",B1:B6)");
+        sheet.SetCell("F4"_pos, "=COUNTIF(A1:A6,\"<>south\")");
+        ASSERT_EQUAL(sheet.GetCell("F3"_pos)->GetValue(), CellInterface::Value(40.0));
+        sheet.SetCell("A2"_pos, "North");
+        ASSERT_EQUAL(sheet.GetCell("F3"_pos)->GetValue(), CellInterface::Value(60.0));
+        ASSERT_EQUAL(sheet.GetCell("F4"_pos)->GetValue(), CellInterface::Value(5.0));
+        sheet.SetCell("B1"_pos, "15");
+        ASSERT_EQUAL(sheet.GetCell("F3"_pos)->GetValue(), CellInterface::Value(80.0));
+        sheet.ClearCell("A2"_pos);
+        ASSERT_EQUAL(sheet.GetCell("F3"_pos)->GetValue(), CellInterface::Value(60.0));
+        sheet.SetCell("A5"_pos, "north");
+        ASSERT_EQUAL(sheet.GetCell("F3"_pos)->GetValue(), CellInterface::Value(110.0));
+        // ошибка суммирования видна только условиям, под которые подходит её строка
+        sheet.SetCell("B4"_pos, "=1/0");
+        ASSERT_EQUAL(sheet.GetCell("F3"_pos)->GetValue(), CellInterface::Value(110.0));
+        ASSERT_EQUAL(evaluate("=SUMIF(A1:A6,\"east\",B1:B6)"), error(FormulaError::Category::Div0));
+        ASSERT_EQUAL(evaluate("=COUNTIF(A1:A6,\"east\")"), CellInterface::Value(1.0));
+
+        bool caught = false;
+        try {
+            sheet.SetCell("B2"_pos, "=SUMIF(A1:A6,\"north\",B1:B6)");
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        // индекс после случайных правок отвечает так же, как полный просмотр
+        std::mt19937 random(2);
+        Sheet column;
+        auto random_key = [&random]() -> std::string {
+            switch (random() % 4) {
+            case 0:
+                return "";
+            case 1:
+                return std::to_string(random() % 5);
+            case 2:
+                return std::string(1, "aBc"[random() % 3]);
+            default:
+                return "=D1+" + std::to_string(random() % 3);
+            }
+        };
+        auto random_sum = [&random]() -> std::string {
+            switch (random() % 4) {
+            case 0:
+                return "";
+            case 1:
+                return "x";
+            case 2:
+                return random() % 4 ? "=D1*2" : "=1/0";
+            default:
+                return std::to_string(random() % 100);
+            }
+        };
+        auto set = [&column](Position pos, const std::string& text) {
+            if (text.empty()) {
+                column.ClearCell(pos);
+            } else {
+                column.SetCell(pos, text);
+            }
+        };
+        const Range criteria_range{{0, 0}, {19, 0}};
+        const Range sum_range{{2, 1}, {21, 1}};
+        const CriterionOp ops[] = {CriterionOp::Equal, CriterionOp::NotEqual, CriterionOp::Less,
+                                   CriterionOp::LessOrEqual, CriterionOp::Greater, CriterionOp::GreaterOrEqual};
+        auto aggregate = [&column](bool indexed, Range range, const Criterion& criterion,
+                                   std::optional<Range> sum) -> std::variant<ConditionalAggregate, FormulaError> {
+            try {
+                return indexed ? column.Aggregate(range, criterion, sum)
+                               : column.SheetInterface::Aggregate(range, criterion, sum);
+            } catch (const FormulaError& error) {
+                return error;
+            }
+        };
+        for (int step = 0; step < 300; ++step) {
+            const int row = static_cast<int>(random() % 24);
+            switch (random() % 8) {
+            case 0:
+                column.SetCell("D1"_pos, std::to_string(random() % 5));
+                break;
+            case 1:
+            case 2:
+            case 3:
+                set({row, 0}, random_key());
+                break;
+            default:
+                set({row, 1}, random_sum());
+            }
+            for (int check = 0; check < 3; ++check) {
+                LookupValue value = random() % 2 ? LookupValue(double(random() % 6)) : LookupValue("abc"s.substr(random() % 3, 1));
+                Criterion criterion{ops[random() % 6], value};
+                for (auto sum : {std::optional<Range>(), std::optional<Range>(sum_range)}) {
+                    auto indexed = aggregate(true, criteria_range, criterion, sum);
+                    auto scanned = aggregate(false, criteria_range, criterion, sum);
+                    ASSERT_EQUAL(indexed.index(), scanned.index());
+                    if (const auto* result = std::get_if<ConditionalAggregate>(&indexed)) {
+                        const auto& expected = std::get<ConditionalAggregate>(scanned);
+                        ASSERT_EQUAL(result->matches, expected.matches);
+                        ASSERT_EQUAL(result->sum, expected.sum);
+                        ASSERT_EQUAL(result->numbers, expected.numbers);
+                    } else {
+                        ASSERT(std::get<FormulaError>(indexed) == std::get<FormulaError>(scanned));
+                    }
+                }
+            }
+        }
+    }
+
+    void TestSharedSubexpressions() {
+        Sheet sheet;
+        sheet.SetCell("B1"_pos, "2");
+        sheet.SetCell("C1"_pos, "6");
+        sheet.SetCell("D1"_pos, "3");
+        // (B1*C1/D1) в 30 формулах, записанный по-разному
+        for (int row = 0; row < 30; ++row) {
+            std::string common = row % 2 ? "(B1*C1)/D1" : "B1 * C1 / D1";
+            sheet.SetCell({row, 0}, "=" + common + "+" + std::to_string(row));
+        }
+        // B1*C1 и B1*C1/D1 -- по одной записи на 30 вхождений, у каждой
+        // формулы -- своя запись корня
+        auto stats = sheet.GetStats();
+        ASSERT_EQUAL(stats.shared_subexpressions, 32u);
+        ASSERT_EQUAL(stats.subexpression_uses, 90u);
+        ASSERT_EQUAL(stats.SubexpressionDedupRatio(), 90.0 / 32);
+        std::ostringstream json;
+        stats.PrintJson(json);
+        ASSERT(json.str().find("\"shared_subexpressions\": 32") != std::string::npos);
+        // запись формулы не зависит от разделения
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "=B1*C1/D1+1");
+
+        ResetEngineStats();
+        for (int row = 0; row < 30; ++row) {
+            ASSERT_EQUAL(sheet.GetCell({row, 0})->GetValue(), CellInterface::Value(4.0 + row));
+        }
+        auto engine = GetEngineStats();
+        if (engine.enabled) {
+            // первая формула считает три узла, остальные -- только корень
+            ASSERT_EQUAL(engine.Get(MetricCounter::SubexpressionMisses), 32u);
+            ASSERT_EQUAL(engine.Get(MetricCounter::SubexpressionHits), 29u);
+        }
+        // правка входа сбрасывает общее значение через граф
+        sheet.SetCell("C1"_pos, "9");
+        for (int row = 0; row < 30; ++row) {
+            ASSERT_EQUAL(sheet.GetCell({row, 0})->GetValue(), CellInterface::Value(6.0 + row));
+        }
+        // изменение другой части формулы тоже даёт верные значения
+        sheet.SetCell("A3"_pos, "=B1*C1/D1+D1");
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(9.0));
+        ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetValue(), CellInterface::Value(9.0));
+
+        // одинаковые формулы целиком и ошибки в общих подвыражениях
+        for (int row = 0; row < 5; ++row) {
+            sheet.SetCell({row, 4}, "=B1/(D1-3)");
+            sheet.SetCell({row, 5}, "=B1/(D1-3)*" + std::to_string(row));
+        }
+        ASSERT_EQUAL(sheet.GetCell("E5"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Div0)));
+        ASSERT_EQUAL(sheet.GetCell("F5"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Div0)));
+        sheet.SetCell("D1"_pos, "4");
+        ASSERT_EQUAL(sheet.GetCell("E5"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT_EQUAL(sheet.GetCell("F5"_pos)->GetValue(), CellInterface::Value(8.0));
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(4.5));
+
+        // формулы пачки и снимка делятся подвыражениями так же
+        std::vector<PreparedCell> cells;
+        for (int row = 0; row < 10; ++row) {
+            cells.push_back({{row, 7}, "=B1*C1+D1", ParseFormulaLazy("B1*C1+D1")});
+        }
+        sheet.SetCells(std::move(cells));
+        sheet.Recalculate();
+        ASSERT_EQUAL(sheet.GetCell("H10"_pos)->GetValue(), CellInterface::Value(22.0));
+        const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_test.snapshot").string();
+        SaveSnapshot(sheet, path);
+        Sheet loaded;
+        LoadSnapshot(loaded, path);
+        std::filesystem::remove(path);
+        ASSERT_EQUAL(PrintedTexts(loaded), PrintedTexts(sheet));
+        loaded.SetCell("C1"_pos, "1");
+        ASSERT_EQUAL(loaded.GetCell("H10"_pos)->GetValue(), CellInterface::Value(6.0));
+        ASSERT_EQUAL(loaded.GetCell("A30"_pos)->GetValue(), CellInterface::Value(29.5));
+
+        // записи удаляются вместе с последней формулой, которая их использует
+        for (int row = 0; row < 30; ++row) {
+            for (int col : {0, 4, 5, 7}) {
+                sheet.ClearCell({row, col});
+            }
+        }
+        ASSERT_EQUAL(sheet.GetStats().shared_subexpressions, 0u);
+        ASSERT_EQUAL(sheet.GetStats().subexpression_uses, 0u);
+    }
+
+    void TestFormulaSimplification() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "90");
+        sheet.SetCell("C1"_pos, "abc");
+        auto evaluate = [&sheet](std::string formula) {
+            sheet.SetCell("B1"_pos, std::move(formula));
+            return sheet.GetCell("B1"_pos)->GetValue();
+        };
+        auto error = [](FormulaError::Category category) {
+            return CellInterface::Value(FormulaError(category));
+        };
+
+        // константы вычисляются при разборе, запись формулы не меняется
+        ASSERT_EQUAL(evaluate("=2*3.14159*A1/360"), CellInterface::Value(2 * 3.14159 * 90 / 360));
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=2*3.14159*A1/360");
+        ASSERT_EQUAL(evaluate("=A1-(10-4)/3"), CellInterface::Value(88.0));
+
+        // ошибка константы остаётся ошибкой и не опережает левый операнд
+        ASSERT_EQUAL(evaluate("=1/0"), error(FormulaError::Category::Div0));
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=1/0");
+        ASSERT_EQUAL(evaluate("=A1+1/(2-2)"), error(FormulaError::Category::Div0));
+        ASSERT_EQUAL(evaluate("=C1+1/(2-2)"), error(FormulaError::Category::Value));
+        ASSERT_EQUAL(evaluate("=1e308*10+C1"), error(FormulaError::Category::Div0));
+        ASSERT_EQUAL(evaluate("=\"x\"*2+A1"), error(FormulaError::Category::Value));
+        ASSERT_EQUAL(evaluate("=\"4\"/2+A1"), CellInterface::Value(92.0));
+
+        // тождества
+        ASSERT_EQUAL(evaluate("=--A1"), CellInterface::Value(90.0));
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=--A1");
+        ASSERT_EQUAL(evaluate("=+A1"), CellInterface::Value(90.0));
+        ASSERT_EQUAL(evaluate("=(A1*A1)*1"), CellInterface::Value(8100.0));
+        ASSERT_EQUAL(evaluate("=1*(A1-1)"), CellInterface::Value(89.0));
+        ASSERT_EQUAL(evaluate("=(A1/2)/(3-2)"), CellInterface::Value(45.0));
+        ASSERT_EQUAL(evaluate("=(A1+1)-0"), CellInterface::Value(91.0));
+        ASSERT_EQUAL(evaluate("=--C1"), error(FormulaError::Category::Value));
+        ASSERT_EQUAL(evaluate("=(C1*2)*1"), error(FormulaError::Category::Value));
+        // A1+0 превращает -0 в 0, а --A1 сохраняет знак нуля
+        sheet.SetCell("D1"_pos, "=-E1");
+        ASSERT(!std::signbit(std::get<double>(evaluate("=D1+0"))));
+        ASSERT(std::signbit(std::get<double>(evaluate("=--D1"))));
+        // у x*1 над ячейкой остаётся проверка на бесконечность
+        sheet.SetCell("C2"_pos, "inf");
+        ASSERT_EQUAL(evaluate("=C2*1"), error(FormulaError::Category::Div0));
+
+        // ключ поиска: +F1 -- число, а не текст ячейки
+        sheet.SetCell("F1"_pos, "x");
+        sheet.SetCell("F2"_pos, "90");
+        ASSERT_EQUAL(evaluate("=MATCH(F1,F1:F2,0)"), CellInterface::Value(1.0));
+        ASSERT_EQUAL(evaluate("=MATCH(+F1,F1:F2,0)"), error(FormulaError::Category::Value));
+        ASSERT_EQUAL(evaluate("=MATCH(--F1,F1:F2,0)"), error(FormulaError::Category::Value));
+        ASSERT_EQUAL(evaluate("=MATCH((A1+0)*1,F1:F2,(1-1))"), CellInterface::Value(2.0));
+
+        // код формулы хранит её как записано
+        auto formula = ParseFormula("2*3-A1/1+--(4*1)");
+        std::string code;
+        formula->Serialize(code);
+        ASSERT_EQUAL(LoadFormula(code)->GetExpression(), formula->GetExpression());
+        ASSERT_EQUAL(formula->GetExpression(), "2*3-A1/1+--4*1");
+        ASSERT_EQUAL(std::get<double>(formula->Evaluate(sheet)), -80.0);
+    }
+
+    void TestManualCalculation() {
+        Sheet sheet;
+        auto value = [&sheet](Position pos) {
+            return sheet.GetCell(pos)->GetValue();
+        };
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1*2");
+        sheet.SetCell("C1"_pos, "=B1+1");
+        ASSERT_EQUAL(value("C1"_pos), CellInterface::Value(3.0));
+        ASSERT(sheet.GetCalculationMode() == CalculationMode::Automatic);
+
+        // правка только отмечает ячейку: зависимые отдают прежние значения
+        sheet.SetCalculationMode(CalculationMode::Manual);
+        ResetEngineStats();
+        sheet.SetCell("A1"_pos, "5");
+        ASSERT_EQUAL(value("B1"_pos), CellInterface::Value(2.0));
+        ASSERT_EQUAL(value("C1"_pos), CellInterface::Value(3.0));
+        auto engine = GetEngineStats();
+        if (engine.enabled) {
+            ASSERT_EQUAL(engine.Get(MetricCounter::Evaluations), 0u);
+        }
+        ASSERT(sheet.IsStale("B1"_pos));
+        ASSERT(sheet.IsStale("C1"_pos));
+        ASSERT(!sheet.IsStale("A1"_pos));
+        ASSERT(!sheet.IsStale("Z9"_pos));
+        // новая формула считается сразу, но из устаревших значений
+        sheet.SetCell("D1"_pos, "=A1+B1");
+        ASSERT_EQUAL(value("D1"_pos), CellInterface::Value(7.0));
+        ASSERT(sheet.IsStale("D1"_pos));
+        // циклы по-прежнему отвергаются сразу
+        bool caught = false;
+        try {
+            sheet.SetCell("A1"_pos, "=C1");
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        sheet.Recalculate();
+        ASSERT_EQUAL(value("B1"_pos), CellInterface::Value(10.0));
+        ASSERT_EQUAL(value("C1"_pos), CellInterface::Value(11.0));
+        ASSERT_EQUAL(value("D1"_pos), CellInterface::Value(15.0));
+        ASSERT(!sheet.IsStale("C1"_pos));
+
+        // зависимость через диапазон, в том числе от ячейки без рёбер
+        sheet.SetCell("E1"_pos, "1");
+        sheet.SetCell("E2"_pos, "2");
+        sheet.SetCell("F1"_pos, "=SUMIF(E1:E3,\">0\")");
+        sheet.SetCell("G1"_pos, "=F1*10");
+        ASSERT_EQUAL(value("G1"_pos), CellInterface::Value(30.0));
+        sheet.SetCell("E3"_pos, "4");
+        sheet.SetCell("E3"_pos, "5");
+        ASSERT_EQUAL(value("G1"_pos), CellInterface::Value(30.0));
+        ASSERT(sheet.IsStale("F1"_pos));
+        ASSERT(sheet.IsStale("G1"_pos));
+        ASSERT(!sheet.IsStale("C1"_pos));
+        sheet.ClearCell("A1"_pos);
+        ASSERT(sheet.IsStale("C1"_pos));
+
+        // возврат в автоматический режим применяет накопленные правки
+        sheet.SetCalculationMode(CalculationMode::Automatic);
+        ASSERT(!sheet.IsStale("G1"_pos));
+        ASSERT_EQUAL(value("G1"_pos), CellInterface::Value(80.0));
+        ASSERT_EQUAL(value("C1"_pos), CellInterface::Value(1.0));
+
+        // у листов книги режим общий, пересчёт книги применяет правки всех листов
+        Workbook book;
+        Sheet& data = book.AddSheet("Data");
+        Sheet& report = book.AddSheet("Report");
+        data.SetCell("A1"_pos, "2");
+        report.SetCell("A1"_pos, "=Data!A1*3");
+        ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(6.0));
+        data.SetCalculationMode(CalculationMode::Manual);
+        ASSERT(report.GetCalculationMode() == CalculationMode::Manual);
+        data.SetCell("A1"_pos, "4");
+        ASSERT(report.IsStale("A1"_pos));
+        ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(6.0));
+        book.Recalculate();
+        ASSERT(!report.IsStale("A1"_pos));
+        ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(12.0));
+
+        // новая формула не берёт общее подвыражение, посчитанное до
+        // отложенной правки: ни заданная после правки, ни заданная до неё,
+        // но ещё не вычислявшаяся, ни ленивая
+        Sheet shared;
+        shared.SetCell("A1"_pos, "1");
+        shared.SetCell("B1"_pos, "=A1*2");
+        shared.SetCell("B2"_pos, "=A1*2");
+        ASSERT_EQUAL(shared.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+        shared.SetCalculationMode(CalculationMode::Manual);
+        shared.SetCell("A1"_pos, "5");
+        shared.SetCell("C1"_pos, "=A1*2");
+        std::vector<PreparedCell> lazy;
+        lazy.push_back({"C2"_pos, "=A1*2", ParseFormulaLazy("A1*2")});
+        shared.SetCells(std::move(lazy));
+        ASSERT_EQUAL(shared.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT_EQUAL(shared.GetCell("C2"_pos)->GetValue(), CellInterface::Value(10.0));
+        shared.SetCell("A1"_pos, "6");
+        ASSERT_EQUAL(shared.GetCell("B2"_pos)->GetValue(), CellInterface::Value(12.0));
+        shared.SetCell("A1"_pos, "7");
+        ASSERT_EQUAL(shared.GetCell("C1"_pos)->GetValue(), CellInterface::Value(14.0));
+        shared.Recalculate();
+        ASSERT_EQUAL(shared.GetCell("B1"_pos)->GetValue(), CellInterface::Value(14.0));
+    }
+
+    void TestRecalculateAsync() {
+        // описатель без пересчёта считается завершённым
+        RecalculationHandle none;
+        ASSERT(none.IsFinished());
+        ASSERT(none.Wait());
+
+        const int rows = 200;
+        Sheet sheet;
+        std::vector<PreparedCell> cells;
+        cells.push_back({"A1"_pos, "1"});
+        for (int row = 0; row < rows; ++row) {
+            cells.push_back({{row, 1}, "=A1*" + std::to_string(row + 1)});
+            cells.push_back({{row, 2}, "=" + Position{row, 1}.ToString() + "+1"});
+        }
+        sheet.SetCells(std::move(cells));
+        auto expect_values = [&sheet](double a1) {
+            for (int row = 0; row < rows; ++row) {
+                ASSERT_EQUAL(sheet.GetCell({row, 2})->GetValue(), CellInterface::Value(a1 * (row + 1) + 1));
+            }
+        };
+
+        sheet.SetCalculationMode(CalculationMode::Manual);
+        sheet.SetCell("A1"_pos, "2");
+        auto handle = sheet.RecalculateAsync({Range{"C100"_pos, "C110"_pos}});
+        ASSERT(handle.Wait());
+        ASSERT(handle.IsFinished());
+        ASSERT(!handle.IsCancelled());
+        ASSERT_EQUAL(handle.GetProgress().total, static_cast<size_t>(2 * rows));
+        ASSERT_EQUAL(handle.GetProgress().done, handle.GetProgress().total);
+        ASSERT(!sheet.IsStale("C200"_pos));
+        expect_values(2);
+        // после пересчёта просьба о приоритете ничего не делает
+        handle.Prioritize(Range{"C1"_pos, "C2"_pos});
+
+        // чтение во время пересчёта вычисляет ячейку вне очереди, правка
+        // останавливает поток; в любом случае значения согласованы
+        sheet.SetCell("A1"_pos, "3");
+        handle = sheet.RecalculateAsync();
+        handle.Prioritize(Range{"C1"_pos, "C10"_pos});
+        ASSERT_EQUAL(sheet.GetCell("C50"_pos)->GetValue(), CellInterface::Value(151.0));
+        sheet.SetCell("A1"_pos, "4");
+        ASSERT(handle.IsFinished());
+        ASSERT(handle.Wait() || handle.GetProgress().done < handle.GetProgress().total);
+        ASSERT(sheet.IsStale("C1"_pos));
+        sheet.Recalculate();
+        expect_values(4);
+
+        // в автоматическом режиме пересчёт досчитывает сброшенные правкой кеши
+        sheet.SetCalculationMode(CalculationMode::Automatic);
+        sheet.SetCell("A1"_pos, "5");
+        handle = sheet.RecalculateAsync();
+        handle.Cancel();
+        handle.Wait();
+        ASSERT(handle.IsFinished());
+        expect_values(5);
+
+        // поток считает и формулы других листов книги
+        Workbook book;
+        Sheet& data = book.AddSheet("Data");
+        Sheet& report = book.AddSheet("Report");
+        data.SetCell("A1"_pos, "2");
+        data.SetCell("B1"_pos, "=A1+1");
+        report.SetCell("A1"_pos, "=Data!B1*3");
+        ASSERT(report.RecalculateAsync().Wait());
+        ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(9.0));
+        // лист книги, добавленный во время пересчёта, останавливает его
+        data.SetCell("A1"_pos, "3");
+        handle = report.RecalculateAsync();
+        book.AddSheet("Extra");
+        ASSERT(handle.IsFinished());
+        ASSERT_EQUAL(report.GetCell("A1"_pos)->GetValue(), CellInterface::Value(12.0));
+
+        // пустая ячейка под ссылкой, полученная через изменяемый лист,
+        // заводится в таблице листа: это останавливает пересчёт, который
+        // таблицу читает
+        Sheet gaps;
+        cells.clear();
+        for (int row = 0; row < rows; ++row) {
+            cells.push_back({{row, 0}, std::to_string(row)});
+            cells.push_back({{row, 1}, "=" + Position{row, 0}.ToString() + "+" + Position{row, 2}.ToString()});
+        }
+        gaps.SetCells(std::move(cells));
+        handle = gaps.RecalculateAsync();
+        for (int row = 0; row < rows; ++row) {
+            CellInterface* gap = gaps.GetCell({row, 2});
+            ASSERT(gap != nullptr);
+            ASSERT_EQUAL(gap->GetText(), "");
+        }
+        ASSERT(handle.IsFinished());
+        for (int row = 0; row < rows; ++row) {
+            ASSERT_EQUAL(gaps.GetCell({row, 1})->GetValue(), CellInterface::Value(static_cast<double>(row)));
+        }
+
+        // Запись чисел SetNumbers собирается при первом чтении текста, а
+        // длинная уходит в кучу; чтение текстов во время пересчёта не должно
+        // портить числа, которые в это время читают формулы
+        Sheet numbers;
+        std::vector<double> column;
+        for (int row = 0; row < rows; ++row) {
+            column.push_back(row + 0.123456789);
+        }
+        numbers.SetNumbers(0, 0, column);
+        cells.clear();
+        for (int row = 0; row < rows; ++row) {
+            cells.push_back({{row, 1}, "=" + Position{row, 0}.ToString() + "*2"});
+        }
+        numbers.SetCells(std::move(cells));
+        handle = numbers.RecalculateAsync();
+        for (int row = 0; row < rows; ++row) {
+            ASSERT(numbers.GetTextRef({row, 0}).size() > 7);
+        }
+        std::ostringstream texts;
+        numbers.PrintTexts(texts);
+        ASSERT(handle.Wait());
+        for (int row = 0; row < rows; ++row) {
+            ASSERT_EQUAL(numbers.GetCell({row, 1})->GetValue(), CellInterface::Value(column[row] * 2));
+        }
+    }
+
+    void TestViewportCalculation() {
+        Sheet sheet;
+        auto value = [&sheet](Position pos) {
+            return sheet.GetCell(pos)->GetValue();
+        };
+        std::vector<PreparedCell> cells;
+        cells.push_back({"A1"_pos, "1"});
+        for (int row = 0; row < 100; ++row) {
+            cells.push_back({{row, 1}, "=A1*" + std::to_string(row + 1)});
+            cells.push_back({{row, 2}, "=" + Position{row, 1}.ToString() + "+1"});
+        }
+        sheet.SetCells(std::move(cells));
+        sheet.Recalculate();
+        ASSERT_EQUAL(value("C100"_pos), CellInterface::Value(101.0));
+
+        bool caught = false;
+        try {
+            sheet.SetVisibleRanges({Range{"C2"_pos, "C1"_pos}});
+        } catch (const InvalidPositionException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        // правка обновляет видимые ячейки и влияющие на них, прочие ждут пересчёта
+        sheet.SetVisibleRanges({Range{"C1"_pos, "C10"_pos}});
+        ASSERT_EQUAL(sheet.GetVisibleRanges().size(), 1u);
+        sheet.SetCalculationMode(CalculationMode::Viewport);
+        sheet.SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(value("C5"_pos), CellInterface::Value(11.0));
+        ASSERT(!sheet.IsStale("C5"_pos));
+        ASSERT(!sheet.IsStale("B5"_pos));
+        ASSERT_EQUAL(value("C50"_pos), CellInterface::Value(51.0));
+        ASSERT(sheet.IsStale("C50"_pos));
+
+        // новая видимая формула над устаревшей ячейкой получает актуальное значение
+        sheet.SetVisibleRanges({Range{"C1"_pos, "C10"_pos}, Range{"E1"_pos, "E1"_pos}});
+        sheet.SetCell("E1"_pos, "=C60");
+        ASSERT_EQUAL(value("E1"_pos), CellInterface::Value(121.0));
+        ASSERT(!sheet.IsStale("E1"_pos));
+        // прокрутка сразу обновляет новую область
+        sheet.SetVisibleRanges({Range{"C50"_pos, "C55"_pos}});
+        ASSERT(!sheet.IsStale("C50"_pos));
+        ASSERT_EQUAL(value("C50"_pos), CellInterface::Value(101.0));
+        ASSERT(sheet.IsStale("C70"_pos));
+
+        // зависимость через диапазон
+        sheet.SetCell("G1"_pos, "1");
+        sheet.SetCell("F1"_pos, "=SUMIF(G1:G3,\">0\")");
+        sheet.SetVisibleRanges({Range{"F1"_pos, "F1"_pos}});
+        ASSERT_EQUAL(value("F1"_pos), CellInterface::Value(1.0));
+        sheet.SetCell("G3"_pos, "4");
+        ASSERT_EQUAL(value("F1"_pos), CellInterface::Value(5.0));
+
+        // остальное досчитывается в свободное время
+        ASSERT(sheet.RecalculateAsync().Wait());
+        ASSERT(!sheet.IsStale("C70"_pos));
+        ASSERT_EQUAL(value("C70"_pos), CellInterface::Value(141.0));
+        sheet.SetCalculationMode(CalculationMode::Automatic);
+        sheet.SetVisibleRanges({});
+        ASSERT(sheet.GetVisibleRanges().empty());
+        sheet.SetCell("A1"_pos, "3");
+        ASSERT_EQUAL(value("C70"_pos), CellInterface::Value(211.0));
+
+        // формула, заданная в видимой области, не берёт общее подвыражение,
+        // посчитанное невидимой формулой до отложенной правки
+        Sheet shared;
+        shared.SetCell("A1"_pos, "1");
+        shared.SetCell("Z100"_pos, "=A1*2");
+        ASSERT_EQUAL(shared.GetCell("Z100"_pos)->GetValue(), CellInterface::Value(2.0));
+        shared.SetVisibleRanges({Range{"A1"_pos, "C10"_pos}});
+        shared.SetCalculationMode(CalculationMode::Viewport);
+        shared.SetCell("A1"_pos, "5");
+        shared.SetCell("C1"_pos, "=A1*2");
+        ASSERT(shared.IsStale("Z100"_pos));
+        ASSERT_EQUAL(shared.GetCell("C1"_pos)->GetValue(), CellInterface::Value(10.0));
+        ASSERT_EQUAL(shared.GetCell("Z100"_pos)->GetValue(), CellInterface::Value(2.0));
+    }
+
+    void TestSubscriptions() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1*2");
+        sheet.SetCell("C1"_pos, "text");
+        std::vector<std::vector<ValueChange>> batches;
+        auto collect = [&batches](Span<const ValueChange> changes) {
+            batches.emplace_back(changes.begin(), changes.end());
+        };
+
+        bool caught = false;
+        try {
+            sheet.Subscribe(Range{"B2"_pos, "B1"_pos}, collect);
+        } catch (const InvalidPositionException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        auto id = sheet.Subscribe(Range{"B1"_pos, "C2"_pos}, collect);
+        sheet.SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(batches.size(), 1u);
+        ASSERT_EQUAL(batches[0].size(), 1u);
+        ASSERT_EQUAL(batches[0][0].pos, "B1"_pos);
+        ASSERT_EQUAL(batches[0][0].old_value, CellInterface::Value(2.0));
+        ASSERT_EQUAL(batches[0][0].new_value, CellInterface::Value(4.0));
+
+        // правки одной операции приходят одной пачкой, по строкам диапазона
+        std::vector<PreparedCell> cells;
+        cells.push_back({"C1"_pos, "other"});
+        cells.push_back({"A1"_pos, "3"});
+        cells.push_back({"B2"_pos, "=B1+1"});
+        sheet.SetCells(std::move(cells));
+        ASSERT_EQUAL(batches.size(), 2u);
+        ASSERT_EQUAL(batches[1].size(), 3u);
+        ASSERT_EQUAL(batches[1][0].pos, "B1"_pos);
+        ASSERT_EQUAL(batches[1][1].pos, "C1"_pos);
+        ASSERT_EQUAL(batches[1][1].old_value, CellInterface::Value("text"));
+        ASSERT_EQUAL(batches[1][1].new_value, CellInterface::Value("other"));
+        ASSERT_EQUAL(batches[1][2].pos, "B2"_pos);
+        ASSERT_EQUAL(batches[1][2].old_value, CellInterface::Value(""));
+        ASSERT_EQUAL(batches[1][2].new_value, CellInterface::Value(7.0));
+
+        // правка, не изменившая значений, пачки не даёт
+        sheet.SetCell("A1"_pos, "=1+2");
+        ASSERT_EQUAL(batches.size(), 2u);
+        sheet.ClearCell("C1"_pos);
+        ASSERT_EQUAL(batches.size(), 3u);
+        ASSERT_EQUAL(batches[2][0].new_value, CellInterface::Value(""));
+
+        // в ручном режиме формулы меняются при пересчёте
+        sheet.SetCalculationMode(CalculationMode::Manual);
+        sheet.SetCell("A1"_pos, "x");
+        ASSERT_EQUAL(batches.size(), 3u);
+        sheet.Recalculate();
+        ASSERT_EQUAL(batches.size(), 4u);
+        ASSERT_EQUAL(batches[3].size(), 2u);
+        ASSERT_EQUAL(batches[3][0].old_value, CellInterface::Value(6.0));
+        ASSERT_EQUAL(batches[3][0].new_value, CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+        sheet.SetCalculationMode(CalculationMode::Automatic);
+
+        // колбэк может отменить подписку
+        uint64_t once = 0;
+        once = sheet.Subscribe(Range{"A1"_pos, "A1"_pos}, [&sheet, &once](Span<const ValueChange>) {
+            ASSERT(sheet.Unsubscribe(once));
+        });
+        ASSERT(once != id);
+        sheet.SetCell("A1"_pos, "4");
+        ASSERT_EQUAL(batches.size(), 5u);
+        ASSERT(!sheet.Unsubscribe(once));
+        ASSERT(sheet.Unsubscribe(id));
+        sheet.SetCell("A1"_pos, "5");
+        ASSERT_EQUAL(batches.size(), 5u);
+
+        // подписка на ячейку другого листа книги
+        Workbook book;
+        Sheet& data = book.AddSheet("Data");
+        Sheet& report = book.AddSheet("Report");
+        data.SetCell("A1"_pos, "2");
+        report.SetCell("A1"_pos, "=Data!A1*3");
+        std::vector<ValueChange> last;
+        report.Subscribe(Range{"A1"_pos, "A1"_pos}, [&last](Span<const ValueChange> changes) {
+            last.assign(changes.begin(), changes.end());
+        });
+        data.SetCell("A1"_pos, "5");
+        ASSERT_EQUAL(last.size(), 1u);
+        ASSERT_EQUAL(last[0].new_value, CellInterface::Value(15.0));
+        data.SetCalculationMode(CalculationMode::Manual);
+        data.SetCell("A1"_pos, "6");
+        book.Recalculate();
+        ASSERT_EQUAL(last[0].new_value, CellInterface::Value(18.0));
+
+        // исключение колбэка выходит из правки, но не ломает доставку:
+        // остальные подписки получают пачку, а следующие правки -- снова все
+        Sheet failing;
+        failing.SetCell("A1"_pos, "1");
+        int thrown = 0;
+        int received = 0;
+        failing.Subscribe(Range{"A1"_pos, "A1"_pos}, [&thrown](Span<const ValueChange>) {
+            ++thrown;
+            throw std::runtime_error("callback failed");
+        });
+        failing.Subscribe(Range{"A1"_pos, "A1"_pos}, [&received](Span<const ValueChange>) {
+            ++received;
+        });
+        for (int i = 2; i <= 3; ++i) {
+            bool caught = false;
+            try {
+                failing.SetCell("A1"_pos, std::to_string(i));
+            } catch (const std::runtime_error&) {
+                caught = true;
+            }
+            ASSERT(caught);
+            ASSERT_EQUAL(thrown, i - 1);
+            ASSERT_EQUAL(received, i - 1);
+        }
+        ASSERT_EQUAL(failing.GetCell("A1"_pos)->GetText(), "3");
+
+        // колбэк не может менять листы: правка бросает до любых изменений
+        Sheet guarded;
+        guarded.SetCell("A1"_pos, "1");
+        bool rejected = false;
+        guarded.Subscribe(Range{"A1"_pos, "A1"_pos}, [&guarded, &rejected](Span<const ValueChange>) {
+            try {
+                guarded.SetCell("B1"_pos, "2");
+            } catch (const std::logic_error&) {
+                rejected = true;
+            }
+        });
+        guarded.SetCell("A1"_pos, "5");
+        ASSERT(rejected);
+        ASSERT(guarded.GetCell("B1"_pos) == nullptr);
+    }
+
+    void TestWorkloadMatchesReference() {
+        WorkloadOptions options;
+        options.filled_rows = 100;
+        options.chain_length = 50;
+        options.aggregation_width = 20;
+        options.dag_cells = 200;
+        options.edits = 1000;
+
+        // одно зерно -- одна и та же нагрузка
+        auto workload = GenerateWorkload(options);
+        auto again = GenerateWorkload(options);
+        ASSERT_EQUAL(workload.edits.size(), again.edits.size());
+        for (size_t i = 0; i < workload.edits.size(); ++i) {
+            ASSERT_EQUAL(workload.edits[i].text, again.edits[i].text);
+            ASSERT_EQUAL(workload.edits[i].pos, again.edits[i].pos);
+        }
+
+        for (uint64_t seed = 1; seed <= 5; ++seed) {
+            options.seed = seed;
+            Sheet sheet;
+            ASSERT_EQUAL(CompareWithReference(GenerateWorkload(options), sheet), "");
+        }
+    }
 }  // namespace
 
 int main() {
@@ -367,5 +2187,35 @@ int main() {
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences); 
+    RUN_TEST(tr, TestTextChangeInvalidatesDependents);
+    RUN_TEST(tr, TestWorkbookCrossSheetReferences);
+    RUN_TEST(tr, TestWorkbookCrossSheetCycle);
+    RUN_TEST(tr, TestWorkbookRecalculate);
+    RUN_TEST(tr, TestCsvImport);
+    RUN_TEST(tr, TestCsvImportTsvAndErrors);
+    RUN_TEST(tr, TestScanFormulaReferences);
+    RUN_TEST(tr, TestLazyFormulaImport);
+    RUN_TEST(tr, TestSnapshotRoundTrip);
+    RUN_TEST(tr, TestSnapshotWorkbookAndErrors);
+    RUN_TEST(tr, TestJournalRecovery);
+    RUN_TEST(tr, TestJournalReplayAfterInterruptedCompaction);
+    RUN_TEST(tr, TestEngineStats);
+    RUN_TEST(tr, TestTracing);
+    RUN_TEST(tr, TestCellProfile);
+    RUN_TEST(tr, TestWorkloadMatchesReference);
+    RUN_TEST(tr, TestReadRefs);
+    RUN_TEST(tr, TestGetValues);
+    RUN_TEST(tr, TestSetNumbers);
+    RUN_TEST(tr, TestCompactCellContent);
+    RUN_TEST(tr, TestStringPool);
+    RUN_TEST(tr, TestReferencedEmptyCells);
+    RUN_TEST(tr, TestLookupFunctions);
+    RUN_TEST(tr, TestConditionalAggregates);
+    RUN_TEST(tr, TestSharedSubexpressions);
+    RUN_TEST(tr, TestFormulaSimplification);
+    RUN_TEST(tr, TestManualCalculation);
+    RUN_TEST(tr, TestRecalculateAsync);
+    RUN_TEST(tr, TestViewportCalculation);
+    RUN_TEST(tr, TestSubscriptions);
     return 0;
 }
@@ -0,0 +1,267 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+constexpr size_t COUNTERS = static_cast<size_t>(MetricCounter::COUNT);
+constexpr size_t HISTOGRAMS = static_cast<size_t>(MetricHistogram::COUNT);
+
+struct AtomicHistogram {
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> max{0};
+    std::array<std::atomic<uint64_t>, Histogram::BUCKETS> buckets{};
+};
+
+// Блок счётчиков одного потока. Пишет в него только владелец, поэтому
+// атомарность нужна лишь для чтения из других потоков: обновление --
+// обычные load и store без блокирующих инструкций.
+struct ThreadMetrics {
+    std::array<std::atomic<uint64_t>, COUNTERS> counters{};
+    std::array<AtomicHistogram, HISTOGRAMS> histograms{};
+};
+
+void Increase(std::atomic<uint64_t>& value, uint64_t delta) {
+    value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+void Reset(ThreadMetrics& metrics) {
+    for (auto& counter : metrics.counters) {
+        counter.store(0, std::memory_order_relaxed);
+    }
+    for (auto& histogram : metrics.histograms) {
+        histogram.count.store(0, std::memory_order_relaxed);
+        histogram.sum.store(0, std::memory_order_relaxed);
+        histogram.max.store(0, std::memory_order_relaxed);
+        for (auto& bucket : histogram.buckets) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+void Accumulate(EngineStats& stats, const ThreadMetrics& metrics) {
+    for (size_t i = 0; i < COUNTERS; ++i) {
+        stats.counters[i] += metrics.counters[i].load(std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < HISTOGRAMS; ++i) {
+        const auto& from = metrics.histograms[i];
+        auto& to = stats.histograms[i];
+        to.count += from.count.load(std::memory_order_relaxed);
+        to.sum += from.sum.load(std::memory_order_relaxed);
+        to.max = std::max(to.max, from.max.load(std::memory_order_relaxed));
+        for (int j = 0; j < Histogram::BUCKETS; ++j) {
+            to.buckets[j] += from.buckets[j].load(std::memory_order_relaxed);
+        }
+    }
+}
+
+// Блоки живых потоков и накопленное завершившимися
+struct Registry {
+    std::mutex mutex;
+    std::vector<ThreadMetrics*> threads;
+    EngineStats retired;
+};
+
+Registry& GetRegistry() {
+    static Registry registry;
+    return registry;
+}
+
+class ThreadSlot {
+public:
+    ThreadSlot() {
+        // реестр создаётся раньше слота и потому переживает его
+        auto& registry = GetRegistry();
+        std::lock_guard lock(registry.mutex);
+        registry.threads.push_back(&metrics_);
+    }
+
+    ~ThreadSlot() {
+        auto& registry = GetRegistry();
+        std::lock_guard lock(registry.mutex);
+        Accumulate(registry.retired, metrics_);
+        registry.threads.erase(std::find(registry.threads.begin(), registry.threads.end(), &metrics_));
+    }
+
+    ThreadMetrics& Get() {
+        return metrics_;
+    }
+
+private:
+    ThreadMetrics metrics_;
+};
+
+ThreadMetrics& GetThreadMetrics() {
+    thread_local ThreadSlot slot;
+    return slot.Get();
+}
+
+int GetBucket(uint64_t value) {
+    int bucket = 0;
+    while (value && bucket + 1 < Histogram::BUCKETS) {
+        value >>= 1;
+        ++bucket;
+    }
+    return bucket;
+}
+
+void PrintHistogramJson(std::ostream& out, const Histogram& histogram) {
+    out << "{\"count\": " << histogram.count << ", \"sum\": " << histogram.sum << ", \"max\": " << histogram.max
+        << ", \"mean\": " << histogram.Mean() << ", \"p50\": " << histogram.Percentile(0.5)
+        << ", \"p99\": " << histogram.Percentile(0.99) << ", \"buckets\": [";
+    int last = Histogram::BUCKETS - 1;
+    while (last > 0 && histogram.buckets[last] == 0) {
+        --last;
+    }
+    for (int i = 0; i <= last; ++i) {
+        out << (i ? ", " : "") << histogram.buckets[i];
+    }
+    out << "]}";
+}
+
+}  // namespace
+
+double Histogram::Mean() const {
+    return count ? static_cast<double>(sum) / count : 0;
+}
+
+uint64_t Histogram::Percentile(double q) const {
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(q * count + 0.5));
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; ++i) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return i == 0 ? 0 : std::min(max, (uint64_t(1) << i) - 1);
+        }
+    }
+    return max;
+}
+
+double EngineStats::CacheHitRate() const {
+    uint64_t hits = Get(MetricCounter::CacheHits);
+    uint64_t total = hits + Get(MetricCounter::CacheMisses);
+    return total ? static_cast<double>(hits) / total : 0;
+}
+
+double EngineStats::SubexpressionHitRate() const {
+    uint64_t hits = Get(MetricCounter::SubexpressionHits);
+    uint64_t total = hits + Get(MetricCounter::SubexpressionMisses);
+    return total ? static_cast<double>(hits) / total : 0;
+}
+
+double SheetStats::SubexpressionDedupRatio() const {
+    return shared_subexpressions ? static_cast<double>(subexpression_uses) / shared_subexpressions : 0;
+}
+
+EngineStats GetEngineStats() {
+    auto& registry = GetRegistry();
+    std::lock_guard lock(registry.mutex);
+    EngineStats stats = registry.retired;
+    for (const auto* metrics : registry.threads) {
+        Accumulate(stats, *metrics);
+    }
+#ifdef SPREADSHEET_METRICS
+    stats.enabled = true;
+#endif
+    return stats;
+}
+
+void ResetEngineStats() {
+    auto& registry = GetRegistry();
+    std::lock_guard lock(registry.mutex);
+    registry.retired = {};
+    for (auto* metrics : registry.threads) {
+        Reset(*metrics);
+    }
+}
+
+void SheetStats::PrintText(std::ostream& out) const {
+    out << "enabled " << engine.enabled << '\n'
+        << "live_cells " << live_cells << '\n'
+        << "live_edges " << live_edges << '\n'
+        << "pooled_strings " << pooled_strings << '\n'
+        << "pooled_bytes " << pooled_bytes << '\n'
+        << "shared_subexpressions " << shared_subexpressions << '\n'
+        << "subexpression_uses " << subexpression_uses << '\n'
+        << "subexpression_dedup_ratio " << SubexpressionDedupRatio() << '\n';
+    for (size_t i = 0; i < COUNTERS; ++i) {
+        out << GetMetricName(static_cast<MetricCounter>(i)) << ' ' << engine.counters[i] << '\n';
+    }
+    out << "cache_hit_rate " << engine.CacheHitRate() << '\n';
+    out << "subexpression_hit_rate " << engine.SubexpressionHitRate() << '\n';
+    for (size_t i = 0; i < HISTOGRAMS; ++i) {
+        const auto& histogram = engine.histograms[i];
+        out << GetMetricName(static_cast<MetricHistogram>(i)) << " count " << histogram.count
+            << " sum " << histogram.sum << " mean " << histogram.Mean() << " p50 " << histogram.Percentile(0.5)
+            << " p99 " << histogram.Percentile(0.99) << " max " << histogram.max << '\n';
+    }
+}
+
+void SheetStats::PrintJson(std::ostream& out) const {
+    out << "{\"enabled\": " << (engine.enabled ? "true" : "false") << ", \"live_cells\": " << live_cells
+        << ", \"live_edges\": " << live_edges << ", \"pooled_strings\": " << pooled_strings
+        << ", \"pooled_bytes\": " << pooled_bytes << ", \"shared_subexpressions\": " << shared_subexpressions
+        << ", \"subexpression_uses\": " << subexpression_uses
+        << ", \"subexpression_dedup_ratio\": " << SubexpressionDedupRatio();
+    for (size_t i = 0; i < COUNTERS; ++i) {
+        out << ", \"" << GetMetricName(static_cast<MetricCounter>(i)) << "\": " << engine.counters[i];
+    }
+    out << ", \"cache_hit_rate\": " << engine.CacheHitRate();
+    out << ", \"subexpression_hit_rate\": " << engine.SubexpressionHitRate();
+    for (size_t i = 0; i < HISTOGRAMS; ++i) {
+        out << ", \"" << GetMetricName(static_cast<MetricHistogram>(i)) << "\": ";
+        PrintHistogramJson(out, engine.histograms[i]);
+    }
+    out << "}";
+}
+
+const char* GetMetricName(MetricCounter counter) {
+    switch (counter) {
+        case MetricCounter::CacheHits:
+            return "cache_hits";
+        case MetricCounter::CacheMisses:
+            return "cache_misses";
+        case MetricCounter::Evaluations:
+            return "evaluations";
+        case MetricCounter::SubexpressionHits:
+            return "subexpression_hits";
+        case MetricCounter::SubexpressionMisses:
+            return "subexpression_misses";
+        default:
+            return "";
+    }
+}
+
+const char* GetMetricName(MetricHistogram histogram) {
+    switch (histogram) {
+        case MetricHistogram::InvalidationFanOut:
+            return "invalidation_fan_out";
+        case MetricHistogram::CycleCheckNodes:
+            return "cycle_check_nodes";
+        case MetricHistogram::ParseNanoseconds:
+            return "parse_nanoseconds";
+        default:
+            return "";
+    }
+}
+
+void AddMetric(MetricCounter counter, uint64_t value) {
+    Increase(GetThreadMetrics().counters[static_cast<size_t>(counter)], value);
+}
+
+void RecordMetric(MetricHistogram histogram, uint64_t value) {
+    auto& to = GetThreadMetrics().histograms[static_cast<size_t>(histogram)];
+    Increase(to.count, 1);
+    Increase(to.sum, value);
+    if (value > to.max.load(std::memory_order_relaxed)) {
+        to.max.store(value, std::memory_order_relaxed);
+    }
+    Increase(to.buckets[GetBucket(value)], 1);
+}
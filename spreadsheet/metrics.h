@@ -0,0 +1,121 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+// Встроенные метрики движка. Собираются, только если проект собран с
+// определённым SPREADSHEET_METRICS (опция CMake с тем же именем); иначе
+// макросы SPREADSHEET_METRIC_* раскрываются в пустоту и ничего не стоят.
+// Каждый поток пишет в собственный блок счётчиков без блокировок, блоки
+// суммируются только при чтении (GetEngineStats).
+
+enum class MetricCounter {
+    CacheHits,      // FormulaImpl::GetValue вернул кешированное значение
+    CacheMisses,    // и вычислял формулу
+    Evaluations,    // вычислений формул (включая вложенные)
+    SubexpressionHits,      // общее подвыражение взято из таблицы листа
+    SubexpressionMisses,    // и вычислялось
+    COUNT
+};
+
+enum class MetricHistogram {
+    InvalidationFanOut,     // ячеек со сброшенным кешем за вызов InvalidateCash
+    CycleCheckNodes,        // вершин, пройденных за вызов IsCycle
+    ParseNanoseconds,       // время одного ParseFormulaAST
+    COUNT
+};
+
+// Распределение по степеням двойки: buckets[0] считает нули, buckets[i] --
+// значения из [2^(i-1), 2^i)
+struct Histogram {
+    static constexpr int BUCKETS = 48;
+
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+    std::array<uint64_t, BUCKETS> buckets{};
+
+    double Mean() const;
+    // верхняя граница корзины, в которую попадает доля q (0..1) значений
+    uint64_t Percentile(double q) const;
+};
+
+// Счётчики движка за время работы процесса по всем листам
+struct EngineStats {
+    bool enabled = false;   // собраны ли метрики вообще
+    std::array<uint64_t, static_cast<size_t>(MetricCounter::COUNT)> counters{};
+    std::array<Histogram, static_cast<size_t>(MetricHistogram::COUNT)> histograms{};
+
+    uint64_t Get(MetricCounter counter) const {
+        return counters[static_cast<size_t>(counter)];
+    }
+    const Histogram& Get(MetricHistogram histogram) const {
+        return histograms[static_cast<size_t>(histogram)];
+    }
+    // доля обращений к формулам, обслуженных из кеша; 0, если обращений не было
+    double CacheHitRate() const;
+    // то же для общих подвыражений (см. subexpressions.h)
+    double SubexpressionHitRate() const;
+};
+
+EngineStats GetEngineStats();
+// Обнуляет счётчики. Обновления, идущие одновременно в других потоках,
+// могут частично пережить обнуление.
+void ResetEngineStats();
+
+// Метрики листа: счётчики движка и размер самого листа
+struct SheetStats {
+    EngineStats engine;
+    uint64_t live_cells = 0;    // ячеек в листе, включая ещё не загруженные из снимка
+    uint64_t live_edges = 0;    // ссылок из формул листа в графе зависимостей
+    uint64_t pooled_strings = 0;    // различных длинных текстов в пуле строк листа
+    uint64_t pooled_bytes = 0;      // и их суммарная длина
+    uint64_t shared_subexpressions = 0;     // различных подвыражений формул листа
+    uint64_t subexpression_uses = 0;        // и их вхождений в формулы
+
+    // вхождений на одно различное подвыражение; 0, если подвыражений нет
+    double SubexpressionDedupRatio() const;
+
+    // строки вида "имя значение"
+    void PrintText(std::ostream& out) const;
+    void PrintJson(std::ostream& out) const;
+};
+
+const char* GetMetricName(MetricCounter counter);
+const char* GetMetricName(MetricHistogram histogram);
+
+void AddMetric(MetricCounter counter, uint64_t value);
+void RecordMetric(MetricHistogram histogram, uint64_t value);
+
+// Записывает в гистограмму время жизни объекта в наносекундах
+class MetricTimer {
+public:
+    explicit MetricTimer(MetricHistogram histogram)
+        : histogram_(histogram), start_(std::chrono::steady_clock::now())
+    {
+    }
+
+    ~MetricTimer() {
+        auto elapsed = std::chrono::steady_clock::now() - start_;
+        RecordMetric(histogram_, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+    MetricTimer(const MetricTimer&) = delete;
+    MetricTimer& operator=(const MetricTimer&) = delete;
+
+private:
+    MetricHistogram histogram_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+#ifdef SPREADSHEET_METRICS
+#define SPREADSHEET_METRIC_ADD(counter, value) AddMetric(MetricCounter::counter, (value))
+#define SPREADSHEET_METRIC_RECORD(histogram, value) RecordMetric(MetricHistogram::histogram, (value))
+#define SPREADSHEET_METRIC_TIMER(histogram) MetricTimer spreadsheet_metric_timer_(MetricHistogram::histogram)
+#else
+#define SPREADSHEET_METRIC_ADD(counter, value) ((void)0)
+#define SPREADSHEET_METRIC_RECORD(histogram, value) ((void)0)
+#define SPREADSHEET_METRIC_TIMER(histogram) ((void)0)
+#endif
@@ -0,0 +1,88 @@
+#include "position_bitset.h"
+
+#include <algorithm>
+
+bool PositionBitset::Insert(Position pos) {
+    uint64_t& word = words_[GetKey(pos.col, pos.row / WORD_BITS)];
+    const uint64_t bit = uint64_t(1) << (pos.row % WORD_BITS);
+    if (word & bit) {
+        return false;
+    }
+    word |= bit;
+    ++size_;
+    return true;
+}
+
+bool PositionBitset::Contains(Position pos) const {
+    auto it = words_.find(GetKey(pos.col, pos.row / WORD_BITS));
+    return it != words_.end() && (it->second >> (pos.row % WORD_BITS) & 1);
+}
+
+bool PositionBitset::Intersects(Range range) const {
+    if (words_.empty() || !range.IsValid()) {
+        return false;
+    }
+    const int first_block = range.first.row / WORD_BITS;
+    const int last_block = range.last.row / WORD_BITS;
+    // маска строк диапазона в слове блока block
+    auto mask = [&range, first_block, last_block](int block) {
+        uint64_t result = ~uint64_t(0);
+        if (block == first_block) {
+            result &= ~uint64_t(0) << (range.first.row % WORD_BITS);
+        }
+        if (block == last_block) {
+            result &= ~uint64_t(0) >> (WORD_BITS - 1 - range.last.row % WORD_BITS);
+        }
+        return result;
+    };
+    const size_t range_words = static_cast<size_t>(range.last.col - range.first.col + 1)
+        * (last_block - first_block + 1);
+    // перебираются либо слова диапазона, либо слова множества -- что короче
+    if (range_words <= words_.size()) {
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+            for (int block = first_block; block <= last_block; ++block) {
+                auto it = words_.find(GetKey(col, block));
+                if (it != words_.end() && (it->second & mask(block))) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+    return std::any_of(words_.begin(), words_.end(), [&](const auto& item) {
+        const Position first = GetFirstPosition(item.first);
+        const int block = first.row / WORD_BITS;
+        return first.col >= range.first.col && first.col <= range.last.col
+            && block >= first_block && block <= last_block && (item.second & mask(block));
+    });
+}
+
+bool PositionBitset::IsEmpty() const {
+    return size_ == 0;
+}
+
+size_t PositionBitset::GetSize() const {
+    return size_;
+}
+
+void PositionBitset::Clear() {
+    words_.clear();
+    size_ = 0;
+}
+
+uint32_t PositionBitset::GetKey(int col, int block) {
+    return static_cast<uint32_t>(col) * WORDS_PER_COLUMN + static_cast<uint32_t>(block);
+}
+
+Position PositionBitset::GetFirstPosition(uint32_t key) {
+    return {static_cast<int>(key % WORDS_PER_COLUMN) * WORD_BITS, static_cast<int>(key / WORDS_PER_COLUMN)};
+}
+
+int PositionBitset::CountTrailingZeros(uint64_t bits) {
+    int count = 0;
+    while (!(bits & 1)) {
+        bits >>= 1;
+        ++count;
+    }
+    return count;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <unordered_map>
+
+// Разреженное множество позиций листа в виде битовой карты: слово из 64
+// бит покрывает 64 соседние строки одного столбца, и хранятся только слова
+// с установленными битами. Правки обычно идут столбцами, поэтому тысяча
+// отмеченных ячеек столбца -- это 16 слов.
+class PositionBitset {
+public:
+    // false, если позиция уже была в множестве
+    bool Insert(Position pos);
+    bool Contains(Position pos) const;
+    // есть ли в множестве хотя бы одна позиция диапазона
+    bool Intersects(Range range) const;
+
+    bool IsEmpty() const;
+    size_t GetSize() const;
+    void Clear();
+
+    // вызывает func(Position) для каждой позиции; порядок не определён
+    template <typename Func>
+    void ForEach(Func func) const {
+        for (const auto& [key, word] : words_) {
+            const Position first = GetFirstPosition(key);
+            for (uint64_t bits = word; bits != 0; bits &= bits - 1) {
+                func(Position{first.row + CountTrailingZeros(bits), first.col});
+            }
+        }
+    }
+
+private:
+    static constexpr int WORD_BITS = 64;
+    static constexpr int WORDS_PER_COLUMN = Position::MAX_ROWS / WORD_BITS;
+
+    // ключ -- номер слова: столбец и блок из 64 строк
+    std::unordered_map<uint32_t, uint64_t> words_;
+    size_t size_ = 0;
+
+    static uint32_t GetKey(int col, int block);
+    static Position GetFirstPosition(uint32_t key);
+    static int CountTrailingZeros(uint64_t bits);
+};
@@ -0,0 +1,212 @@
+#include "profile.h"
+
+#include <algorithm>
+#include <atomic>
+#include <iomanip>
+#include <mutex>
+#include <unordered_map>
+
+namespace {
+
+struct ProfileKey {
+    SheetInterface* sheet;
+    Position pos;
+
+    bool operator==(const ProfileKey& rhs) const {
+        return sheet == rhs.sheet && pos == rhs.pos;
+    }
+
+    struct Hasher {
+        size_t operator() (const ProfileKey& key) const {
+            return Position::Hasher() (key.pos) + 37 * std::hash<const void*>() (key.sheet);
+        }
+    };
+};
+
+using ProfileTable = std::unordered_map<ProfileKey, CellProfile, ProfileKey::Hasher>;
+
+// Таблица потока. Пишет в неё только владелец, мьютекс нужен для отчёта и
+// сброса из других потоков и почти всегда свободен.
+struct ThreadTable {
+    std::mutex mutex;
+    ProfileTable table;
+};
+
+struct Registry {
+    std::mutex mutex;
+    std::vector<ThreadTable*> threads;
+    ProfileTable retired;   // накопленное завершившимися потоками
+};
+
+std::atomic<bool> profiling{false};
+thread_local CellEvaluationScope* current_scope = nullptr;
+
+Registry& GetRegistry() {
+    static Registry registry;
+    return registry;
+}
+
+void Merge(ProfileTable& to, const ProfileTable& from) {
+    for (const auto& [key, profile] : from) {
+        auto& entry = to[key];
+        entry.sheet = key.sheet;
+        entry.pos = key.pos;
+        entry.evaluations += profile.evaluations;
+        entry.inclusive_ns += profile.inclusive_ns;
+        entry.exclusive_ns += profile.exclusive_ns;
+        entry.edits += profile.edits;
+        entry.invalidated += profile.invalidated;
+    }
+}
+
+class ThreadSlot {
+public:
+    ThreadSlot() {
+        auto& registry = GetRegistry();
+        std::lock_guard lock(registry.mutex);
+        registry.threads.push_back(&table_);
+    }
+
+    ~ThreadSlot() {
+        auto& registry = GetRegistry();
+        std::lock_guard lock(registry.mutex);
+        Merge(registry.retired, table_.table);
+        registry.threads.erase(std::find(registry.threads.begin(), registry.threads.end(), &table_));
+    }
+
+    ThreadTable& Get() {
+        return table_;
+    }
+
+private:
+    ThreadTable table_;
+};
+
+ThreadTable& GetThreadTable() {
+    thread_local ThreadSlot slot;
+    return slot.Get();
+}
+
+CellProfile& GetEntry(ProfileTable& table, SheetInterface* sheet, Position pos) {
+    auto& entry = table[{sheet, pos}];
+    entry.sheet = sheet;
+    entry.pos = pos;
+    return entry;
+}
+
+uint64_t GetOrderKey(const CellProfile& profile, ProfileOrder order) {
+    switch (order) {
+        case ProfileOrder::InclusiveTime:
+            return profile.inclusive_ns;
+        case ProfileOrder::Evaluations:
+            return profile.evaluations;
+        case ProfileOrder::Invalidated:
+            return profile.invalidated;
+        default:
+            return profile.exclusive_ns;
+    }
+}
+
+}  // namespace
+
+void StartProfiling() {
+    auto& registry = GetRegistry();
+    std::lock_guard lock(registry.mutex);
+    registry.retired.clear();
+    for (auto* thread : registry.threads) {
+        std::lock_guard thread_lock(thread->mutex);
+        thread->table.clear();
+    }
+    profiling.store(true, std::memory_order_relaxed);
+}
+
+void StopProfiling() {
+    profiling.store(false, std::memory_order_relaxed);
+}
+
+bool IsProfiling() {
+    return profiling.load(std::memory_order_relaxed);
+}
+
+std::vector<CellProfile> GetCellProfiles() {
+    auto& registry = GetRegistry();
+    std::lock_guard lock(registry.mutex);
+    ProfileTable total = registry.retired;
+    for (auto* thread : registry.threads) {
+        std::lock_guard thread_lock(thread->mutex);
+        Merge(total, thread->table);
+    }
+    std::vector<CellProfile> result;
+    result.reserve(total.size());
+    for (const auto& [_, profile] : total) {
+        result.push_back(profile);
+    }
+    return result;
+}
+
+void RankProfiles(std::vector<CellProfile>& profiles, ProfileOrder order, size_t top) {
+    auto by_order = [order](const CellProfile& lhs, const CellProfile& rhs) {
+        uint64_t lhs_key = GetOrderKey(lhs, order);
+        uint64_t rhs_key = GetOrderKey(rhs, order);
+        // при равенстве порядок не должен зависеть от хеш-таблицы
+        return lhs_key != rhs_key ? lhs_key > rhs_key : lhs.pos < rhs.pos;
+    };
+    top = std::min(top, profiles.size());
+    std::partial_sort(profiles.begin(), profiles.begin() + top, profiles.end(), by_order);
+    profiles.resize(top);
+}
+
+void PrintProfile(std::ostream& out, const std::vector<CellProfile>& profiles) {
+    out << std::left << std::setw(8) << "cell" << std::right << std::setw(12) << "evaluations"
+        << std::setw(14) << "inclusive_ms" << std::setw(14) << "exclusive_ms" << std::setw(10) << "edits"
+        << std::setw(14) << "invalidated" << std::setw(10) << "cone" << '\n';
+    out << std::fixed << std::setprecision(3);
+    for (const auto& profile : profiles) {
+        out << std::left << std::setw(8) << profile.pos.ToString() << std::right << std::setw(12)
+            << profile.evaluations << std::setw(14) << profile.inclusive_ns / 1e6 << std::setw(14)
+            << profile.exclusive_ns / 1e6 << std::setw(10) << profile.edits << std::setw(14) << profile.invalidated
+            << std::setw(10) << profile.cone_size << '\n';
+    }
+    out.unsetf(std::ios_base::floatfield);
+}
+
+namespace ProfileImpl {
+
+void AddInvalidation(SheetInterface* sheet, Position pos, uint64_t invalidated) {
+    auto& thread = GetThreadTable();
+    std::lock_guard lock(thread.mutex);
+    auto& entry = GetEntry(thread.table, sheet, pos);
+    ++entry.edits;
+    entry.invalidated += invalidated;
+}
+
+}  // namespace ProfileImpl
+
+CellEvaluationScope::CellEvaluationScope(SheetInterface* sheet, Position pos) {
+    if (!IsProfiling()) {
+        return;
+    }
+    sheet_ = sheet;
+    pos_ = pos;
+    parent_ = current_scope;
+    current_scope = this;
+    start_ = std::chrono::steady_clock::now();
+}
+
+CellEvaluationScope::~CellEvaluationScope() {
+    if (!sheet_) {
+        return;
+    }
+    const uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start_).count();
+    current_scope = parent_;
+    if (parent_) {
+        parent_->children_ns_ += elapsed;
+    }
+    auto& thread = GetThreadTable();
+    std::lock_guard lock(thread.mutex);
+    auto& entry = GetEntry(thread.table, sheet_, pos_);
+    ++entry.evaluations;
+    entry.inclusive_ns += elapsed;
+    entry.exclusive_ns += elapsed - std::min(elapsed, children_ns_);
+}
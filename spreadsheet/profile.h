@@ -0,0 +1,82 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+// Профилировщик стоимости ячеек: за время сеанса (StartProfiling ..
+// StopProfiling) для каждой ячейки копятся число вычислений её формулы,
+// полное время (со вложенными вычислениями ячеек, на которые она ссылается)
+// и собственное время, а для изменённых ячеек -- число правок и сколько
+// кешей эти правки сбросили. Собирается, только если проект собран с
+// SPREADSHEET_PROFILING (опция CMake с тем же именем); иначе макросы
+// SPREADSHEET_PROFILE_* раскрываются в пустоту.
+// Каждый поток копит данные в своей таблице; отчёт сливает таблицы.
+
+struct CellProfile {
+    SheetInterface* sheet = nullptr;
+    Position pos;
+    uint64_t evaluations = 0;
+    uint64_t inclusive_ns = 0;
+    uint64_t exclusive_ns = 0;
+    uint64_t edits = 0;          // правок, после которых сбрасывались кеши
+    uint64_t invalidated = 0;    // кешей, сброшенных этими правками
+    uint64_t cone_size = 0;      // ячеек, транзитивно зависящих от этой
+};
+
+enum class ProfileOrder {
+    ExclusiveTime,
+    InclusiveTime,
+    Evaluations,
+    Invalidated,
+};
+
+// Начинает сеанс, забывая накопленное раньше
+void StartProfiling();
+void StopProfiling();
+bool IsProfiling();
+
+// Накопленное за сеанс по всем листам, без cone_size (его считает
+// Sheet::GetProfile по графу зависимостей)
+std::vector<CellProfile> GetCellProfiles();
+
+// Сортирует по убыванию выбранной величины и оставляет первые top
+void RankProfiles(std::vector<CellProfile>& profiles, ProfileOrder order, size_t top);
+
+// Таблица: ячейка, вычисления, полное и собственное время в мс, правки,
+// сброшенные кеши, размер конуса зависимых
+void PrintProfile(std::ostream& out, const std::vector<CellProfile>& profiles);
+
+namespace ProfileImpl {
+void AddInvalidation(SheetInterface* sheet, Position pos, uint64_t invalidated);
+}  // namespace ProfileImpl
+
+// Замер вычисления формулы ячейки от создания до разрушения объекта.
+// Вложенные замеры вычитаются из собственного времени внешнего.
+class CellEvaluationScope {
+public:
+    CellEvaluationScope(SheetInterface* sheet, Position pos);
+    ~CellEvaluationScope();
+
+    CellEvaluationScope(const CellEvaluationScope&) = delete;
+    CellEvaluationScope& operator=(const CellEvaluationScope&) = delete;
+
+private:
+    SheetInterface* sheet_ = nullptr;   // nullptr, если сеанс не идёт
+    Position pos_;
+    std::chrono::steady_clock::time_point start_;
+    uint64_t children_ns_ = 0;
+    CellEvaluationScope* parent_ = nullptr;
+};
+
+#ifdef SPREADSHEET_PROFILING
+#define SPREADSHEET_PROFILE_EVALUATION(sheet, pos) CellEvaluationScope spreadsheet_profile_scope_((sheet), (pos))
+#define SPREADSHEET_PROFILE_INVALIDATION(sheet, pos, invalidated) \
+    (IsProfiling() ? ProfileImpl::AddInvalidation((sheet), (pos), (invalidated)) : (void)0)
+#else
+#define SPREADSHEET_PROFILE_EVALUATION(sheet, pos) ((void)0)
+#define SPREADSHEET_PROFILE_INVALIDATION(sheet, pos, invalidated) ((void)0)
+#endif
@@ -0,0 +1,59 @@
+#include "recalculation.h"
+
+void RecalculationState::Finish(bool is_completed) {
+    std::lock_guard lock(mutex);
+    finished = true;
+    completed = is_completed;
+    finished_cv.notify_all();
+}
+
+RecalculationHandle::RecalculationHandle(std::shared_ptr<RecalculationState> state)
+    : state_(std::move(state))
+{
+
+}
+
+RecalculationHandle::Progress RecalculationHandle::GetProgress() const {
+    if (!state_) {
+        return {};
+    }
+    return {state_->done.load(), state_->total};
+}
+
+bool RecalculationHandle::IsFinished() const {
+    if (!state_) {
+        return true;
+    }
+    std::lock_guard lock(state_->mutex);
+    return state_->finished;
+}
+
+bool RecalculationHandle::IsCancelled() const {
+    return state_ && state_->cancelled;
+}
+
+bool RecalculationHandle::Wait() const {
+    if (!state_) {
+        return true;
+    }
+    std::unique_lock lock(state_->mutex);
+    state_->finished_cv.wait(lock, [this] { return state_->finished; });
+    return state_->completed;
+}
+
+void RecalculationHandle::Cancel() {
+    if (state_) {
+        state_->cancelled = true;
+    }
+}
+
+void RecalculationHandle::Prioritize(Range range) {
+    if (!state_) {
+        return;
+    }
+    std::lock_guard lock(state_->mutex);
+    if (!state_->finished) {
+        state_->urgent.push_back(range);
+        state_->has_urgent = true;
+    }
+}
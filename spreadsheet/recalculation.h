@@ -0,0 +1,63 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Состояние фонового пересчёта (Sheet::RecalculateAsync), общее для потока
+// пересчёта и описателей. Поток проверяет cancelled между ячейками, поэтому
+// остановка не оставляет наполовину посчитанных значений: каждая
+// закешированная формула посчитана из актуальных значений влияющих.
+struct RecalculationState {
+    std::atomic<size_t> done{0};
+    size_t total = 0;
+    std::atomic<bool> cancelled{false};
+
+    std::mutex mutex;
+    std::condition_variable finished_cv;
+    bool finished = false;
+    bool completed = false;     // досчитан до конца
+    // диапазоны, которые попросили досчитать раньше остальных (под mutex);
+    // флаг позволяет не брать мьютекс, пока просьб нет
+    std::vector<Range> urgent;
+    std::atomic<bool> has_urgent{false};
+
+    // отмечает окончание пересчёта и будит ждущих
+    void Finish(bool completed);
+};
+
+// Описатель фонового пересчёта. Копии описывают один и тот же пересчёт;
+// описатель по умолчанию не связан ни с каким пересчётом и считается
+// завершённым.
+class RecalculationHandle {
+public:
+    struct Progress {
+        size_t done = 0;    // обработано формул листа
+        size_t total = 0;   // всего формул без значения на момент запуска
+    };
+
+    RecalculationHandle() = default;
+    explicit RecalculationHandle(std::shared_ptr<RecalculationState> state);
+
+    Progress GetProgress() const;
+    // пересчёт закончился: досчитан или остановлен
+    bool IsFinished() const;
+    bool IsCancelled() const;
+
+    // Ждёт окончания пересчёта; true, если он досчитан до конца
+    bool Wait() const;
+    // Просит поток остановиться после текущей ячейки и не ждёт его. Правка
+    // любого листа книги останавливает пересчёт сама и дожидается потока.
+    void Cancel();
+    // Формулы диапазона считаются раньше оставшихся (например, ставшая
+    // видимой область); уже посчитанные не трогаются
+    void Prioritize(Range range);
+
+private:
+    std::shared_ptr<RecalculationState> state_;
+};
@@ -2,60 +2,330 @@
 
 #include "cell.h"
 #include "common.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "workbook.h"
 
 #include <algorithm>
+#include <cassert>
 #include <functional>
 #include <iostream>
 #include <optional>
+#include <stdexcept>
 
 using namespace std::literals;
 
+namespace {
+
+// запись снимка перенесена в table_
+constexpr uint8_t SNAPSHOT_CELL_TAKEN = 1;
+// сохранённое в снимке значение формулы устарело
+constexpr uint8_t SNAPSHOT_CELL_STALE = 2;
+
+bool IsInside(const Range& range, Position pos) {
+    return range.first.row <= pos.row && pos.row <= range.last.row
+        && range.first.col <= pos.col && pos.col <= range.last.col;
+}
+
+}  // namespace
+
 Sheet::Sheet() 
-    : graph_(*this)
+    : graph_(std::make_shared<DependencyGraph>())
+{
+
+}
+
+Sheet::Sheet(Workbook* workbook, std::string name, std::shared_ptr<DependencyGraph> graph)
+    : graph_(std::move(graph)), workbook_(workbook), name_(std::move(name))
 {
 
 }
 
-Sheet::~Sheet() {}
+Sheet::~Sheet() {
+    graph_->CancelRecalculation();
+}
 
 void Sheet::SetCell(Position pos, std::string text) {
+    SPREADSHEET_TRACE_SPAN("set_cell", pos);
     ValidatePosition(pos);
-    if (table_.count(pos) && table_.at(pos).GetText() == text) {
+    graph_->GetSubscriptions().CheckNotDelivering();
+    graph_->CancelRecalculation();
+    Cell* cell = MaterializeCell(pos);
+    // формула сравнивается текстом, чтобы не разбирать её зря
+    if (cell && cell->GetFormula() && cell->GetTextRef() == text) {
         return;
     }
-    table_[pos].SetItems(pos, this, &graph_);
-    table_[pos].Set(text);
-    SetEmptyNewReferencedCells(table_.at(pos).GetReferencedCells());
+    auto [it, inserted] = table_.try_emplace(pos);
+    Cell& target = it->second;
+    try {
+        target.SetItems(pos, this);
+        // текст сравнивается уже подготовленным: длинный текст попадает в
+        // пул строк, и повтор того же текста -- та же запись пула
+        CellContent content = target.Prepare(std::move(text));
+        if (cell && cell->GetContent().IsSame(content)) {
+            return;
+        }
+        target.Set(std::move(content));
+    } catch (...) {
+        // неудачная правка не оставляет пустой ячейки
+        if (inserted) {
+            table_.erase(it);
+        }
+        throw;
+    }
+    if (journal_) {
+        journal_->LogSet(name_, pos, target.GetText());
+    }
     if (pos.row >= size_.rows) {
         size_.rows = pos.row + 1;
     }
     if (pos.col >= size_.cols) {
         size_.cols = pos.col + 1;
     }
+    graph_->GetSubscriptions().Deliver();
+}
+
+void Sheet::SetCells(std::vector<PreparedCell> cells) {
+    SPREADSHEET_TRACE_SPAN("set_cells");
+    for (const auto& cell : cells) {
+        ValidatePosition(cell.pos);
+    }
+    graph_->GetSubscriptions().CheckNotDelivering();
+    graph_->CancelRecalculation();
+
+    // оставляем последнюю запись для каждой позиции
+    std::unordered_map<Position, size_t, Position::Hasher> last_index;
+    last_index.reserve(cells.size());
+    for (size_t i = 0; i < cells.size(); ++i) {
+        last_index[cells[i].pos] = i;
+    }
+
+    std::vector<Position> new_cells;
+    std::vector<Cell*> targets;
+    std::vector<CellContent> contents;
+    std::vector<DependencyGraph::Change> changes;
+    targets.reserve(last_index.size());
+    contents.reserve(last_index.size());
+    changes.reserve(last_index.size());
+    table_.reserve(table_.size() + last_index.size());
+    auto rollback = [&] {
+        for (const auto& pos : new_cells) {
+            table_.erase(pos);
+        }
+    };
+    try {
+        for (size_t i = 0; i < cells.size(); ++i) {
+            auto& [pos, text, formula] = cells[i];
+            if (last_index.at(pos) != i) {
+                continue;
+            }
+            // ячейка снимка переносится, чтобы откат не потерял её содержимое
+            MaterializeCell(pos);
+            auto [it, inserted] = table_.try_emplace(pos);
+            if (inserted) {
+                new_cells.push_back(pos);
+            }
+            Cell& cell = it->second;
+            cell.SetItems(pos, this);
+            targets.push_back(&cell);
+            contents.push_back(cell.Prepare(std::move(text), std::move(formula)));
+            changes.push_back({{this, pos}, cell.GetReferencedNodes(contents.back()),
+                               cell.GetReferencedRangeNodes(contents.back())});
+        }
+    } catch (...) {
+        rollback();
+        throw;
+    }
+
+    if (!graph_->TryChangeCells(changes)) {
+        rollback();
+        throw CircularDependencyException("circular dependency");
+    }
+
+    for (size_t i = 0; i < changes.size(); ++i) {
+        Position pos = changes[i].node.pos;
+        targets[i]->SetPrepared(std::move(contents[i]));
+        size_.rows = std::max(size_.rows, pos.row + 1);
+        size_.cols = std::max(size_.cols, pos.col + 1);
+    }
+    if (journal_) {
+        for (size_t i = 0; i < changes.size(); ++i) {
+            journal_->LogSet(name_, changes[i].node.pos, targets[i]->GetText());
+        }
+    }
+    graph_->GetSubscriptions().Deliver();
+}
+
+void Sheet::SetNumbers(int column, int start_row, Span<const double> numbers) {
+    SPREADSHEET_TRACE_SPAN("set_numbers", Position{start_row, column});
+    ValidatePosition({start_row, column});
+    if (numbers.size() > static_cast<size_t>(Position::MAX_ROWS)) {
+        throw InvalidPositionException("Too many numbers for column " + Position{start_row, column}.ToString());
+    }
+    graph_->GetSubscriptions().CheckNotDelivering();
+    graph_->CancelRecalculation();
+    const int end_row = start_row + static_cast<int>(numbers.size());
+    ValidatePosition({std::max(start_row, end_row - 1), column});
+
+    std::vector<DependencyGraph::Change> changes;
+    changes.reserve(numbers.size());
+    for (int row = start_row; row < end_row; ++row) {
+        Position pos{row, column};
+        double number = numbers[row - start_row];
+        Cell* cell = MaterializeCell(pos);
+        if (cell && !cell->GetFormula()) {
+            auto value = cell->GetValueRef();
+            if (const double* old = std::get_if<double>(&value); old && *old == number) {
+                continue;
+            }
+        }
+        if (!cell) {
+            cell = &table_[pos];
+            cell->SetItems(pos, this);
+        }
+        cell->SetNumber(number);
+        changes.push_back({{this, pos}, {}, {}});
+    }
+    if (changes.empty()) {
+        return;
+    }
+    // у чисел нет ссылок, поэтому цикла быть не может: граф только убирает
+    // рёбра бывших формул и сбрасывает кеши зависимых
+    [[maybe_unused]] bool changed = graph_->TryChangeCells(changes);
+    assert(changed);
+
+    size_.rows = std::max(size_.rows, end_row);
+    size_.cols = std::max(size_.cols, column + 1);
+    if (journal_) {
+        for (const auto& change : changes) {
+            journal_->LogNumber(name_, change.node.pos, *table_.at(change.node.pos).GetNumber());
+        }
+    }
+    graph_->GetSubscriptions().Deliver();
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
     ValidatePosition(pos);
-    if (table_.count(pos)) {
-        return &table_.at(pos);
+    auto* sheet = const_cast<Sheet*>(this);
+    if (const Cell* cell = sheet->MaterializeCell(pos)) {
+        return cell;
     }
-    return nullptr;
+    // пустая ячейка, на которую ссылаются формулы: общий пустой объект
+    return graph_->HasDependents({sheet, pos}) ? &empty_cell_ : nullptr;
 }
+
 CellInterface* Sheet::GetCell(Position pos) {
     ValidatePosition(pos);
-    if (table_.count(pos)) {
-        return &table_.at(pos);
+    if (Cell* cell = MaterializeCell(pos)) {
+        return cell;
+    }
+    if (!graph_->HasDependents({this, pos})) {
+        return nullptr;
+    }
+    // через изменяемый указатель ячейку могут задать (CellInterface::Set),
+    // поэтому здесь она заводится в table_. Поток фонового пересчёта в это
+    // время читает table_, и вставка, как правка, сначала его останавливает.
+    graph_->CancelRecalculation();
+    Cell& cell = table_[pos];
+    cell.SetItems(pos, this);
+    return &cell;
+}
+
+CellInterface::ValueRef Sheet::GetValueRef(Position pos) const {
+    ValidatePosition(pos);
+    const Cell* cell = const_cast<Sheet*>(this)->MaterializeCell(pos);
+    return cell ? cell->GetValueRef() : std::string_view();
+}
+
+std::string_view Sheet::GetTextRef(Position pos) const {
+    ValidatePosition(pos);
+    const Cell* cell = const_cast<Sheet*>(this)->MaterializeCell(pos);
+    return cell ? cell->GetTextRef() : std::string_view();
+}
+
+Span<const Position> Sheet::GetReferencedCellsRef(Position pos) const {
+    ValidatePosition(pos);
+    const Cell* cell = const_cast<Sheet*>(this)->MaterializeCell(pos);
+    return cell ? cell->GetReferencedCellsRef() : Span<const Position>();
+}
+
+void Sheet::GetValues(Range range, const ValueBuffers& buffers) const {
+    if (!range.IsValid()) {
+        throw InvalidPositionException("Invalid range " + range.first.ToString() + ":" + range.last.ToString());
+    }
+    const Size size = range.GetSize();
+    const size_t count = static_cast<size_t>(size.rows) * size.cols;
+    if (buffers.numbers.size() < count || buffers.tags.size() < count) {
+        throw std::invalid_argument("value buffers are smaller than the range");
+    }
+    const bool texts = buffers.text_offsets && buffers.text_bytes;
+    if (texts) {
+        buffers.text_offsets->resize(count + 1);
+        buffers.text_bytes->clear();
+        (*buffers.text_offsets)[0] = 0;
+    }
+
+    std::vector<std::pair<const Cell*, size_t>> stack;
+    size_t i = 0;
+    for (int row = range.first.row; row <= range.last.row; ++row) {
+        for (int col = range.first.col; col <= range.last.col; ++col, ++i) {
+            const Cell* cell = const_cast<Sheet*>(this)->MaterializeCell({row, col});
+            double number = 0;
+            ValueTag tag = ValueTag::Empty;
+            if (cell && !cell->IsCashedValue()) {
+                EvaluateInOrder(*cell, stack);
+            }
+            // у формулы текст собирается лениво, поэтому пустоту проверяем без него
+            if (cell && (cell->GetFormula() || !cell->GetTextRef().empty())) {
+                auto value = cell->GetValueRef();
+                if (const auto* text = std::get_if<std::string_view>(&value)) {
+                    tag = ValueTag::Text;
+                    if (texts) {
+                        buffers.text_bytes->append(text->data(), text->size());
+                    }
+                } else if (const auto* x = std::get_if<double>(&value)) {
+                    tag = ValueTag::Number;
+                    number = *x;
+                } else {
+                    switch (std::get<FormulaError>(value).GetCategory()) {
+                    case FormulaError::Category::Ref:
+                        tag = ValueTag::RefError;
+                        break;
+                    case FormulaError::Category::Value:
+                        tag = ValueTag::ValueError;
+                        break;
+                    case FormulaError::Category::Div0:
+                        tag = ValueTag::Div0Error;
+                        break;
+                    case FormulaError::Category::NA:
+                        tag = ValueTag::NaError;
+                        break;
+                    }
+                }
+            }
+            buffers.numbers[i] = number;
+            buffers.tags[i] = tag;
+            if (texts) {
+                (*buffers.text_offsets)[i + 1] = static_cast<uint32_t>(buffers.text_bytes->size());
+            }
+        }
     }
-    return nullptr; 
 }
 
 void Sheet::ClearCell(Position pos) {
     ValidatePosition(pos);
-    if (!table_.count(pos)) {
+    graph_->GetSubscriptions().CheckNotDelivering();
+    graph_->CancelRecalculation();
+    if (!MaterializeCell(pos)) {
         return;
     }
     table_[pos].Clear();
     table_.erase(pos);
+    if (journal_) {
+        journal_->LogClear(name_, pos);
+    }
+    graph_->GetSubscriptions().Deliver();
 }
 
 Size Sheet::GetPrintableSize() const {
@@ -64,6 +334,7 @@ Size Sheet::GetPrintableSize() const {
 }
 
 void Sheet::PrintValues(std::ostream& output) const {
+    const_cast<Sheet*>(this)->MaterializeAll();
     RecalculateSize();
     for (int i = 0; i < size_.rows; ++i) {
         for (int k = 0; k < size_.cols; ++k) {
@@ -79,6 +350,7 @@ void Sheet::PrintValues(std::ostream& output) const {
 }
 
 void Sheet::PrintTexts(std::ostream& output) const {
+    const_cast<Sheet*>(this)->MaterializeAll();
     RecalculateSize();
     for (int i = 0; i < size_.rows; ++i) {
         for (int k = 0; k < size_.cols; ++k) {
@@ -93,6 +365,503 @@ void Sheet::PrintTexts(std::ostream& output) const {
     }
 }
 
+const SheetInterface* Sheet::FindSheet(std::string_view name) const {
+    return workbook_ ? workbook_->GetSheet(name) : nullptr;
+}
+
+SheetInterface* Sheet::FindSheet(std::string_view name) {
+    return workbook_ ? workbook_->GetSheet(name) : nullptr;
+}
+
+std::optional<int> Sheet::Lookup(const LookupValue& key, Range range, LookupMode mode) const {
+    if (!range.IsValid() || range.first.col != range.last.col) {
+        return SheetInterface::Lookup(key, range, mode);
+    }
+    auto normalized = NormalizeLookupValue(key);
+    if (!normalized) {
+        return std::nullopt;
+    }
+    SPREADSHEET_TRACE_SPAN("lookup", range.first);
+    std::lock_guard lock(lookup_mutex_);
+    const int col = range.first.col;
+    auto* sheet = const_cast<Sheet*>(this);
+    auto read = [sheet, col](int row) {
+        return ReadLookupValue(sheet->MaterializeCell({row, col}));
+    };
+    LookupIndex& index = lookup_indexes_.try_emplace({col, range.first.row, range.last.row},
+        range.first.row, range.last.row).first->second;
+    if (!index.IsComplete()) {
+        index.Reset();
+        const int rows = range.last.row - range.first.row + 1;
+        if (!snapshot_ && table_.size() < static_cast<size_t>(rows)) {
+            // в разреженном столбце дешевле пройти по заданным ячейкам; без
+            // снимка чтение значений не добавляет ячеек в table_
+            for (const auto& [pos, cell] : table_) {
+                if (pos.col == col && pos.row >= range.first.row && pos.row <= range.last.row) {
+                    index.Set(pos.row, ReadLookupValue(&cell));
+                }
+            }
+        } else {
+            for (int row = range.first.row; row <= range.last.row; ++row) {
+                index.Set(row, read(row));
+            }
+        }
+        index.SetComplete();
+    } else {
+        for (int row : index.TakeDirtyRows()) {
+            index.Set(row, read(row));
+        }
+    }
+    auto row = index.Find(*normalized, mode);
+    if (!row) {
+        return std::nullopt;
+    }
+    return *row - range.first.row;
+}
+
+ConditionalAggregate Sheet::Aggregate(Range criteria_range, const Criterion& criterion,
+                                     std::optional<Range> sum_range) const {
+    const bool by_columns = criteria_range.IsValid() && criteria_range.first.col == criteria_range.last.col
+        && (!sum_range || (sum_range->IsValid() && sum_range->first.col == sum_range->last.col
+            && sum_range->GetSize().rows == criteria_range.GetSize().rows));
+    if (!by_columns) {
+        return SheetInterface::Aggregate(criteria_range, criterion, sum_range);
+    }
+    auto normalized = NormalizeLookupValue(criterion.value);
+    if (!normalized) {
+        return {};
+    }
+    SPREADSHEET_TRACE_SPAN("aggregate", criteria_range.first);
+    std::lock_guard lock(lookup_mutex_);
+    const Position criteria = criteria_range.first;
+    const Position sum = sum_range ? sum_range->first : criteria;
+    const int rows = criteria_range.last.row - criteria.row + 1;
+    auto* sheet = const_cast<Sheet*>(this);
+    AggregateIndex& index = aggregate_indexes_.try_emplace({criteria.col, criteria.row, criteria_range.last.row,
+        sum.col, sum.row}, rows).first->second;
+    auto read = [sheet, &index, criteria, sum](int row) {
+        const Cell* cell = sheet->MaterializeCell({criteria.row + row, criteria.col});
+        auto key = ReadLookupValue(cell);
+        if (!(sum == criteria)) {
+            cell = sheet->MaterializeCell({sum.row + row, sum.col});
+        }
+        index.Set(row, std::move(key), ReadAggregateValue(cell));
+    };
+    if (!index.IsComplete()) {
+        index.Reset();
+        if (!snapshot_ && table_.size() < static_cast<size_t>(rows)) {
+            // в разреженных столбцах читаются только строки с ячейками
+            std::vector<int> filled;
+            for (const auto& [pos, _] : table_) {
+                if (pos.col == criteria.col && pos.row >= criteria.row && pos.row < criteria.row + rows) {
+                    filled.push_back(pos.row - criteria.row);
+                } else if (pos.col == sum.col && pos.row >= sum.row && pos.row < sum.row + rows) {
+                    filled.push_back(pos.row - sum.row);
+                }
+            }
+            std::sort(filled.begin(), filled.end());
+            filled.erase(std::unique(filled.begin(), filled.end()), filled.end());
+            for (int row : filled) {
+                read(row);
+            }
+        } else {
+            for (int row = 0; row < rows; ++row) {
+                read(row);
+            }
+        }
+        index.SetComplete();
+    } else {
+        for (int row : index.TakeDirtyRows()) {
+            read(row);
+        }
+    }
+    return index.Aggregate({criterion.op, std::move(*normalized)});
+}
+
+void Sheet::InvalidateLookups(Position pos) {
+    for (auto it = lookup_indexes_.lower_bound({pos.col, 0, 0});
+         it != lookup_indexes_.end() && std::get<0>(it->first) == pos.col; ++it) {
+        const auto [col, first_row, last_row] = it->first;
+        if (pos.row >= first_row && pos.row <= last_row) {
+            it->second.MarkDirty(pos.row);
+        }
+    }
+    // различных диапазонов условий на листе немного, они просматриваются все
+    for (auto& [key, index] : aggregate_indexes_) {
+        const auto [criteria_col, first_row, last_row, sum_col, sum_first_row] = key;
+        if (pos.col == criteria_col && pos.row >= first_row && pos.row <= last_row) {
+            index.MarkDirty(pos.row - first_row);
+        }
+        if (pos.col == sum_col && pos.row >= sum_first_row && pos.row <= sum_first_row + last_row - first_row) {
+            index.MarkDirty(pos.row - sum_first_row);
+        }
+    }
+}
+
+const std::string& Sheet::GetName() const {
+    return name_;
+}
+
+StringPool& Sheet::GetStringPool() {
+    return strings_;
+}
+
+SubexpressionTable& Sheet::GetSubexpressions() {
+    return subexpressions_;
+}
+
+DependencyGraph& Sheet::GetGraph() const {
+    return *graph_;
+}
+
+void Sheet::Recalculate() {
+    SPREADSHEET_TRACE_SPAN("recalculate");
+    graph_->GetSubscriptions().CheckNotDelivering();
+    graph_->CancelRecalculation();
+    graph_->ApplyPendingChanges();
+    MaterializeAll();
+    std::vector<std::pair<const Cell*, size_t>> stack;
+    for (const auto& [_, cell] : table_) {
+        if (!cell.IsCashedValue()) {
+            EvaluateInOrder(cell, stack);
+        }
+    }
+    graph_->GetSubscriptions().Deliver();
+}
+
+RecalculationHandle Sheet::RecalculateAsync(std::vector<Range> priority) {
+    SPREADSHEET_TRACE_SPAN("recalculate_async");
+    for (const auto& range : priority) {
+        if (!range.IsValid()) {
+            throw InvalidPositionException("Invalid range " + range.ToString());
+        }
+    }
+    graph_->GetSubscriptions().CheckNotDelivering();
+    graph_->CancelRecalculation();
+    graph_->ApplyPendingChanges();
+    const auto& visible = graph_->GetVisibleRanges(this);
+    priority.insert(priority.end(), visible.begin(), visible.end());
+    // поток вычисляет и ячейки других листов книги, а перенос из снимка
+    // меняет таблицу листа, поэтому всё переносится заранее
+    if (workbook_) {
+        for (const auto& name : workbook_->GetSheetNames()) {
+            workbook_->GetSheet(name)->MaterializeAll();
+        }
+    } else {
+        MaterializeAll();
+    }
+
+    std::vector<const Cell*> roots;
+    std::vector<const Cell*> rest;
+    for (const auto& [pos, cell] : table_) {
+        if (cell.IsCashedValue()) {
+            continue;
+        }
+        bool urgent = std::any_of(priority.begin(), priority.end(), [pos = pos](const Range& range) {
+            return IsInside(range, pos);
+        });
+        (urgent ? roots : rest).push_back(&cell);
+    }
+    roots.insert(roots.end(), rest.begin(), rest.end());
+
+    // подписчики получают новые значения сразу, до запуска потока
+    graph_->GetSubscriptions().Deliver();
+    auto state = std::make_shared<RecalculationState>();
+    state->total = roots.size();
+    graph_->StartRecalculation(state, [this, state = state.get(), roots = std::move(roots)] {
+        RunRecalculation(*state, roots);
+    });
+    return RecalculationHandle(std::move(state));
+}
+
+void Sheet::SetCalculationMode(CalculationMode mode) {
+    graph_->GetSubscriptions().CheckNotDelivering();
+    graph_->CancelRecalculation();
+    graph_->SetCalculationMode(mode);
+    graph_->GetSubscriptions().Deliver();
+}
+
+CalculationMode Sheet::GetCalculationMode() const {
+    return graph_->GetCalculationMode();
+}
+
+void Sheet::SetVisibleRanges(std::vector<Range> ranges) {
+    for (const auto& range : ranges) {
+        if (!range.IsValid()) {
+            throw InvalidPositionException("Invalid range " + range.ToString());
+        }
+    }
+    graph_->GetSubscriptions().CheckNotDelivering();
+    graph_->CancelRecalculation();
+    graph_->SetVisibleRanges(this, std::move(ranges));
+    graph_->GetSubscriptions().Deliver();
+}
+
+uint64_t Sheet::Subscribe(Range range, ChangeCallback callback) {
+    if (!range.IsValid()) {
+        throw InvalidPositionException("Invalid range " + range.ToString());
+    }
+    graph_->GetSubscriptions().CheckNotDelivering();
+    graph_->CancelRecalculation();
+    return graph_->GetSubscriptions().Add(this, range, std::move(callback));
+}
+
+bool Sheet::Unsubscribe(uint64_t id) {
+    return graph_->GetSubscriptions().Remove(id);
+}
+
+std::vector<Range> Sheet::GetVisibleRanges() const {
+    return graph_->GetVisibleRanges(const_cast<Sheet*>(this));
+}
+
+bool Sheet::IsStale(Position pos) const {
+    ValidatePosition(pos);
+    return graph_->IsPendingDependent({const_cast<Sheet*>(this), pos});
+}
+
+void Sheet::ForEachCell(const std::function<void(Position, const Cell&)>& func) const {
+    const_cast<Sheet*>(this)->MaterializeAll();
+    for (const auto& [pos, cell] : table_) {
+        func(pos, cell);
+    }
+}
+
+void Sheet::AttachSnapshot(std::shared_ptr<const SnapshotImage> snapshot) {
+    graph_->GetSubscriptions().CheckNotDelivering();
+    graph_->CancelRecalculation();
+    if (!table_.empty() || snapshot_) {
+        throw SnapshotException("snapshot can be loaded only into an empty sheet");
+    }
+    const size_t n = snapshot->GetCellCount();
+    std::vector<DependencyGraph::Change> changes;
+    for (size_t i = 0; i < n; ++i) {
+        const auto& record = snapshot->GetCell(i);
+        if (record.references_count == 0) {
+            continue;
+        }
+        auto& change = changes.emplace_back();
+        change.node = {this, {record.row, record.col}};
+        change.referenced_cells.reserve(record.references_count);
+        const SnapshotReference* references = snapshot->GetReferences(record);
+        for (uint32_t k = 0; k < record.references_count; ++k) {
+            const auto& reference = references[k];
+            Position pos{reference.row, reference.col};
+            SheetInterface* sheet = this;
+            if (reference.sheet_size != 0) {
+                auto sheet_name = snapshot->GetSheetName(reference);
+                sheet = FindSheet(sheet_name);
+                if (!sheet) {
+                    throw SnapshotException("unknown sheet " + std::string(sheet_name));
+                }
+            }
+            if (reference.kind != SNAPSHOT_REFERENCE_RANGE) {
+                change.referenced_cells.push_back({sheet, pos});
+                continue;
+            }
+            // диапазон занимает две записи: вторая -- его правый нижний угол
+            if (++k == record.references_count) {
+                throw SnapshotException("corrupted snapshot: truncated range reference");
+            }
+            Range range{pos, {references[k].row, references[k].col}};
+            if (!range.IsValid()) {
+                throw SnapshotException("corrupted snapshot: bad range reference");
+            }
+            change.referenced_ranges.push_back({sheet, range});
+        }
+    }
+    graph_->RestoreCells(changes);
+    lookup_indexes_.clear();
+    aggregate_indexes_.clear();
+    snapshot_state_.assign(n, 0);
+    snapshot_ = std::move(snapshot);
+}
+
+void Sheet::ResetCashedValue(Position pos) {
+    InvalidateLookups(pos);
+    if (auto it = table_.find(pos); it != table_.end()) {
+        it->second.ResetCashedValue();
+        return;
+    }
+    if (!snapshot_) {
+        return;
+    }
+    if (auto index = snapshot_->Find(pos)) {
+        snapshot_state_[*index] |= SNAPSHOT_CELL_STALE;
+    }
+}
+
+void Sheet::SetJournal(Journal* journal) {
+    journal_ = journal;
+}
+
+SheetStats Sheet::GetStats() const {
+    SheetStats stats;
+    stats.engine = GetEngineStats();
+    stats.live_cells = table_.size();
+    for (uint8_t state : snapshot_state_) {
+        stats.live_cells += !(state & SNAPSHOT_CELL_TAKEN);
+    }
+    stats.live_edges = graph_->GetReferenceCount(this);
+    stats.pooled_strings = strings_.GetSize();
+    stats.pooled_bytes = strings_.GetBytes();
+    stats.shared_subexpressions = subexpressions_.GetSize();
+    stats.subexpression_uses = subexpressions_.GetUses();
+    return stats;
+}
+
+std::vector<CellProfile> Sheet::GetProfile(ProfileOrder order, size_t top) const {
+    auto profiles = GetCellProfiles();
+    profiles.erase(std::remove_if(profiles.begin(), profiles.end(), [this](const CellProfile& profile) {
+        return profile.sheet != this;
+    }), profiles.end());
+    RankProfiles(profiles, order, top);
+    for (auto& profile : profiles) {
+        profile.cone_size = graph_->GetDependentCount({profile.sheet, profile.pos});
+    }
+    return profiles;
+}
+
+Cell* Sheet::MaterializeCell(Position pos) {
+    if (auto it = table_.find(pos); it != table_.end()) {
+        return &it->second;
+    }
+    if (!snapshot_) {
+        return nullptr;
+    }
+    auto index = snapshot_->Find(pos);
+    if (!index || (snapshot_state_[*index] & SNAPSHOT_CELL_TAKEN)) {
+        return nullptr;
+    }
+    return MaterializeSnapshotCell(*index);
+}
+
+Cell* Sheet::MaterializeSnapshotCell(size_t index) {
+    const auto& record = snapshot_->GetCell(index);
+    Position pos{record.row, record.col};
+    snapshot_state_[index] |= SNAPSHOT_CELL_TAKEN;
+    // пустые записи бывают в снимках, сохранённых, когда пустые ячейки
+    // под ссылками ещё хранились в table_
+    if (record.text_size == 0) {
+        return nullptr;
+    }
+
+    Cell& cell = table_[pos];
+    cell.SetItems(pos, this);
+    if (record.code_size == 0 && record.value_type == SnapshotValueType::Number) {
+        cell.SetNumber(record.number);
+        return &cell;
+    }
+    if (record.code_size == 0) {
+        cell.SetPrepared(cell.Prepare(std::string(snapshot_->GetText(record))));
+        return &cell;
+    }
+    auto impl = std::make_unique<FormulaImpl>(LoadFormula(snapshot_->GetCode(record)), pos, this);
+    if (!(snapshot_state_[index] & SNAPSHOT_CELL_STALE)) {
+        if (record.value_type == SnapshotValueType::Number) {
+            impl->SetCashedValue(record.number);
+        } else if (record.value_type == SnapshotValueType::Error) {
+            impl->SetCashedValue(FormulaError(static_cast<FormulaError::Category>(record.error)));
+        }
+    }
+    cell.SetPrepared(CellContent::FromFormula(std::move(impl)));
+    return &cell;
+}
+
+void Sheet::MaterializeAll() {
+    if (!snapshot_) {
+        return;
+    }
+    table_.reserve(table_.size() + snapshot_->GetCellCount());
+    for (size_t i = 0; i < snapshot_state_.size(); ++i) {
+        if (!(snapshot_state_[i] & SNAPSHOT_CELL_TAKEN)) {
+            MaterializeSnapshotCell(i);
+        }
+    }
+    // все записи перенесены, снимок больше не нужен
+    snapshot_.reset();
+    snapshot_state_.clear();
+}
+
+void Sheet::EvaluateInOrder(const Cell& root, std::vector<std::pair<const Cell*, size_t>>& stack,
+    const std::atomic<bool>* cancelled) const {
+    // ячейка попадает на стек только без кеша, а вычисляется после всех
+    // своих влияющих; дважды на стек она не попадёт, так как циклов нет
+    stack.clear();
+    stack.push_back({&root, 0});
+    while (!stack.empty()) {
+        if (cancelled && *cancelled) {
+            return;
+        }
+        auto& [cell, next] = stack.back();
+        auto references = cell->GetReferencedCellsRef();
+        if (next < references.size()) {
+            Position pos = references[next++];
+            const Cell* referenced = pos.IsValid() ? const_cast<Sheet*>(this)->MaterializeCell(pos) : nullptr;
+            if (referenced && !referenced->IsCashedValue()) {
+                stack.push_back({referenced, 0});
+            }
+            continue;
+        }
+        cell->GetValue();
+        stack.pop_back();
+    }
+}
+
+void Sheet::RunRecalculation(RecalculationState& state, const std::vector<const Cell*>& roots) {
+    std::vector<std::pair<const Cell*, size_t>> stack;
+    std::vector<Range> urgent;
+    for (const Cell* root : roots) {
+        if (state.has_urgent) {
+            {
+                std::lock_guard lock(state.mutex);
+                urgent.swap(state.urgent);
+                state.has_urgent = false;
+            }
+            for (const auto& range : urgent) {
+                EvaluateRange(range, stack, state.cancelled);
+            }
+            urgent.clear();
+        }
+        {
+            auto lock = graph_->LockEvaluation();
+            if (!root->IsCashedValue()) {
+                EvaluateInOrder(*root, stack, &state.cancelled);
+            }
+        }
+        if (state.cancelled) {
+            return;
+        }
+        ++state.done;
+    }
+}
+
+void Sheet::EvaluateRange(Range range, std::vector<std::pair<const Cell*, size_t>>& stack,
+    const std::atomic<bool>& cancelled) {
+    auto evaluate = [&](const Cell& cell) {
+        auto lock = graph_->LockEvaluation();
+        if (!cancelled && !cell.IsCashedValue()) {
+            EvaluateInOrder(cell, stack, &cancelled);
+        }
+    };
+    // перебирается диапазон либо ячейки листа -- что короче
+    const Size size = range.GetSize();
+    if (static_cast<size_t>(size.rows) * size.cols > table_.size()) {
+        for (const auto& [pos, cell] : table_) {
+            if (IsInside(range, pos)) {
+                evaluate(cell);
+            }
+        }
+        return;
+    }
+    for (int row = range.first.row; row <= range.last.row; ++row) {
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+            if (auto it = table_.find({row, col}); it != table_.end()) {
+                evaluate(it->second);
+            }
+        }
+    }
+}
+
 void Sheet::ValidatePosition(Position pos) {
     if (!pos.IsValid()) {
         throw InvalidPositionException("Invalid position " + pos.ToString());
@@ -100,28 +869,24 @@ void Sheet::ValidatePosition(Position pos) {
 }
   
 void Sheet::RecalculateSize() const {
-    if (table_.empty()) {
-        size_ = Size{0, 0};
-        return;
-    }
     int max_col = -1;
     int max_row = -1;
-    for (const auto& [pos, _] : table_) {
-        if (table_.at(pos).GetText().empty()) {
+    for (const auto& [pos, cell] : table_) {
+        if (cell.GetContent().IsEmpty()) {
             continue;
         }
         max_row = std::max(pos.row, max_row);
         max_col = std::max(pos.col, max_col);
     } 
-    size_ = Size{max_row + 1, max_col + 1};
-}
-
-void Sheet::SetEmptyNewReferencedCells(const std::vector<Position>& referenced_cells) {
-    for (const auto& cell : referenced_cells) {
-        if (!table_.count(cell)) {
-            table_[cell].Set("");
+    // ещё не перенесённые ячейки снимка
+    for (size_t i = 0; i < snapshot_state_.size(); ++i) {
+        const auto& record = snapshot_->GetCell(i);
+        if (!(snapshot_state_[i] & SNAPSHOT_CELL_TAKEN) && record.text_size != 0) {
+            max_row = std::max(record.row, max_row);
+            max_col = std::max(record.col, max_col);
         }
     }
+    size_ = Size{max_row + 1, max_col + 1};
 }
 
 std::unique_ptr<SheetInterface> CreateSheet() {
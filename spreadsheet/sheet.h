@@ -2,38 +2,262 @@
 
 #include "cell.h"
 #include "common.h"
+#include "aggregate.h"
+#include "lookup.h"
+#include "metrics.h"
+#include "profile.h"
+#include "recalculation.h"
+#include "subexpressions.h"
+#include "subscriptions.h"
 
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <tuple>
 #include <unordered_map>
 #include <functional>
 
 
+class Journal;
+class Workbook;
+class SnapshotImage;
+
+// Содержимое ячейки, подготовленное заранее (например, потоком импорта):
+// если текст -- формула, её можно передать уже разобранной
+struct PreparedCell {
+    Position pos;
+    std::string text;
+    std::unique_ptr<FormulaInterface> formula = nullptr;
+};
+
+// Тип значения ячейки в буферах GetValues; ошибки различаются категорией
+enum class ValueTag : uint8_t {
+    Empty,
+    Number,
+    Text,
+    RefError,
+    ValueError,
+    Div0Error,
+    NaError,
+};
+
+// Буферы вызывающего для Sheet::GetValues. Ячейки диапазона лежат по
+// строкам, в порядке хранения: у ячейки (first.row + r, first.col + c)
+// индекс r * cols + c, так что диапазон из одного столбца даёт сплошной
+// столбец значений.
+// numbers и tags должны вмещать весь диапазон; у не чисел в numbers 0.
+// Если заданы text_offsets и text_bytes, тексты складываются подряд в
+// text_bytes: текст ячейки i -- [text_offsets[i], text_offsets[i + 1]).
+// Векторы перезаписываются с сохранением ёмкости, поэтому повторный вызов с
+// теми же буферами не выделяет память.
+struct ValueBuffers {
+    Span<double> numbers;
+    Span<ValueTag> tags;
+    std::vector<uint32_t>* text_offsets = nullptr;
+    std::string* text_bytes = nullptr;
+};
+
 class Sheet : public SheetInterface {
 public:
     Sheet();
+    // лист книги: ячейки листа попадают в общий граф зависимостей книги
+    Sheet(Workbook* workbook, std::string name, std::shared_ptr<DependencyGraph> graph);
     ~Sheet();
 
     void SetCell(Position pos, std::string text) override;
+    // Задаёт содержимое сразу многих ячеек одной операцией над графом
+    // зависимостей. При повторе позиции побеждает последняя запись. Если пачка
+    // создаёт цикл, бросает CircularDependencyException и лист не меняется.
+    void SetCells(std::vector<PreparedCell> cells);
+    // Записывает числа в столбец column начиная со строки start_row без
+    // разбора текста: ячейки становятся числовыми (их текст -- запись
+    // числа). Кеши зависимых от всего блока сбрасываются одним обходом
+    // графа; ячейки, где число не изменилось, не трогаются. Бросает
+    // InvalidPositionException, если блок выходит за пределы листа.
+    void SetNumbers(int column, int start_row, Span<const double> numbers);
      
     const CellInterface* GetCell(Position pos) const override;
+    // Пустая ячейка под ссылкой заводится в листе, чтобы её можно было
+    // задать через указатель; как и правка, это останавливает фоновый
+    // пересчёт (RecalculateAsync)
     CellInterface* GetCell(Position pos) override;
 
     void ClearCell(Position pos) override;
+
+    // Чтение без копирования и без выделений памяти (см. Cell::GetValueRef):
+    // результат действителен до следующего изменения листа. Пустая ячейка
+    // даёт пустую строку и пустой диапазон.
+    CellInterface::ValueRef GetValueRef(Position pos) const;
+    std::string_view GetTextRef(Position pos) const;
+    Span<const Position> GetReferencedCellsRef(Position pos) const;
+
+    // Заполняет буферы значениями диапазона за один проход по ячейкам.
+    // Формулы без кеша вычисляются вместе с влияющими ячейками в порядке
+    // зависимостей, без глубокой рекурсии. Бросает InvalidPositionException
+    // для недопустимого диапазона и std::invalid_argument, если буферы малы.
+    void GetValues(Range range, const ValueBuffers& buffers) const;
       
     Size GetPrintableSize() const override;
 
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
 
+    const SheetInterface* FindSheet(std::string_view name) const override;
+    SheetInterface* FindSheet(std::string_view name) override;
+
+    // Поиск в диапазоне одного столбца идёт по индексу этого отрезка
+    // столбца (см. lookup.h): он строится при первом поиске и дальше
+    // обновляется по отметкам InvalidateLookups. Поиск в строке
+    // просматривает её целиком.
+    std::optional<int> Lookup(const LookupValue& key, Range range, LookupMode mode) const override;
+    // Условия над столбцом (и суммирование по столбцу той же высоты)
+    // считаются по индексу, сгруппированному по значению условия (см.
+    // aggregate.h): формулы с разными условиями над одним диапазоном делят
+    // один индекс. Прочие диапазоны просматриваются целиком.
+    ConditionalAggregate Aggregate(Range criteria_range, const Criterion& criterion,
+        std::optional<Range> sum_range) const override;
+    // Отмечает, что значение ячейки могло измениться, в индексах поиска и
+    // агрегатов, покрывающих её; вызывается графом зависимостей при правке ячейки и при
+    // сбросе её кеша
+    void InvalidateLookups(Position pos);
+
+    const std::string& GetName() const;
+
+    // граф зависимостей листа; у листов книги он общий
+    DependencyGraph& GetGraph() const;
+    // пул длинных текстов ячеек листа (см. string_pool.h)
+    StringPool& GetStringPool();
+    // общие подвыражения формул листа (см. subexpressions.h)
+    SubexpressionTable& GetSubexpressions();
+
+    // Вычисляет и кеширует значения всех формул листа в порядке
+    // зависимостей. Сначала применяет правки, накопленные в ручном режиме
+    // (во всей книге, если лист в книге).
+    void Recalculate();
+    // Пересчитывает то же в фоновом потоке и сразу возвращает описатель
+    // пересчёта (см. recalculation.h) с ходом и отменой. Формулы из
+    // диапазонов priority считаются первыми; RecalculationHandle::Prioritize
+    // поднимает диапазон в очереди уже во время пересчёта. Пока пересчёт
+    // идёт, лист можно читать из вызывающего потока: чтение формулы ждёт,
+    // пока поток досчитает текущую ячейку, и вычисляет запрошенную вне
+    // очереди; чтение текста числа (запись собирается при первом чтении)
+    // тоже ждёт текущую ячейку. Правка любого листа книги (и новый пересчёт) сначала
+    // останавливает поток и дожидается его, так что посчитанные им значения
+    // остаются согласованными. Видимые области листа (SetVisibleRanges)
+    // считаются первыми вместе с priority. Бросает InvalidPositionException
+    // для недопустимого диапазона.
+    RecalculationHandle RecalculateAsync(std::vector<Range> priority = {});
+
+    // Режим пересчёта (см. DependencyGraph::SetCalculationMode); у листов
+    // книги он общий. В ручном режиме формула, зависящая от правки, до
+    // Recalculate отдаёт последнее посчитанное значение, а IsStale
+    // сообщает, что оно могло устареть. Формула без значения (например,
+    // только что заданная) считается при чтении из текущих значений ячеек.
+    void SetCalculationMode(CalculationMode mode);
+    CalculationMode GetCalculationMode() const;
+    bool IsStale(Position pos) const;
+
+    // Области листа, которые сейчас видит пользователь (пустой список --
+    // ни одной). В режиме CalculationMode::Viewport правка сразу обновляет
+    // только их и влияющие на них ячейки, а остальное откладывается до
+    // Recalculate или RecalculateAsync в свободное время. Бросает
+    // InvalidPositionException для недопустимого диапазона.
+    void SetVisibleRanges(std::vector<Range> ranges);
+    std::vector<Range> GetVisibleRanges() const;
+
+    // Подписка на значения диапазона (см. subscriptions.h). После каждой
+    // операции над листами книги (SetCell, SetCells, SetNumbers, ClearCell,
+    // пересчёт, смена режима или видимых областей) подписка получает одну
+    // пачку со старыми и новыми значениями изменившихся ячеек диапазона. В
+    // ручном режиме формулы меняются только при пересчёте. Загрузка снимка
+    // подписчиков не уведомляет. Колбэк может читать листы и отменять
+    // подписки; операции, меняющие листы книги (и Subscribe), бросают из
+    // него std::logic_error. Исключение колбэка выходит из операции, после
+    // которой шла доставка, когда остальные подписки получили свои пачки.
+    // Возвращает номер подписки; бросает InvalidPositionException для
+    // недопустимого диапазона.
+    uint64_t Subscribe(Range range, ChangeCallback callback);
+    // false, если подписки с таким номером нет
+    bool Unsubscribe(uint64_t id);
+
+    // Обходит все ячейки листа, кроме пустых ячеек, на которые только
+    // ссылаются формулы. Порядок обхода не определён.
+    void ForEachCell(const std::function<void(Position, const Cell&)>& func) const;
+
+    // Подключает снимок (см. snapshot.h) к пустому листу: рёбра графа
+    // восстанавливаются сразу, ячейки переносятся из снимка при первом
+    // обращении. Бросает SnapshotException, если лист не пуст.
+    void AttachSnapshot(std::shared_ptr<const SnapshotImage> snapshot);
+
+    // Сбрасывает кеш значения ячейки, в том числе ещё не перенесённой из снимка
+    void ResetCashedValue(Position pos);
+
+    // Успешные правки листа (SetCell, SetCells, ClearCell) записываются в
+    // журнал (см. journal.h); nullptr отключает запись
+    void SetJournal(Journal* journal);
+
+    // Метрики движка (см. metrics.h) и размер листа. Счётчики движка общие
+    // для всех листов процесса; без SPREADSHEET_METRICS они нулевые.
+    SheetStats GetStats() const;
+
+    // Самые дорогие ячейки листа за сеанс профилирования (см. profile.h)
+    // с размером конуса зависимых ячеек
+    std::vector<CellProfile> GetProfile(ProfileOrder order = ProfileOrder::ExclusiveTime, size_t top = 20) const;
+
     static void ValidatePosition(Position pos);
 
 private:
+    // объявлен раньше table_, чтобы пережить ячейки, ссылающиеся на него
+    StringPool strings_;
+    // объявлена раньше table_ по той же причине
+    SubexpressionTable subexpressions_;
+    // заданные ячейки; пустая позиция, на которую только ссылаются формулы,
+    // есть лишь в графе зависимостей, а GetCell отдаёт для неё empty_cell_
     std::unordered_map<Position, Cell, Position::Hasher> table_;
-    DependencyGraph graph_;
+    Cell empty_cell_;
+    std::shared_ptr<DependencyGraph> graph_;
+    Workbook* workbook_ = nullptr;
+    std::string name_;
+    Journal* journal_ = nullptr;
     mutable Size size_ = {0, 0}; 
+
+    // состояние записей снимка, см. SNAPSHOT_CELL_*
+    std::shared_ptr<const SnapshotImage> snapshot_;
+    std::vector<uint8_t> snapshot_state_;
+
+    // индексы поиска по (столбец, первая строка, последняя строка); живут,
+    // пока жив лист. Листы книги считаются параллельно, и формулы разных
+    // листов могут искать в этом листе одновременно, поэтому поиск идёт под
+    // мьютексом (рекурсивным: значение ячейки в индексе может само
+    // вычисляться поиском в другом отрезке листа). Правки листа не
+    // потокобезопасны, как и раньше, и отмечают строки без блокировки.
+    mutable std::map<std::tuple<int, int, int>, LookupIndex> lookup_indexes_;
+    // индексы агрегатов по (столбец условий, первая строка, последняя
+    // строка, столбец суммирования, его первая строка); под тем же мьютексом
+    mutable std::map<std::tuple<int, int, int, int, int>, AggregateIndex> aggregate_indexes_;
+    mutable std::recursive_mutex lookup_mutex_;
     
-    void SetEmptyNewReferencedCells(const std::vector<Position>& referenced_cells);
     void RecalculateSize() const;
 
+    // Ячейка из table_ либо перенесённая из снимка; nullptr, если её нет.
+    // Перенос не меняет видимого содержимого листа, поэтому константные
+    // методы тоже вызывают его.
+    Cell* MaterializeCell(Position pos);
+    Cell* MaterializeSnapshotCell(size_t index);
+    void MaterializeAll();
+
+    // Вычисляет формулу root, сначала вычислив влияющие ячейки листа без
+    // кеша (обход в глубину на явном стеке). Возвращается досрочно, если
+    // задан cancelled и он выставлен.
+    void EvaluateInOrder(const Cell& root, std::vector<std::pair<const Cell*, size_t>>& stack,
+        const std::atomic<bool>* cancelled = nullptr) const;
+    // тело потока RecalculateAsync: формулы roots по порядку, каждая под
+    // замком вычислений графа, с просьбами Prioritize между ними
+    void RunRecalculation(RecalculationState& state, const std::vector<const Cell*>& roots);
+    void EvaluateRange(Range range, std::vector<std::pair<const Cell*, size_t>>& stack,
+        const std::atomic<bool>& cancelled);
+
 };
 
 std::ostream& operator<<(std::ostream& out, const CellInterface::Value& value);
@@ -0,0 +1,331 @@
+#include "snapshot.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <utility>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SPREADSHEET_HAS_MMAP 1
+#elif defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+namespace {
+
+constexpr char SNAPSHOT_MAGIC[8] = "SPSHEET";
+
+// [offset, offset + size) лежит внутри [0, limit) без переполнения
+bool Fits(uint64_t offset, uint64_t size, uint64_t limit) {
+    return offset <= limit && size <= limit - offset;
+}
+
+uint64_t AlignTo8(uint64_t offset) {
+    return (offset + 7) & ~uint64_t(7);
+}
+
+bool ReadWholeFile(const std::string& path, std::vector<char>& buffer) {
+    std::ifstream input(path, std::ios::binary);
+    if (!input) {
+        return false;
+    }
+    buffer.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+    return !input.bad();
+}
+
+// Сбрасывает на диск содержимое файла или каталога (в каталоге -- записи о
+// переименованных файлах). В Windows каталог не открыть: переименование
+// там сохраняет журнал NTFS.
+bool SyncPath(const std::string& path, bool directory) {
+#if defined(__unix__) || defined(__APPLE__)
+    int fd = ::open(path.c_str(), directory ? O_RDONLY : O_WRONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = ::fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+#elif defined(_WIN32)
+    if (directory) {
+        return true;
+    }
+    int fd = ::_open(path.c_str(), _O_WRONLY | _O_BINARY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = ::_commit(fd) == 0;
+    ::_close(fd);
+    return ok;
+#else
+    (void)path;
+    (void)directory;
+    return true;
+#endif
+}
+
+}  // namespace
+
+SnapshotImage::SnapshotImage(const std::string& path) {
+#ifdef SPREADSHEET_HAS_MMAP
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw SnapshotException("cannot open " + path);
+    }
+    struct stat st;
+    if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            data_ = static_cast<const char*>(data);
+            size_ = st.st_size;
+            mapped_ = true;
+        }
+    }
+    ::close(fd);
+#endif
+    if (!mapped_) {
+        if (!ReadWholeFile(path, buffer_)) {
+            throw SnapshotException("cannot read " + path);
+        }
+        data_ = buffer_.data();
+        size_ = buffer_.size();
+    }
+
+    try {
+        Validate();
+    } catch (...) {
+#ifdef SPREADSHEET_HAS_MMAP
+        if (mapped_) {
+            ::munmap(const_cast<char*>(data_), size_);
+        }
+#endif
+        throw;
+    }
+}
+
+SnapshotImage::~SnapshotImage() {
+#ifdef SPREADSHEET_HAS_MMAP
+    if (mapped_) {
+        ::munmap(const_cast<char*>(data_), size_);
+    }
+#endif
+}
+
+void SnapshotImage::Validate() {
+    if (size_ < sizeof(SnapshotHeader)) {
+        throw SnapshotException("not a snapshot: file is too short");
+    }
+    // отображение выровнено по странице, буфер vector -- по max_align_t
+    auto* header = reinterpret_cast<const SnapshotHeader*>(data_);
+    if (std::memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+        throw SnapshotException("not a snapshot: bad magic");
+    }
+    if (header->byte_order != SNAPSHOT_BYTE_ORDER) {
+        throw SnapshotException("snapshot was written on a machine with another byte order");
+    }
+    if (header->version == 0 || header->version > SNAPSHOT_VERSION) {
+        throw SnapshotException("unsupported snapshot version " + std::to_string(header->version));
+    }
+    if (header->cells_offset % 8 != 0 || header->references_offset % 8 != 0
+        || !Fits(header->cells_offset, uint64_t(header->cell_count) * sizeof(SnapshotCell), size_)
+        || header->reference_count > size_ / sizeof(SnapshotReference)
+        || !Fits(header->references_offset, header->reference_count * sizeof(SnapshotReference), size_)
+        || !Fits(header->strings_offset, header->strings_size, size_)) {
+        throw SnapshotException("corrupted snapshot: bad table bounds");
+    }
+
+    header_ = header;
+    cells_ = reinterpret_cast<const SnapshotCell*>(data_ + header->cells_offset);
+    references_ = reinterpret_cast<const SnapshotReference*>(data_ + header->references_offset);
+    strings_ = data_ + header->strings_offset;
+
+    for (uint32_t i = 0; i < header->cell_count; ++i) {
+        const auto& cell = cells_[i];
+        Position pos{cell.row, cell.col};
+        if (!pos.IsValid() || (i > 0 && !(Position{cells_[i - 1].row, cells_[i - 1].col} < pos))) {
+            throw SnapshotException("corrupted snapshot: bad cell position");
+        }
+        if (!Fits(cell.text_offset, uint64_t(cell.text_size) + cell.code_size, header->strings_size)
+            || !Fits(cell.references_begin, cell.references_count, header->reference_count)
+            || cell.value_type > SnapshotValueType::Error
+            || cell.error > static_cast<uint8_t>(FormulaError::Category::NA)) {
+            throw SnapshotException("corrupted snapshot: bad cell " + pos.ToString());
+        }
+    }
+    for (uint64_t i = 0; i < header->reference_count; ++i) {
+        const auto& reference = references_[i];
+        if (!Position{reference.row, reference.col}.IsValid()
+            || !Fits(reference.sheet_offset, reference.sheet_size, header->strings_size)
+            || reference.kind > SNAPSHOT_REFERENCE_RANGE) {
+            throw SnapshotException("corrupted snapshot: bad reference");
+        }
+    }
+}
+
+bool SnapshotImage::HasValues() const {
+    return header_->flags & SNAPSHOT_WITH_VALUES;
+}
+
+size_t SnapshotImage::GetCellCount() const {
+    return header_->cell_count;
+}
+
+const SnapshotCell& SnapshotImage::GetCell(size_t index) const {
+    return cells_[index];
+}
+
+std::optional<size_t> SnapshotImage::Find(Position pos) const {
+    const SnapshotCell* end = cells_ + header_->cell_count;
+    const SnapshotCell* it = std::lower_bound(cells_, end, pos, [](const SnapshotCell& cell, Position pos) {
+        return Position{cell.row, cell.col} < pos;
+    });
+    if (it == end || it->row != pos.row || it->col != pos.col) {
+        return std::nullopt;
+    }
+    return it - cells_;
+}
+
+std::string_view SnapshotImage::GetText(const SnapshotCell& cell) const {
+    return {strings_ + cell.text_offset, cell.text_size};
+}
+
+std::string_view SnapshotImage::GetCode(const SnapshotCell& cell) const {
+    return {strings_ + cell.text_offset + cell.text_size, cell.code_size};
+}
+
+const SnapshotReference* SnapshotImage::GetReferences(const SnapshotCell& cell) const {
+    return references_ + cell.references_begin;
+}
+
+std::string_view SnapshotImage::GetSheetName(const SnapshotReference& reference) const {
+    return {strings_ + reference.sheet_offset, reference.sheet_size};
+}
+
+void SaveSnapshot(const Sheet& sheet, const std::string& path, const SnapshotOptions& options) {
+    std::vector<std::pair<Position, const Cell*>> cells;
+    sheet.ForEachCell([&cells](Position pos, const Cell& cell) {
+        cells.emplace_back(pos, &cell);
+    });
+    std::sort(cells.begin(), cells.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.first < rhs.first;
+    });
+
+    std::vector<SnapshotCell> records;
+    std::vector<SnapshotReference> references;
+    std::string strings;
+    records.reserve(cells.size());
+    for (const auto& [pos, cell] : cells) {
+        SnapshotCell record{};
+        record.row = pos.row;
+        record.col = pos.col;
+        record.text_offset = strings.size();
+        strings += cell->GetText();
+        record.text_size = static_cast<uint32_t>(strings.size() - record.text_offset);
+
+        if (const FormulaInterface* formula = cell->GetFormula()) {
+            size_t code_begin = strings.size();
+            formula->Serialize(strings);
+            record.code_size = static_cast<uint32_t>(strings.size() - code_begin);
+
+            record.references_begin = references.size();
+            for (const auto& ref : formula->GetReferencedCells()) {
+                references.push_back({ref.row, ref.col, 0, 0, 0});
+            }
+            for (const auto& [sheet_name, ref] : formula->GetExternalReferencedCells()) {
+                references.push_back({ref.row, ref.col, strings.size(), static_cast<uint32_t>(sheet_name.size()), 0});
+                strings += sheet_name;
+            }
+            for (const auto& range : formula->GetReferencedRanges()) {
+                references.push_back({range.first.row, range.first.col, 0, 0, SNAPSHOT_REFERENCE_RANGE});
+                references.push_back({range.last.row, range.last.col, 0, 0, SNAPSHOT_REFERENCE_CELL});
+            }
+            for (const auto& [sheet_name, range] : formula->GetExternalReferencedRanges()) {
+                uint64_t sheet_offset = strings.size();
+                auto sheet_size = static_cast<uint32_t>(sheet_name.size());
+                strings += sheet_name;
+                references.push_back({range.first.row, range.first.col, sheet_offset, sheet_size,
+                                      SNAPSHOT_REFERENCE_RANGE});
+                references.push_back({range.last.row, range.last.col, sheet_offset, sheet_size,
+                                      SNAPSHOT_REFERENCE_CELL});
+            }
+            record.references_count = static_cast<uint32_t>(references.size() - record.references_begin);
+
+            if (options.with_values) {
+                auto value = cell->GetValue();
+                if (std::holds_alternative<double>(value)) {
+                    record.value_type = SnapshotValueType::Number;
+                    record.number = std::get<double>(value);
+                } else if (std::holds_alternative<FormulaError>(value)) {
+                    record.value_type = SnapshotValueType::Error;
+                    record.error = static_cast<uint8_t>(std::get<FormulaError>(value).GetCategory());
+                }
+            }
+        } else if (auto value = cell->GetValueRef(); std::holds_alternative<double>(value)) {
+            // числовая ячейка (Sheet::SetNumbers): число -- её содержимое,
+            // а не кеш, поэтому пишется всегда
+            record.value_type = SnapshotValueType::Number;
+            record.number = std::get<double>(value);
+        }
+        records.push_back(record);
+    }
+
+    SnapshotHeader header{};
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.flags = options.with_values ? SNAPSHOT_WITH_VALUES : 0;
+    header.cell_count = static_cast<uint32_t>(records.size());
+    header.reference_count = references.size();
+    header.cells_offset = sizeof(SnapshotHeader);
+    header.references_offset = AlignTo8(header.cells_offset + records.size() * sizeof(SnapshotCell));
+    header.strings_offset = AlignTo8(header.references_offset + references.size() * sizeof(SnapshotReference));
+    header.strings_size = strings.size();
+
+    // Пишем во временный файл, чтобы при сбое старый снимок остался целым.
+    // Перед переименованием файл сбрасывается на диск: иначе после
+    // отключения питания переименование может сохраниться раньше данных.
+    // После него сбрасывается каталог, и к возврату новый снимок сохранён.
+    const std::string tmp_path = path + ".tmp";
+    {
+        std::ofstream output(tmp_path, std::ios::binary | std::ios::trunc);
+        if (!output) {
+            throw SnapshotException("cannot write " + tmp_path);
+        }
+        auto pad_to = [&output](uint64_t offset) {
+            static const char zeros[8] = {};
+            output.write(zeros, offset - static_cast<uint64_t>(output.tellp()));
+        };
+        output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        output.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(SnapshotCell));
+        pad_to(header.references_offset);
+        output.write(reinterpret_cast<const char*>(references.data()), references.size() * sizeof(SnapshotReference));
+        pad_to(header.strings_offset);
+        output.write(strings.data(), strings.size());
+        output.close();
+        if (!output) {
+            throw SnapshotException("cannot write " + tmp_path);
+        }
+    }
+    if (!SyncPath(tmp_path, false)) {
+        throw SnapshotException("cannot sync " + tmp_path);
+    }
+    std::error_code error;
+    std::filesystem::rename(tmp_path, path, error);
+    if (error) {
+        throw SnapshotException("cannot replace " + path + ": " + error.message());
+    }
+    auto directory = std::filesystem::path(path).parent_path();
+    if (!SyncPath(directory.empty() ? "." : directory.string(), true)) {
+        throw SnapshotException("cannot sync the directory of " + path);
+    }
+}
+
+void LoadSnapshot(Sheet& sheet, const std::string& path) {
+    sheet.AttachSnapshot(std::make_shared<const SnapshotImage>(path));
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include "sheet.h"
+
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Исключение, выбрасываемое при ошибке чтения или записи снимка, а также
+// если файл не является снимком этой версии
+class SnapshotException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Двоичный снимок листа. Файл состоит из заголовка, таблицы ячеек,
+// отсортированной по позиции, таблицы ссылок (рёбер графа зависимостей) и
+// области строк, где лежат тексты ячеек, скомпилированные формулы (см.
+// FormulaInterface::Serialize) и имена листов внешних ссылок. Все таблицы
+// выровнены на 8 байт и читаются прямо из отображённого в память файла.
+// Числа записываются в порядке байт машины, создавшей снимок; на машине с
+// другим порядком байт снимок не загружается.
+// Версия 2 добавила ссылки на диапазоны; снимки версии 1 читаются как есть.
+inline constexpr uint32_t SNAPSHOT_VERSION = 2;
+inline constexpr uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+inline constexpr uint32_t SNAPSHOT_WITH_VALUES = 1;  // флаг: сохранены значения формул
+
+struct SnapshotHeader {
+    char magic[8];               // "SPSHEET\0"
+    uint32_t version;
+    uint32_t byte_order;         // SNAPSHOT_BYTE_ORDER
+    uint32_t flags;
+    uint32_t cell_count;
+    uint64_t reference_count;
+    uint64_t cells_offset;
+    uint64_t references_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+};
+
+enum class SnapshotValueType : uint8_t {
+    None,
+    Number,
+    Error,
+};
+
+struct SnapshotCell {
+    int32_t row;
+    int32_t col;
+    uint64_t text_offset;        // текст ячейки в области строк
+    uint32_t text_size;
+    uint32_t code_size;          // формула сразу за текстом; 0 -- не формула
+    uint64_t references_begin;   // ссылки формулы в таблице ссылок
+    uint32_t references_count;
+    SnapshotValueType value_type;  // у не формулы Number -- числовая ячейка
+    uint8_t error;               // FormulaError::Category
+    uint16_t reserved;
+    double number;
+};
+
+// SnapshotReference::kind
+inline constexpr uint32_t SNAPSHOT_REFERENCE_CELL = 0;
+// левый верхний угол диапазона; следующая запись -- правый нижний
+inline constexpr uint32_t SNAPSHOT_REFERENCE_RANGE = 1;
+
+struct SnapshotReference {
+    int32_t row;
+    int32_t col;
+    uint64_t sheet_offset;       // имя листа в области строк
+    uint32_t sheet_size;         // 0 -- ссылка на ячейку того же листа
+    uint32_t kind;               // SNAPSHOT_REFERENCE_*
+};
+
+static_assert(sizeof(SnapshotHeader) == 64);
+static_assert(sizeof(SnapshotCell) == 48);
+static_assert(sizeof(SnapshotReference) == 24);
+
+// Открытый файл снимка. Файл отображается в память (или читается целиком,
+// если отображение недоступно) и проверяется при открытии, после чего
+// записи отдаются без копирования.
+class SnapshotImage {
+public:
+    explicit SnapshotImage(const std::string& path);
+    ~SnapshotImage();
+
+    SnapshotImage(const SnapshotImage&) = delete;
+    SnapshotImage& operator=(const SnapshotImage&) = delete;
+
+    bool HasValues() const;
+    size_t GetCellCount() const;
+    const SnapshotCell& GetCell(size_t index) const;
+    // индекс записи ячейки в позиции pos (поиск делением пополам)
+    std::optional<size_t> Find(Position pos) const;
+
+    std::string_view GetText(const SnapshotCell& cell) const;
+    std::string_view GetCode(const SnapshotCell& cell) const;
+    const SnapshotReference* GetReferences(const SnapshotCell& cell) const;
+    std::string_view GetSheetName(const SnapshotReference& reference) const;
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    bool mapped_ = false;
+    std::vector<char> buffer_;   // содержимое файла, если он не отображён
+
+    const SnapshotHeader* header_ = nullptr;
+    const SnapshotCell* cells_ = nullptr;
+    const SnapshotReference* references_ = nullptr;
+    const char* strings_ = nullptr;
+
+    void Validate();
+};
+
+struct SnapshotOptions {
+    bool with_values = false;    // вычислить формулы и сохранить их значения
+};
+
+// Записывает лист в файл. Файл заменяется атомарно: снимок пишется рядом,
+// сбрасывается на диск (fsync) и затем переименовывается, после чего
+// сбрасывается каталог. После сбоя или отключения питания на месте файла
+// либо старый снимок, либо новый целиком; к возврату новый уже сохранён.
+void SaveSnapshot(const Sheet& sheet, const std::string& path, const SnapshotOptions& options = {});
+
+// Загружает снимок в пустой лист. Рёбра графа зависимостей восстанавливаются
+// сразу и без поиска циклов, а ячейки создаются при первом обращении к ним;
+// формулы при этом собираются из скомпилированного вида без разбора текста.
+// Внешние ссылки разрешаются через книгу листа, поэтому листы, на которые
+// ссылается снимок, должны уже существовать.
+void LoadSnapshot(Sheet& sheet, const std::string& path);
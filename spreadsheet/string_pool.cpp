@@ -0,0 +1,78 @@
+#include "string_pool.h"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <new>
+#include <stdexcept>
+
+StringPool::~StringPool() {
+    assert(entries_.empty());
+    for (Entry* entry : entries_) {
+        Free(entry);
+    }
+}
+
+StringPool::Entry* StringPool::Acquire(std::string_view text) {
+    if (text.size() > std::numeric_limits<uint32_t>::max()) {
+        throw std::length_error("pooled string is too long");
+    }
+    Entry probe;
+    probe.data_ = text.data();
+    probe.size_ = static_cast<uint32_t>(text.size());
+    auto it = entries_.find(&probe);
+    if (it == entries_.end()) {
+        // new char[] выравнивает блок для любого типа
+        char* block = new char[sizeof(Entry) + text.size()];
+        auto* entry = new (block) Entry;
+        entry->pool_ = this;
+        entry->data_ = block + sizeof(Entry);
+        entry->size_ = probe.size_;
+        std::copy(text.begin(), text.end(), block + sizeof(Entry));
+        try {
+            it = entries_.insert(entry).first;
+        } catch (...) {
+            Free(entry);
+            throw;
+        }
+        bytes_ += text.size();
+    }
+    Entry* entry = *it;
+    if (entry->references_ == std::numeric_limits<uint32_t>::max()) {
+        throw std::length_error("too many references to a pooled string");
+    }
+    ++entry->references_;
+    return entry;
+}
+
+void StringPool::Release(Entry* entry) {
+    assert(entry && entry->references_ > 0);
+    if (--entry->references_ > 0) {
+        return;
+    }
+    StringPool* pool = entry->pool_;
+    pool->entries_.erase(entry);
+    pool->bytes_ -= entry->size_;
+    Free(entry);
+}
+
+size_t StringPool::GetSize() const {
+    return entries_.size();
+}
+
+size_t StringPool::GetBytes() const {
+    return bytes_;
+}
+
+size_t StringPool::EntryHasher::operator()(const Entry* entry) const noexcept {
+    return std::hash<std::string_view>()(entry->GetText());
+}
+
+bool StringPool::EntryEqual::operator()(const Entry* lhs, const Entry* rhs) const noexcept {
+    return lhs->GetText() == rhs->GetText();
+}
+
+void StringPool::Free(Entry* entry) {
+    entry->~Entry();
+    delete[] reinterpret_cast<char*>(entry);
+}
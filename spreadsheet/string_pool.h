@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <unordered_set>
+
+// Пул строк листа. Одинаковый текст ячеек (например, категории вроде
+// статуса заказа или названия региона) хранится в пуле один раз, а ячейки
+// держат указатель на запись пула -- её идентификатор. Запись одна на
+// каждый различный текст, поэтому тексты ячеек одного листа сравниваются
+// сравнением идентификаторов, без сравнения символов.
+// Запись живёт, пока на неё ссылается хотя бы одна ячейка. Пул не
+// потокобезопасен, как и сам лист, и должен пережить все свои записи.
+class StringPool {
+public:
+    // Запись и её символы лежат в одном блоке памяти: символы -- сразу за
+    // заголовком
+    class Entry {
+    public:
+        std::string_view GetText() const {
+            return {data_, size_};
+        }
+
+    private:
+        friend class StringPool;
+
+        StringPool* pool_ = nullptr;
+        // у пробной записи, по которой ищется текст, -- искомые символы
+        const char* data_ = nullptr;
+        uint32_t size_ = 0;
+        uint32_t references_ = 0;
+    };
+
+    StringPool() = default;
+    StringPool(const StringPool&) = delete;
+    StringPool& operator=(const StringPool&) = delete;
+    ~StringPool();
+
+    // Запись с текстом text (существующая или новая); её счётчик ссылок
+    // увеличивается. Бросает std::length_error, если текст или число
+    // ссылок не помещаются в 32 бита.
+    Entry* Acquire(std::string_view text);
+    // Отпускает ссылку, полученную через Acquire; запись без ссылок удаляется
+    // из своего пула
+    static void Release(Entry* entry);
+
+    // число различных строк и суммарная длина их текста
+    size_t GetSize() const;
+    size_t GetBytes() const;
+
+private:
+    struct EntryHasher {
+        size_t operator()(const Entry* entry) const noexcept;
+    };
+    struct EntryEqual {
+        bool operator()(const Entry* lhs, const Entry* rhs) const noexcept;
+    };
+
+    std::unordered_set<Entry*, EntryHasher, EntryEqual> entries_;
+    size_t bytes_ = 0;
+
+    static void Free(Entry* entry);
+};
@@ -73,6 +73,26 @@ Position Position::FromString(std::string_view str) {
     return {row - 1, col - 1};
 }
 
+bool SheetPosition::operator==(const SheetPosition& rhs) const {
+    return sheet == rhs.sheet && pos == rhs.pos;
+}
+
+bool SheetPosition::operator<(const SheetPosition& rhs) const {
+    return std::tie(sheet, pos) < std::tie(rhs.sheet, rhs.pos);
+}
+
+std::string SheetPosition::ToString() const {
+    // имена, не похожие на идентификатор, берутся в апострофы: 'My sheet'!A1
+    bool is_identifier = !sheet.empty() && !std::isdigit(static_cast<unsigned char>(sheet[0]))
+        && std::all_of(sheet.begin(), sheet.end(), [](char c) {
+               return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+           });
+    std::string result = is_identifier ? sheet : ESCAPE_SIGN + sheet + ESCAPE_SIGN;
+    result += SHEET_SEPARATOR;
+    result += pos.ToString();
+    return result;
+}
+
 Size::Size() = default;
 
 Size::Size(int rows, int cols) 
@@ -96,6 +116,38 @@ Size::Size(const Size& other) {
     cols = other.cols;
 }
 
+bool Range::IsValid() const {
+    return first.IsValid() && last.IsValid() && first.row <= last.row && first.col <= last.col;
+}
+
+Size Range::GetSize() const {
+    return {last.row - first.row + 1, last.col - first.col + 1};
+}
+
+bool Range::operator==(const Range& rhs) const {
+    return first == rhs.first && last == rhs.last;
+}
+
+bool Range::operator<(const Range& rhs) const {
+    return std::tie(first, last) < std::tie(rhs.first, rhs.last);
+}
+
+std::string Range::ToString() const {
+    return first.ToString() + ":" + last.ToString();
+}
+
+bool SheetRange::operator==(const SheetRange& rhs) const {
+    return sheet == rhs.sheet && range == rhs.range;
+}
+
+bool SheetRange::operator<(const SheetRange& rhs) const {
+    return std::tie(sheet, range) < std::tie(rhs.sheet, rhs.range);
+}
+
+std::string SheetRange::ToString() const {
+    return SheetPosition{sheet, range.first}.ToString() + ":" + range.last.ToString();
+}
+
 FormulaError::FormulaError(Category category) 
     : category_(category)
 {
@@ -120,6 +172,9 @@ std::string_view FormulaError::ToString() const {
     if (category_ == Category::Div0) {
         return "#DIV/0!";
     }
+    if (category_ == Category::NA) {
+        return "#N/A";
+    }
     throw std::runtime_error("unknown_error");
 }
 
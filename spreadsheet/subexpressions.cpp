@@ -0,0 +1,38 @@
+#include "subexpressions.h"
+
+#include <cassert>
+
+SubexpressionTable::~SubexpressionTable() {
+    assert(entries_.empty());
+}
+
+SubexpressionTable::Entry* SubexpressionTable::Acquire(const std::string& code) {
+    auto [it, inserted] = entries_.try_emplace(code);
+    Entry& entry = it->second;
+    if (inserted) {
+        entry.table_ = this;
+        entry.code_ = &it->first;
+    }
+    ++entry.users_;
+    ++uses_;
+    return &entry;
+}
+
+void SubexpressionTable::Release(Entry* entry) {
+    assert(entry && entry->users_ > 0);
+    SubexpressionTable* table = entry->table_;
+    --table->uses_;
+    if (--entry->users_ > 0) {
+        return;
+    }
+    // ключ записи лежит в её же узле, поэтому удаляется по итератору
+    table->entries_.erase(table->entries_.find(*entry->code_));
+}
+
+size_t SubexpressionTable::GetSize() const {
+    return entries_.size();
+}
+
+size_t SubexpressionTable::GetUses() const {
+    return uses_;
+}
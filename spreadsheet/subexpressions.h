@@ -0,0 +1,68 @@
+#pragma once
+
+#include "common.h"
+
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <variant>
+
+// Таблица общих подвыражений формул листа. Ключ подвыражения -- его
+// скомпилированный код (FormulaAST::Serialize): в коде нет пробелов и
+// скобок, а ссылки записаны позициями, поэтому B1*C1/D1 и (B1*C1)/D1 из
+// разных ячеек -- одна запись. Запись хранит значение подвыражения,
+// посчитанное первой формулой, которой оно понадобилось; остальные формулы
+// берут его готовым.
+// Значение сбрасывается вместе с кешем любой формулы, в которую входит
+// подвыражение (FormulaInterface::ResetSubexpressions). Каждая ячейка, на
+// которую ссылается подвыражение, влияет и на все такие формулы, поэтому
+// граф зависимостей при её правке сбросит и его. Пока правки отложены
+// (ручной режим), значение может устареть вместе с кешами использующих
+// его формул, поэтому формула при первом вычислении сбрасывает свои записи.
+// Запись живёт, пока её использует хотя бы одно подвыражение. Таблица не
+// потокобезопасна, как и сам лист, и должна пережить все свои записи.
+class SubexpressionTable {
+public:
+    using Value = std::variant<double, FormulaError>;
+
+    class Entry {
+    public:
+        const std::optional<Value>& GetValue() const {
+            return value_;
+        }
+        void SetValue(Value value) {
+            value_ = std::move(value);
+        }
+        void ResetValue() {
+            value_.reset();
+        }
+
+    private:
+        friend class SubexpressionTable;
+
+        SubexpressionTable* table_ = nullptr;
+        const std::string* code_ = nullptr;     // ключ записи в таблице
+        size_t users_ = 0;
+        std::optional<Value> value_;
+    };
+
+    SubexpressionTable() = default;
+    SubexpressionTable(const SubexpressionTable&) = delete;
+    SubexpressionTable& operator=(const SubexpressionTable&) = delete;
+    ~SubexpressionTable();
+
+    // Запись подвыражения с кодом code (существующая или новая); её
+    // счётчик использований увеличивается
+    Entry* Acquire(const std::string& code);
+    // Отпускает использование, полученное через Acquire; запись без
+    // использований удаляется из своей таблицы
+    static void Release(Entry* entry);
+
+    // число различных подвыражений и число их вхождений в формулы листа
+    size_t GetSize() const;
+    size_t GetUses() const;
+
+private:
+    std::unordered_map<std::string, Entry> entries_;
+    size_t uses_ = 0;
+};
@@ -0,0 +1,163 @@
+#include "subscriptions.h"
+
+#include <algorithm>
+#include <cassert>
+#include <exception>
+#include <stdexcept>
+
+namespace {
+
+CellInterface::Value ReadValue(SheetInterface* sheet, Position pos) {
+    const CellInterface* cell = static_cast<const SheetInterface*>(sheet)->GetCell(pos);
+    return cell ? cell->GetValue() : CellInterface::Value{};
+}
+
+}  // namespace
+
+uint64_t SubscriptionRegistry::Add(SheetInterface* sheet, Range range, ChangeCallback callback) {
+    auto subscription = std::make_unique<Subscription>();
+    subscription->id = next_id_++;
+    subscription->sheet = sheet;
+    subscription->range = range;
+    subscription->callback = std::move(callback);
+    const Size size = range.GetSize();
+    const size_t area = static_cast<size_t>(size.rows) * size.cols;
+    subscription->values.reserve(area);
+    for (int row = range.first.row; row <= range.last.row; ++row) {
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+            subscription->values.push_back(ReadValue(sheet, {row, col}));
+        }
+    }
+    subscription->dirty.reserve(area);
+    subscription->queued.assign(area, false);
+
+    for (int col = range.first.col; col <= range.last.col; ++col) {
+        by_column_[{sheet, col}].push_back(subscription.get());
+    }
+    pending_.reserve(subscriptions_.size() + 1);
+    subscriptions_.push_back(std::move(subscription));
+    return subscriptions_.back()->id;
+}
+
+bool SubscriptionRegistry::Remove(uint64_t id) {
+    auto it = std::find_if(subscriptions_.begin(), subscriptions_.end(), [id](const auto& subscription) {
+        return subscription->id == id && !subscription->removed;
+    });
+    if (it == subscriptions_.end()) {
+        return false;
+    }
+    // во время доставки список pending_ ещё обходится: подписка удаляется после
+    (*it)->removed = true;
+    if (!delivering_) {
+        Erase(it->get());
+    }
+    return true;
+}
+
+void SubscriptionRegistry::CheckNotDelivering() const {
+    if (delivering_) {
+        throw std::logic_error("cells can't be changed from a change callback");
+    }
+}
+
+void SubscriptionRegistry::MarkSubscribed(SheetInterface* sheet, Position pos) {
+    // правка из колбэка дописала бы в pending_, пока доставка его обходит
+    assert(!delivering_);
+    auto it = by_column_.find({sheet, pos.col});
+    if (it == by_column_.end()) {
+        return;
+    }
+    for (Subscription* subscription : it->second) {
+        const Range& range = subscription->range;
+        if (pos.row < range.first.row || pos.row > range.last.row) {
+            continue;
+        }
+        const uint32_t index = (pos.row - range.first.row) * range.GetSize().cols + (pos.col - range.first.col);
+        if (subscription->queued[index]) {
+            continue;
+        }
+        subscription->queued[index] = true;
+        if (subscription->dirty.empty()) {
+            pending_.push_back(subscription);
+        }
+        subscription->dirty.push_back(index);
+    }
+}
+
+void SubscriptionRegistry::Deliver() {
+    if (pending_.empty() || delivering_) {
+        return;
+    }
+    delivering_ = true;
+    // исключение колбэка не мешает остальным подпискам получить свои пачки:
+    // первое выходит из Deliver после того, как доставка закончена
+    std::exception_ptr error;
+    try {
+        // сначала собираются все пачки: колбэк видит значения после всей операции
+        for (Subscription* subscription : pending_) {
+            auto& values = subscription->values;
+            auto& dirty = subscription->dirty;
+            const Range& range = subscription->range;
+            subscription->changes.clear();
+            std::sort(dirty.begin(), dirty.end());
+            const int cols = range.GetSize().cols;
+            for (uint32_t index : dirty) {
+                const Position pos{range.first.row + static_cast<int>(index) / cols,
+                    range.first.col + static_cast<int>(index) % cols};
+                auto value = ReadValue(subscription->sheet, pos);
+                if (!(value == values[index])) {
+                    subscription->changes.push_back({pos, std::move(values[index]), value});
+                    values[index] = std::move(value);
+                }
+            }
+        }
+        for (Subscription* subscription : pending_) {
+            if (subscription->removed || subscription->changes.empty()) {
+                continue;
+            }
+            try {
+                subscription->callback(subscription->changes);
+            } catch (...) {
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+        }
+    } catch (...) {
+        error = std::current_exception();
+    }
+    for (Subscription* subscription : pending_) {
+        for (uint32_t index : subscription->dirty) {
+            subscription->queued[index] = false;
+        }
+        subscription->dirty.clear();
+    }
+    pending_.clear();
+    delivering_ = false;
+
+    for (size_t i = 0; i < subscriptions_.size();) {
+        if (subscriptions_[i]->removed) {
+            Erase(subscriptions_[i].get());
+        } else {
+            ++i;
+        }
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void SubscriptionRegistry::Erase(Subscription* subscription) {
+    for (int col = subscription->range.first.col; col <= subscription->range.last.col; ++col) {
+        auto it = by_column_.find({subscription->sheet, col});
+        auto& column = it->second;
+        column.erase(std::find(column.begin(), column.end(), subscription));
+        if (column.empty()) {
+            by_column_.erase(it);
+        }
+    }
+    pending_.erase(std::remove(pending_.begin(), pending_.end(), subscription), pending_.end());
+    subscriptions_.erase(std::find_if(subscriptions_.begin(), subscriptions_.end(), [subscription](const auto& item) {
+        return item.get() == subscription;
+    }));
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Изменение значения ячейки, о котором узнаёт подписчик
+struct ValueChange {
+    Position pos;
+    CellInterface::Value old_value;
+    CellInterface::Value new_value;
+};
+
+// Пачка изменений одной подписки; действительна только во время вызова
+using ChangeCallback = std::function<void(Span<const ValueChange>)>;
+
+// Подписки на значения диапазонов. Граф зависимостей отмечает каждую
+// ячейку, которую правка изменила или чей кеш сбросила (MarkChanged), а
+// лист после операции вызывает Deliver: отмеченные ячейки подписок
+// вычисляются, и каждая подписка получает одну пачку с ячейками, значение
+// которых действительно изменилось. Подписка хранит последние значения
+// диапазона, а её буферы заводятся при подписке, поэтому отметка и доставка
+// чисел и коротких текстов память не выделяют.
+class SubscriptionRegistry {
+public:
+    // Значения диапазона запоминаются сразу (формулы при этом вычисляются)
+    uint64_t Add(SheetInterface* sheet, Range range, ChangeCallback callback);
+    // false, если подписки нет
+    bool Remove(uint64_t id);
+
+    void MarkChanged(SheetInterface* sheet, Position pos) {
+        if (!by_column_.empty()) {
+            MarkSubscribed(sheet, pos);
+        }
+    }
+    // Вызывает колбэки подписок с отмеченными ячейками. Колбэк может читать
+    // листы и отменять подписки, но не менять ячейки (см. CheckNotDelivering).
+    // Если колбэк бросает исключение, остальные подписки всё равно получают
+    // свои пачки, а первое исключение выходит из Deliver.
+    void Deliver();
+    // Бросает std::logic_error, если идёт доставка: операции, меняющие
+    // ячейки, кеши или подписки, вызывают его до любых изменений
+    void CheckNotDelivering() const;
+
+private:
+    struct Subscription {
+        uint64_t id = 0;
+        SheetInterface* sheet = nullptr;
+        Range range;
+        ChangeCallback callback;
+        // значения диапазона по строкам, как в Sheet::GetValues
+        std::vector<CellInterface::Value> values;
+        // отмеченные ячейки (индексы в values) без повторов
+        std::vector<uint32_t> dirty;
+        std::vector<bool> queued;
+        std::vector<ValueChange> changes;
+        bool removed = false;
+    };
+
+    uint64_t next_id_ = 1;
+    std::vector<std::unique_ptr<Subscription>> subscriptions_;
+    // подписки по (лист, столбец): отметка смотрит только подписки столбца
+    std::map<std::pair<SheetInterface*, int>, std::vector<Subscription*>> by_column_;
+    // подписки с отмеченными ячейками
+    std::vector<Subscription*> pending_;
+    bool delivering_ = false;
+
+    void MarkSubscribed(SheetInterface* sheet, Position pos);
+    void Erase(Subscription* subscription);
+};
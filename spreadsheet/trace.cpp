@@ -0,0 +1,196 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Ячейка кольца. Владелец кольца пишет поля между двумя записями seq
+// (seqlock): нечётное значение -- запись идёт, 2 * index + 2 -- в ячейке
+// событие с номером index. Читатель отбрасывает ячейку, если seq изменился
+// за время чтения.
+struct TraceSlot {
+    std::atomic<uint64_t> seq{0};
+    std::atomic<const char*> name{nullptr};
+    std::atomic<uint64_t> pos{0};
+    std::atomic<uint64_t> start{0};
+    std::atomic<uint64_t> duration{0};
+    std::atomic<uint32_t> depth{0};
+    std::atomic<uint32_t> thread{0};
+};
+
+struct TraceRing {
+    std::unique_ptr<TraceSlot[]> slots = std::make_unique<TraceSlot[]>(TRACE_EVENTS_PER_THREAD);
+    std::atomic<uint64_t> head{0};  // число записанных событий
+    bool free = false;              // поток-владелец завершился
+};
+
+struct TraceEvent {
+    const char* name;
+    Position pos;
+    uint64_t start;
+    uint64_t duration;
+    uint32_t depth;
+    uint32_t thread;
+};
+
+// Кольца не освобождаются до конца процесса: события завершившихся потоков
+// остаются доступны для выгрузки, а кольцо переходит к следующему потоку
+struct Registry {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<TraceRing>> rings;
+    uint32_t next_thread = 1;
+    std::atomic<uint64_t> session_start{0};
+    std::atomic<uint64_t> session_stop{std::numeric_limits<uint64_t>::max()};
+};
+
+Registry& GetRegistry() {
+    static Registry registry;
+    return registry;
+}
+
+uint64_t Now() {
+    static const auto epoch = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+struct ThreadState {
+    TraceRing* ring = nullptr;
+    uint32_t thread = 0;
+    uint32_t depth = 0;
+
+    ~ThreadState() {
+        if (ring) {
+            auto& registry = GetRegistry();
+            std::lock_guard lock(registry.mutex);
+            ring->free = true;
+        }
+    }
+
+    TraceRing& GetRing() {
+        if (!ring) {
+            auto& registry = GetRegistry();
+            std::lock_guard lock(registry.mutex);
+            auto it = std::find_if(registry.rings.begin(), registry.rings.end(),
+                [](const auto& ring) { return ring->free; });
+            if (it == registry.rings.end()) {
+                it = registry.rings.insert(registry.rings.end(), std::make_unique<TraceRing>());
+            }
+            (*it)->free = false;
+            ring = it->get();
+            thread = registry.next_thread++;
+        }
+        return *ring;
+    }
+};
+
+thread_local ThreadState thread_state;
+
+uint64_t PackPosition(Position pos) {
+    return static_cast<uint64_t>(static_cast<uint32_t>(pos.row)) << 32 | static_cast<uint32_t>(pos.col);
+}
+
+Position UnpackPosition(uint64_t packed) {
+    return {static_cast<int>(static_cast<uint32_t>(packed >> 32)), static_cast<int>(static_cast<uint32_t>(packed))};
+}
+
+void ReadRing(const TraceRing& ring, std::vector<TraceEvent>& events) {
+    const uint64_t head = ring.head.load(std::memory_order_acquire);
+    const uint64_t first = head > TRACE_EVENTS_PER_THREAD ? head - TRACE_EVENTS_PER_THREAD : 0;
+    for (uint64_t index = first; index < head; ++index) {
+        const TraceSlot& slot = ring.slots[index % TRACE_EVENTS_PER_THREAD];
+        const uint64_t seq = slot.seq.load(std::memory_order_acquire);
+        if (seq != 2 * index + 2) {
+            continue;
+        }
+        TraceEvent event{slot.name.load(std::memory_order_relaxed),
+            UnpackPosition(slot.pos.load(std::memory_order_relaxed)), slot.start.load(std::memory_order_relaxed),
+            slot.duration.load(std::memory_order_relaxed), slot.depth.load(std::memory_order_relaxed),
+            slot.thread.load(std::memory_order_relaxed)};
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) == seq) {
+            events.push_back(event);
+        }
+    }
+}
+
+}  // namespace
+
+namespace TraceImpl {
+
+uint64_t BeginSpan() {
+    ++thread_state.depth;
+    return Now();
+}
+
+void EndSpan(const char* name, Position pos, uint64_t start) {
+    const uint64_t end = Now();
+    const uint32_t depth = --thread_state.depth;
+    TraceRing& ring = thread_state.GetRing();
+    const uint64_t index = ring.head.load(std::memory_order_relaxed);
+    TraceSlot& slot = ring.slots[index % TRACE_EVENTS_PER_THREAD];
+
+    slot.seq.store(2 * index + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.name.store(name, std::memory_order_relaxed);
+    slot.pos.store(PackPosition(pos), std::memory_order_relaxed);
+    slot.start.store(start, std::memory_order_relaxed);
+    slot.duration.store(end - start, std::memory_order_relaxed);
+    slot.depth.store(depth, std::memory_order_relaxed);
+    slot.thread.store(thread_state.thread, std::memory_order_relaxed);
+    slot.seq.store(2 * index + 2, std::memory_order_release);
+    ring.head.store(index + 1, std::memory_order_release);
+}
+
+}  // namespace TraceImpl
+
+void StartTracing() {
+    auto& registry = GetRegistry();
+    registry.session_stop.store(std::numeric_limits<uint64_t>::max(), std::memory_order_relaxed);
+    registry.session_start.store(Now(), std::memory_order_relaxed);
+    TraceImpl::enabled.store(true, std::memory_order_relaxed);
+}
+
+void StopTracing() {
+    TraceImpl::enabled.store(false, std::memory_order_relaxed);
+    GetRegistry().session_stop.store(Now(), std::memory_order_relaxed);
+}
+
+void WriteTrace(std::ostream& out) {
+    auto& registry = GetRegistry();
+    std::vector<TraceEvent> events;
+    {
+        std::lock_guard lock(registry.mutex);
+        for (const auto& ring : registry.rings) {
+            ReadRing(*ring, events);
+        }
+    }
+    const uint64_t session_start = registry.session_start.load(std::memory_order_relaxed);
+    const uint64_t session_stop = registry.session_stop.load(std::memory_order_relaxed);
+    events.erase(std::remove_if(events.begin(), events.end(), [&](const TraceEvent& event) {
+        return event.start < session_start || event.start + event.duration > session_stop;
+    }), events.end());
+    std::sort(events.begin(), events.end(), [](const TraceEvent& lhs, const TraceEvent& rhs) {
+        return lhs.start < rhs.start;
+    });
+
+    // время в trace-event -- микросекунды
+    out << std::fixed << std::setprecision(3) << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+    for (size_t i = 0; i < events.size(); ++i) {
+        const auto& event = events[i];
+        out << (i ? "," : "") << "\n{\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+            << event.thread << ", \"ts\": " << (event.start - session_start) / 1000.0
+            << ", \"dur\": " << event.duration / 1000.0 << ", \"args\": {\"depth\": " << event.depth;
+        if (event.pos.IsValid()) {
+            out << ", \"cell\": \"" << event.pos.ToString() << "\"";
+        }
+        out << "}}";
+    }
+    out << "\n]}\n";
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+
+// Трассировка пересчёта в формате trace-event (chrome://tracing, Perfetto).
+// Отрезки (разбор формулы, поиск цикла, инвалидация, вычисление ячейки)
+// пишутся, только если проект собран с SPREADSHEET_TRACING (опция CMake с
+// тем же именем) и идёт сеанс записи (StartTracing); без опции макрос
+// SPREADSHEET_TRACE_SPAN раскрывается в пустоту.
+// Каждый поток пишет в собственное кольцо на TRACE_EVENTS_PER_THREAD
+// событий без блокировок; при переполнении старые события затираются.
+
+constexpr size_t TRACE_EVENTS_PER_THREAD = 1 << 16;
+
+namespace TraceImpl {
+inline std::atomic<bool> enabled{false};
+
+uint64_t BeginSpan();
+void EndSpan(const char* name, Position pos, uint64_t start);
+}  // namespace TraceImpl
+
+// Начинает сеанс: события, записанные раньше, в выгрузку не попадут
+void StartTracing();
+void StopTracing();
+
+inline bool IsTracing() {
+    return TraceImpl::enabled.load(std::memory_order_relaxed);
+}
+
+// Выгружает события текущего (или последнего) сеанса в JSON. Можно
+// вызывать и во время записи: события, затираемые в этот момент,
+// пропускаются.
+void WriteTrace(std::ostream& out);
+
+// Отрезок от создания до разрушения объекта. name должен жить вечно
+// (строковый литерал); pos -- ячейка, к которой относится отрезок.
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* name, Position pos = Position::NONE) {
+        if (IsTracing()) {
+            name_ = name;
+            pos_ = pos;
+            start_ = TraceImpl::BeginSpan();
+        }
+    }
+
+    ~TraceSpan() {
+        if (name_) {
+            TraceImpl::EndSpan(name_, pos_, start_);
+        }
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+    const char* name_ = nullptr;
+    Position pos_ = Position::NONE;
+    uint64_t start_ = 0;
+};
+
+#ifdef SPREADSHEET_TRACING
+#define SPREADSHEET_TRACE_SPAN(...) TraceSpan spreadsheet_trace_span_(__VA_ARGS__)
+#else
+#define SPREADSHEET_TRACE_SPAN(...) ((void)0)
+#endif
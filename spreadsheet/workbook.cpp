@@ -0,0 +1,149 @@
+#include "workbook.h"
+
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+
+Workbook::Workbook()
+    : graph_(std::make_shared<DependencyGraph>())
+{
+
+}
+
+Sheet& Workbook::AddSheet(std::string name) {
+    if (name.empty() || name.find_first_of("'!\r\n") != std::string::npos) {
+        throw std::invalid_argument("invalid sheet name " + name);
+    }
+    if (sheet_by_name_.count(name)) {
+        throw std::invalid_argument("sheet " + name + " already exists");
+    }
+    // фоновый пересчёт листа читает список листов книги
+    graph_->CancelRecalculation();
+    sheets_.push_back(std::make_unique<Sheet>(this, name, graph_));
+    sheet_by_name_[std::move(name)] = sheets_.back().get();
+    return *sheets_.back();
+}
+
+Sheet* Workbook::GetSheet(std::string_view name) {
+    auto it = sheet_by_name_.find(name);
+    return it == sheet_by_name_.end() ? nullptr : it->second;
+}
+
+const Sheet* Workbook::GetSheet(std::string_view name) const {
+    auto it = sheet_by_name_.find(name);
+    return it == sheet_by_name_.end() ? nullptr : it->second;
+}
+
+std::vector<std::string> Workbook::GetSheetNames() const {
+    std::vector<std::string> names;
+    names.reserve(sheets_.size());
+    for (const auto& sheet : sheets_) {
+        names.push_back(sheet->GetName());
+    }
+    return names;
+}
+
+void Workbook::Recalculate() {
+    // листы ниже считаются параллельно, а граф общий: правки ручного режима
+    // применяются заранее, одним потоком
+    graph_->GetSubscriptions().CheckNotDelivering();
+    graph_->CancelRecalculation();
+    graph_->ApplyPendingChanges();
+    // подписки тоже обслуживаются одним потоком: ячейки подписок
+    // вычисляются здесь, и листам ниже доставлять уже нечего
+    graph_->GetSubscriptions().Deliver();
+    size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (const auto& level : GetRecalculationLevels()) {
+        // формулы листа читают только свой лист и листы прошлых уровней,
+        // которые к этому моменту уже посчитаны, поэтому группы уровня
+        // можно считать одновременно
+        std::atomic<size_t> next_group = 0;
+        auto worker = [&level, &next_group] {
+            for (size_t i = next_group++; i < level.size(); i = next_group++) {
+                for (Sheet* sheet : level[i]) {
+                    sheet->Recalculate();
+                }
+            }
+        };
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < std::min(max_threads, level.size()); ++i) {
+            threads.emplace_back(worker);
+        }
+        worker();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+}
+
+std::vector<std::vector<std::vector<Sheet*>>> Workbook::GetRecalculationLevels() const {
+    const size_t n = sheets_.size();
+    std::unordered_map<const SheetInterface*, size_t> index;
+    for (size_t i = 0; i < n; ++i) {
+        index[sheets_[i].get()] = i;
+    }
+
+    std::vector<std::vector<size_t>> referenced_sheets(n);
+    for (const auto& [depent, referenced] : graph_->GetSheetEdges()) {
+        referenced_sheets[index.at(depent)].push_back(index.at(referenced));
+    }
+
+    // reachable[i][j] -- лист i зависит (возможно, транзитивно) от листа j
+    std::vector<std::vector<bool>> reachable(n, std::vector<bool>(n, false));
+    for (size_t i = 0; i < n; ++i) {
+        std::vector<size_t> stack = {i};
+        while (!stack.empty()) {
+            size_t sheet = stack.back();
+            stack.pop_back();
+            for (size_t next : referenced_sheets[sheet]) {
+                if (!reachable[i][next]) {
+                    reachable[i][next] = true;
+                    stack.push_back(next);
+                }
+            }
+        }
+    }
+
+    // листы, зависящие друг от друга, объединяются в одну группу
+    std::vector<size_t> group(n);
+    for (size_t i = 0; i < n; ++i) {
+        group[i] = i;
+        for (size_t j = 0; j < i; ++j) {
+            if (reachable[i][j] && reachable[j][i]) {
+                group[i] = group[j];
+                break;
+            }
+        }
+    }
+
+    // уровень группы на единицу больше уровней групп, от которых она зависит
+    std::vector<size_t> level(n, 0);
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t i = 0; i < n; ++i) {
+            for (size_t j : referenced_sheets[i]) {
+                if (group[i] != group[j] && level[group[i]] < level[group[j]] + 1) {
+                    level[group[i]] = level[group[j]] + 1;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    std::vector<std::vector<std::vector<Sheet*>>> levels;
+    std::vector<size_t> group_slot(n, n);
+    for (size_t i = 0; i < n; ++i) {
+        size_t lvl = level[group[i]];
+        if (levels.size() <= lvl) {
+            levels.resize(lvl + 1);
+        }
+        if (group_slot[group[i]] == n) {
+            group_slot[group[i]] = levels[lvl].size();
+            levels[lvl].emplace_back();
+        }
+        levels[lvl][group_slot[group[i]]].push_back(sheets_[i].get());
+    }
+    return levels;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "sheet.h"
+
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Книга из нескольких листов. Формулы могут ссылаться на ячейки других
+// листов (Sheet2!A1), все листы книги используют общий граф зависимостей.
+class Workbook {
+public:
+    Workbook();
+
+    // Добавляет пустой лист. Бросает std::invalid_argument, если имя пустое,
+    // содержит апостроф, '!' или перевод строки либо уже занято.
+    Sheet& AddSheet(std::string name);
+
+    // Возвращает лист с заданным именем либо nullptr
+    Sheet* GetSheet(std::string_view name);
+    const Sheet* GetSheet(std::string_view name) const;
+
+    // Имена листов в порядке добавления
+    std::vector<std::string> GetSheetNames() const;
+
+    // Вычисляет все формулы книги. Листы, не связанные ссылками, считаются
+    // параллельно; лист считается только после листов, на которые он ссылается.
+    // Листы, ссылающиеся друг на друга по кругу, считаются одним потоком.
+    // Правки, накопленные в ручном режиме (Sheet::SetCalculationMode),
+    // применяются перед пересчётом.
+    void Recalculate();
+
+private:
+    std::shared_ptr<DependencyGraph> graph_;
+    std::vector<std::unique_ptr<Sheet>> sheets_;
+    std::map<std::string, Sheet*, std::less<>> sheet_by_name_;
+
+    // группы листов по уровням: группы одного уровня независимы друг от друга
+    std::vector<std::vector<std::vector<Sheet*>>> GetRecalculationLevels() const;
+};
@@ -0,0 +1,430 @@
+#include "workload.h"
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <sstream>
+#include <unordered_set>
+#include <utility>
+
+namespace {
+
+// столбцы модели
+constexpr int COL_INPUT_A = 0;
+constexpr int COL_INPUT_B = 1;
+constexpr int COL_PRODUCT = 2;      // C = A * B + 1
+constexpr int COL_RATIO = 3;        // D = C / (B + 1) - A
+constexpr int COL_MIX = 4;          // E = C + D * 2
+constexpr int COL_CHAIN = 6;        // G
+constexpr int COL_AGGREGATE = 7;    // H
+constexpr int COL_DAG = 10;
+constexpr int DAG_COLS = 10;
+
+std::string Name(int row, int col) {
+    return Position{row, col}.ToString();
+}
+
+class WorkloadGenerator {
+public:
+    explicit WorkloadGenerator(const WorkloadOptions& options)
+        : options_(options), random_(options.seed)
+    {
+        options_.filled_rows = std::max(options_.filled_rows, 1);
+        options_.chain_length = std::max(options_.chain_length, 2);
+        options_.aggregation_width = std::clamp(options_.aggregation_width, 1, options_.filled_rows);
+    }
+
+    Workload Generate() {
+        Workload workload;
+        BuildFilledColumns(workload.build);
+        BuildChain(workload.build);
+        BuildAggregations(workload.build);
+        for (int i = 0; i < options_.dag_cells; ++i) {
+            workload.build.push_back(Set(GetDagPosition(i), MakeDagText(i)));
+        }
+        for (int i = 0; i < options_.edits; ++i) {
+            workload.edits.push_back(MakeEdit());
+        }
+        return workload;
+    }
+
+private:
+    WorkloadOptions options_;
+    // mt19937_64 задан стандартом точно, а распределения -- нет, поэтому
+    // числа из диапазона берутся остатком
+    std::mt19937_64 random_;
+
+    uint64_t Next(uint64_t n) {
+        return random_() % n;
+    }
+
+    bool Chance(int percent) {
+        return Next(100) < static_cast<uint64_t>(percent);
+    }
+
+    static WorkloadOperation Set(Position pos, std::string text) {
+        return {WorkloadOperation::Kind::Set, pos, std::move(text)};
+    }
+
+    std::string MakeNumber() {
+        return std::to_string(Next(1000)) + (Chance(50) ? ".5" : "");
+    }
+
+    int RandomRow() {
+        return static_cast<int>(Next(options_.filled_rows));
+    }
+
+    static Position GetDagPosition(int index) {
+        return {index / DAG_COLS, COL_DAG + index % DAG_COLS};
+    }
+
+    void BuildFilledColumns(std::vector<WorkloadOperation>& out) {
+        for (int row = 0; row < options_.filled_rows; ++row) {
+            std::string r = std::to_string(row + 1);
+            out.push_back(Set({row, COL_INPUT_A}, MakeNumber()));
+            out.push_back(Set({row, COL_INPUT_B}, MakeNumber()));
+            out.push_back(Set({row, COL_PRODUCT}, "=A" + r + "*B" + r + "+1"));
+            out.push_back(Set({row, COL_RATIO}, "=C" + r + "/(B" + r + "+1)-A" + r));
+            out.push_back(Set({row, COL_MIX}, "=C" + r + "+D" + r + "*2"));
+        }
+    }
+
+    void BuildChain(std::vector<WorkloadOperation>& out) {
+        out.push_back(Set({0, COL_CHAIN}, "1"));
+        for (int row = 1; row < options_.chain_length; ++row) {
+            out.push_back(Set({row, COL_CHAIN}, "=" + Name(row - 1, COL_CHAIN) + "*1.0001+1"));
+        }
+    }
+
+    void BuildAggregations(std::vector<WorkloadOperation>& out) {
+        for (int i = 0; i < options_.aggregations; ++i) {
+            int first = static_cast<int>(Next(options_.filled_rows - options_.aggregation_width + 1));
+            std::string text = "=";
+            for (int k = 0; k < options_.aggregation_width; ++k) {
+                text += (k ? "+" : "") + Name(first + k, COL_PRODUCT);
+            }
+            out.push_back(Set({i, COL_AGGREGATE}, std::move(text)));
+        }
+    }
+
+    // ячейка графа ссылается только на ячейки с меньшим номером и на входные
+    // столбцы, поэтому граф ацикличен при любых заменах формул
+    std::string MakeDagReference(int index) {
+        if (index > 0 && Chance(80)) {
+            return GetDagPosition(static_cast<int>(Next(index))).ToString();
+        }
+        return Name(RandomRow(), Chance(50) ? COL_INPUT_A : COL_INPUT_B);
+    }
+
+    std::string MakeDagText(int index) {
+        if (Chance(3)) {
+            static const char* texts[] = {"text", "'=1+2", "12", "3D"};
+            return texts[Next(4)];
+        }
+        static const char* operations[] = {"+", "-", "*", "/"};
+        std::string text = "=" + MakeDagReference(index);
+        int terms = 1 + static_cast<int>(Next(3));
+        for (int k = 0; k < terms; ++k) {
+            text += operations[Next(4)];
+            if (Chance(10)) {
+                text += "(" + MakeNumber() + "-" + MakeDagReference(index) + ")";
+            } else {
+                text += MakeDagReference(index);
+            }
+        }
+        return text;
+    }
+
+    WorkloadOperation MakeEdit() {
+        uint64_t kind = Next(100);
+        if (kind < 35) {
+            return Set({RandomRow(), Chance(50) ? COL_INPUT_A : COL_INPUT_B}, MakeNumber());
+        }
+        if (kind < 50 && options_.dag_cells > 0) {
+            int index = static_cast<int>(Next(options_.dag_cells));
+            return Set(GetDagPosition(index), MakeDagText(index));
+        }
+        if (kind < 60) {
+            // G(i) транзитивно зависит от G(j) при j < i
+            int from = 1 + static_cast<int>(Next(options_.chain_length - 1));
+            int to = static_cast<int>(Next(from));
+            return Set({to, COL_CHAIN}, "=" + Name(from, COL_CHAIN) + "+1");
+        }
+        if (kind < 65) {
+            int row = RandomRow();
+            return Set({row, COL_INPUT_A}, "=" + Name(row, Chance(50) ? COL_PRODUCT : COL_MIX));
+        }
+        if (kind < 70) {
+            static const char* broken[] = {"=1+", "=A1*(", "=)", "=A0"};
+            return Set({RandomRow(), COL_INPUT_B}, broken[Next(4)]);
+        }
+        if (kind < 72) {
+            return Set(Position{-1, static_cast<int>(Next(10))}, "1");
+        }
+        if (kind < 80) {
+            Position pos = Chance(50) || options_.dag_cells == 0
+                ? Position{RandomRow(), static_cast<int>(Next(COL_MIX + 1))}
+                : GetDagPosition(static_cast<int>(Next(options_.dag_cells)));
+            return {WorkloadOperation::Kind::Clear, pos, {}};
+        }
+        return {WorkloadOperation::Kind::Read, MakeReadPosition(), {}};
+    }
+
+    Position MakeReadPosition() {
+        switch (Next(4)) {
+            case 0:
+                return {options_.chain_length - 1, COL_CHAIN};
+            case 1:
+                return {static_cast<int>(Next(std::max(options_.aggregations, 1))), COL_AGGREGATE};
+            case 2:
+                if (options_.dag_cells > 0) {
+                    return GetDagPosition(static_cast<int>(Next(options_.dag_cells)));
+                }
+                [[fallthrough]];
+            default:
+                return {RandomRow(), static_cast<int>(Next(COL_MIX + 1))};
+        }
+    }
+};
+
+bool SameValue(const CellInterface::Value& lhs, const CellInterface::Value& rhs) {
+    if (std::holds_alternative<double>(lhs) && std::holds_alternative<double>(rhs)) {
+        double a = std::get<double>(lhs);
+        double b = std::get<double>(rhs);
+        // оптимизации вправе менять порядок вычислений в последних битах
+        return a == b || std::abs(a - b) <= 1e-9 * std::max(std::abs(a), std::abs(b));
+    }
+    return lhs == rhs;
+}
+
+std::string Describe(const WorkloadOperation& operation) {
+    static const char* kinds[] = {"set", "clear", "read"};
+    std::string result = kinds[static_cast<int>(operation.kind)];
+    result += " " + (operation.pos.IsValid() ? operation.pos.ToString() : "invalid position");
+    if (operation.kind == WorkloadOperation::Kind::Set) {
+        result += " \"" + operation.text + "\"";
+    }
+    return result;
+}
+
+std::string Describe(const WorkloadOutcome& outcome) {
+    if (!outcome.error.empty()) {
+        return outcome.error;
+    }
+    std::ostringstream out;
+    out << outcome.value;
+    return out.str();
+}
+
+}  // namespace
+
+Workload GenerateWorkload(const WorkloadOptions& options) {
+    return WorkloadGenerator(options).Generate();
+}
+
+std::vector<WorkloadOutcome> RunWorkload(SheetInterface& sheet, const std::vector<WorkloadOperation>& operations) {
+    std::vector<WorkloadOutcome> outcomes(operations.size());
+    for (size_t i = 0; i < operations.size(); ++i) {
+        const auto& operation = operations[i];
+        auto& outcome = outcomes[i];
+        try {
+            switch (operation.kind) {
+                case WorkloadOperation::Kind::Set:
+                    sheet.SetCell(operation.pos, operation.text);
+                    break;
+                case WorkloadOperation::Kind::Clear:
+                    sheet.ClearCell(operation.pos);
+                    break;
+                case WorkloadOperation::Kind::Read: {
+                    // пустая ячейка может быть как nullptr, так и объектом
+                    const CellInterface* cell = std::as_const(sheet).GetCell(operation.pos);
+                    outcome.value = cell ? cell->GetValue() : CellInterface::Value();
+                    break;
+                }
+            }
+        }
+        catch (const InvalidPositionException&) {
+            outcome.error = "InvalidPositionException";
+        }
+        catch (const FormulaException&) {
+            outcome.error = "FormulaException";
+        }
+        catch (const CircularDependencyException&) {
+            outcome.error = "CircularDependencyException";
+        }
+    }
+    return outcomes;
+}
+
+class ReferenceSheet::ReferenceCell : public CellInterface {
+public:
+    ReferenceCell(const ReferenceSheet& sheet, Position pos, std::string text,
+        std::unique_ptr<FormulaInterface> formula)
+        : sheet_(sheet), pos_(pos), text_(std::move(text)), formula_(std::move(formula))
+    {
+    }
+
+    void Set(std::string text) override {
+        throw std::logic_error("reference cells are set through ReferenceSheet::SetCell");
+    }
+
+    Value GetValue() const override {
+        if (!formula_) {
+            if (!text_.empty() && text_[0] == ESCAPE_SIGN) {
+                return text_.substr(1);
+            }
+            return text_;
+        }
+        if (auto it = sheet_.values_.find(pos_); it != sheet_.values_.end()) {
+            return it->second;
+        }
+        auto result = formula_->Evaluate(sheet_);
+        Value value = std::holds_alternative<double>(result) ? Value(std::get<double>(result))
+                                                              : Value(std::get<FormulaError>(result));
+        sheet_.values_[pos_] = value;
+        return value;
+    }
+
+    std::string GetText() const override {
+        return formula_ ? FORMULA_SIGN + formula_->GetExpression() : text_;
+    }
+
+    std::vector<Position> GetReferencedCells() const override {
+        return formula_ ? formula_->GetReferencedCells() : std::vector<Position>{};
+    }
+
+private:
+    const ReferenceSheet& sheet_;
+    Position pos_;
+    std::string text_;
+    std::unique_ptr<FormulaInterface> formula_;
+};
+
+ReferenceSheet::ReferenceSheet() = default;
+
+ReferenceSheet::~ReferenceSheet() = default;
+
+void ReferenceSheet::SetCell(Position pos, std::string text) {
+    Sheet::ValidatePosition(pos);
+    std::unique_ptr<FormulaInterface> formula;
+    if (text.size() > 1 && text[0] == FORMULA_SIGN) {
+        formula = ParseFormula(text.substr(1));
+        if (Reaches(formula->GetReferencedCells(), pos)) {
+            throw CircularDependencyException("circular dependency");
+        }
+    }
+    cells_[pos] = std::make_unique<ReferenceCell>(*this, pos, std::move(text), std::move(formula));
+    values_.clear();
+}
+
+const CellInterface* ReferenceSheet::GetCell(Position pos) const {
+    Sheet::ValidatePosition(pos);
+    auto it = cells_.find(pos);
+    return it == cells_.end() ? nullptr : it->second.get();
+}
+
+CellInterface* ReferenceSheet::GetCell(Position pos) {
+    Sheet::ValidatePosition(pos);
+    auto it = cells_.find(pos);
+    return it == cells_.end() ? nullptr : it->second.get();
+}
+
+void ReferenceSheet::ClearCell(Position pos) {
+    Sheet::ValidatePosition(pos);
+    cells_.erase(pos);
+    values_.clear();
+}
+
+Size ReferenceSheet::GetPrintableSize() const {
+    Size size{0, 0};
+    for (const auto& [pos, cell] : cells_) {
+        if (!cell->GetText().empty()) {
+            size.rows = std::max(size.rows, pos.row + 1);
+            size.cols = std::max(size.cols, pos.col + 1);
+        }
+    }
+    return size;
+}
+
+void ReferenceSheet::PrintValues(std::ostream& output) const {
+    PrintCells(output, [&output](const CellInterface& cell) {
+        output << cell.GetValue();
+    });
+}
+
+void ReferenceSheet::PrintTexts(std::ostream& output) const {
+    PrintCells(output, [&output](const CellInterface& cell) {
+        output << cell.GetText();
+    });
+}
+
+template <typename Func>
+void ReferenceSheet::PrintCells(std::ostream& output, Func print) const {
+    Size size = GetPrintableSize();
+    for (int row = 0; row < size.rows; ++row) {
+        for (int col = 0; col < size.cols; ++col) {
+            if (auto it = cells_.find({row, col}); it != cells_.end()) {
+                print(*it->second);
+            }
+            if (col != size.cols - 1) {
+                output << '\t';
+            }
+        }
+        output << '\n';
+    }
+}
+
+bool ReferenceSheet::Reaches(const std::vector<Position>& from, Position target) const {
+    std::unordered_set<Position, Position::Hasher> visited;
+    std::vector<Position> stack = from;
+    while (!stack.empty()) {
+        Position pos = stack.back();
+        stack.pop_back();
+        if (pos == target) {
+            return true;
+        }
+        if (!visited.insert(pos).second) {
+            continue;
+        }
+        if (auto it = cells_.find(pos); it != cells_.end()) {
+            for (Position next : it->second->GetReferencedCells()) {
+                stack.push_back(next);
+            }
+        }
+    }
+    return false;
+}
+
+std::string CompareWithReference(const Workload& workload, SheetInterface& sheet) {
+    ReferenceSheet reference;
+    size_t offset = 0;
+    for (const auto* operations : {&workload.build, &workload.edits}) {
+        auto actual = RunWorkload(sheet, *operations);
+        auto expected = RunWorkload(reference, *operations);
+        for (size_t i = 0; i < operations->size(); ++i) {
+            if (actual[i].error != expected[i].error || !SameValue(actual[i].value, expected[i].value)) {
+                return "operation " + std::to_string(offset + i) + " (" + Describe((*operations)[i]) + "): sheet gave "
+                    + Describe(actual[i]) + ", reference gave " + Describe(expected[i]);
+            }
+        }
+        offset += operations->size();
+    }
+
+    std::ostringstream actual_texts;
+    std::ostringstream expected_texts;
+    sheet.PrintTexts(actual_texts);
+    reference.PrintTexts(expected_texts);
+    if (actual_texts.str() != expected_texts.str()) {
+        return "printed texts differ";
+    }
+    std::ostringstream actual_values;
+    std::ostringstream expected_values;
+    sheet.PrintValues(actual_values);
+    reference.PrintValues(expected_values);
+    if (actual_values.str() != expected_values.str()) {
+        return "printed values differ";
+    }
+    return {};
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Генератор воспроизводимой нагрузки на лист и эталонный движок для
+// сравнения с ним. Одно и то же зерно даёт одну и ту же нагрузку на любой
+// платформе.
+
+struct WorkloadOptions {
+    uint64_t seed = 1;
+    int filled_rows = 1000;         // строк в столбцах, заполненных вниз
+    int chain_length = 500;         // длина цепочки G1 -> G2 -> ...
+    int aggregations = 10;          // формул-сумм по столбцу C
+    int aggregation_width = 100;    // слагаемых в каждой сумме
+    int dag_cells = 2000;           // ячеек случайного ациклического графа
+    int edits = 5000;               // правок и чтений после построения
+};
+
+struct WorkloadOperation {
+    enum class Kind {
+        Set,
+        Clear,
+        Read,
+    };
+
+    Kind kind = Kind::Set;
+    Position pos;
+    std::string text;
+};
+
+// Построение модели (заполненные вниз столбцы, цепочка, суммы, случайный
+// граф) и последующие правки: смена входных чисел, замена формул, попытки
+// создать цикл, синтаксические ошибки, очистки и чтения
+struct Workload {
+    std::vector<WorkloadOperation> build;
+    std::vector<WorkloadOperation> edits;
+};
+
+Workload GenerateWorkload(const WorkloadOptions& options);
+
+// Итог операции: имя исключения (пусто, если его не было) и значение
+// прочитанной ячейки (для Read)
+struct WorkloadOutcome {
+    std::string error;
+    CellInterface::Value value;
+};
+
+std::vector<WorkloadOutcome> RunWorkload(SheetInterface& sheet, const std::vector<WorkloadOperation>& operations);
+
+// Эталонный движок: без графа зависимостей и кеша значений. При каждой
+// правке цикл ищется обходом формул, а все вычисленные значения забываются.
+// Медленный, но очевидно правильный.
+class ReferenceSheet : public SheetInterface {
+public:
+    ReferenceSheet();
+    ~ReferenceSheet();
+
+    void SetCell(Position pos, std::string text) override;
+
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+
+    void ClearCell(Position pos) override;
+
+    Size GetPrintableSize() const override;
+
+    void PrintValues(std::ostream& output) const override;
+    void PrintTexts(std::ostream& output) const override;
+
+private:
+    class ReferenceCell;
+
+    std::unordered_map<Position, std::unique_ptr<ReferenceCell>, Position::Hasher> cells_;
+    // значения формул, вычисленные после последней правки
+    mutable std::unordered_map<Position, CellInterface::Value, Position::Hasher> values_;
+
+    bool Reaches(const std::vector<Position>& from, Position target) const;
+    template <typename Func>
+    void PrintCells(std::ostream& output, Func print) const;
+};
+
+// Прогоняет нагрузку через проверяемый лист и эталонный движок, сравнивая
+// итог каждой операции и печать листа в конце. Возвращает описание первого
+// расхождения либо пустую строку.
+std::string CompareWithReference(const Workload& workload, SheetInterface& sheet);